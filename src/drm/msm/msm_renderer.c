@@ -76,6 +76,8 @@ struct msm_context {
 
    int eventfd;
 
+   uint64_t commands;
+
    /**
     * Indexed by ring_idx-1, which is the same as the submitqueue priority+1.
     * On the kernel side, there is some drm_sched_entity per {drm_file, prio}
@@ -1230,6 +1232,8 @@ msm_renderer_submit_cmd(struct virgl_context *vctx, const void *_buffer, size_t
          return ret;
       }
 
+      mctx->commands++;
+
       buffer += hdr->len;
       size -= hdr->len;
    }
@@ -1242,6 +1246,14 @@ msm_renderer_submit_cmd(struct virgl_context *vctx, const void *_buffer, size_t
    return 0;
 }
 
+static void
+msm_renderer_get_stats(struct virgl_context *vctx,
+                       struct virgl_renderer_context_stats *stats)
+{
+   struct msm_context *mctx = to_msm_context(vctx);
+   stats->commands = mctx->commands;
+}
+
 static int
 msm_renderer_get_fencing_fd(struct virgl_context *vctx)
 {
@@ -1332,6 +1344,7 @@ msm_renderer_create(int fd)
    mctx->base.get_fencing_fd = msm_renderer_get_fencing_fd;
    mctx->base.retire_fences = msm_renderer_retire_fences;
    mctx->base.submit_fence = msm_renderer_submit_fence;
+   mctx->base.get_stats = msm_renderer_get_stats;
    mctx->base.supports_fence_sharing = true;
 
    return &mctx->base;
@@ -141,6 +141,7 @@ static const struct vn_info_extension_table vkr_extension_table = {
 
 static const struct debug_named_value vkr_debug_options[] = {
    { "validate", VKR_DEBUG_VALIDATE, "Force enabling the validation layer" },
+   { "gpu_time", VKR_DEBUG_GPU_TIME, "Measure the GPU time of queue submissions" },
    DEBUG_NAMED_VALUE_END
 };
 
@@ -95,6 +95,7 @@ typedef uint64_t vkr_object_id;
 
 enum vkr_debug_flags {
    VKR_DEBUG_VALIDATE = 1 << 0,
+   VKR_DEBUG_GPU_TIME = 1 << 1,
 };
 
 /* base class for all objects */
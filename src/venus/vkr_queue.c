@@ -111,6 +111,305 @@ vkr_queue_sync_submit(struct vkr_queue *queue,
    return true;
 }
 
+static void
+vkr_queue_gpu_timer_destroy(struct vkr_queue *queue)
+{
+   struct vkr_queue_gpu_timer *timer = queue->gpu_timer;
+   struct vkr_device *dev = queue->device;
+   struct vn_device_proc_table *vk = &dev->proc_table;
+
+   for (uint32_t slot = 0; slot < VKR_QUEUE_GPU_TIMER_SLOTS; slot++) {
+      if (timer->fences[slot] != VK_NULL_HANDLE)
+         vk->DestroyFence(dev->base.handle.device, timer->fences[slot], NULL);
+   }
+
+   /* the command buffers go away with their pool */
+   if (timer->command_pool != VK_NULL_HANDLE)
+      vk->DestroyCommandPool(dev->base.handle.device, timer->command_pool, NULL);
+   if (timer->query_pool != VK_NULL_HANDLE)
+      vk->DestroyQueryPool(dev->base.handle.device, timer->query_pool, NULL);
+
+   free(timer);
+   queue->gpu_timer = NULL;
+}
+
+static bool
+vkr_queue_gpu_timer_record(struct vkr_queue *queue, uint32_t slot)
+{
+   struct vkr_queue_gpu_timer *timer = queue->gpu_timer;
+   struct vn_device_proc_table *vk = &queue->device->proc_table;
+   const VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+   };
+   VkCommandBuffer begin_cmd = timer->begin_cmds[slot];
+   VkCommandBuffer end_cmd = timer->end_cmds[slot];
+
+   if (vk->BeginCommandBuffer(begin_cmd, &begin_info) != VK_SUCCESS)
+      return false;
+   vk->CmdResetQueryPool(begin_cmd, timer->query_pool, 2 * slot, 2);
+   vk->CmdWriteTimestamp(begin_cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         timer->query_pool, 2 * slot);
+   if (vk->EndCommandBuffer(begin_cmd) != VK_SUCCESS)
+      return false;
+
+   if (vk->BeginCommandBuffer(end_cmd, &begin_info) != VK_SUCCESS)
+      return false;
+   vk->CmdWriteTimestamp(end_cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         timer->query_pool, 2 * slot + 1);
+   return vk->EndCommandBuffer(end_cmd) == VK_SUCCESS;
+}
+
+static void
+vkr_queue_gpu_timer_init(struct vkr_queue *queue)
+{
+   struct vkr_device *dev = queue->device;
+   struct vkr_physical_device *physical_dev = dev->physical_device;
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   VkDevice device = dev->base.handle.device;
+   const uint32_t valid_bits =
+      physical_dev->queue_family_properties[queue->family].timestampValidBits;
+
+   /* protected queues would need protected command buffers */
+   if (!valid_bits || (queue->flags & VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT))
+      return;
+
+   struct vkr_queue_gpu_timer *timer = calloc(1, sizeof(*timer));
+   if (!timer)
+      return;
+   queue->gpu_timer = timer;
+
+   timer->timestamp_mask = valid_bits >= 64 ? UINT64_MAX : (1ull << valid_bits) - 1;
+   timer->timestamp_period = physical_dev->properties.limits.timestampPeriod;
+   snprintf(timer->name, sizeof(timer->name), "vkr-queue-%u-%u", queue->family,
+            queue->index);
+
+   const VkCommandPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .queueFamilyIndex = queue->family,
+   };
+   const VkQueryPoolCreateInfo query_pool_info = {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = 2 * VKR_QUEUE_GPU_TIMER_SLOTS,
+   };
+   if (vk->CreateCommandPool(device, &pool_info, NULL, &timer->command_pool) !=
+          VK_SUCCESS ||
+       vk->CreateQueryPool(device, &query_pool_info, NULL, &timer->query_pool) !=
+          VK_SUCCESS)
+      goto fail;
+
+   const VkCommandBufferAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = timer->command_pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = VKR_QUEUE_GPU_TIMER_SLOTS,
+   };
+   if (vk->AllocateCommandBuffers(device, &alloc_info, timer->begin_cmds) != VK_SUCCESS ||
+       vk->AllocateCommandBuffers(device, &alloc_info, timer->end_cmds) != VK_SUCCESS)
+      goto fail;
+
+   const VkFenceCreateInfo fence_info = {
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+   };
+   for (uint32_t slot = 0; slot < VKR_QUEUE_GPU_TIMER_SLOTS; slot++) {
+      if (vk->CreateFence(device, &fence_info, NULL, &timer->fences[slot]) != VK_SUCCESS ||
+          !vkr_queue_gpu_timer_record(queue, slot))
+         goto fail;
+   }
+
+   return;
+
+fail:
+   vkr_log("failed to set up GPU timestamps for queue family %u", queue->family);
+   vkr_queue_gpu_timer_destroy(queue);
+}
+
+/* Add up the slots whose timestamps are in, oldest first. The queries of a
+ * slot still hold the results of its last use until the reset at the start
+ * of its next submission runs, so they are only read once the fence of the
+ * slot has signalled.
+ */
+static void
+vkr_queue_gpu_timer_collect(struct vkr_queue *queue)
+{
+   struct vkr_queue_gpu_timer *timer = queue->gpu_timer;
+   struct vkr_device *dev = queue->device;
+   struct vn_device_proc_table *vk = &dev->proc_table;
+   VkDevice device = dev->base.handle.device;
+
+   while (timer->count) {
+      VkFence fence = timer->fences[timer->head];
+      uint64_t timestamps[2];
+      VkResult result = vk->GetFenceStatus(device, fence);
+      if (result == VK_NOT_READY)
+         break;
+
+      if (result == VK_SUCCESS) {
+         vk->ResetFences(device, 1, &fence);
+         result = vk->GetQueryPoolResults(device, timer->query_pool, 2 * timer->head, 2,
+                                          sizeof(timestamps), timestamps,
+                                          sizeof(timestamps[0]), VK_QUERY_RESULT_64_BIT);
+      }
+
+      /* the results of a lost device or an abandoned slot are dropped */
+      if (result == VK_SUCCESS) {
+         const uint64_t ticks = (timestamps[1] - timestamps[0]) & timer->timestamp_mask;
+         const uint64_t gpu_ns = (uint64_t)((double)ticks * timer->timestamp_period);
+
+         timer->submits++;
+         timer->gpu_ns += gpu_ns;
+         TRACE_GPU_TIME(timer->name, gpu_ns);
+      }
+
+      timer->head = (timer->head + 1) % VKR_QUEUE_GPU_TIMER_SLOTS;
+      timer->count--;
+   }
+}
+
+/* Return the slot for the next submission, or -1 when all are in flight. */
+static int
+vkr_queue_gpu_timer_acquire(struct vkr_queue *queue)
+{
+   struct vkr_queue_gpu_timer *timer = queue->gpu_timer;
+
+   vkr_queue_gpu_timer_collect(queue);
+   if (timer->count == VKR_QUEUE_GPU_TIMER_SLOTS)
+      return -1;
+
+   return (timer->head + timer->count++) % VKR_QUEUE_GPU_TIMER_SLOTS;
+}
+
+/* The timestamps of a failed submission are never written. */
+static void
+vkr_queue_gpu_timer_release(struct vkr_queue *queue)
+{
+   queue->gpu_timer->count--;
+}
+
+/* The end timestamp of a submission couldn't be submitted, but the begin
+ * command buffer of the slot may still be pending, and the command buffers
+ * can't be pending twice. Retire the slot with the queue without its
+ * timestamps, or wait for the queue when even that fails, which is usually
+ * a lost device where the wait returns right away.
+ */
+static void
+vkr_queue_gpu_timer_abandon(struct vkr_queue *queue, int slot)
+{
+   struct vn_device_proc_table *vk = &queue->device->proc_table;
+   VkQueue handle = queue->base.handle.queue;
+
+   if (vk->QueueSubmit(handle, 0, NULL, queue->gpu_timer->fences[slot]) == VK_SUCCESS)
+      return;
+
+   vk->QueueWaitIdle(handle);
+   vkr_queue_gpu_timer_release(queue);
+}
+
+/* The timestamps go into submissions of their own around the batch, so the
+ * time includes the semaphore waits of the batch. The end timestamp is
+ * submitted separately to signal the fence of the slot, the guest fence
+ * stays with the batch.
+ */
+static VkResult
+vkr_queue_submit(struct vkr_queue *queue,
+                 uint32_t submit_count,
+                 const VkSubmitInfo *submits,
+                 VkFence fence)
+{
+   struct vn_device_proc_table *vk = &queue->device->proc_table;
+   VkQueue handle = queue->base.handle.queue;
+   int slot;
+
+   if (!queue->gpu_timer || !submit_count || (slot = vkr_queue_gpu_timer_acquire(queue)) < 0)
+      return vk->QueueSubmit(handle, submit_count, submits, fence);
+
+   VkSubmitInfo *timed_submits = malloc(sizeof(*timed_submits) * (submit_count + 1));
+   if (!timed_submits) {
+      vkr_queue_gpu_timer_release(queue);
+      return vk->QueueSubmit(handle, submit_count, submits, fence);
+   }
+
+   timed_submits[0] = (VkSubmitInfo){
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &queue->gpu_timer->begin_cmds[slot],
+   };
+   memcpy(&timed_submits[1], submits, sizeof(*submits) * submit_count);
+
+   VkResult result = vk->QueueSubmit(handle, submit_count + 1, timed_submits, fence);
+   free(timed_submits);
+   if (result != VK_SUCCESS) {
+      vkr_queue_gpu_timer_release(queue);
+      return result;
+   }
+
+   const VkSubmitInfo end_submit = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &queue->gpu_timer->end_cmds[slot],
+   };
+   if (vk->QueueSubmit(handle, 1, &end_submit, queue->gpu_timer->fences[slot]) !=
+       VK_SUCCESS)
+      vkr_queue_gpu_timer_abandon(queue, slot);
+
+   return result;
+}
+
+static VkResult
+vkr_queue_submit2(struct vkr_queue *queue,
+                  uint32_t submit_count,
+                  const VkSubmitInfo2 *submits,
+                  VkFence fence)
+{
+   struct vn_device_proc_table *vk = &queue->device->proc_table;
+   VkQueue handle = queue->base.handle.queue;
+   int slot;
+
+   if (!queue->gpu_timer || !submit_count || (slot = vkr_queue_gpu_timer_acquire(queue)) < 0)
+      return vk->QueueSubmit2(handle, submit_count, submits, fence);
+
+   VkSubmitInfo2 *timed_submits = malloc(sizeof(*timed_submits) * (submit_count + 1));
+   if (!timed_submits) {
+      vkr_queue_gpu_timer_release(queue);
+      return vk->QueueSubmit2(handle, submit_count, submits, fence);
+   }
+
+   const VkCommandBufferSubmitInfo cmd_infos[2] = {
+      {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+         .commandBuffer = queue->gpu_timer->begin_cmds[slot],
+      },
+      {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+         .commandBuffer = queue->gpu_timer->end_cmds[slot],
+      },
+   };
+   timed_submits[0] = (VkSubmitInfo2){
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+      .commandBufferInfoCount = 1,
+      .pCommandBufferInfos = &cmd_infos[0],
+   };
+   memcpy(&timed_submits[1], submits, sizeof(*submits) * submit_count);
+
+   VkResult result = vk->QueueSubmit2(handle, submit_count + 1, timed_submits, fence);
+   free(timed_submits);
+   if (result != VK_SUCCESS) {
+      vkr_queue_gpu_timer_release(queue);
+      return result;
+   }
+
+   const VkSubmitInfo2 end_submit = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+      .commandBufferInfoCount = 1,
+      .pCommandBufferInfos = &cmd_infos[1],
+   };
+   if (vk->QueueSubmit2(handle, 1, &end_submit, queue->gpu_timer->fences[slot]) !=
+       VK_SUCCESS)
+      vkr_queue_gpu_timer_abandon(queue, slot);
+
+   return result;
+}
+
 static void
 vkr_queue_sync_thread_fini(struct vkr_queue *queue)
 {
@@ -134,6 +433,16 @@ vkr_queue_destroy(struct vkr_context *ctx, struct vkr_queue *queue)
 {
    vkr_queue_sync_thread_fini(queue);
 
+   if (queue->gpu_timer) {
+      vkr_queue_gpu_timer_collect(queue);
+      if (queue->gpu_timer->submits) {
+         vkr_log("context %u %s: GPU time %" PRIu64 " us in %" PRIu64 " submissions",
+                 ctx->ctx_id, queue->gpu_timer->name, queue->gpu_timer->gpu_ns / 1000,
+                 queue->gpu_timer->submits);
+      }
+      vkr_queue_gpu_timer_destroy(queue);
+   }
+
    list_del(&queue->base.track_head);
 
    mtx_destroy(&queue->vk_mutex);
@@ -255,6 +564,9 @@ vkr_queue_create(struct vkr_context *ctx,
       return NULL;
    }
 
+   if (VKR_DEBUG(GPU_TIME))
+      vkr_queue_gpu_timer_init(queue);
+
    list_inithead(&queue->base.track_head);
 
    return queue;
@@ -371,13 +683,11 @@ vkr_dispatch_vkQueueSubmit(UNUSED struct vn_dispatch_context *dispatch,
 {
    TRACE_FUNC();
    struct vkr_queue *queue = vkr_queue_from_handle(args->queue);
-   struct vn_device_proc_table *vk = &queue->device->proc_table;
 
    vn_replace_vkQueueSubmit_args_handle(args);
 
    mtx_lock(&queue->vk_mutex);
-   args->ret =
-      vk->QueueSubmit(args->queue, args->submitCount, args->pSubmits, args->fence);
+   args->ret = vkr_queue_submit(queue, args->submitCount, args->pSubmits, args->fence);
    mtx_unlock(&queue->vk_mutex);
 }
 
@@ -412,13 +722,11 @@ vkr_dispatch_vkQueueSubmit2(UNUSED struct vn_dispatch_context *dispatch,
 {
    TRACE_FUNC();
    struct vkr_queue *queue = vkr_queue_from_handle(args->queue);
-   struct vn_device_proc_table *vk = &queue->device->proc_table;
 
    vn_replace_vkQueueSubmit2_args_handle(args);
 
    mtx_lock(&queue->vk_mutex);
-   args->ret =
-      vk->QueueSubmit2(args->queue, args->submitCount, args->pSubmits, args->fence);
+   args->ret = vkr_queue_submit2(queue, args->submitCount, args->pSubmits, args->fence);
    mtx_unlock(&queue->vk_mutex);
 }
 
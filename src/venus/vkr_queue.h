@@ -19,6 +19,32 @@ struct vkr_queue_sync {
    struct list_head head;
 };
 
+/* With VKR_DEBUG=gpu_time, queue submissions are bracketed by timestamps.
+ * The command buffers writing them are recorded once per slot, and a slot is
+ * reused once its results have been read.
+ */
+#define VKR_QUEUE_GPU_TIMER_SLOTS 64
+
+struct vkr_queue_gpu_timer {
+   VkCommandPool command_pool;
+   VkQueryPool query_pool;
+   VkCommandBuffer begin_cmds[VKR_QUEUE_GPU_TIMER_SLOTS];
+   VkCommandBuffer end_cmds[VKR_QUEUE_GPU_TIMER_SLOTS];
+   /* signalled after the end timestamp of the slot is written */
+   VkFence fences[VKR_QUEUE_GPU_TIMER_SLOTS];
+
+   /* slots in flight, starting from the oldest one */
+   uint32_t head;
+   uint32_t count;
+
+   uint64_t timestamp_mask;
+   float timestamp_period;
+
+   uint64_t submits;
+   uint64_t gpu_ns;
+   char name[32];
+};
+
 struct vkr_queue {
    struct vkr_object base;
 
@@ -32,6 +58,9 @@ struct vkr_queue {
    /* only used when client driver uses multiple timelines */
    uint32_t ring_idx;
 
+   /* NULL unless VKR_DEBUG=gpu_time, protected by vk_mutex */
+   struct vkr_queue_gpu_timer *gpu_timer;
+
    /* Ensure host access to VkQueue being externally synchronized between renderer main
     * thread and ring thread.
     */
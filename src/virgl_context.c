@@ -25,12 +25,22 @@
 #include "virgl_context.h"
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "util/libsync.h"
 #include "util/os_misc.h"
 #include "util/u_hash_table.h"
 #include "util/u_pointer.h"
 #include "virgl_util.h"
+#include "virglrenderer.h"
+
+struct virgl_context_fence_time {
+   struct list_head head;
+   uint32_t ring_idx;
+   uint64_t fence_id;
+   uint64_t submit_ns;
+};
 
 static struct util_hash_table *virgl_context_table;
 
@@ -42,7 +52,10 @@ virgl_context_destroy_func(void *val)
    if (ctx->in_fence_fd >= 0)
       close(ctx->in_fence_fd);
 
+   /* fences may still retire while the context is torn down */
+   struct virgl_context_stats *stats = ctx->stats;
    ctx->destroy(ctx);
+   virgl_context_fini_stats(stats);
 }
 
 int
@@ -117,3 +130,159 @@ int virgl_context_take_in_fence_fd(struct virgl_context *ctx)
 
    return ret;
 }
+
+int
+virgl_context_init_stats(struct virgl_context *ctx)
+{
+   struct virgl_context_stats *stats = calloc(1, sizeof(*stats));
+   if (!stats)
+      return ENOMEM;
+
+   list_inithead(&stats->pending_fences);
+   if (mtx_init(&stats->mutex, mtx_plain) != thrd_success) {
+      free(stats);
+      return ENOMEM;
+   }
+
+   ctx->stats = stats;
+   return 0;
+}
+
+void
+virgl_context_fini_stats(struct virgl_context_stats *stats)
+{
+   if (!stats)
+      return;
+
+   list_for_each_entry_safe(struct virgl_context_fence_time, time,
+                            &stats->pending_fences, head)
+      free(time);
+
+   mtx_destroy(&stats->mutex);
+   free(stats);
+}
+
+void
+virgl_context_count_submit(struct virgl_context *ctx, size_t size)
+{
+   struct virgl_context_stats *stats = ctx->stats;
+
+   mtx_lock(&stats->mutex);
+   stats->submits++;
+   stats->submit_bytes += size;
+   mtx_unlock(&stats->mutex);
+}
+
+void
+virgl_context_count_fence(struct virgl_context *ctx,
+                          uint32_t ring_idx,
+                          uint64_t fence_id)
+{
+   struct virgl_context_stats *stats = ctx->stats;
+   struct virgl_context_fence_time *time = malloc(sizeof(*time));
+
+   mtx_lock(&stats->mutex);
+   stats->fences_submitted++;
+   /* without the submission time the fence only misses in the latency */
+   if (time) {
+      time->ring_idx = ring_idx;
+      time->fence_id = fence_id;
+      time->submit_ns = virgl_time_get_ns();
+      list_addtail(&time->head, &stats->pending_fences);
+   }
+   mtx_unlock(&stats->mutex);
+}
+
+/* The fence was counted before it was submitted, in case it retires right
+ * away, but the submission failed. */
+void
+virgl_context_uncount_fence(struct virgl_context *ctx,
+                            uint32_t ring_idx,
+                            uint64_t fence_id)
+{
+   struct virgl_context_stats *stats = ctx->stats;
+
+   mtx_lock(&stats->mutex);
+   stats->fences_submitted--;
+   list_for_each_entry_safe_rev(struct virgl_context_fence_time, time,
+                                &stats->pending_fences, head) {
+      if (time->ring_idx == ring_idx && time->fence_id == fence_id) {
+         list_del(&time->head);
+         free(time);
+         break;
+      }
+   }
+   mtx_unlock(&stats->mutex);
+}
+
+/* Fences of a ring retire in order, and retiring a fence may also retire the
+ * earlier fences merged into it. Fences can retire while the context is torn
+ * down, before the statistics are. */
+void
+virgl_context_count_fence_retire(struct virgl_context *ctx,
+                                 uint32_t ring_idx,
+                                 uint64_t fence_id)
+{
+   struct virgl_context_stats *stats = ctx->stats;
+   struct virgl_context_fence_time *last = NULL;
+   const uint64_t now = virgl_time_get_ns();
+
+   /* a context that failed to set up its statistics is destroyed right away */
+   if (!stats)
+      return;
+
+   mtx_lock(&stats->mutex);
+
+   list_for_each_entry(struct virgl_context_fence_time, time,
+                       &stats->pending_fences, head) {
+      if (time->ring_idx == ring_idx && time->fence_id == fence_id) {
+         last = time;
+         break;
+      }
+   }
+
+   if (last) {
+      list_for_each_entry_safe(struct virgl_context_fence_time, time,
+                               &stats->pending_fences, head) {
+         if (time->ring_idx != ring_idx)
+            continue;
+
+         const uint64_t latency = now - time->submit_ns;
+         const bool done = time == last;
+         stats->fences_retired++;
+         stats->fence_latency_ns += latency;
+         if (latency > stats->max_fence_latency_ns)
+            stats->max_fence_latency_ns = latency;
+
+         list_del(&time->head);
+         free(time);
+         if (done)
+            break;
+      }
+   }
+
+   mtx_unlock(&stats->mutex);
+}
+
+void
+virgl_context_get_stats(struct virgl_context *ctx,
+                        struct virgl_renderer_context_stats *stats)
+{
+   struct virgl_context_stats *counts = ctx->stats;
+
+   memset(stats, 0, sizeof(*stats));
+   stats->ctx_id = ctx->ctx_id;
+   stats->capset_id = ctx->capset_id;
+
+   mtx_lock(&counts->mutex);
+   stats->submits = counts->submits;
+   stats->submit_bytes = counts->submit_bytes;
+   stats->fences_submitted = counts->fences_submitted;
+   stats->fences_retired = counts->fences_retired;
+   stats->fence_latency_ns = counts->fence_latency_ns;
+   stats->max_fence_latency_ns = counts->max_fence_latency_ns;
+   mtx_unlock(&counts->mutex);
+
+   if (ctx->get_stats)
+      ctx->get_stats(ctx, stats);
+}
@@ -32,10 +32,12 @@
 #include "virglrenderer_hw.h"
 #include "virgl_resource.h"
 
+#include "c11/threads.h"
 #include "util/list.h"
 
 struct vrend_transfer_info;
 struct pipe_resource;
+struct virgl_renderer_context_stats;
 
 struct virgl_context_blob {
    /* valid fd or pipe resource */
@@ -57,6 +59,23 @@ typedef void (*virgl_context_fence_retire)(struct virgl_context *ctx,
                                            uint32_t ring_idx,
                                            uint64_t fence_id);
 
+/* Counters kept for every context type, outside of the context
+ * implementations.  Fences may be retired from another thread. */
+struct virgl_context_stats {
+   mtx_t mutex;
+
+   uint64_t submits;
+   uint64_t submit_bytes;
+
+   uint64_t fences_submitted;
+   uint64_t fences_retired;
+   uint64_t fence_latency_ns;
+   uint64_t max_fence_latency_ns;
+
+   /* submission times of the fences not retired yet */
+   struct list_head pending_fences;
+};
+
 /**
  * Base class for renderer contexts.  For example, vrend_decode_ctx is a
  * subclass of virgl_context.
@@ -80,6 +99,9 @@ struct virgl_context {
 
    bool supports_fence_sharing;
 
+   /* allocated separately, it outlives the context during destroy */
+   struct virgl_context_stats *stats;
+
    void (*destroy)(struct virgl_context *ctx);
 
    void (*attach_resource)(struct virgl_context *ctx,
@@ -128,6 +150,10 @@ struct virgl_context {
                        uint32_t flags,
                        uint32_t ring_idx,
                        uint64_t fence_id);
+
+   /* optional, fill in the statistics only the context type knows about */
+   void (*get_stats)(struct virgl_context *ctx,
+                     struct virgl_renderer_context_stats *stats);
 };
 
 struct virgl_context_foreach_args {
@@ -158,4 +184,32 @@ virgl_context_foreach(const struct virgl_context_foreach_args *args);
 
 int virgl_context_take_in_fence_fd(struct virgl_context *ctx);
 
+int
+virgl_context_init_stats(struct virgl_context *ctx);
+
+void
+virgl_context_fini_stats(struct virgl_context_stats *stats);
+
+void
+virgl_context_count_submit(struct virgl_context *ctx, size_t size);
+
+void
+virgl_context_count_fence(struct virgl_context *ctx,
+                          uint32_t ring_idx,
+                          uint64_t fence_id);
+
+void
+virgl_context_uncount_fence(struct virgl_context *ctx,
+                            uint32_t ring_idx,
+                            uint64_t fence_id);
+
+void
+virgl_context_count_fence_retire(struct virgl_context *ctx,
+                                 uint32_t ring_idx,
+                                 uint64_t fence_id);
+
+void
+virgl_context_get_stats(struct virgl_context *ctx,
+                        struct virgl_renderer_context_stats *stats);
+
 #endif /* VIRGL_CONTEXT_H */
@@ -587,6 +587,7 @@ enum virgl_formats {
 #define VIRGL_CAP_V2_DRAW_PARAMETERS      (1u << 14)
 #define VIRGL_CAP_V2_GROUP_VOTE           (1u << 15)
 #define VIRGL_CAP_V2_MIRROR_CLAMP_TO_EDGE (1u << 16)
+#define VIRGL_CAP_V2_VIDEO_FENCE_RING     (1u << 17)
 
 /* virgl bind flags - these are compatible with mesa 10.5 gallium.
  * but are fixed, no other should be passed to virgl either.
@@ -711,6 +711,11 @@ enum vrend_tweak_type {
 #define VIRGL_CREATE_VIDEO_CODEC_WIDTH      6
 #define VIRGL_CREATE_VIDEO_CODEC_HEIGHT     7
 #define VIRGL_CREATE_VIDEO_CODEC_MAX_REF    8
+#define VIRGL_CREATE_VIDEO_CODEC_FLAGS      9
+
+/* end_frame returns before the frame is complete, completion is signalled
+ * by the fences on VIRGL_VIDEO_FENCE_RING_IDX */
+#define VIRGL_VIDEO_CODEC_FLAG_ASYNC        (1 << 0)
 
 /* VIRGL_CCMD_DESTROY_VIDEO_CODEC */
 #define VIRGL_DESTROY_VIDEO_CODEC_MIN_SIZE  1
@@ -756,6 +761,10 @@ enum vrend_tweak_type {
 #define VIRGL_END_FRAME_CDC_HANDLE          1
 #define VIRGL_END_FRAME_TGT_HANDLE          2
 
+/* A fence on this ring signals once the frames ended before it are
+ * complete, available with VIRGL_CAP_V2_VIDEO_FENCE_RING */
+#define VIRGL_VIDEO_FENCE_RING_IDX          1
+
 /* VIRGL_CCMD_CLEAR_SURFACE */
 #define VIRGL_CLEAR_SURFACE_SIZE                   10
 #define VIRGL_CLEAR_SURFACE_S0                     1
@@ -35,6 +35,8 @@
 #include "util/u_pointer.h"
 #include "virgl_util.h"
 #include "virgl_context.h"
+#include "virglrenderer.h"
+#include "vrend_iov.h"
 
 static struct util_hash_table *virgl_resource_table;
 static struct virgl_resource_pipe_callbacks pipe_callbacks;
@@ -274,3 +276,49 @@ virgl_resource_export_fd(struct virgl_resource *res, int *fd)
 
    return VIRGL_RESOURCE_FD_INVALID;
 }
+
+static enum virgl_renderer_storage_type
+virgl_resource_storage_type(const struct virgl_resource *res)
+{
+   switch (res->fd_type) {
+   case VIRGL_RESOURCE_FD_DMABUF:
+      return VIRGL_RENDERER_STORAGE_DMABUF;
+   case VIRGL_RESOURCE_FD_OPAQUE:
+      return VIRGL_RENDERER_STORAGE_OPAQUE_FD;
+   case VIRGL_RESOURCE_FD_SHM:
+      return VIRGL_RENDERER_STORAGE_SHM;
+   case VIRGL_RESOURCE_OPAQUE_HANDLE:
+      return VIRGL_RENDERER_STORAGE_OPAQUE_HANDLE;
+   default:
+      return res->pipe_resource ? VIRGL_RENDERER_STORAGE_HOST :
+                                  VIRGL_RENDERER_STORAGE_GUEST;
+   }
+}
+
+static enum pipe_error
+virgl_resource_stats_func(UNUSED void *key, void *val, void *data)
+{
+   const struct virgl_resource *res = val;
+   struct virgl_renderer_resource_stats *stats = data;
+   struct virgl_renderer_resource_stats *type_stats =
+      &stats[virgl_resource_storage_type(res)];
+   uint64_t bytes = res->map_size;
+
+   if (!bytes) {
+      for (int i = 0; i < res->iov_count; i++)
+         bytes += res->iov[i].iov_len;
+   }
+
+   type_stats->count++;
+   type_stats->bytes += bytes;
+
+   return PIPE_OK;
+}
+
+void
+virgl_resource_get_stats(struct virgl_renderer_resource_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats) * VIRGL_RENDERER_STORAGE_TYPE_COUNT);
+   util_hash_table_foreach(virgl_resource_table, virgl_resource_stats_func,
+                           stats);
+}
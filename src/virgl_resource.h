@@ -30,6 +30,7 @@
 struct iovec;
 struct pipe_resource;
 struct virgl_context;
+struct virgl_renderer_resource_stats;
 
 enum virgl_resource_fd_type {
    VIRGL_RESOURCE_FD_DMABUF,
@@ -172,4 +173,8 @@ virgl_resource_detach_iov(struct virgl_resource *res);
 enum virgl_resource_fd_type
 virgl_resource_export_fd(struct virgl_resource *res, int *fd);
 
+/* stats is indexed by virgl_renderer_storage_type */
+void
+virgl_resource_get_stats(struct virgl_renderer_resource_stats *stats);
+
 #endif /* VIRGL_RESOURCE_H */
@@ -39,6 +39,7 @@
 #include "util/u_string.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -205,6 +206,31 @@ void virgl_override_log_level(enum virgl_log_level_flags log_level)
    virgl_log_level_initialized = true;
 }
 
+static struct {
+   struct virgl_init_phase_record phases[VIRGL_INIT_PHASE_MAX];
+   uint32_t count;
+} virgl_init_profile;
+
+void virgl_init_phase_add(const char *name, uint64_t duration_us)
+{
+   if (virgl_init_profile.count == VIRGL_INIT_PHASE_MAX)
+      return;
+
+   virgl_init_profile.phases[virgl_init_profile.count++] =
+      (struct virgl_init_phase_record){ name, duration_us };
+}
+
+uint32_t virgl_init_phases_get(const struct virgl_init_phase_record **phases)
+{
+   *phases = virgl_init_profile.phases;
+   return virgl_init_profile.count;
+}
+
+void virgl_init_phases_reset(void)
+{
+   virgl_init_profile.count = 0;
+}
+
 static struct {
    virgl_log_callback_type log_cb;
    virgl_free_data_callback_type free_data_cb;
@@ -255,10 +281,17 @@ void virgl_prefixed_logv(const char *domain,
 
 #if ENABLE_TRACING == TRACE_WITH_PERCETTO
 PERCETTO_CATEGORY_DEFINE(VIRGL_PERCETTO_CATEGORIES)
+PERCETTO_TRACK_DEFINE(virgl_gpu_time, PERCETTO_TRACK_COUNTER);
 
 void trace_init(void)
 {
   PERCETTO_INIT(PERCETTO_CLOCK_DONT_CARE);
+  PERCETTO_REGISTER_TRACK(virgl_gpu_time);
+}
+
+void trace_gpu_time(UNUSED const char *name, uint64_t gpu_ns)
+{
+   TRACE_COUNTER(virgl, virgl_gpu_time, (int64_t)gpu_ns);
 }
 #endif
 
@@ -290,6 +323,11 @@ void trace_end(void **dummy)
    (void)dummy;
    vperfetto_min_endTrackEvent_VMM();
 }
+
+void trace_gpu_time(UNUSED const char *name, UNUSED uint64_t gpu_ns)
+{
+   /* only the stats API reports GPU time with this backend */
+}
 #endif
 
 #if ENABLE_TRACING == TRACE_WITH_SYSPROF
@@ -322,6 +360,15 @@ void trace_end(void **func_name)
                           NULL);
    free(trace);
 }
+
+void trace_gpu_time(const char *name, uint64_t gpu_ns)
+{
+   /* the batch ended at the latest when its result was read */
+   const SysprofTimeStamp now = SYSPROF_CAPTURE_CURRENT_TIME;
+
+   sysprof_collector_mark(now - (SysprofTimeStamp)gpu_ns, gpu_ns,
+                          "virglrenderer-gpu", name, NULL);
+}
 #endif
 
 #if ENABLE_TRACING == TRACE_WITH_STDERR
@@ -348,4 +395,11 @@ void trace_end(void **func_name)
       fprintf(stderr, "  ");
    fprintf(stderr, "LEAVE %s\n", (const char *) *func_name);
 }
+
+void trace_gpu_time(const char *name, uint64_t gpu_ns)
+{
+   for (int i = 0; i < nesting_depth; ++i)
+      fprintf(stderr, "  ");
+   fprintf(stderr, "GPU:%s %" PRIu64 " ns\n", name, gpu_ns);
+}
 #endif
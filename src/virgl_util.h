@@ -28,6 +28,7 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -59,6 +60,20 @@ static inline bool is_only_bit(uint32_t mask, uint32_t bit)
     return (mask == bit);
 }
 
+static inline uint64_t virgl_time_get_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t virgl_time_get_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 uint32_t hash_func_u32(const void *key);
 
 bool equal_func(const void *key1, const void *key2);
@@ -153,6 +168,10 @@ void trace_end(void **scope);
 #define TRACE_SCOPE_BEGIN(SCOPE) trace_begin(SCOPE)
 #define TRACE_SCOPE_END(SCOPE_OBJ)  trace_end(&SCOPE_OBJ)
 
+/* GPU time of a command batch, measured when the batch has already run */
+void trace_gpu_time(const char *name, uint64_t gpu_ns);
+#define TRACE_GPU_TIME(NAME, NS) trace_gpu_time(NAME, NS)
+
 #else
 #define TRACE_INIT()
 #define TRACE_FUNC()
@@ -160,6 +179,46 @@ void trace_end(void **scope);
 #define TRACE_SCOPE_SLOW(SCOPE)
 #define TRACE_SCOPE_BEGIN(SCOPE) NULL
 #define TRACE_SCOPE_END(SCOPE_OBJ) (void)SCOPE_OBJ
+#define TRACE_GPU_TIME(NAME, NS) ((void)(NAME), (void)(NS))
 #endif /* ENABLE_TRACING */
 
+/* Startup profile: every init phase is a trace scope and its duration is
+ * logged at debug level and recorded for virgl_renderer_get_init_phases, so
+ * the cost of bringing up each backend shows up without a tracing build. */
+struct virgl_init_phase {
+   const char *name;
+   uint64_t start_us;
+   void *trace_scope;
+};
+
+#define VIRGL_INIT_PHASE_MAX 16
+
+struct virgl_init_phase_record {
+   const char *name;
+   uint64_t duration_us;
+};
+
+/* Phases past VIRGL_INIT_PHASE_MAX are only logged. Init is serialized by
+ * the caller, so the records aren't locked. */
+void virgl_init_phase_add(const char *name, uint64_t duration_us);
+uint32_t virgl_init_phases_get(const struct virgl_init_phase_record **phases);
+void virgl_init_phases_reset(void);
+
+static inline void virgl_init_phase_begin(struct virgl_init_phase *phase,
+                                          const char *name)
+{
+   phase->name = name;
+   phase->start_us = virgl_time_get_us();
+   phase->trace_scope = TRACE_SCOPE_BEGIN(name);
+}
+
+static inline void virgl_init_phase_end(struct virgl_init_phase *phase)
+{
+   uint64_t duration_us = virgl_time_get_us() - phase->start_us;
+
+   TRACE_SCOPE_END(phase->trace_scope);
+   virgl_debug("init phase %s: %.3f ms\n", phase->name, duration_us / 1000.0);
+   virgl_init_phase_add(phase->name, duration_us);
+}
+
 #endif /* VIRGL_UTIL_H */
@@ -52,6 +52,10 @@
  *     it transmits the raw picture data from VASurface to the guest side,
  *     and after encoding, it transmits the result and the coded data in
  *     VACodedBuffer to the guest side.
+ *     The three steps are also available separately, as
+ *     virgl_video_submit_frame(), virgl_video_sync_buffer() and
+ *     virgl_video_complete_frame(), so that the wait for the video engine
+ *     can be moved to another thread.
  *
  * @author Feng Jiang <jiangfeng@kylinos.cn>
  */
@@ -863,6 +867,12 @@ struct virgl_video_buffer *virgl_video_create_buffer(
     buffer->height = args->height;
     buffer->opaque = args->opaque;
 
+    if (callbacks && callbacks->buffer_created && buffer->opaque) {
+        buffer->dmabuf = export_video_dma_buf(buffer, VIRGL_VIDEO_DMABUF_READ_WRITE);
+        if (buffer->dmabuf)
+            callbacks->buffer_created(buffer, buffer->dmabuf);
+    }
+
     return buffer;
 }
 
@@ -3176,8 +3186,8 @@ int virgl_video_encode_bitstream(struct virgl_video_codec *codec,
     return -1;
 }
 
-int virgl_video_end_frame(struct virgl_video_codec *codec,
-                          struct virgl_video_buffer *target)
+int virgl_video_submit_frame(struct virgl_video_codec *codec,
+                             struct virgl_video_buffer *target)
 {
     VAStatus va_stat;
 
@@ -3190,18 +3200,46 @@ int virgl_video_end_frame(struct virgl_video_codec *codec,
         return -1;
     }
 
-    va_stat = vaSyncSurface(va_dpy, target->va_sfc);
+    return 0;
+}
+
+int virgl_video_sync_buffer(struct virgl_video_buffer *buffer)
+{
+    VAStatus va_stat;
+
+    if (!va_dpy || !buffer)
+        return -1;
+
+    va_stat = vaSyncSurface(va_dpy, buffer->va_sfc);
     if (VA_STATUS_SUCCESS != va_stat) {
         virgl_error("sync surface failed, err = 0x%x\n", va_stat);
         return -1;
     }
 
+    return 0;
+}
+
+void virgl_video_complete_frame(struct virgl_video_codec *codec,
+                                struct virgl_video_buffer *target)
+{
+    if (!va_dpy || !codec || !target)
+        return;
+
     if (codec->entrypoint != PIPE_VIDEO_ENTRYPOINT_ENCODE) {
         decode_completed(codec, target);
     } else {
         encode_completed(codec, target);
     }
+}
+
+int virgl_video_end_frame(struct virgl_video_codec *codec,
+                          struct virgl_video_buffer *target)
+{
+    if (virgl_video_submit_frame(codec, target) ||
+        virgl_video_sync_buffer(target))
+        return -1;
+
+    virgl_video_complete_frame(codec, target);
 
     return 0;
 }
-
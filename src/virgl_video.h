@@ -106,6 +106,12 @@ struct virgl_video_dma_buf {
  * better shield the underlying logic differences.
  */
 struct virgl_video_callbacks {
+    /* Callback when a video buffer is created, the dmabuf can be imported to
+     * share the memory of the buffer instead of copying the pictures in the
+     * other callbacks. Optional. */
+    void (*buffer_created)(struct virgl_video_buffer *buffer,
+                           const struct virgl_video_dma_buf *dmabuf);
+
     /* Callback when decoding is complete, used to download the decoded picture
      * from the video buffer */
     void (*decode_completed)(struct virgl_video_codec *codec,
@@ -159,5 +165,17 @@ int virgl_video_encode_bitstream(struct virgl_video_codec *codec,
 int virgl_video_end_frame(struct virgl_video_codec *codec,
                           struct virgl_video_buffer *target);
 
+/*
+ * virgl_video_end_frame() split in its steps: submit the frame to the video
+ * engine, wait for the engine to be done with the target buffer, and run
+ * the completion callbacks. virgl_video_sync_buffer() may be called from
+ * any thread, the other steps from the thread that uses the codec.
+ */
+int virgl_video_submit_frame(struct virgl_video_codec *codec,
+                             struct virgl_video_buffer *target);
+int virgl_video_sync_buffer(struct virgl_video_buffer *buffer);
+void virgl_video_complete_frame(struct virgl_video_codec *codec,
+                                struct virgl_video_buffer *target);
+
 #endif /* VIRGL_VIDEO_H */
 
@@ -22,7 +22,10 @@
  *
  **************************************************************************/
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
 #include <epoxy/gl.h>
@@ -72,10 +75,45 @@ struct global_state {
    bool external_winsys_initialized;
    bool drm_initialized;
    bool fence_initialized;
+
+   /* the first caps query belongs to startup, later ones do not */
+   bool caps_phase_recorded;
+
+   /* with VIRGL_RENDERER_LAZY_VIRGL_INIT, ctx0 fences created before vrend
+    * is up have no work to wait for and retire on the next poll */
+   bool vrend_init_failed;
+   bool ctx0_fence_pending;
+   uint32_t ctx0_fence_id;
+
+   /* VIRGL_STATS_FILE */
+   const char *stats_file;
+   uint64_t stats_interval_ns;
+   uint64_t stats_next_ns;
 };
 
 static struct global_state state;
 
+static int virgl_renderer_init_vrend(void);
+
+/* Bring vrend up on first use when its initialization was deferred. */
+static bool virgl_renderer_need_vrend(void)
+{
+   if (state.vrend_initialized)
+      return true;
+
+   if (!state.client_initialized || state.vrend_init_failed ||
+       (state.flags & VIRGL_RENDERER_NO_VIRGL))
+      return false;
+
+   if (virgl_renderer_init_vrend()) {
+      virgl_error("deferred vrend initialization failed\n");
+      state.vrend_init_failed = true;
+      return false;
+   }
+
+   return true;
+}
+
 /* new API - just wrap internal API for now */
 
 static int virgl_renderer_resource_create_internal(struct virgl_renderer_resource_create_args *args,
@@ -87,7 +125,7 @@ static int virgl_renderer_resource_create_internal(struct virgl_renderer_resourc
    struct vrend_renderer_resource_create_args vrend_args =  { 0 };
    uint32_t map_info;
 
-   if (!state.vrend_initialized)
+   if (!virgl_renderer_need_vrend())
       return EINVAL;
 
    /* do not accept handle 0 */
@@ -178,10 +216,18 @@ void virgl_renderer_resource_unref(uint32_t res_handle)
 void virgl_renderer_fill_caps(uint32_t set, uint32_t version,
                               void *caps)
 {
+   struct virgl_init_phase phase;
+   bool record_phase = !state.caps_phase_recorded;
+
+   if (record_phase) {
+      virgl_init_phase_begin(&phase, "caps");
+      state.caps_phase_recorded = true;
+   }
+
    switch (set) {
    case VIRGL_RENDERER_CAPSET_VIRGL:
    case VIRGL_RENDERER_CAPSET_VIRGL2:
-      if (state.vrend_initialized)
+      if (virgl_renderer_need_vrend())
          vrend_renderer_fill_caps(set, version, (union virgl_caps *)caps);
       break;
    case VIRGL_RENDERER_CAPSET_VENUS:
@@ -195,12 +241,16 @@ void virgl_renderer_fill_caps(uint32_t set, uint32_t version,
    default:
       break;
    }
+
+   if (record_phase)
+      virgl_init_phase_end(&phase);
 }
 
 static void per_context_fence_retire(struct virgl_context *ctx,
                                      uint32_t ring_idx,
                                      uint64_t fence_id)
 {
+   virgl_context_count_fence_retire(ctx, ring_idx, fence_id);
    state.cbs->write_context_fence(state.cookie,
                                   ctx->ctx_id,
                                   ring_idx,
@@ -235,7 +285,7 @@ int virgl_renderer_context_create_with_flags(uint32_t ctx_id,
    switch (capset_id) {
    case VIRGL_RENDERER_CAPSET_VIRGL:
    case VIRGL_RENDERER_CAPSET_VIRGL2:
-      if (!state.vrend_initialized)
+      if (!virgl_renderer_need_vrend())
          return EINVAL;
       ctx = vrend_renderer_context_create(ctx_id, nlen, name);
       break;
@@ -261,9 +311,17 @@ int virgl_renderer_context_create_with_flags(uint32_t ctx_id,
    ctx->capset_id = capset_id;
    ctx->fence_retire = per_context_fence_retire;
 
+   ret = virgl_context_init_stats(ctx);
+   if (ret) {
+      ctx->destroy(ctx);
+      return ret;
+   }
+
    ret = virgl_context_add(ctx);
    if (ret) {
+      struct virgl_context_stats *stats = ctx->stats;
       ctx->destroy(ctx);
+      virgl_context_fini_stats(stats);
       return ret;
    }
 
@@ -296,6 +354,7 @@ int virgl_renderer_submit_cmd(void *buffer,
    if (ndw < 0 || (unsigned)ndw > UINT32_MAX / sizeof(uint32_t))
       return EINVAL;
 
+   virgl_context_count_submit(ctx, ndw * sizeof(uint32_t));
    return ctx->submit_cmd(ctx, buffer, ndw * sizeof(uint32_t));
 }
 
@@ -407,12 +466,59 @@ void virgl_renderer_resource_detach_iov(int res_handle, struct iovec **iov_p, in
    virgl_resource_detach_iov(res);
 }
 
+static bool
+virgl_context_foreach_wait_idle(struct virgl_context *ctx,
+                                UNUSED void *data)
+{
+   if (ctx->capset_id == VIRGL_RENDERER_CAPSET_VIRGL ||
+       ctx->capset_id == VIRGL_RENDERER_CAPSET_VIRGL2)
+      vrend_renderer_context_wait_idle(ctx);
+   return true;
+}
+
+static bool
+virgl_context_foreach_queue_ctx0_fence(struct virgl_context *ctx,
+                                       void *data)
+{
+   if (ctx->capset_id == VIRGL_RENDERER_CAPSET_VIRGL ||
+       ctx->capset_id == VIRGL_RENDERER_CAPSET_VIRGL2)
+      vrend_renderer_context_queue_ctx0_fence(ctx, data);
+   return true;
+}
+
 int virgl_renderer_create_fence(int client_fence_id, UNUSED uint32_t ctx_id)
 {
    TRACE_FUNC();
    const uint32_t fence_id = (uint32_t)client_fence_id;
-   if (state.vrend_initialized)
+   if (state.vrend_initialized) {
+      /* the ctx0 fence covers the commands of all vrend contexts, with
+       * threaded contexts the workers still executing some create it once
+       * they got to it */
+      if (vrend_renderer_use_threaded_contexts()) {
+         struct vrend_ctx0_fence_wait *wait = vrend_ctx0_fence_wait_create(fence_id);
+         struct virgl_context_foreach_args args;
+         if (!wait)
+            return ENOMEM;
+
+         args.callback = virgl_context_foreach_queue_ctx0_fence;
+         args.data = wait;
+         virgl_context_foreach(&args);
+         return vrend_ctx0_fence_wait_put(wait);
+      }
       return vrend_renderer_create_ctx0_fence(fence_id);
+   }
+
+   /* nothing ran on ctx0 yet, the fence is signaled already */
+   if (state.client_initialized && !state.vrend_init_failed &&
+       !(state.flags & VIRGL_RENDERER_NO_VIRGL)) {
+      if (state.flags & VIRGL_RENDERER_ASYNC_FENCE_CB) {
+         state.cbs->write_fence(state.cookie, fence_id);
+      } else {
+         state.ctx0_fence_id = fence_id;
+         state.ctx0_fence_pending = true;
+      }
+      return 0;
+   }
    return EINVAL;
 }
 
@@ -427,7 +533,14 @@ int virgl_renderer_context_create_fence(uint32_t ctx_id,
       return -EINVAL;
 
    assert(state.cbs->version >= 3 && state.cbs->write_context_fence);
-   return ctx->submit_fence(ctx, flags, ring_idx, fence_id);
+
+   /* the fence may retire before submit_fence returns */
+   virgl_context_count_fence(ctx, ring_idx, fence_id);
+   int ret = ctx->submit_fence(ctx, flags, ring_idx, fence_id);
+   if (ret)
+      virgl_context_uncount_fence(ctx, ring_idx, fence_id);
+
+   return ret;
 }
 
 void virgl_renderer_context_poll(uint32_t ctx_id)
@@ -448,6 +561,286 @@ int virgl_renderer_context_get_poll_fd(uint32_t ctx_id)
    return ctx->get_fencing_fd(ctx);
 }
 
+int virgl_renderer_context_get_shader_stats(uint32_t ctx_id,
+                                            struct virgl_renderer_shader_stats *stats)
+{
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   switch (ctx->capset_id) {
+   case VIRGL_RENDERER_CAPSET_VIRGL:
+   case VIRGL_RENDERER_CAPSET_VIRGL2:
+      vrend_renderer_context_get_shader_stats(ctx, stats);
+      return 0;
+   default:
+      return EINVAL;
+   }
+}
+
+int virgl_renderer_context_get_copy_stats(uint32_t ctx_id,
+                                          struct virgl_renderer_copy_stats *stats)
+{
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   switch (ctx->capset_id) {
+   case VIRGL_RENDERER_CAPSET_VIRGL:
+   case VIRGL_RENDERER_CAPSET_VIRGL2:
+      vrend_renderer_context_get_copy_stats(ctx, stats);
+      return 0;
+   default:
+      return EINVAL;
+   }
+}
+
+int virgl_renderer_context_get_decode_stats(uint32_t ctx_id,
+                                            struct virgl_renderer_decode_stats *stats,
+                                            struct virgl_renderer_cmd_stats *cmds,
+                                            uint32_t *num_cmds)
+{
+   struct virgl_context *ctx = virgl_context_lookup(ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   switch (ctx->capset_id) {
+   case VIRGL_RENDERER_CAPSET_VIRGL:
+   case VIRGL_RENDERER_CAPSET_VIRGL2:
+      return vrend_renderer_context_get_decode_stats(ctx, stats, cmds, num_cmds);
+   default:
+      return EINVAL;
+   }
+}
+
+struct virgl_renderer_stats_args {
+   struct virgl_renderer_context_stats *ctxs;
+   uint32_t max_ctxs;
+   uint32_t count;
+};
+
+static bool
+virgl_context_foreach_get_stats(struct virgl_context *ctx, void *data)
+{
+   struct virgl_renderer_stats_args *args = data;
+
+   if (args->count < args->max_ctxs)
+      virgl_context_get_stats(ctx, &args->ctxs[args->count]);
+   args->count++;
+
+   return true;
+}
+
+int virgl_renderer_get_stats(struct virgl_renderer_stats *stats,
+                             struct virgl_renderer_context_stats *ctxs,
+                             uint32_t *num_ctxs)
+{
+   struct virgl_renderer_stats_args args = { 0 };
+   struct virgl_context_foreach_args foreach_args;
+
+   if (!state.context_initialized || !state.resource_initialized)
+      return EINVAL;
+
+   if (num_ctxs && ctxs) {
+      args.ctxs = ctxs;
+      args.max_ctxs = *num_ctxs;
+   }
+
+   foreach_args.callback = virgl_context_foreach_get_stats;
+   foreach_args.data = &args;
+   virgl_context_foreach(&foreach_args);
+
+   if (num_ctxs)
+      *num_ctxs = args.count;
+
+   if (stats) {
+      memset(stats, 0, sizeof(*stats));
+      stats->contexts = args.count;
+      if (state.vrend_initialized)
+         stats->format_probes = vrend_renderer_get_format_probes();
+      virgl_resource_get_stats(stats->resources);
+   }
+
+   return 0;
+}
+
+int virgl_renderer_get_init_phases(struct virgl_renderer_init_phase *phases,
+                                   uint32_t *num_phases)
+{
+   const struct virgl_init_phase_record *records;
+   uint32_t count;
+
+   if (!num_phases)
+      return EINVAL;
+
+   count = virgl_init_phases_get(&records);
+   if (phases) {
+      for (uint32_t i = 0; i < MIN2(count, *num_phases); i++) {
+         phases[i].name = records[i].name;
+         phases[i].duration_us = records[i].duration_us;
+      }
+   }
+   *num_phases = count;
+
+   return 0;
+}
+
+static const char *virgl_renderer_capset_name(uint32_t capset_id)
+{
+   switch (capset_id) {
+   case VIRGL_RENDERER_CAPSET_VIRGL:
+      return "virgl";
+   case VIRGL_RENDERER_CAPSET_VIRGL2:
+      return "virgl2";
+   case VIRGL_RENDERER_CAPSET_VENUS:
+      return "venus";
+   case VIRGL_RENDERER_CAPSET_DRM:
+      return "drm";
+   default:
+      return "unknown";
+   }
+}
+
+static const struct {
+   const char *name;
+   const char *type;
+   const char *help;
+   size_t offset;
+} virgl_renderer_context_metrics[] = {
+#define CONTEXT_METRIC(name, type, field, help) \
+   { name, type, help, offsetof(struct virgl_renderer_context_stats, field) }
+   CONTEXT_METRIC("virgl_context_submits_total", "counter", submits,
+                  "Command buffers submitted."),
+   CONTEXT_METRIC("virgl_context_submit_bytes_total", "counter", submit_bytes,
+                  "Size of the command buffers submitted."),
+   CONTEXT_METRIC("virgl_context_commands_total", "counter", commands,
+                  "Commands in the command buffers."),
+   CONTEXT_METRIC("virgl_context_fences_submitted_total", "counter", fences_submitted,
+                  "Fences submitted."),
+   CONTEXT_METRIC("virgl_context_fences_retired_total", "counter", fences_retired,
+                  "Fences retired."),
+   CONTEXT_METRIC("virgl_context_fence_latency_nanoseconds_total", "counter",
+                  fence_latency_ns, "Time from submission to retirement of the fences."),
+   CONTEXT_METRIC("virgl_context_fence_latency_max_nanoseconds", "gauge",
+                  max_fence_latency_ns, "Longest time from submission to retirement of a fence."),
+   CONTEXT_METRIC("virgl_context_cache_hits_total", "counter", cache_hits,
+                  "Shader, pipeline or sampler cache hits."),
+   CONTEXT_METRIC("virgl_context_cache_misses_total", "counter", cache_misses,
+                  "Shader, pipeline or sampler cache misses."),
+   CONTEXT_METRIC("virgl_context_gpu_time_nanoseconds_total", "counter", gpu_time_ns,
+                  "GPU time of the command buffers."),
+   CONTEXT_METRIC("virgl_context_draw_gpu_time_nanoseconds_total", "counter",
+                  draw_gpu_time_ns, "GPU time of the draws."),
+   CONTEXT_METRIC("virgl_context_gpu_timed_submits_total", "counter", gpu_timed_submits,
+                  "Command buffers accounted for in the GPU time."),
+#undef CONTEXT_METRIC
+};
+
+static const char *virgl_renderer_storage_names[VIRGL_RENDERER_STORAGE_TYPE_COUNT] = {
+   [VIRGL_RENDERER_STORAGE_GUEST] = "guest",
+   [VIRGL_RENDERER_STORAGE_HOST] = "host",
+   [VIRGL_RENDERER_STORAGE_DMABUF] = "dmabuf",
+   [VIRGL_RENDERER_STORAGE_OPAQUE_FD] = "opaque_fd",
+   [VIRGL_RENDERER_STORAGE_SHM] = "shm",
+   [VIRGL_RENDERER_STORAGE_OPAQUE_HANDLE] = "opaque_handle",
+};
+
+int virgl_renderer_write_stats(int fd)
+{
+   struct virgl_renderer_stats stats;
+   struct virgl_renderer_context_stats *ctxs = NULL;
+   uint32_t num_ctxs;
+   FILE *fp;
+   int ret;
+
+   ret = virgl_renderer_get_stats(NULL, NULL, &num_ctxs);
+   if (ret)
+      return ret;
+
+   if (num_ctxs) {
+      ctxs = calloc(num_ctxs, sizeof(*ctxs));
+      if (!ctxs)
+         return ENOMEM;
+   }
+   virgl_renderer_get_stats(&stats, ctxs, &num_ctxs);
+
+   fp = fdopen(dup(fd), "w");
+   if (!fp) {
+      free(ctxs);
+      return errno;
+   }
+
+   fprintf(fp, "# HELP virgl_contexts Contexts of the renderer.\n"
+               "# TYPE virgl_contexts gauge\n"
+               "virgl_contexts %u\n", stats.contexts);
+
+   fprintf(fp, "# HELP virgl_format_probes Times the host formats were probed instead of read from the cache.\n"
+               "# TYPE virgl_format_probes gauge\n"
+               "virgl_format_probes %u\n", stats.format_probes);
+
+   fprintf(fp, "# HELP virgl_resources Resources by storage type.\n"
+               "# TYPE virgl_resources gauge\n");
+   for (unsigned i = 0; i < VIRGL_RENDERER_STORAGE_TYPE_COUNT; i++)
+      fprintf(fp, "virgl_resources{storage=\"%s\"} %u\n",
+              virgl_renderer_storage_names[i], stats.resources[i].count);
+
+   fprintf(fp, "# HELP virgl_resource_bytes Size of the resources by storage type.\n"
+               "# TYPE virgl_resource_bytes gauge\n");
+   for (unsigned i = 0; i < VIRGL_RENDERER_STORAGE_TYPE_COUNT; i++)
+      fprintf(fp, "virgl_resource_bytes{storage=\"%s\"} %" PRIu64 "\n",
+              virgl_renderer_storage_names[i], stats.resources[i].bytes);
+
+   for (unsigned m = 0; m < ARRAY_SIZE(virgl_renderer_context_metrics); m++) {
+      fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n",
+              virgl_renderer_context_metrics[m].name,
+              virgl_renderer_context_metrics[m].help,
+              virgl_renderer_context_metrics[m].name,
+              virgl_renderer_context_metrics[m].type);
+
+      for (uint32_t i = 0; i < num_ctxs; i++) {
+         const uint64_t *value = (const uint64_t *)
+            ((const char *)&ctxs[i] + virgl_renderer_context_metrics[m].offset);
+
+         fprintf(fp, "%s{ctx=\"%u\",capset=\"%s\"} %" PRIu64 "\n",
+                 virgl_renderer_context_metrics[m].name, ctxs[i].ctx_id,
+                 virgl_renderer_capset_name(ctxs[i].capset_id), *value);
+      }
+   }
+
+   ret = ferror(fp) ? EIO : 0;
+   if (fclose(fp) && !ret)
+      ret = errno;
+   free(ctxs);
+
+   return ret;
+}
+
+/* Replace the stats file at once, so that readers never see a partial one. */
+static void virgl_renderer_dump_stats(void)
+{
+   const uint64_t now = virgl_time_get_ns();
+   char tmp_path[PATH_MAX];
+   int fd, ret;
+
+   if (now < state.stats_next_ns)
+      return;
+   state.stats_next_ns = now + state.stats_interval_ns;
+
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state.stats_file);
+   fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      virgl_warn("failed to open %s\n", tmp_path);
+      return;
+   }
+
+   ret = virgl_renderer_write_stats(fd);
+   close(fd);
+   if (ret || rename(tmp_path, state.stats_file)) {
+      virgl_warn("failed to write %s\n", state.stats_file);
+      unlink(tmp_path);
+   }
+}
+
 void virgl_renderer_force_ctx_0(void)
 {
    if (state.vrend_initialized)
@@ -590,7 +983,8 @@ void virgl_renderer_get_rect(int resource_id, struct iovec *iov, unsigned int nu
 }
 
 
-static void ctx0_fence_retire(uint64_t fence_id, UNUSED void *retire_data)
+static void ctx0_fence_retire(UNUSED uint32_t ring_idx, uint64_t fence_id,
+                              UNUSED void *retire_data)
 {
    // ctx0 fence_id is created from uint32_t but stored internally as uint64_t,
    // so casting back to uint32_t doesn't result in data loss.
@@ -745,12 +1139,20 @@ virgl_context_foreach_retire_fences(struct virgl_context *ctx,
 void virgl_renderer_poll(void)
 {
    TRACE_FUNC();
+   if (state.ctx0_fence_pending) {
+      state.ctx0_fence_pending = false;
+      state.cbs->write_fence(state.cookie, state.ctx0_fence_id);
+   }
+
    if (state.vrend_initialized)
       vrend_renderer_poll();
 
    struct virgl_context_foreach_args args;
    args.callback = virgl_context_foreach_retire_fences;
    virgl_context_foreach(&args);
+
+   if (state.stats_file)
+      virgl_renderer_dump_stats();
 }
 
 void virgl_renderer_cleanup(UNUSED void *cookie)
@@ -783,14 +1185,97 @@ void virgl_renderer_cleanup(UNUSED void *cookie)
    /* vkr_allocator_init is called on-demand upon the first map */
    vkr_allocator_fini();
 
+   virgl_init_phases_reset();
    memset(&state, 0, sizeof(state));
 }
 
+/* Create the winsys and the vrend renderer, either from virgl_renderer_init
+ * or on first use with VIRGL_RENDERER_LAZY_VIRGL_INIT. */
+static int virgl_renderer_init_vrend(void)
+{
+   struct virgl_init_phase phase;
+   int ret;
+
+   if (!state.winsys_initialized && !(state.flags & VIRGL_RENDERER_NO_VIRGL) &&
+       (state.flags & (VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_GLX))) {
+      int drm_fd = -1;
+
+      if (state.flags & VIRGL_RENDERER_USE_EGL) {
+         if (state.cbs->version >= 2 && state.cbs->get_drm_fd)
+            drm_fd = state.cbs->get_drm_fd(state.cookie);
+      }
+
+      virgl_init_phase_begin(&phase, "winsys");
+      ret = vrend_winsys_init(state.flags, drm_fd);
+      virgl_init_phase_end(&phase);
+      if (ret) {
+         if (drm_fd >= 0)
+            close(drm_fd);
+         return ret;
+      }
+      state.winsys_initialized = true;
+   }
+
+   if (!state.winsys_initialized && !state.external_winsys_initialized &&
+       state.cbs && state.cbs->version >= 4 && state.cbs->get_egl_display) {
+      void *egl_display = NULL;
+
+      if (!state.cbs->create_gl_context || !state.cbs->destroy_gl_context ||
+          !state.cbs->make_current)
+         return EINVAL;
+
+      egl_display = state.cbs->get_egl_display(state.cookie);
+
+      if (!egl_display)
+         return -1;
+
+      virgl_init_phase_begin(&phase, "winsys");
+      ret = vrend_winsys_init_external(egl_display);
+      virgl_init_phase_end(&phase);
+      if (ret)
+         return -1;
+
+      state.external_winsys_initialized = true;
+   }
+
+   if (!state.vrend_initialized && !(state.flags & VIRGL_RENDERER_NO_VIRGL)) {
+      uint32_t renderer_flags = 0;
+
+      if (!state.cookie || !state.cbs)
+         return -1;
+
+      if (state.flags & VIRGL_RENDERER_THREAD_SYNC)
+         renderer_flags |= VREND_USE_THREAD_SYNC;
+      if (state.flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
+         renderer_flags |= VREND_USE_ASYNC_FENCE_CB;
+      if (state.flags & VIRGL_RENDERER_USE_EXTERNAL_BLOB)
+         renderer_flags |= VREND_USE_EXTERNAL_BLOB;
+      if (state.flags & VIRGL_RENDERER_USE_VIDEO)
+         renderer_flags |= VREND_USE_VIDEO;
+      if (state.flags & VIRGL_RENDERER_D3D11_SHARE_TEXTURE)
+         renderer_flags |= VREND_D3D11_SHARE_TEXTURE;
+      if (state.flags & VIRGL_RENDERER_COMPAT_PROFILE)
+         renderer_flags |= VREND_USE_COMPAT_CONTEXT;
+      if (state.flags & VIRGL_RENDERER_THREADED_CONTEXTS)
+         renderer_flags |= VREND_USE_THREADED_CONTEXTS;
+
+      virgl_init_phase_begin(&phase, "vrend");
+      ret = vrend_renderer_init(&vrend_cbs, renderer_flags);
+      virgl_init_phase_end(&phase);
+      if (ret)
+         return ret;
+      state.vrend_initialized = true;
+   }
+
+   return 0;
+}
+
 int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cbs)
 {
    TRACE_INIT();
    TRACE_FUNC();
 
+   struct virgl_init_phase phase;
    int ret;
 
    /* VIRGL_RENDERER_THREAD_SYNC is a hint and can be silently ignored */
@@ -812,6 +1297,14 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
       state.flags = flags;
       state.cbs = cbs;
       state.client_initialized = true;
+
+      state.stats_file = getenv("VIRGL_STATS_FILE");
+      if (state.stats_file) {
+         const char *interval = getenv("VIRGL_STATS_INTERVAL");
+         const int seconds = interval ? atoi(interval) : 0;
+
+         state.stats_interval_ns = (uint64_t)(seconds > 0 ? seconds : 10) * 1000000000;
+      }
    }
 
    if (!state.resource_initialized) {
@@ -832,79 +1325,17 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
       state.context_initialized = true;
    }
 
-   if (!state.winsys_initialized && !(flags & VIRGL_RENDERER_NO_VIRGL) &&
-       (flags & (VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_USE_GLX))) {
-      int drm_fd = -1;
-
-      if (flags & VIRGL_RENDERER_USE_EGL) {
-         if (cbs->version >= 2 && cbs->get_drm_fd)
-            drm_fd = cbs->get_drm_fd(cookie);
-      }
-
-      ret = vrend_winsys_init(flags, drm_fd);
-      if (ret) {
-         if (drm_fd >= 0)
-            close(drm_fd);
-         goto fail;
-      }
-      state.winsys_initialized = true;
-   }
-
-   if (!state.winsys_initialized && !state.external_winsys_initialized &&
-       state.cbs && state.cbs->version >= 4 && state.cbs->get_egl_display) {
-      void *egl_display = NULL;
-
-      if (!cbs->create_gl_context || !cbs->destroy_gl_context ||
-          !cbs->make_current) {
-         ret = EINVAL;
-         goto fail;
-      }
-
-      egl_display = state.cbs->get_egl_display(cookie);
-
-      if (!egl_display) {
-         ret = -1;
-         goto fail;
-      }
-      ret = vrend_winsys_init_external(egl_display);
-
-      if (ret) {
-         ret = -1;
-         goto fail;
-      }
-
-      state.external_winsys_initialized = true;
-   }
-
-   if (!state.vrend_initialized && !(flags & VIRGL_RENDERER_NO_VIRGL)) {
-      uint32_t renderer_flags = 0;
-
-      if (!cookie || !cbs) {
-         ret = -1;
-         goto fail;
-      }
-
-      if (flags & VIRGL_RENDERER_THREAD_SYNC)
-         renderer_flags |= VREND_USE_THREAD_SYNC;
-      if (flags & VIRGL_RENDERER_ASYNC_FENCE_CB)
-         renderer_flags |= VREND_USE_ASYNC_FENCE_CB;
-      if (flags & VIRGL_RENDERER_USE_EXTERNAL_BLOB)
-         renderer_flags |= VREND_USE_EXTERNAL_BLOB;
-      if (flags & VIRGL_RENDERER_USE_VIDEO)
-         renderer_flags |= VREND_USE_VIDEO;
-      if (flags & VIRGL_RENDERER_D3D11_SHARE_TEXTURE)
-         renderer_flags |= VREND_D3D11_SHARE_TEXTURE;
-      if (flags & VIRGL_RENDERER_COMPAT_PROFILE)
-         renderer_flags |= VREND_USE_COMPAT_CONTEXT;
-
-      ret = vrend_renderer_init(&vrend_cbs, renderer_flags);
+   if (!(flags & VIRGL_RENDERER_LAZY_VIRGL_INIT)) {
+      ret = virgl_renderer_init_vrend();
       if (ret)
          goto fail;
-      state.vrend_initialized = true;
    }
 
+   /* the proxy starts the render server that runs Venus */
    if (!state.proxy_initialized && (flags & VIRGL_RENDERER_RENDER_SERVER)) {
+      virgl_init_phase_begin(&phase, "proxy");
       ret = proxy_renderer_init(&proxy_cbs, flags | VIRGL_RENDERER_NO_VIRGL);
+      virgl_init_phase_end(&phase);
       if (ret)
          goto fail;
       state.proxy_initialized = true;
@@ -917,7 +1348,9 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
       if (cbs->version >= 2 && cbs->get_drm_fd)
          drm_fd = cbs->get_drm_fd(cookie);
 
+      virgl_init_phase_begin(&phase, "drm");
       ret = drm_renderer_init(drm_fd);
+      virgl_init_phase_end(&phase);
       if (ret)
          goto fail;
       state.drm_initialized = true;
@@ -978,6 +1411,11 @@ void virgl_renderer_reset(void)
 int virgl_renderer_get_poll_fd(void)
 {
    TRACE_FUNC();
+   /* the fd belongs to the vrend sync thread */
+   if ((state.flags & VIRGL_RENDERER_THREAD_SYNC) &&
+       !(state.flags & VIRGL_RENDERER_ASYNC_FENCE_CB))
+      virgl_renderer_need_vrend();
+
    if (state.vrend_initialized)
       return vrend_renderer_get_poll_fd();
 
@@ -1383,6 +1821,18 @@ virgl_renderer_export_fence(uint64_t client_fence_id, int *fd)
    if (*fd >= 0)
       return 0;
 
+   /* with threaded contexts the ctx0 fence may still be queued on a worker */
+   if (state.vrend_initialized && vrend_renderer_use_threaded_contexts()) {
+      struct virgl_context_foreach_args args;
+      args.callback = virgl_context_foreach_wait_idle;
+      args.data = NULL;
+      virgl_context_foreach(&args);
+
+      *fd = virgl_fence_get_fd(client_fence_id);
+      if (*fd >= 0)
+         return 0;
+   }
+
    return -EINVAL;
 }
 
@@ -1462,5 +1912,6 @@ int virgl_renderer_submit_cmd2(void *buffer,
          return err;
    }
 
+   virgl_context_count_submit(ctx, ndw * sizeof(uint32_t));
    return ctx->submit_cmd(ctx, buffer, ndw * sizeof(uint32_t));
 }
@@ -167,6 +167,26 @@ struct virgl_renderer_callbacks {
 /* Blob allocations must be done by guest from dedicated heap (Host visible memory). */
 #define VIRGL_RENDERER_USE_GUEST_VRAM (1 << 14)
 
+/*
+ * Execute the command streams of each virgl context on a worker thread of its
+ * own, virgl_renderer_submit_cmd only queues them. Requires
+ * VIRGL_RENDERER_THREAD_SYNC, and the GL context callbacks must be callable
+ * from any thread. Contexts are no longer implicitly ordered against each
+ * other, the guest has to synchronize shared resources with fences.
+ */
+#define VIRGL_RENDERER_THREADED_CONTEXTS (1 << 15)
+
+/*
+ * Defer the winsys and virgl renderer initialization until it is needed,
+ * by the first virgl context, resource or capset query, so VMMs that mostly
+ * run Venus or DRM native contexts do not pay for GL startup. ctx0 fences
+ * created before that retire on the next virgl_renderer_poll, or right away
+ * with VIRGL_RENDERER_ASYNC_FENCE_CB. With VIRGL_RENDERER_THREAD_SYNC and
+ * without VIRGL_RENDERER_ASYNC_FENCE_CB, virgl_renderer_get_poll_fd
+ * initializes the virgl renderer since the fd belongs to it.
+ */
+#define VIRGL_RENDERER_LAZY_VIRGL_INIT (1 << 16)
+
 VIRGL_EXPORT int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cb);
 VIRGL_EXPORT void virgl_renderer_poll(void); /* force fences */
 
@@ -461,6 +481,170 @@ virgl_renderer_submit_cmd2(void *buffer,
                            uint64_t *in_fence_ids,
                            uint32_t num_in_fences);
 
+/* Groups of shader key fields, used to tell why a new shader variant was
+ * needed. */
+enum virgl_renderer_shader_key_group {
+   VIRGL_RENDERER_SHADER_KEY_IO,        /* inter-stage inputs and outputs */
+   VIRGL_RENDERER_SHADER_KEY_FS_INFO,   /* fragment shader interpolation */
+   VIRGL_RENDERER_SHADER_KEY_STAGE,     /* stage specific state, e.g. cbuf formats */
+   VIRGL_RENDERER_SHADER_KEY_SAMPLERS,  /* sampler view swizzles and targets */
+   VIRGL_RENDERER_SHADER_KEY_BINDINGS,  /* ssbo and image binding offsets */
+   VIRGL_RENDERER_SHADER_KEY_RASTER,    /* alpha test, stipple, two side, flatshade */
+   VIRGL_RENDERER_SHADER_KEY_GROUP_COUNT,
+};
+
+struct virgl_renderer_shader_stats {
+   uint64_t shaders;                  /* shader objects created */
+   uint64_t variants;                 /* shader variants created */
+   uint32_t max_variants_per_shader;
+   /* how often each key group differed from the previously used variant
+    * when a new variant was created */
+   uint64_t key_group_changes[VIRGL_RENDERER_SHADER_KEY_GROUP_COUNT];
+
+   uint64_t compiles;
+   uint64_t compile_time_us;
+   uint64_t links;
+   uint64_t link_time_us;
+   uint64_t program_cache_hits;       /* links replaced by a shared program binary */
+   uint64_t program_binaries_stored;  /* linked programs shared as binaries, 0
+                                       * without program binary support */
+
+   uint32_t programs;                 /* programs currently linked */
+   uint32_t max_programs_per_sub_ctx;
+};
+
+/* Shader statistics of a virgl context, fails for other context types. */
+VIRGL_EXPORT int
+virgl_renderer_context_get_shader_stats(uint32_t ctx_id,
+                                        struct virgl_renderer_shader_stats *stats);
+
+/* How the resource_copy_region commands of a context were carried out. */
+struct virgl_renderer_copy_stats {
+   uint64_t buffer_copies;            /* between two buffers */
+   uint64_t copy_image;               /* glCopyImageSubData */
+   uint64_t compute;                  /* compute shader copies */
+   uint64_t blits;                    /* glBlitFramebuffer */
+   uint64_t gpu_fallbacks;            /* texture read back into a pixel buffer */
+   uint64_t cpu_fallbacks;            /* texture data staged in host memory */
+};
+
+/* Copy statistics of a virgl context, fails for other context types. */
+VIRGL_EXPORT int
+virgl_renderer_context_get_copy_stats(uint32_t ctx_id,
+                                      struct virgl_renderer_copy_stats *stats);
+
+/* Time spent in the commands of one type. The percentiles come from a log2
+ * histogram, they are the upper bound of the bucket they fall in. */
+struct virgl_renderer_cmd_stats {
+   uint64_t count;
+   uint64_t total_ns;
+   uint64_t p50_ns;
+   uint64_t p99_ns;
+};
+
+struct virgl_renderer_decode_stats {
+   uint64_t submits;                  /* command buffers decoded */
+   uint64_t bytes;                    /* size of the command buffers */
+   uint64_t commands;
+   uint64_t total_ns;                 /* time spent in the commands */
+};
+
+/* Command statistics of a virgl context, collected for the contexts created
+ * while VIRGL_CMD_STATS is set in the environment. cmds may be NULL, or is
+ * indexed by the VIRGL_CCMD_* command type: *num_cmds is its size on input
+ * and the number of command types on output. The statistics are also logged
+ * when the context is destroyed. Fails for other context types and when the
+ * statistics are not collected.
+ *
+ * This waits for the commands already submitted to the context and takes
+ * locks, it must not be called from a signal handler. */
+VIRGL_EXPORT int
+virgl_renderer_context_get_decode_stats(uint32_t ctx_id,
+                                        struct virgl_renderer_decode_stats *stats,
+                                        struct virgl_renderer_cmd_stats *cmds,
+                                        uint32_t *num_cmds);
+
+/* Where the memory of a resource lives. */
+enum virgl_renderer_storage_type {
+   VIRGL_RENDERER_STORAGE_GUEST,          /* guest pages only */
+   VIRGL_RENDERER_STORAGE_HOST,           /* renderer object, e.g. a GL texture */
+   VIRGL_RENDERER_STORAGE_DMABUF,
+   VIRGL_RENDERER_STORAGE_OPAQUE_FD,
+   VIRGL_RENDERER_STORAGE_SHM,
+   VIRGL_RENDERER_STORAGE_OPAQUE_HANDLE,
+   VIRGL_RENDERER_STORAGE_TYPE_COUNT,
+};
+
+struct virgl_renderer_resource_stats {
+   uint32_t count;
+   uint64_t bytes;                    /* blob size, or size of the guest pages */
+};
+
+/* Statistics every context type reports, fields a context type doesn't
+ * track are 0. */
+struct virgl_renderer_context_stats {
+   uint32_t ctx_id;
+   uint32_t capset_id;
+
+   uint64_t submits;                  /* command buffers submitted */
+   uint64_t submit_bytes;
+   uint64_t commands;                 /* commands in the command buffers */
+
+   uint64_t fences_submitted;
+   uint64_t fences_retired;           /* including fences merged into later ones */
+   uint64_t fence_latency_ns;         /* total time from submission to retirement */
+   uint64_t max_fence_latency_ns;
+
+   uint64_t cache_hits;               /* shader, pipeline or sampler cache */
+   uint64_t cache_misses;
+
+   /* with VIRGL_GPU_TIME, measured with GPU timestamps around the command
+    * buffers, and around the draws when it is set to "draw". A command
+    * buffer is only accounted for once the context submits the next one. */
+   uint64_t gpu_time_ns;
+   uint64_t draw_gpu_time_ns;
+   uint64_t gpu_timed_submits;        /* command buffers in gpu_time_ns */
+};
+
+struct virgl_renderer_stats {
+   uint32_t contexts;
+   /* times the host formats were probed since init, 0 when they were read
+    * from the VIRGL_FORMAT_CACHE file or virgl isn't initialized yet */
+   uint32_t format_probes;
+   /* indexed by virgl_renderer_storage_type, resources are shared between
+    * contexts and only counted for the renderer */
+   struct virgl_renderer_resource_stats resources[VIRGL_RENDERER_STORAGE_TYPE_COUNT];
+};
+
+/* Statistics of the renderer and of all its contexts. ctxs may be NULL:
+ * *num_ctxs is its size on input and the number of contexts on output.
+ *
+ * When VIRGL_STATS_FILE is set in the environment, virgl_renderer_poll also
+ * writes the statistics to that file in the Prometheus text format, every
+ * VIRGL_STATS_INTERVAL seconds (10 by default). */
+VIRGL_EXPORT int
+virgl_renderer_get_stats(struct virgl_renderer_stats *stats,
+                         struct virgl_renderer_context_stats *ctxs,
+                         uint32_t *num_ctxs);
+
+struct virgl_renderer_init_phase {
+   const char *name;                  /* static string, e.g. "winsys" */
+   uint64_t duration_us;
+};
+
+/* Startup profile of virgl_renderer_init, of the lazy virgl init and of the
+ * first caps query, in the order the phases ended; a phase may contain
+ * others. phases may be NULL: *num_phases is its size on input and the
+ * number of recorded phases on output. The profile is cleared by
+ * virgl_renderer_cleanup. */
+VIRGL_EXPORT int
+virgl_renderer_get_init_phases(struct virgl_renderer_init_phase *phases,
+                               uint32_t *num_phases);
+
+/* Write the statistics to fd in the Prometheus text format. */
+VIRGL_EXPORT int
+virgl_renderer_write_stats(int fd);
+
 #endif /* VIRGL_RENDERER_UNSTABLE_APIS */
 
 #endif
@@ -26,6 +26,7 @@
 /* for when we can't use glBlitFramebuffer */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "util/hash_table.h"
 #include "util/macros.h"
@@ -75,6 +76,12 @@ struct vrend_blitter_ctx {
 
    GLuint vbo_id;
    struct blit_coord vertices[4];
+
+   /* compute copy programs, indexed by log2 of the texel size */
+   GLuint copy_programs[5];
+   /* compute programs converting between two image formats, keyed by the
+    * source and destination internal formats */
+   struct hash_table_u64 *convert_programs;
 };
 
 static struct vrend_blitter_ctx vrend_blit_ctx;
@@ -90,6 +97,12 @@ struct blit_swizzle_and_type {
   bool is_array;
 };
 
+struct blit_program {
+   GLuint id;
+   /* linked by vrend_blitter_precompile, the status is checked on first use */
+   bool link_pending;
+};
+
 #pragma pack(push,1)
 struct PACKED blit_prog_key {
    bool is_color: 1;
@@ -100,7 +113,7 @@ struct PACKED blit_prog_key {
    uint8_t num_samples;
    struct {
       bool has_swizzle: 1;
-      enum virgl_formats src_format: 9;
+      enum tgsi_return_type tgsi_ret: 3;
       enum pipe_swizzle swizzle1: 3;
       enum pipe_swizzle swizzle2: 3;
       enum pipe_swizzle swizzle3: 3;
@@ -123,13 +136,18 @@ prog_key_to_uint64( struct blit_prog_key prog_key )
    return pu.u;
 }
 
-static GLint blit_shader_build_and_check(GLenum shader_type, const char *buf)
+static GLint blit_shader_build_and_check(GLenum shader_type, const char *buf,
+                                         bool check)
 {
    GLint param;
    GLint id = glCreateShader(shader_type);
    glShaderSource(id, 1, (const char **)&buf, NULL);
    glCompileShader(id);
 
+   /* compile errors also show up as link errors */
+   if (!check)
+      return id;
+
    glGetShaderiv(id, GL_COMPILE_STATUS, &param);
    if (param == GL_FALSE) {
       char infolog[65536];
@@ -143,11 +161,10 @@ static GLint blit_shader_build_and_check(GLenum shader_type, const char *buf)
    return id;
 }
 
-static bool blit_shader_link_and_check(GLuint prog_id)
+static bool blit_shader_check_link(GLuint prog_id)
 {
    GLint lret;
 
-   glLinkProgram(prog_id);
    glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
    if (lret == GL_FALSE) {
       char infolog[65536];
@@ -161,6 +178,72 @@ static bool blit_shader_link_and_check(GLuint prog_id)
    return true;
 }
 
+static bool blit_shader_link_and_check(GLuint prog_id)
+{
+   glLinkProgram(prog_id);
+   return blit_shader_check_link(prog_id);
+}
+
+static GLuint blit_program_lookup(struct vrend_blitter_ctx *blit_ctx,
+                                  struct blit_prog_key key)
+{
+   struct blit_program *prog =
+      _mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key));
+
+   if (!prog)
+      return 0;
+
+   if (prog->link_pending) {
+      prog->link_pending = false;
+      if (!blit_shader_check_link(prog->id)) {
+         glDeleteProgram(prog->id);
+         _mesa_hash_table_u64_remove(blit_ctx->blit_programs, prog_key_to_uint64(key));
+         free(prog);
+         return 0;
+      }
+   }
+   return prog->id;
+}
+
+static void blit_program_insert(struct vrend_blitter_ctx *blit_ctx,
+                                struct blit_prog_key key,
+                                GLuint prog_id, bool link_pending)
+{
+   struct blit_program *prog = CALLOC_STRUCT(blit_program);
+
+   if (!prog) {
+      glDeleteProgram(prog_id);
+      return;
+   }
+
+   prog->id = prog_id;
+   prog->link_pending = link_pending;
+   _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key), prog);
+}
+
+/* Creates the program for key, with link_pending the link status isn't
+ * checked so that the driver can compile it in the background. */
+static GLuint blit_create_program(struct vrend_blitter_ctx *blit_ctx,
+                                  struct blit_prog_key key,
+                                  GLuint fs_id, bool link_pending)
+{
+   GLuint prog_id = glCreateProgram();
+
+   glAttachShader(prog_id, blit_ctx->vs);
+   glAttachShader(prog_id, fs_id);
+   if (link_pending) {
+      glLinkProgram(prog_id);
+   } else if (!blit_shader_link_and_check(prog_id)) {
+      glDeleteShader(fs_id);
+      glDeleteProgram(prog_id);
+      return 0;
+   }
+
+   glDeleteShader(fs_id);
+   blit_program_insert(blit_ctx, key, prog_id, link_pending);
+   return prog_id;
+}
+
 static void create_dest_swizzle_snippet(const enum pipe_swizzle swizzle[4],
                                         char snippet[DEST_SWIZZLE_SNIPPET_SIZE])
 {
@@ -277,7 +360,8 @@ static GLuint blit_build_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
                                       enum tgsi_return_type tgsi_ret,
                                       const enum pipe_swizzle swizzle[4],
                                       int nr_samples,
-                                      uint32_t flags)
+                                      uint32_t flags,
+                                      bool check)
 {
    char shader_buf[4096];
    struct blit_swizzle_and_type swizzle_and_type;
@@ -338,10 +422,11 @@ static GLuint blit_build_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
    VREND_DEBUG(dbg_blit, NULL, "-- Blit FS color shader MSAA: %d -----------------\n"
                "%s\n---------------------------------------\n", msaa, shader_buf);
 
-   return blit_shader_build_and_check(GL_FRAGMENT_SHADER, shader_buf);
+   return blit_shader_build_and_check(GL_FRAGMENT_SHADER, shader_buf, check);
 }
 
-static GLuint blit_build_frag_depth(struct vrend_blitter_ctx *blit_ctx, enum tgsi_texture_type tgsi_tex_target, bool msaa)
+static GLuint blit_build_frag_depth(struct vrend_blitter_ctx *blit_ctx, enum tgsi_texture_type tgsi_tex_target, bool msaa,
+                                    bool check)
 {
    char shader_buf[4096];
    struct blit_swizzle_and_type swizzle_and_type;
@@ -364,43 +449,49 @@ static GLuint blit_build_frag_depth(struct vrend_blitter_ctx *blit_ctx, enum tgs
    VREND_DEBUG(dbg_blit, NULL, "-- Blit FS depth shader MSAA: %d -----------------\n"
                "%s\n---------------------------------------\n", msaa, shader_buf);
 
-   return blit_shader_build_and_check(GL_FRAGMENT_SHADER, shader_buf);
+   return blit_shader_build_and_check(GL_FRAGMENT_SHADER, shader_buf, check);
 }
 
-static GLuint blit_get_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx, enum pipe_texture_target pipe_tex_target, unsigned nr_samples)
+static struct blit_prog_key blit_writedepth_key(enum pipe_texture_target pipe_tex_target,
+                                                unsigned nr_samples)
 {
    struct blit_prog_key key = {
-         .is_color = false,
-         .is_msaa = nr_samples > 1,
-         .num_samples = nr_samples,
-         .pipe_tex_target = pipe_tex_target,
-      };
-
-      void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key));
-      GLuint prog_id;
-      if (shader) {
-         prog_id = (GLuint)((size_t)(shader) & 0xffffffff);
-      } else {
-         prog_id = glCreateProgram();
-         glAttachShader(prog_id, blit_ctx->vs);
-         enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, key.num_samples);
-         GLuint fs_id = blit_build_frag_depth(blit_ctx, tgsi_tex, key.is_msaa);
-         glAttachShader(prog_id, fs_id);
-         if(!blit_shader_link_and_check(prog_id))
-            return 0;
-
-         glDeleteShader(fs_id);
-         _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key), (void *)(uintptr_t)prog_id);
-      }
-      return prog_id;
+      .is_color = false,
+      .is_msaa = nr_samples > 1,
+      .num_samples = nr_samples,
+      .pipe_tex_target = pipe_tex_target,
+   };
+   return key;
 }
 
-static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
-                                       enum pipe_texture_target pipe_tex_target,
-                                       unsigned nr_samples,
-                                       const struct vrend_format_table *src_entry,
-                                       const enum pipe_swizzle swizzle[static 4],
-                                       uint32_t flags)
+static GLuint blit_create_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx,
+                                              struct blit_prog_key key,
+                                              bool link_pending)
+{
+   enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(key.pipe_tex_target,
+                                                               key.num_samples);
+   GLuint fs_id = blit_build_frag_depth(blit_ctx, tgsi_tex, key.is_msaa, !link_pending);
+   if (!fs_id)
+      return 0;
+
+   return blit_create_program(blit_ctx, key, fs_id, link_pending);
+}
+
+static GLuint blit_get_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx, enum pipe_texture_target pipe_tex_target, unsigned nr_samples)
+{
+   struct blit_prog_key key = blit_writedepth_key(pipe_tex_target, nr_samples);
+   GLuint prog_id = blit_program_lookup(blit_ctx, key);
+
+   if (!prog_id)
+      prog_id = blit_create_frag_tex_writedepth(blit_ctx, key, false);
+   return prog_id;
+}
+
+static struct blit_prog_key blit_tex_col_key(enum pipe_texture_target pipe_tex_target,
+                                             unsigned nr_samples,
+                                             enum tgsi_return_type tgsi_ret,
+                                             const enum pipe_swizzle swizzle[static 4],
+                                             uint32_t flags)
 {
    bool needs_swizzle = false;
    for (unsigned i = 0; i < 4; ++i) {
@@ -419,7 +510,8 @@ static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
       .pipe_tex_target  = pipe_tex_target
    };
 
-   key.texcol.src_format = src_entry->format;
+   /* the shader only depends on the return type of the source format */
+   key.texcol.tgsi_ret = tgsi_ret;
    key.texcol.has_swizzle = needs_swizzle;
    if (key.texcol.has_swizzle) {
       key.texcol.swizzle1 = swizzle[0];
@@ -427,29 +519,44 @@ static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
       key.texcol.swizzle3 = swizzle[2];
       key.texcol.swizzle4 = swizzle[3];
    }
+   return key;
+}
 
-   GLuint prog_id = 0;
-   void *shader = _mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key));
+static GLuint blit_create_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
+                                       struct blit_prog_key key,
+                                       const enum pipe_swizzle swizzle[static 4],
+                                       uint32_t flags,
+                                       bool link_pending)
+{
+   enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(key.pipe_tex_target,
+                                                               key.num_samples);
+   enum tgsi_return_type tgsi_ret = key.texcol.tgsi_ret;
+   int msaa_samples = key.num_samples > 1 ?
+                         (tgsi_ret == TGSI_RETURN_TYPE_UNORM ? key.num_samples : 1) : 0;
+
+   GLuint fs_id = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret,
+                                          swizzle, msaa_samples, flags,
+                                          !link_pending);
+   if (!fs_id)
+      return 0;
 
-   if (shader) {
-      prog_id = (GLuint)((size_t)(shader) & 0xffffffff);
-   } else {
-      prog_id = glCreateProgram();
-      glAttachShader(prog_id, blit_ctx->vs);
-      enum tgsi_texture_type tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, key.num_samples);
-      enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
-      int msaa_samples = nr_samples > 1 ? (tgsi_ret == TGSI_RETURN_TYPE_UNORM ? nr_samples : 1) : 0;
-
-      GLuint fs_id = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret,
-                                             swizzle, msaa_samples, flags);
-      glAttachShader(prog_id, fs_id);
-      if(!blit_shader_link_and_check(prog_id))
-         return 0;
+   return blit_create_program(blit_ctx, key, fs_id, link_pending);
+}
 
-      glDeleteShader(fs_id);
-      _mesa_hash_table_u64_insert(blit_ctx->blit_programs, prog_key_to_uint64(key), (void *)(uintptr_t)prog_id);
-   }
+static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
+                                       enum pipe_texture_target pipe_tex_target,
+                                       unsigned nr_samples,
+                                       const struct vrend_format_table *src_entry,
+                                       const enum pipe_swizzle swizzle[static 4],
+                                       uint32_t flags)
+{
+   struct blit_prog_key key = blit_tex_col_key(pipe_tex_target, nr_samples,
+                                               tgsi_ret_for_format(src_entry->format),
+                                               swizzle, flags);
+   GLuint prog_id = blit_program_lookup(blit_ctx, key);
 
+   if (!prog_id)
+      prog_id = blit_create_frag_tex_col(blit_ctx, key, swizzle, flags, false);
    return prog_id;
 }
 
@@ -463,6 +570,7 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
    }
 
    vrend_blit_ctx.blit_programs = _mesa_hash_table_u64_create(NULL);
+   vrend_blit_ctx.convert_programs = _mesa_hash_table_u64_create(NULL);
 
    blit_ctx->use_gles = epoxy_is_desktop_gl() == 0;
    ctx_params.shared = true;
@@ -487,7 +595,11 @@ static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
 
    glGenBuffers(1, &blit_ctx->vbo_id);
    blit_ctx->vs = blit_shader_build_and_check(GL_VERTEX_SHADER,
-        blit_ctx->use_gles ? VS_PASSTHROUGH_GLES : VS_PASSTHROUGH_GL);
+        blit_ctx->use_gles ? VS_PASSTHROUGH_GLES : VS_PASSTHROUGH_GL, true);
+
+   if (epoxy_has_gl_extension("GL_KHR_parallel_shader_compile") ||
+       epoxy_has_gl_extension("GL_ARB_parallel_shader_compile"))
+      glMaxShaderCompilerThreadsKHR(0xffffffff);
 
    for (i = 0; i < 4; i++) {
       blit_ctx->vertices[i].pos.z = 0;
@@ -906,13 +1018,263 @@ void vrend_renderer_blit_gl(ASSERTED struct vrend_context *ctx,
    glBindTexture(src_res->target, 0);
 }
 
+/* Texture formats that can be bound to an image unit, with the layout
+ * qualifier, the size class and the image type prefix they load as. */
+static const struct blit_image_format {
+   GLenum internalformat;
+   const char *name;
+   unsigned size;
+   const char *type;
+   bool gles;
+} blit_image_formats[] = {
+   { GL_RGBA32F, "rgba32f", 16, "", true },
+   { GL_RGBA32UI, "rgba32ui", 16, "u", true },
+   { GL_RGBA32I, "rgba32i", 16, "i", true },
+   { GL_RGBA16F, "rgba16f", 8, "", true },
+   { GL_RG32F, "rg32f", 8, "", false },
+   { GL_RGBA16UI, "rgba16ui", 8, "u", true },
+   { GL_RG32UI, "rg32ui", 8, "u", false },
+   { GL_RGBA16I, "rgba16i", 8, "i", true },
+   { GL_RG32I, "rg32i", 8, "i", false },
+   { GL_RGBA16, "rgba16", 8, "", false },
+   { GL_RGBA16_SNORM, "rgba16_snorm", 8, "", false },
+   { GL_R11F_G11F_B10F, "r11f_g11f_b10f", 4, "", false },
+   { GL_R32F, "r32f", 4, "", true },
+   { GL_RGB10_A2UI, "rgb10_a2ui", 4, "u", false },
+   { GL_RGBA8UI, "rgba8ui", 4, "u", true },
+   { GL_RG16UI, "rg16ui", 4, "u", false },
+   { GL_R32UI, "r32ui", 4, "u", true },
+   { GL_RGBA8I, "rgba8i", 4, "i", true },
+   { GL_RG16I, "rg16i", 4, "i", false },
+   { GL_R32I, "r32i", 4, "i", true },
+   { GL_RGB10_A2, "rgb10_a2", 4, "", false },
+   { GL_RGBA8, "rgba8", 4, "", true },
+   { GL_RG16, "rg16", 4, "", false },
+   { GL_RGBA8_SNORM, "rgba8_snorm", 4, "", true },
+   { GL_RG16_SNORM, "rg16_snorm", 4, "", false },
+   { GL_RG16F, "rg16f", 4, "", false },
+   { GL_RG8UI, "rg8ui", 2, "u", false },
+   { GL_R16UI, "r16ui", 2, "u", false },
+   { GL_RG8I, "rg8i", 2, "i", false },
+   { GL_R16I, "r16i", 2, "i", false },
+   { GL_RG8, "rg8", 2, "", false },
+   { GL_R16, "r16", 2, "", false },
+   { GL_RG8_SNORM, "rg8_snorm", 2, "", false },
+   { GL_R16_SNORM, "r16_snorm", 2, "", false },
+   { GL_R16F, "r16f", 2, "", false },
+   { GL_R8UI, "r8ui", 1, "u", false },
+   { GL_R8I, "r8i", 1, "i", false },
+   { GL_R8, "r8", 1, "", false },
+   { GL_R8_SNORM, "r8_snorm", 1, "", false },
+};
+
+static const struct blit_image_format *blit_image_format(GLenum internalformat)
+{
+   for (unsigned i = 0; i < ARRAY_SIZE(blit_image_formats); i++) {
+      if (blit_image_formats[i].internalformat == internalformat)
+         return &blit_image_formats[i];
+   }
+   return NULL;
+}
+
+static bool blit_copy_target_supported(const struct vrend_resource *res)
+{
+   /* every layer of these is bound as a plain 2D image */
+   switch (res->target) {
+   case GL_TEXTURE_2D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_CUBE_MAP:
+   case GL_TEXTURE_CUBE_MAP_ARRAY:
+      return res->base.nr_samples <= 1 && !res->y_0_top;
+   default:
+      return false;
+   }
+}
+
+static GLuint blit_get_copy_program(struct vrend_blitter_ctx *blit_ctx,
+                                    unsigned size_idx, GLenum *image_format)
+{
+   static const struct {
+      GLenum format;
+      const char *name;
+   } gl_formats[] = {
+      { GL_R8UI, "r8ui" },
+      { GL_R16UI, "r16ui" },
+      { GL_R32UI, "r32ui" },
+      { GL_RG32UI, "rg32ui" },
+      { GL_RGBA32UI, "rgba32ui" },
+   }, gles_formats[] = {
+      { GL_NONE, NULL },
+      { GL_NONE, NULL },
+      { GL_R32UI, "r32ui" },
+      { GL_RGBA16UI, "rgba16ui" },
+      { GL_RGBA32UI, "rgba32ui" },
+   };
+   const char *name = blit_ctx->use_gles ? gles_formats[size_idx].name :
+                                           gl_formats[size_idx].name;
+   char shader_buf[1024];
+   GLuint cs_id, prog_id;
+
+   *image_format = blit_ctx->use_gles ? gles_formats[size_idx].format :
+                                        gl_formats[size_idx].format;
+   if (blit_ctx->copy_programs[size_idx] || !name)
+      return blit_ctx->copy_programs[size_idx];
+
+   snprintf(shader_buf, sizeof(shader_buf),
+            blit_ctx->use_gles ? CS_COPY_GLES : CS_COPY_GL, name, name);
+
+   VREND_DEBUG(dbg_blit, NULL, "-- Copy CS %s -----------------\n"
+               "%s\n---------------------------------------\n", name, shader_buf);
+
+   cs_id = blit_shader_build_and_check(GL_COMPUTE_SHADER, shader_buf, true);
+   if (!cs_id)
+      return 0;
+
+   prog_id = glCreateProgram();
+   glAttachShader(prog_id, cs_id);
+   if (blit_shader_link_and_check(prog_id))
+      blit_ctx->copy_programs[size_idx] = prog_id;
+   glDeleteShader(cs_id);
+
+   return blit_ctx->copy_programs[size_idx];
+}
+
+static GLuint blit_get_convert_program(struct vrend_blitter_ctx *blit_ctx,
+                                       const struct blit_image_format *src,
+                                       const struct blit_image_format *dst)
+{
+   uint64_t key = ((uint64_t)src->internalformat << 32) | dst->internalformat;
+   char shader_buf[1024];
+   GLuint cs_id, prog_id;
+
+   prog_id = pointer_to_uintptr(_mesa_hash_table_u64_search(blit_ctx->convert_programs, key));
+   if (prog_id)
+      return prog_id;
+
+   snprintf(shader_buf, sizeof(shader_buf),
+            blit_ctx->use_gles ? CS_CONVERT_GLES : CS_CONVERT_GL,
+            src->name, src->type, dst->name, dst->type);
+
+   VREND_DEBUG(dbg_blit, NULL, "-- Convert CS %s -> %s -----------\n"
+               "%s\n---------------------------------------\n",
+               src->name, dst->name, shader_buf);
+
+   cs_id = blit_shader_build_and_check(GL_COMPUTE_SHADER, shader_buf, true);
+   if (!cs_id)
+      return 0;
+
+   prog_id = glCreateProgram();
+   glAttachShader(prog_id, cs_id);
+   if (blit_shader_link_and_check(prog_id))
+      _mesa_hash_table_u64_insert(blit_ctx->convert_programs, key,
+                                  uintptr_to_pointer(prog_id));
+   else
+      prog_id = 0;
+   glDeleteShader(cs_id);
+
+   return prog_id;
+}
+
+/* Copy a box between two textures with a compute shader. Copy compatible
+ * formats are copied bit by bit, other formats are loaded and stored through
+ * their own image formats, which converts them like a blit would as long as
+ * both load as the same type. This avoids the readback of
+ * vrend_resource_copy_fallback for formats that can't be rendered to or
+ * copied with glCopyImageSubData. Returns false without touching any GL
+ * state if the copy isn't supported. */
+bool vrend_renderer_copy_compute(struct vrend_resource *src_res,
+                                 struct vrend_resource *dst_res,
+                                 uint32_t src_level,
+                                 const struct pipe_box *src_box,
+                                 uint32_t dst_level,
+                                 uint32_t dstx, uint32_t dsty, uint32_t dstz)
+{
+   struct vrend_blitter_ctx *blit_ctx = &vrend_blit_ctx;
+   const struct blit_image_format *src_format =
+      blit_image_format(vrend_get_format_table_entry(src_res->base.format)->internalformat);
+   const struct blit_image_format *dst_format =
+      blit_image_format(vrend_get_format_table_entry(dst_res->base.format)->internalformat);
+   bool convert = !format_is_copy_compatible(src_res->base.format,
+                                             dst_res->base.format, 0);
+   bool use_gles = epoxy_is_desktop_gl() == 0;
+   GLenum src_image_format, dst_image_format;
+   GLuint prog_id;
+
+   if (!src_format || !dst_format)
+      return false;
+
+   if (convert ? strcmp(src_format->type, dst_format->type) != 0 :
+                 src_format->size != dst_format->size)
+      return false;
+
+   if (!blit_copy_target_supported(src_res) || !blit_copy_target_supported(dst_res))
+      return false;
+
+   /* GLES only has 32 bit or wider uint image formats and a subset of the
+    * typed ones, and can only bind immutable textures */
+   if (use_gles) {
+      if (convert ? !src_format->gles || !dst_format->gles : src_format->size < 4)
+         return false;
+      if (!has_bit(src_res->storage_bits, VREND_STORAGE_GL_IMMUTABLE) ||
+          !has_bit(dst_res->storage_bits, VREND_STORAGE_GL_IMMUTABLE))
+         return false;
+   }
+
+   TRACE_FUNC();
+   vrend_renderer_init_blit_ctx(blit_ctx);
+
+   if (convert) {
+      prog_id = blit_get_convert_program(blit_ctx, src_format, dst_format);
+      src_image_format = src_format->internalformat;
+      dst_image_format = dst_format->internalformat;
+   } else {
+      prog_id = blit_get_copy_program(blit_ctx, util_logbase2(src_format->size),
+                                      &src_image_format);
+      dst_image_format = src_image_format;
+   }
+   if (!prog_id)
+      return false;
+
+   glUseProgram(prog_id);
+   glUniform4i(0, src_box->x, src_box->y, dstx, dsty);
+   glUniform2i(1, src_box->width, src_box->height);
+
+   for (int i = 0; i < src_box->depth; i++) {
+      glBindImageTexture(0, src_res->gl_id, src_level, GL_FALSE, src_box->z + i,
+                         GL_READ_ONLY, src_image_format);
+      glBindImageTexture(1, dst_res->gl_id, dst_level, GL_FALSE, dstz + i,
+                         GL_WRITE_ONLY, dst_image_format);
+      glDispatchCompute(DIV_ROUND_UP(src_box->width, 8),
+                        DIV_ROUND_UP(src_box->height, 8), 1);
+   }
+
+   glMemoryBarrier(GL_ALL_BARRIER_BITS);
+   glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_READ_ONLY, src_image_format);
+   glBindImageTexture(1, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, dst_image_format);
+   glUseProgram(0);
+   return true;
+}
+
 void vrend_blitter_fini(void)
 {
    vrend_blit_ctx.initialised = false;
    vrend_clicbs->destroy_gl_context(vrend_blit_ctx.gl_context);
+   for (unsigned i = 0; i < ARRAY_SIZE(vrend_blit_ctx.copy_programs); i++) {
+      if (vrend_blit_ctx.copy_programs[i])
+         glDeleteProgram(vrend_blit_ctx.copy_programs[i]);
+   }
+   if (vrend_blit_ctx.convert_programs) {
+      hash_table_foreach(vrend_blit_ctx.convert_programs->table, entry)
+         glDeleteProgram(pointer_to_uintptr(entry->data));
+
+      _mesa_hash_table_u64_destroy(vrend_blit_ctx.convert_programs);
+   }
    if (vrend_blit_ctx.blit_programs) {
       hash_table_foreach(vrend_blit_ctx.blit_programs->table, entry) {
-         glDeleteProgram((GLuint)pointer_to_uintptr(entry->data));
+         struct blit_program *prog = entry->data;
+         glDeleteProgram(prog->id);
+         free(prog);
       }
 
       _mesa_hash_table_u64_destroy(vrend_blit_ctx.blit_programs);
@@ -920,3 +1282,45 @@ void vrend_blitter_fini(void)
    memset(&vrend_blit_ctx, 0, sizeof(vrend_blit_ctx));
 }
 
+/* Build the programs of the most common blits up front, so that the first
+ * MSAA resolve or format conversion doesn't compile shaders mid-frame. The
+ * link status is only checked when a program is first used, with
+ * KHR_parallel_shader_compile the driver builds them in the background. */
+void vrend_blitter_precompile(bool msaa)
+{
+   struct vrend_blitter_ctx *blit_ctx = &vrend_blit_ctx;
+   static const enum pipe_swizzle identity[4] = {
+      PIPE_SWIZZLE_X, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_Z, PIPE_SWIZZLE_W
+   };
+   static const enum pipe_texture_target targets[] = {
+      PIPE_TEXTURE_2D, PIPE_TEXTURE_2D_ARRAY, PIPE_TEXTURE_CUBE,
+   };
+   static const enum tgsi_return_type rets[] = {
+      TGSI_RETURN_TYPE_UNORM, TGSI_RETURN_TYPE_UINT, TGSI_RETURN_TYPE_SINT,
+   };
+   static const unsigned msaa_samples[] = { 2, 4, 8 };
+
+   TRACE_FUNC();
+   vrend_renderer_init_blit_ctx(blit_ctx);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(targets); i++) {
+      for (unsigned j = 0; j < ARRAY_SIZE(rets); j++) {
+         struct blit_prog_key key = blit_tex_col_key(targets[i], 0, rets[j], identity, 0);
+         if (!_mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key)))
+            blit_create_frag_tex_col(blit_ctx, key, identity, 0, true);
+      }
+   }
+
+   if (msaa) {
+      for (unsigned i = 0; i < ARRAY_SIZE(msaa_samples); i++) {
+         struct blit_prog_key key = blit_tex_col_key(PIPE_TEXTURE_2D, msaa_samples[i],
+                                                     TGSI_RETURN_TYPE_UNORM, identity, 0);
+         if (!_mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key)))
+            blit_create_frag_tex_col(blit_ctx, key, identity, 0, true);
+      }
+   }
+
+   struct blit_prog_key key = blit_writedepth_key(PIPE_TEXTURE_2D, 0);
+   if (!_mesa_hash_table_u64_search(blit_ctx->blit_programs, prog_key_to_uint64(key)))
+      blit_create_frag_tex_writedepth(blit_ctx, key, true);
+}
@@ -173,10 +173,60 @@
    "   gl_FragDepth = float(texelFetch(samp, %s(tc%s), 0).x);\n" \
    "}\n"
 
+/* raw copy between two image compatible textures, the image format is
+ * picked by texel size so that the bits are copied without conversion */
+#define CS_COPY_BODY                                                    \
+   "layout(local_size_x = 8, local_size_y = 8) in;\n"                   \
+   "layout(binding = 0, %s) readonly uniform highp uimage2D src;\n"     \
+   "layout(binding = 1, %s) writeonly uniform highp uimage2D dst;\n"    \
+   "layout(location = 0) uniform ivec4 offsets;\n"                      \
+   "layout(location = 1) uniform ivec2 size;\n"                         \
+   "void main() {\n"                                                    \
+   "   ivec2 pos = ivec2(gl_GlobalInvocationID.xy);\n"                  \
+   "   if (pos.x >= size.x || pos.y >= size.y)\n"                       \
+   "      return;\n"                                                    \
+   "   imageStore(dst, offsets.zw + pos, imageLoad(src, offsets.xy + pos));\n" \
+   "}\n"
+
+#define CS_COPY_GL                              \
+   "#version 430\n"                             \
+   "// Blitter\n"                               \
+   CS_COPY_BODY
+
+#define CS_COPY_GLES                            \
+   "#version 310 es\n"                          \
+   "// Blitter\n"                               \
+   CS_COPY_BODY
+
+/* converting copy, each texture is bound with its own image format and the
+ * texels are converted on load and store */
+#define CS_CONVERT_BODY                                                 \
+   "layout(local_size_x = 8, local_size_y = 8) in;\n"                   \
+   "layout(binding = 0, %s) readonly uniform highp %simage2D src;\n"    \
+   "layout(binding = 1, %s) writeonly uniform highp %simage2D dst;\n"   \
+   "layout(location = 0) uniform ivec4 offsets;\n"                      \
+   "layout(location = 1) uniform ivec2 size;\n"                         \
+   "void main() {\n"                                                    \
+   "   ivec2 pos = ivec2(gl_GlobalInvocationID.xy);\n"                  \
+   "   if (pos.x >= size.x || pos.y >= size.y)\n"                       \
+   "      return;\n"                                                    \
+   "   imageStore(dst, offsets.zw + pos, imageLoad(src, offsets.xy + pos));\n" \
+   "}\n"
+
+#define CS_CONVERT_GL                           \
+   "#version 430\n"                             \
+   "// Blitter\n"                               \
+   CS_CONVERT_BODY
+
+#define CS_CONVERT_GLES                         \
+   "#version 310 es\n"                          \
+   "// Blitter\n"                               \
+   CS_CONVERT_BODY
 
 struct vrend_context;
 struct vrend_resource;
 struct vrend_blit_info;
+struct pipe_box;
 #define FS_TEXFETCH_DS_MSAA_GL HEADER_GL FS_TEXFETCH_DS_MSAA_BODY
 #define FS_TEXFETCH_DS_MSAA_GLES HEADER_GLES FS_TEXFETCH_DS_MSAA_BODY_GLES
 #define FS_TEXFETCH_DS_MSAA_ARRAY_GLES HEADER_GLES_MS_ARRAY FS_TEXFETCH_DS_MSAA_BODY_GLES
@@ -186,6 +236,13 @@ void vrend_renderer_blit_gl(ASSERTED struct vrend_context *ctx,
                             struct vrend_resource *src_res,
                             struct vrend_resource *dst_res,
                             const struct vrend_blit_info *info);
+bool vrend_renderer_copy_compute(struct vrend_resource *src_res,
+                                 struct vrend_resource *dst_res,
+                                 uint32_t src_level,
+                                 const struct pipe_box *src_box,
+                                 uint32_t dst_level,
+                                 uint32_t dstx, uint32_t dsty, uint32_t dstz);
 void vrend_blitter_fini(void);
+void vrend_blitter_precompile(bool msaa);
 
 #endif
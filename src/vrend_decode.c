@@ -22,13 +22,18 @@
  *
  **************************************************************************/
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <epoxy/gl.h>
 #include <fcntl.h>
 
+#include "util/bitscan.h"
+#include "util/u_atomic.h"
 #include "util/u_memory.h"
+#include "util/u_thread.h"
+#include "util/list.h"
 #include "pipe/p_defines.h"
 #include "pipe/p_state.h"
 #include "pipe/p_shader_tokens.h"
@@ -48,9 +53,79 @@
 /* decode side */
 #define DECODE_MAX_TOKENS 8000
 
+enum vrend_decode_work_type {
+   VREND_DECODE_WORK_CMD,
+   VREND_DECODE_WORK_FENCE,
+   VREND_DECODE_WORK_CTX0_FENCE,
+};
+
+/* A ctx0 fence covers the commands submitted to all contexts before it. It is
+ * queued to the workers with commands pending and created by whichever gets
+ * to it last, after the others flushed theirs. */
+struct vrend_ctx0_fence_wait {
+   int32_t pending;
+   uint32_t fence_id;
+};
+
+/* a command buffer or fence queued for the context worker */
+struct vrend_decode_work {
+   struct list_head head;
+   enum vrend_decode_work_type type;
+   struct vrend_ctx0_fence_wait *ctx0_wait;
+   uint32_t fence_flags;
+   uint32_t fence_ring_idx;
+   uint64_t fence_id;
+   size_t size;
+   uint32_t buf[];
+};
+
+/* With threaded contexts each context executes its commands and creates its
+ * fences on a thread of its own, in submission order. */
+struct vrend_decode_worker {
+   thrd_t thread;
+   mtx_t mutex;
+   /* signalled when work is queued and when the worker goes idle */
+   cnd_t cond;
+   struct list_head queue;
+   bool busy;
+   bool stop;
+};
+
+#define VREND_DECODE_STATS_BUCKETS 64
+
+/* With VIRGL_CMD_STATS set every command is timed. Bucket i of the histogram
+ * counts the commands that took [2^(i-1), 2^i) ns. */
+struct vrend_decode_cmd_stats {
+   uint64_t count;
+   uint64_t total_ns;
+   uint32_t histogram[VREND_DECODE_STATS_BUCKETS];
+};
+
+struct vrend_decode_stats {
+   uint64_t submits;
+   uint64_t bytes;
+   struct vrend_decode_cmd_stats cmds[VIRGL_MAX_COMMANDS];
+};
+
+/* The counters read by virgl_renderer_get_stats. The thread executing the
+ * commands publishes them after every command buffer, so reading them does
+ * not wait for the context worker. */
+struct vrend_decode_counters {
+   mtx_t mutex;
+   uint64_t commands;
+   uint64_t cache_hits;
+   uint64_t cache_misses;
+   uint64_t gpu_time_ns;
+   uint64_t draw_gpu_time_ns;
+   uint64_t gpu_timed_submits;
+};
+
 struct vrend_decode_ctx {
    struct virgl_context base;
    struct vrend_context *grctx;
+   struct vrend_decode_worker *worker;
+   struct vrend_decode_stats *stats;
+   struct vrend_decode_counters counters;
 };
 
 static inline uint32_t get_buf_entry(const uint32_t *buf, uint32_t offset)
@@ -99,6 +174,9 @@ static int vrend_decode_create_shader(struct vrend_context *ctx,
          return EINVAL;
    }
 
+   /* the whole struct takes part in shader cache lookups */
+   memset(&so_info, 0, sizeof(so_info));
+
    shader_offset = 6;
    if (num_so_outputs) {
       so_info.num_outputs = num_so_outputs;
@@ -126,8 +204,7 @@ static int vrend_decode_create_shader(struct vrend_context *ctx,
          }
       }
       shader_offset += 4 + (2 * num_so_outputs);
-   } else
-     memset(&so_info, 0, sizeof(so_info));
+   }
 
    shd_text = get_buf_ptr(buf, shader_offset);
    ret = vrend_create_shader(ctx, handle, &so_info, req_local_mem, (const char *)shd_text, offlen, num_tokens, type, length - shader_offset + 1);
@@ -1592,14 +1669,74 @@ static int vrend_decode_pipe_resource_set_type(struct vrend_context *ctx, const
    return vrend_renderer_pipe_resource_set_type(ctx, res_id, &args);
 }
 
+static void vrend_decode_stats_add(struct vrend_decode_cmd_stats *stats,
+                                   uint64_t ns)
+{
+   unsigned bucket = MIN2(util_last_bit64(ns), VREND_DECODE_STATS_BUCKETS - 1);
+
+   stats->count++;
+   stats->total_ns += ns;
+   stats->histogram[bucket]++;
+}
+
+static uint64_t vrend_decode_stats_percentile(const struct vrend_decode_cmd_stats *stats,
+                                              unsigned percent)
+{
+   uint64_t rank = (stats->count * percent + 99) / 100;
+   uint64_t seen = 0;
+
+   for (unsigned i = 0; i < VREND_DECODE_STATS_BUCKETS; i++) {
+      seen += stats->histogram[i];
+      if (seen && seen >= rank)
+         return i ? UINT64_MAX >> (64 - i) : 0;
+   }
+   return 0;
+}
+
+static void vrend_decode_stats_get(const struct vrend_decode_cmd_stats *stats,
+                                   struct virgl_renderer_cmd_stats *out)
+{
+   out->count = stats->count;
+   out->total_ns = stats->total_ns;
+   out->p50_ns = vrend_decode_stats_percentile(stats, 50);
+   out->p99_ns = vrend_decode_stats_percentile(stats, 99);
+}
+
+static void vrend_decode_stats_dump(struct vrend_decode_ctx *dctx)
+{
+   const struct vrend_decode_stats *stats = dctx->stats;
+
+   virgl_info("context %d: %" PRIu64 " command buffers, %" PRIu64 " bytes\n",
+              dctx->base.ctx_id, stats->submits, stats->bytes);
+
+   for (unsigned i = 0; i < VIRGL_MAX_COMMANDS; i++) {
+      struct virgl_renderer_cmd_stats cmd;
+
+      if (!stats->cmds[i].count)
+         continue;
+
+      vrend_decode_stats_get(&stats->cmds[i], &cmd);
+      virgl_info("  %-24s %10" PRIu64 " calls %12.3f ms  p50 %" PRIu64
+                 " ns  p99 %" PRIu64 " ns\n",
+                 vrend_get_comand_name(i), cmd.count, cmd.total_ns / 1e6,
+                 cmd.p50_ns, cmd.p99_ns);
+   }
+}
+
 static void vrend_decode_ctx_init_base(struct vrend_decode_ctx *dctx,
                                        uint32_t ctx_id);
-
-static void vrend_decode_ctx_fence_retire(uint64_t fence_id,
+static int vrend_decode_worker_start(struct vrend_decode_ctx *dctx);
+static void vrend_decode_worker_stop(struct vrend_decode_ctx *dctx);
+static void vrend_decode_worker_wait_idle(struct vrend_decode_ctx *dctx);
+static void vrend_decode_ctx_acquire(struct vrend_decode_ctx *dctx);
+static void vrend_decode_ctx_release(struct vrend_decode_ctx *dctx);
+
+static void vrend_decode_ctx_fence_retire(uint32_t ring_idx,
+                                          uint64_t fence_id,
                                           void *retire_data)
 {
    struct vrend_decode_ctx *dctx = retire_data;
-   dctx->base.fence_retire(&dctx->base, 0, fence_id);
+   dctx->base.fence_retire(&dctx->base, ring_idx, fence_id);
 }
 
 struct virgl_context *vrend_renderer_context_create(uint32_t handle,
@@ -1608,7 +1745,7 @@ struct virgl_context *vrend_renderer_context_create(uint32_t handle,
 {
    struct vrend_decode_ctx *dctx;
 
-   dctx = malloc(sizeof(struct vrend_decode_ctx));
+   dctx = calloc(1, sizeof(struct vrend_decode_ctx));
    if (!dctx)
       return NULL;
 
@@ -1623,16 +1760,160 @@ struct virgl_context *vrend_renderer_context_create(uint32_t handle,
    vrend_renderer_set_fence_retire(dctx->grctx,
                                    vrend_decode_ctx_fence_retire,
                                    dctx);
+   mtx_init(&dctx->counters.mutex, mtx_plain);
+
+   /* without memory for the statistics the context just runs without them */
+   if (getenv("VIRGL_CMD_STATS"))
+      dctx->stats = calloc(1, sizeof(*dctx->stats));
+
+   /* "draw" also times every draw call, any other value only the batches */
+   const char *gpu_time = getenv("VIRGL_GPU_TIME");
+   if (gpu_time) {
+      uint32_t flags = VREND_GPU_TIME_BATCHES;
+
+      if (!strcmp(gpu_time, "draw"))
+         flags |= VREND_GPU_TIME_DRAWS;
+      if (!vrend_context_enable_gpu_time(dctx->grctx, flags))
+         virgl_warn("context %u: no timer queries, GPU time is not measured\n", handle);
+   }
+
+   if (vrend_renderer_use_threaded_contexts()) {
+      /* the new GL context is current here, the worker binds it next */
+      vrend_context_lock(dctx->grctx);
+      vrend_context_unlock(dctx->grctx);
+
+      if (vrend_decode_worker_start(dctx)) {
+         vrend_destroy_context(dctx->grctx);
+         mtx_destroy(&dctx->counters.mutex);
+         free(dctx->stats);
+         free(dctx);
+         return NULL;
+      }
+   }
 
    return &dctx->base;
 }
 
+void vrend_renderer_context_wait_idle(struct virgl_context *ctx)
+{
+   vrend_decode_worker_wait_idle((struct vrend_decode_ctx *)ctx);
+}
+
+void vrend_renderer_context_get_shader_stats(struct virgl_context *ctx,
+                                             struct virgl_renderer_shader_stats *stats)
+{
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   vrend_decode_worker_wait_idle(dctx);
+   vrend_context_get_shader_stats(dctx->grctx, stats);
+}
+
+void vrend_renderer_context_get_copy_stats(struct virgl_context *ctx,
+                                           struct virgl_renderer_copy_stats *stats)
+{
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   vrend_decode_worker_wait_idle(dctx);
+   vrend_context_get_copy_stats(dctx->grctx, stats);
+}
+
+int vrend_renderer_context_get_decode_stats(struct virgl_context *ctx,
+                                            struct virgl_renderer_decode_stats *stats,
+                                            struct virgl_renderer_cmd_stats *cmds,
+                                            uint32_t *num_cmds)
+{
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   if (!dctx->stats)
+      return EINVAL;
+
+   vrend_decode_worker_wait_idle(dctx);
+
+   if (stats) {
+      memset(stats, 0, sizeof(*stats));
+      stats->submits = dctx->stats->submits;
+      stats->bytes = dctx->stats->bytes;
+      for (unsigned i = 0; i < VIRGL_MAX_COMMANDS; i++) {
+         stats->commands += dctx->stats->cmds[i].count;
+         stats->total_ns += dctx->stats->cmds[i].total_ns;
+      }
+   }
+
+   if (num_cmds) {
+      if (cmds) {
+         for (unsigned i = 0; i < MIN2(*num_cmds, VIRGL_MAX_COMMANDS); i++)
+            vrend_decode_stats_get(&dctx->stats->cmds[i], &cmds[i]);
+      }
+      *num_cmds = VIRGL_MAX_COMMANDS;
+   }
+
+   return 0;
+}
+
+/* Called on the thread that executes the commands. */
+static void vrend_decode_ctx_publish_counters(struct vrend_decode_ctx *dctx)
+{
+   struct vrend_decode_counters *counters = &dctx->counters;
+   uint64_t commands = 0, cache_hits, cache_misses;
+   struct vrend_gpu_time gpu_time;
+
+   /* commands are only counted with VIRGL_CMD_STATS */
+   if (dctx->stats) {
+      for (unsigned i = 0; i < VIRGL_MAX_COMMANDS; i++)
+         commands += dctx->stats->cmds[i].count;
+   }
+   vrend_context_get_cache_stats(dctx->grctx, &cache_hits, &cache_misses);
+   vrend_context_get_gpu_time(dctx->grctx, &gpu_time);
+
+   mtx_lock(&counters->mutex);
+   counters->commands = commands;
+   counters->cache_hits = cache_hits;
+   counters->cache_misses = cache_misses;
+   counters->gpu_time_ns = gpu_time.batch_ns;
+   counters->draw_gpu_time_ns = gpu_time.draw_ns;
+   counters->gpu_timed_submits = gpu_time.batches;
+   mtx_unlock(&counters->mutex);
+}
+
+static void vrend_decode_ctx_get_stats(struct virgl_context *ctx,
+                                       struct virgl_renderer_context_stats *stats)
+{
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   struct vrend_decode_counters *counters = &dctx->counters;
+
+   mtx_lock(&counters->mutex);
+   stats->commands = counters->commands;
+   stats->cache_hits = counters->cache_hits;
+   stats->cache_misses = counters->cache_misses;
+   stats->gpu_time_ns = counters->gpu_time_ns;
+   stats->draw_gpu_time_ns = counters->draw_gpu_time_ns;
+   stats->gpu_timed_submits = counters->gpu_timed_submits;
+   mtx_unlock(&counters->mutex);
+}
+
 static void vrend_decode_ctx_destroy(struct virgl_context *ctx)
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   struct vrend_gpu_time gpu_time;
+
+   vrend_decode_worker_stop(dctx);
+
+   vrend_context_get_gpu_time(dctx->grctx, &gpu_time);
+   if (gpu_time.batches || gpu_time.draws) {
+      virgl_info("context %u: GPU time %" PRIu64 " us in %" PRIu64 " batches, "
+                 "%" PRIu64 " us in %" PRIu64 " draws\n", ctx->ctx_id,
+                 gpu_time.batch_ns / 1000, gpu_time.batches,
+                 gpu_time.draw_ns / 1000, gpu_time.draws);
+   }
 
    vrend_destroy_context(dctx->grctx);
+   mtx_destroy(&dctx->counters.mutex);
+
+   if (dctx->stats) {
+      vrend_decode_stats_dump(dctx);
+      free(dctx->stats);
+   }
    free(dctx);
 }
 
@@ -1641,7 +1922,10 @@ static void vrend_decode_ctx_attach_resource(struct virgl_context *ctx,
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   vrend_decode_ctx_acquire(dctx);
    vrend_renderer_attach_res_ctx(dctx->grctx, res);
+   vrend_decode_ctx_release(dctx);
 }
 
 static void vrend_decode_ctx_detach_resource(struct virgl_context *ctx,
@@ -1649,7 +1933,10 @@ static void vrend_decode_ctx_detach_resource(struct virgl_context *ctx,
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   vrend_decode_ctx_acquire(dctx);
    vrend_renderer_detach_res_ctx(dctx->grctx, res);
+   vrend_decode_ctx_release(dctx);
 }
 
 static int vrend_decode_ctx_transfer_3d(struct virgl_context *ctx,
@@ -1659,9 +1946,13 @@ static int vrend_decode_ctx_transfer_3d(struct virgl_context *ctx,
 {
    TRACE_FUNC();
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+
+   vrend_decode_ctx_acquire(dctx);
    int ret = vrend_renderer_transfer_iov(dctx->grctx, res->res_id, info,
                                          transfer_mode);
-   return vrend_check_no_error(dctx->grctx) || ret ? ret : EINVAL;
+   ret = vrend_check_no_error(dctx->grctx) || ret ? ret : EINVAL;
+   vrend_decode_ctx_release(dctx);
+   return ret;
 }
 
 static int vrend_decode_ctx_get_blob(struct virgl_context *ctx,
@@ -1676,6 +1967,7 @@ static int vrend_decode_ctx_get_blob(struct virgl_context *ctx,
 
    blob->type = VIRGL_RESOURCE_FD_INVALID;
    /* this transfers ownership and blob_id is no longer valid */
+   vrend_decode_worker_wait_idle(dctx);
    blob->u.pipe_resource = vrend_get_blob_pipe(dctx->grctx, blob_id);
    if (!blob->u.pipe_resource)
       return -EINVAL;
@@ -1737,12 +2029,16 @@ static int vrend_decode_create_video_codec(struct vrend_context *ctx,
    uint32_t width      = get_buf_entry(buf, VIRGL_CREATE_VIDEO_CODEC_WIDTH);
    uint32_t height     = get_buf_entry(buf, VIRGL_CREATE_VIDEO_CODEC_HEIGHT);
    uint32_t max_ref    = 2; /* The max number of ref frames is 2 by default */
+   uint32_t flags      = 0;
 
    if (length >= VIRGL_CREATE_VIDEO_CODEC_MAX_REF)
       max_ref = get_buf_entry(buf, VIRGL_CREATE_VIDEO_CODEC_MAX_REF);
 
+   if (length >= VIRGL_CREATE_VIDEO_CODEC_FLAGS)
+      flags = get_buf_entry(buf, VIRGL_CREATE_VIDEO_CODEC_FLAGS);
+
    vrend_video_create_codec(vctx, handle, profile, entrypoint,
-                            chroma_fmt, level, width, height, max_ref, 0);
+                            chroma_fmt, level, width, height, max_ref, flags);
 
    return 0;
 }
@@ -1986,19 +2282,12 @@ static const vrend_decode_callback decode_table[VIRGL_MAX_COMMANDS] = {
 #endif
 };
 
-static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
-                                       const void *buffer,
-                                       size_t size)
+static int vrend_decode_ctx_execute_cmds(struct vrend_decode_ctx *gdctx,
+                                         const void *buffer,
+                                         size_t size)
 {
-   TRACE_FUNC();
-   struct vrend_decode_ctx *gdctx = (struct vrend_decode_ctx *)ctx;
-   bool bret;
    int ret;
 
-   bret = vrend_hw_switch_context(gdctx->grctx, true);
-   if (bret == false)
-      return EINVAL;
-
    const uint32_t *typed_buf = (const uint32_t *)buffer;
    const uint32_t buf_total = (uint32_t)(size / sizeof(uint32_t));
    uint32_t buf_offset = 0;
@@ -2026,7 +2315,21 @@ static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
 
       TRACE_SCOPE_SLOW(vrend_get_comand_name(cmd));
 
-      ret = decode_table[cmd](gdctx->grctx, buf, len);
+      if (cmd == VIRGL_CCMD_DRAW_VBO)
+         vrend_context_gpu_time_begin(gdctx->grctx, VREND_GPU_TIME_DRAWS);
+
+      if (gdctx->stats) {
+         uint64_t start_ns = virgl_time_get_ns();
+         ret = decode_table[cmd](gdctx->grctx, buf, len);
+         vrend_decode_stats_add(&gdctx->stats->cmds[cmd],
+                                virgl_time_get_ns() - start_ns);
+      } else {
+         ret = decode_table[cmd](gdctx->grctx, buf, len);
+      }
+
+      if (cmd == VIRGL_CCMD_DRAW_VBO)
+         vrend_context_gpu_time_end(gdctx->grctx, VREND_GPU_TIME_DRAWS);
+
       if (!vrend_check_no_error(gdctx->grctx) && !ret)
          ret = EINVAL;
       if (ret) {
@@ -2040,6 +2343,280 @@ static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
    return 0;
 }
 
+static int vrend_decode_ctx_execute(struct vrend_decode_ctx *gdctx,
+                                    const void *buffer,
+                                    size_t size)
+{
+   TRACE_FUNC();
+   bool bret;
+   int ret;
+
+   bret = vrend_hw_switch_context(gdctx->grctx, true);
+   if (bret == false)
+      return EINVAL;
+
+   if (gdctx->stats) {
+      gdctx->stats->submits++;
+      gdctx->stats->bytes += size;
+   }
+
+   vrend_context_gpu_time_begin(gdctx->grctx, VREND_GPU_TIME_BATCHES);
+   ret = vrend_decode_ctx_execute_cmds(gdctx, buffer, size);
+   vrend_context_gpu_time_end(gdctx->grctx, VREND_GPU_TIME_BATCHES);
+
+   vrend_decode_ctx_publish_counters(gdctx);
+   return ret;
+}
+
+static int vrend_decode_ctx_create_fence(struct vrend_decode_ctx *dctx,
+                                         uint32_t flags,
+                                         uint32_t ring_idx,
+                                         uint64_t fence_id)
+{
+#ifdef ENABLE_VIDEO
+   /* signalled by the video worker once the frames before it are complete */
+   if (ring_idx == VIRGL_VIDEO_FENCE_RING_IDX)
+      return vrend_video_create_fence(vrend_context_get_video_ctx(dctx->grctx),
+                                      flags, fence_id);
+#else
+   (void)ring_idx;
+#endif
+
+   return vrend_renderer_create_fence(dctx->grctx, flags, fence_id);
+}
+
+static void vrend_decode_worker_run(struct vrend_decode_ctx *dctx,
+                                    struct vrend_decode_work *work)
+{
+   switch (work->type) {
+   case VREND_DECODE_WORK_CMD:
+      /* the context is flagged in_error, later submissions are rejected */
+      if (vrend_decode_ctx_execute(dctx, work->buf, work->size))
+         virgl_error("context %d failed to execute queued commands\n",
+                     dctx->base.ctx_id);
+      break;
+   case VREND_DECODE_WORK_FENCE:
+      if (vrend_decode_ctx_create_fence(dctx, work->fence_flags,
+                                        work->fence_ring_idx, work->fence_id))
+         virgl_error("context %d failed to create fence %" PRIu64 "\n",
+                     dctx->base.ctx_id, work->fence_id);
+      break;
+   case VREND_DECODE_WORK_CTX0_FENCE:
+      vrend_context_flush(dctx->grctx);
+      if (vrend_ctx0_fence_wait_put(work->ctx0_wait))
+         virgl_error("context %d failed to create ctx0 fence\n",
+                     dctx->base.ctx_id);
+      break;
+   }
+}
+
+static int vrend_decode_worker_thread(void *arg)
+{
+   struct vrend_decode_ctx *dctx = arg;
+   struct vrend_decode_worker *worker = dctx->worker;
+   char name[16];
+
+   snprintf(name, sizeof(name), "vrend-ctx-%u", dctx->base.ctx_id);
+   u_thread_setname(name);
+
+   mtx_lock(&worker->mutex);
+   while (true) {
+      while (list_is_empty(&worker->queue) && !worker->stop)
+         cnd_wait(&worker->cond, &worker->mutex);
+      if (list_is_empty(&worker->queue))
+         break;
+
+      /* keep the GL context bound while there is work queued */
+      worker->busy = true;
+      mtx_unlock(&worker->mutex);
+      vrend_context_lock(dctx->grctx);
+
+      mtx_lock(&worker->mutex);
+      while (!list_is_empty(&worker->queue)) {
+         struct vrend_decode_work *work =
+            list_first_entry(&worker->queue, struct vrend_decode_work, head);
+         list_del(&work->head);
+         mtx_unlock(&worker->mutex);
+
+         vrend_decode_worker_run(dctx, work);
+         free(work);
+
+         mtx_lock(&worker->mutex);
+      }
+      mtx_unlock(&worker->mutex);
+
+      vrend_context_unlock(dctx->grctx);
+      mtx_lock(&worker->mutex);
+      worker->busy = false;
+      cnd_broadcast(&worker->cond);
+   }
+   mtx_unlock(&worker->mutex);
+
+   return 0;
+}
+
+static int vrend_decode_worker_start(struct vrend_decode_ctx *dctx)
+{
+   struct vrend_decode_worker *worker = CALLOC_STRUCT(vrend_decode_worker);
+   if (!worker)
+      return ENOMEM;
+
+   list_inithead(&worker->queue);
+   mtx_init(&worker->mutex, mtx_plain);
+   cnd_init(&worker->cond);
+   dctx->worker = worker;
+
+   if (thrd_create(&worker->thread, vrend_decode_worker_thread, dctx) != thrd_success) {
+      cnd_destroy(&worker->cond);
+      mtx_destroy(&worker->mutex);
+      FREE(worker);
+      dctx->worker = NULL;
+      return ENOMEM;
+   }
+   return 0;
+}
+
+/* Let the worker finish the queued work and exit. */
+static void vrend_decode_worker_stop(struct vrend_decode_ctx *dctx)
+{
+   struct vrend_decode_worker *worker = dctx->worker;
+
+   if (!worker)
+      return;
+
+   mtx_lock(&worker->mutex);
+   worker->stop = true;
+   cnd_broadcast(&worker->cond);
+   mtx_unlock(&worker->mutex);
+
+   thrd_join(worker->thread, NULL);
+
+   cnd_destroy(&worker->cond);
+   mtx_destroy(&worker->mutex);
+   FREE(worker);
+   dctx->worker = NULL;
+}
+
+static void vrend_decode_worker_queue(struct vrend_decode_ctx *dctx,
+                                      struct vrend_decode_work *work)
+{
+   struct vrend_decode_worker *worker = dctx->worker;
+
+   mtx_lock(&worker->mutex);
+   list_addtail(&work->head, &worker->queue);
+   cnd_broadcast(&worker->cond);
+   mtx_unlock(&worker->mutex);
+}
+
+/* Wait until everything submitted so far has been executed. */
+static void vrend_decode_worker_wait_idle(struct vrend_decode_ctx *dctx)
+{
+   struct vrend_decode_worker *worker = dctx->worker;
+
+   if (!worker)
+      return;
+
+   mtx_lock(&worker->mutex);
+   while (worker->busy || !list_is_empty(&worker->queue))
+      cnd_wait(&worker->cond, &worker->mutex);
+   mtx_unlock(&worker->mutex);
+}
+
+struct vrend_ctx0_fence_wait *vrend_ctx0_fence_wait_create(uint32_t fence_id)
+{
+   struct vrend_ctx0_fence_wait *wait = CALLOC_STRUCT(vrend_ctx0_fence_wait);
+   if (!wait)
+      return NULL;
+
+   /* the reference of the renderer thread */
+   wait->pending = 1;
+   wait->fence_id = fence_id;
+   return wait;
+}
+
+/* Drop a reference, the last one creates the fence in the GL context current
+ * on the calling thread. */
+int vrend_ctx0_fence_wait_put(struct vrend_ctx0_fence_wait *wait)
+{
+   int ret = 0;
+
+   if (p_atomic_dec_zero(&wait->pending)) {
+      ret = vrend_renderer_create_ctx0_fence(wait->fence_id);
+      FREE(wait);
+   }
+   return ret;
+}
+
+/* Queue the ctx0 fence behind the commands of an active worker. A worker that
+ * is idle has flushed everything it executed. */
+void vrend_renderer_context_queue_ctx0_fence(struct virgl_context *ctx,
+                                             struct vrend_ctx0_fence_wait *wait)
+{
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   struct vrend_decode_worker *worker = dctx->worker;
+   struct vrend_decode_work *work;
+
+   if (!worker)
+      return;
+
+   mtx_lock(&worker->mutex);
+   if (!worker->busy && list_is_empty(&worker->queue)) {
+      mtx_unlock(&worker->mutex);
+      return;
+   }
+   mtx_unlock(&worker->mutex);
+
+   work = calloc(1, sizeof(*work));
+   if (!work) {
+      vrend_decode_worker_wait_idle(dctx);
+      return;
+   }
+
+   work->type = VREND_DECODE_WORK_CTX0_FENCE;
+   work->ctx0_wait = wait;
+   p_atomic_inc(&wait->pending);
+   vrend_decode_worker_queue(dctx, work);
+}
+
+/* Operations from the renderer thread are ordered after the queued commands,
+ * and use the GL context while the worker is idle. */
+static void vrend_decode_ctx_acquire(struct vrend_decode_ctx *dctx)
+{
+   if (!dctx->worker)
+      return;
+
+   vrend_decode_worker_wait_idle(dctx);
+   vrend_context_lock(dctx->grctx);
+}
+
+static void vrend_decode_ctx_release(struct vrend_decode_ctx *dctx)
+{
+   if (dctx->worker)
+      vrend_context_unlock(dctx->grctx);
+}
+
+static int vrend_decode_ctx_submit_cmd(struct virgl_context *ctx,
+                                       const void *buffer,
+                                       size_t size)
+{
+   struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   struct vrend_decode_work *work;
+
+   if (!dctx->worker)
+      return vrend_decode_ctx_execute(dctx, buffer, size);
+
+   TRACE_FUNC();
+   work = malloc(sizeof(*work) + size);
+   if (!work)
+      return ENOMEM;
+
+   work->type = VREND_DECODE_WORK_CMD;
+   work->size = size;
+   memcpy(work->buf, buffer, size);
+   vrend_decode_worker_queue(dctx, work);
+   return 0;
+}
+
 static int vrend_decode_ctx_get_fencing_fd(UNUSED struct virgl_context *ctx)
 {
    return vrend_renderer_get_poll_fd();
@@ -2056,11 +2633,30 @@ static int vrend_decode_ctx_submit_fence(struct virgl_context *ctx,
                                          uint64_t fence_id)
 {
    struct vrend_decode_ctx *dctx = (struct vrend_decode_ctx *)ctx;
+   struct vrend_decode_work *work;
 
+#ifdef ENABLE_VIDEO
+   if (ring_idx && ring_idx != VIRGL_VIDEO_FENCE_RING_IDX)
+      return -EINVAL;
+#else
    if (ring_idx)
       return -EINVAL;
+#endif
 
-   return vrend_renderer_create_fence(dctx->grctx, flags, fence_id);
+   if (!dctx->worker)
+      return vrend_decode_ctx_create_fence(dctx, flags, ring_idx, fence_id);
+
+   /* the fence is created after the commands queued before it */
+   work = calloc(1, sizeof(*work));
+   if (!work)
+      return ENOMEM;
+
+   work->type = VREND_DECODE_WORK_FENCE;
+   work->fence_flags = flags;
+   work->fence_ring_idx = ring_idx;
+   work->fence_id = fence_id;
+   vrend_decode_worker_queue(dctx, work);
+   return 0;
 }
 
 static void vrend_decode_ctx_init_base(struct vrend_decode_ctx *dctx,
@@ -2082,4 +2678,5 @@ static void vrend_decode_ctx_init_base(struct vrend_decode_ctx *dctx,
    ctx->get_fencing_fd = vrend_decode_ctx_get_fencing_fd;
    ctx->retire_fences = vrend_decode_ctx_retire_fences;
    ctx->submit_fence = vrend_decode_ctx_submit_fence;
+   ctx->get_stats = vrend_decode_ctx_get_stats;
 }
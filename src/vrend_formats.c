@@ -22,11 +22,52 @@
  *
  **************************************************************************/
 #include <epoxy/gl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "vrend_renderer.h"
 #include "util/u_memory.h"
 #include "util/u_format.h"
 
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
+/* The probed format table and the probed caps are kept in a file keyed on
+ * the host driver, so later runs on the same driver can skip the probing. */
+#define VREND_FORMAT_CACHE_MAGIC 0x544d4656 /* "VFMT" */
+#define VREND_FORMAT_CACHE_VERSION 1
+
+enum vrend_format_cache_flags {
+   VREND_FORMAT_CACHE_HAS_MS_CAPS = 1 << 0,
+   VREND_FORMAT_CACHE_HAS_MIXED_COLOR = 1 << 1,
+   VREND_FORMAT_CACHE_MIXED_COLOR = 1 << 2,
+};
+
+struct vrend_format_cache_header {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t key;
+   uint32_t num_formats;
+   uint32_t flags;
+   uint32_t ms_max_samples_in;
+   uint32_t ms_max_samples;
+   uint32_t ms_sample_locations[8];
+};
+
+static struct {
+   bool enabled;
+   char path[PATH_MAX];
+   struct vrend_format_cache_header header;
+} format_cache;
+
+/* set while the cache key is computed, the format lists are then hashed
+ * instead of probed */
+static XXH64_state_t *format_key_state;
+
 #define SWIZZLE_INVALID 0xff
 #define NO_SWIZZLE { SWIZZLE_INVALID, SWIZZLE_INVALID, SWIZZLE_INVALID, SWIZZLE_INVALID }
 #define RRR1_SWIZZLE { PIPE_SWIZZLE_X, PIPE_SWIZZLE_X, PIPE_SWIZZLE_X, PIPE_SWIZZLE_1 }
@@ -438,6 +479,11 @@ static void vrend_add_formats(struct vrend_format_table *table, int num_entries)
     GLuint buffers;
     GLuint tex_id, fb_id;
 
+    if (format_key_state) {
+       XXH64_update(format_key_state, &table[i], sizeof(table[i]));
+       continue;
+    }
+
     if (vrend_get_format_table_entry(table[i].format)->format)
        continue;
 
@@ -524,6 +570,12 @@ static void vrend_add_formats(struct vrend_format_table *table, int num_entries)
 static void vrend_add_compressed_formats(struct vrend_format_table *table, int num_entries)
 {
    int flags = epoxy_is_desktop_gl() ? VIRGL_TEXTURE_CAN_READBACK : 0;
+
+   if (format_key_state) {
+      XXH64_update(format_key_state, table, num_entries * sizeof(*table));
+      return;
+   }
+
    for (int i = 0; i < num_entries; i++) {
       vrend_insert_format(&table[i], VIRGL_BIND_SAMPLER_VIEW, flags);
    }
@@ -679,6 +731,9 @@ bool vrend_check_framebuffer_mixed_color_attachements(void)
    GLuint fb_id;
    bool retval = false;
 
+   if (format_cache.header.flags & VREND_FORMAT_CACHE_HAS_MIXED_COLOR)
+      return format_cache.header.flags & VREND_FORMAT_CACHE_MIXED_COLOR;
+
    glGenTextures(2, tex_id);
    glGenFramebuffers(1, &fb_id);
 
@@ -698,6 +753,11 @@ bool vrend_check_framebuffer_mixed_color_attachements(void)
    glDeleteFramebuffers(1, &fb_id);
    glDeleteTextures(2, tex_id);
 
+   format_cache.header.flags |= VREND_FORMAT_CACHE_HAS_MIXED_COLOR;
+   if (retval)
+      format_cache.header.flags |= VREND_FORMAT_CACHE_MIXED_COLOR;
+   vrend_format_cache_store();
+
    return retval;
 }
 
@@ -713,6 +773,13 @@ unsigned vrend_renderer_query_multisample_caps(unsigned max_samples, struct virg
    int out_buf_offsets[4] = {0,1,2,4};
    int lowest_working_ms_count_idx = -1;
 
+   if ((format_cache.header.flags & VREND_FORMAT_CACHE_HAS_MS_CAPS) &&
+       format_cache.header.ms_max_samples_in == max_samples) {
+      memcpy(caps->sample_locations, format_cache.header.ms_sample_locations,
+             sizeof(caps->sample_locations));
+      return format_cache.header.ms_max_samples;
+   }
+
    assert(glGetError() == GL_NO_ERROR &&
           "Stale error state detected, please check for failures in initialization");
 
@@ -758,6 +825,14 @@ unsigned vrend_renderer_query_multisample_caps(unsigned max_samples, struct virg
       glDeleteTextures(1, &tex);
    }
    glDeleteFramebuffers(1, &fbo);
+
+   format_cache.header.flags |= VREND_FORMAT_CACHE_HAS_MS_CAPS;
+   format_cache.header.ms_max_samples_in = max_samples;
+   format_cache.header.ms_max_samples = max_samples_confirmed;
+   memcpy(format_cache.header.ms_sample_locations, caps->sample_locations,
+          sizeof(caps->sample_locations));
+   vrend_format_cache_store();
+
    return max_samples_confirmed;
 }
 
@@ -927,3 +1002,167 @@ bool format_is_copy_compatible(enum virgl_formats src, enum virgl_formats dst,
    return format_compressed_compressed_copy_compatible(dst, src) ||
           format_compressed_compressed_copy_compatible(src, dst);
 }
+
+/* The cache is only used when VIRGL_FORMAT_CACHE is set, to the cache file
+ * or to an empty string for one in the user cache directory. Renderers in a
+ * sandbox or in tests must not write to the home directory by default. */
+static bool vrend_format_cache_path(char *path, size_t size)
+{
+   const char *env = getenv("VIRGL_FORMAT_CACHE");
+   const char *dir;
+   char base[PATH_MAX];
+
+   if (!env)
+      return false;
+
+   if (env[0]) {
+      snprintf(path, size, "%s", env);
+      return true;
+   }
+
+   dir = getenv("XDG_CACHE_HOME");
+   if (dir && dir[0]) {
+      snprintf(base, sizeof(base), "%s", dir);
+   } else {
+      dir = getenv("HOME");
+      if (!dir || !dir[0])
+         return false;
+      snprintf(base, sizeof(base), "%s/.cache", dir);
+      if (mkdir(base, 0755) && errno != EEXIST)
+         return false;
+   }
+
+   if (strlen(base) + strlen("/virglrenderer/formats") >= size)
+      return false;
+
+   snprintf(path, size, "%s/virglrenderer", base);
+   if (mkdir(path, 0755) && errno != EEXIST)
+      return false;
+   strcat(path, "/formats");
+   return true;
+}
+
+static uint64_t vrend_format_cache_key(bool use_gles)
+{
+   XXH64_state_t state;
+   const char *strings[3];
+   GLint num_extensions = 0;
+   uint32_t sizes[2] = { VIRGL_FORMAT_MAX_EXTENDED, sizeof(struct vrend_format_table) };
+
+   XXH64_reset(&state, VREND_FORMAT_CACHE_VERSION);
+   XXH64_update(&state, VERSION, strlen(VERSION));
+   XXH64_update(&state, &use_gles, sizeof(use_gles));
+   XXH64_update(&state, sizes, sizeof(sizes));
+
+   strings[0] = (const char *)glGetString(GL_VENDOR);
+   strings[1] = (const char *)glGetString(GL_RENDERER);
+   strings[2] = (const char *)glGetString(GL_VERSION);
+   for (unsigned i = 0; i < ARRAY_SIZE(strings); i++) {
+      if (strings[i])
+         XXH64_update(&state, strings[i], strlen(strings[i]) + 1);
+   }
+
+   glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+   for (GLint i = 0; i < num_extensions; i++) {
+      const char *ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+      if (ext)
+         XXH64_update(&state, ext, strlen(ext) + 1);
+   }
+
+   /* the built in format lists are part of the key */
+   format_key_state = &state;
+   vrend_build_format_list_common();
+   if (use_gles)
+      vrend_build_format_list_gles();
+   else
+      vrend_build_format_list_gl();
+   format_key_state = NULL;
+
+   return XXH64_digest(&state);
+}
+
+bool vrend_format_cache_load(bool use_gles)
+{
+   struct vrend_format_cache_header header;
+   struct vrend_format_table entry;
+   bool loaded = false;
+   FILE *f;
+
+   memset(&format_cache, 0, sizeof(format_cache));
+   if (getenv("VIRGL_DISABLE_FORMAT_CACHE") ||
+       !vrend_format_cache_path(format_cache.path, sizeof(format_cache.path)))
+      return false;
+
+   format_cache.enabled = true;
+   format_cache.header.magic = VREND_FORMAT_CACHE_MAGIC;
+   format_cache.header.version = VREND_FORMAT_CACHE_VERSION;
+   format_cache.header.key = vrend_format_cache_key(use_gles);
+
+   f = fopen(format_cache.path, "rb");
+   if (!f)
+      return false;
+
+   if (fread(&header, sizeof(header), 1, f) != 1 ||
+       header.magic != VREND_FORMAT_CACHE_MAGIC ||
+       header.version != VREND_FORMAT_CACHE_VERSION ||
+       header.key != format_cache.header.key ||
+       header.num_formats > VIRGL_FORMAT_MAX_EXTENDED)
+      goto out;
+
+   /* validate everything before touching the format table */
+   for (uint32_t i = 0; i < header.num_formats; i++) {
+      if (fread(&entry, sizeof(entry), 1, f) != 1 ||
+          (uint32_t)entry.format >= VIRGL_FORMAT_MAX_EXTENDED)
+         goto out;
+   }
+
+   fseek(f, sizeof(header), SEEK_SET);
+   for (uint32_t i = 0; i < header.num_formats; i++) {
+      if (fread(&entry, sizeof(entry), 1, f) != 1)
+         goto out;
+      vrend_insert_format(&entry, entry.bindings, entry.flags);
+   }
+
+   format_cache.header = header;
+   loaded = true;
+   virgl_debug("Loaded %u probed formats from %s\n", header.num_formats,
+               format_cache.path);
+out:
+   fclose(f);
+   return loaded;
+}
+
+void vrend_format_cache_store(void)
+{
+   char tmp_path[PATH_MAX + 16];
+   uint32_t num_formats = 0;
+   bool ok;
+   FILE *f;
+
+   if (!format_cache.enabled)
+      return;
+
+   for (int i = 0; i < VIRGL_FORMAT_MAX_EXTENDED; i++) {
+      if (vrend_get_format_table_entry(i)->format)
+         num_formats++;
+   }
+   format_cache.header.num_formats = num_formats;
+
+   /* write a private file and rename it, so concurrent runs never see a
+    * partial cache */
+   snprintf(tmp_path, sizeof(tmp_path), "%s.%d", format_cache.path, (int)getpid());
+   f = fopen(tmp_path, "wb");
+   if (!f)
+      return;
+
+   ok = fwrite(&format_cache.header, sizeof(format_cache.header), 1, f) == 1;
+   for (int i = 0; i < VIRGL_FORMAT_MAX_EXTENDED && ok; i++) {
+      const struct vrend_format_table *entry = vrend_get_format_table_entry(i);
+      if (entry->format)
+         ok = fwrite(entry, sizeof(*entry), 1, f) == 1;
+   }
+
+   ok = !fclose(f) && ok;
+   if (!ok || rename(tmp_path, format_cache.path))
+      unlink(tmp_path);
+}
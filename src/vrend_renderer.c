@@ -65,6 +65,9 @@
 
 #include "tgsi/tgsi_text.h"
 
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
 #ifdef HAVE_EPOXY_GLX_H
 #include <epoxy/glx.h>
 #endif
@@ -121,8 +124,49 @@ struct vrend_query {
    GLuint gltype;
    struct vrend_context *ctx;
    int sub_ctx_id;
+   struct vrend_sub_context *owning_sub;
    struct vrend_resource *res;
    bool fake_samples_passed;
+   /* the batch the result is being resolved in */
+   struct vrend_query_batch *batch;
+   uint32_t batch_slot;
+};
+
+/* Query names are recycled per sub context. A query object takes the type
+ * of its first use, so a name only goes back to a pool of the same GL type,
+ * pool 0 holds fresh names that are generated in blocks. */
+#define VREND_QUERY_POOL_SIZE 32
+#define VREND_QUERY_POOL_TYPES 8
+
+struct vrend_query_pool {
+   GLenum gltype;
+   uint32_t num_ids;
+   GLuint ids[VREND_QUERY_POOL_SIZE];
+};
+
+/* With ARB_query_buffer_object the results of the waiting queries of a sub
+ * context are written to a buffer on the GPU, and read back for the whole
+ * batch once the fence behind the writes has signaled. Every slot holds the
+ * availability and the result as two 64 bit values. */
+#define VREND_QUERY_BATCH_SIZE 64
+
+struct vrend_query_batch {
+   struct list_head head;
+   GLuint buffer;
+   /* NULL while queries can still be added */
+   GLsync fence;
+   uint32_t num_queries;
+   struct vrend_query *queries[VREND_QUERY_BATCH_SIZE];
+};
+
+/* With VIRGL_GPU_TIME, command batches and optionally draws are bracketed by
+ * GL_TIMESTAMP queries. A timer stays within the sub context it was started
+ * in, only its GL context can read the queries, and the results are
+ * collected when that sub context starts timing the next batch. */
+struct vrend_gpu_timer {
+   struct list_head head;
+   GLuint queries[2];
+   bool draw;
 };
 
 struct global_error_state {
@@ -162,6 +206,7 @@ enum features_id
    feat_framebuffer_fetch,
    feat_framebuffer_fetch_non_coherent,
    feat_geometry_shader,
+   feat_get_texture_sub_image,
    feat_gl_conditional_render,
    feat_gl_prim_restart,
    feat_gles_khr_robustness,
@@ -180,6 +225,7 @@ enum features_id
    feat_mesa_invert,
    feat_ms_scaled_blit,
    feat_multisample,
+   feat_multi_bind,
    feat_multi_draw_indirect,
    feat_nv_conditional_render,
    feat_nv_prim_restart,
@@ -188,7 +234,9 @@ enum features_id
    feat_polygon_offset_clamp,
    feat_occlusion_query,
    feat_occlusion_query_boolean,
+   feat_parallel_shader_compile,
    feat_pipeline_statistics_query,
+   feat_program_binary,
    feat_qbo,
    feat_robust_buffer_access,
    feat_sample_mask,
@@ -275,6 +323,7 @@ static const  struct {
    FEAT(framebuffer_fetch, UNAVAIL, UNAVAIL,  "GL_EXT_shader_framebuffer_fetch" ),
    FEAT(framebuffer_fetch_non_coherent, UNAVAIL, UNAVAIL,  "GL_EXT_shader_framebuffer_fetch_non_coherent" ),
    FEAT(geometry_shader, 32, 32, "GL_EXT_geometry_shader", "GL_OES_geometry_shader"),
+   FEAT(get_texture_sub_image, 45, UNAVAIL, "GL_ARB_get_texture_sub_image"),
    FEAT(gl_conditional_render, 30, UNAVAIL, NULL),
    FEAT(gl_prim_restart, 31, 30, NULL),
    FEAT(gles_khr_robustness, UNAVAIL, UNAVAIL,  "GL_KHR_robustness" ),
@@ -293,15 +342,18 @@ static const  struct {
    FEAT(mesa_invert, UNAVAIL, UNAVAIL,  "GL_MESA_pack_invert" ),
    FEAT(ms_scaled_blit, UNAVAIL, UNAVAIL,  "GL_EXT_framebuffer_multisample_blit_scaled" ),
    FEAT(multisample, 32, 30,  "GL_ARB_texture_multisample" ),
+   FEAT(multi_bind, 44, UNAVAIL,  "GL_ARB_multi_bind" ),
    FEAT(multi_draw_indirect, 43, UNAVAIL,  "GL_ARB_multi_draw_indirect", "GL_EXT_multi_draw_indirect" ),
    FEAT(nv_conditional_render, UNAVAIL, UNAVAIL,  "GL_NV_conditional_render" ),
    FEAT(nv_prim_restart, UNAVAIL, UNAVAIL,  "GL_NV_primitive_restart" ),
    FEAT(shader_noperspective_interpolation, 31, UNAVAIL, "GL_NV_shader_noperspective_interpolation", "GL_EXT_gpu_shader4"),
    FEAT(nvx_gpu_memory_info, UNAVAIL, UNAVAIL, "GL_NVX_gpu_memory_info" ),
    FEAT(pipeline_statistics_query, 46, UNAVAIL, "GL_ARB_pipeline_statistics_query"),
+   FEAT(program_binary, 41, 30, "GL_ARB_get_program_binary", "GL_OES_get_program_binary"),
    FEAT(polygon_offset_clamp, 46, UNAVAIL,  "GL_ARB_polygon_offset_clamp", "GL_EXT_polygon_offset_clamp"),
    FEAT(occlusion_query, 15, UNAVAIL, "GL_ARB_occlusion_query"),
    FEAT(occlusion_query_boolean, 33, 30, "GL_EXT_occlusion_query_boolean", "GL_ARB_occlusion_query2"),
+   FEAT(parallel_shader_compile, UNAVAIL, UNAVAIL, "GL_KHR_parallel_shader_compile", "GL_ARB_parallel_shader_compile"),
    FEAT(qbo, 44, UNAVAIL, "GL_ARB_query_buffer_object" ),
    FEAT(robust_buffer_access, 43, UNAVAIL,  "GL_ARB_robust_buffer_access_behavior", "GL_KHR_robust_buffer_access_behavior" ),
    FEAT(sample_mask, 32, 31,  "GL_ARB_texture_multisample" ),
@@ -346,8 +398,15 @@ static const  struct {
 
 struct global_renderer_state {
    struct vrend_context *ctx0;
-   struct vrend_context *current_ctx;
-   struct vrend_context *current_hw_ctx;
+   /* the thread that called vrend_renderer_init, it keeps ctx0 current */
+   thrd_t renderer_thread;
+
+   /* the waiting queries, the shared caches and the blitter context are
+    * used by all context workers */
+   mtx_t query_mutex;
+   mtx_t cache_mutex;
+   mtx_t blit_mutex;
+   uint32_t query_check_pass;
 
    struct list_head waiting_query_list;
    struct list_head fence_list;
@@ -372,6 +431,13 @@ struct global_renderer_state {
    float tess_factors[6];
    int eventfd;
 
+   /* parsed TGSI shared between all contexts, keyed by text hash */
+   struct hash_table_u64 *tgsi_cache;
+   /* linked program binaries shared between all contexts */
+   struct hash_table_u64 *program_binaries;
+   /* GL sampler objects shared between all contexts, keyed by GL state */
+   struct hash_table_u64 *sampler_cache;
+
    uint32_t max_draw_buffers;
    uint32_t max_texture_buffer_size;
    uint32_t max_texture_2d_size;
@@ -380,9 +446,18 @@ struct global_renderer_state {
    uint32_t max_shader_patch_varyings;
    uint32_t max_vertex_attributes;
 
+   /* limits of the constant ring, zero when legacy constants are uploaded
+    * with glUniform4uiv */
+   uint32_t max_const_ubo_vec4;
+   uint32_t max_const_ubo_blocks;
+   uint32_t const_ring_alignment;
+
    /* inferred GL caching type */
    uint32_t inferred_gl_caching_type;
 
+   /* times the formats were probed since init, not taken from the cache */
+   uint32_t format_probes;
+
    uint64_t features[feat_last / 64 + 1];
 
    bool finishing : 1;
@@ -396,6 +471,10 @@ struct global_renderer_state {
    bool stop_sync_thread : 1;
    /* async fence callback */
    bool use_async_fence_cb : 1;
+   /* guest contexts are executed by their own worker threads */
+   bool use_threaded_contexts : 1;
+   /* copy_region always takes the read back fallback, for testing */
+   bool use_copy_fallback : 1;
 
 #ifdef HAVE_EPOXY_EGL_H
    bool use_egl_fence : 1;
@@ -414,6 +493,11 @@ struct sysval_uniform_block {
 
 static struct global_renderer_state vrend_state;
 
+/* The vrend context whose GL context is current on the calling thread, with
+ * threaded contexts every worker tracks its own. */
+static __THREAD_INITIAL_EXEC struct vrend_context *vrend_current_ctx;
+static __THREAD_INITIAL_EXEC struct vrend_context *vrend_current_hw_ctx;
+
 static inline bool has_feature(enum features_id feature_id)
 {
    int slot = feature_id / 64;
@@ -461,6 +545,8 @@ struct vrend_linked_shader_program {
    GLuint *shadow_samp_add_locs[PIPE_SHADER_TYPES];
 
    GLint const_location[PIPE_SHADER_TYPES];
+   GLuint const_block_id[PIPE_SHADER_TYPES];
+   GLint const_block_bind[PIPE_SHADER_TYPES];
 
    GLuint *attrib_locs;
    uint32_t shadow_samp_mask[PIPE_SHADER_TYPES];
@@ -482,6 +568,12 @@ struct vrend_linked_shader_program {
    uint32_t gles_use_query_texturelevel_mask;
 
    bool reads_drawid;
+
+   /* glLinkProgram was issued by the LINK_SHADER hook but the link status
+    * and uniform locations are only queried on first use */
+   bool link_pending;
+
+   struct vrend_program_binary *binary;
 };
 
 struct vrend_shader {
@@ -501,6 +593,52 @@ struct vrend_shader {
    struct list_head programs;
 };
 
+/* Result of parsing and analysing one guest shader text. Entries are shared
+ * by all selectors created from identical text in any context and are
+ * dropped from vrend_state.tgsi_cache when the last selector goes away. */
+struct vrend_tgsi_cache_entry {
+   struct pipe_reference reference;
+   uint64_t hash;
+   bool in_cache;
+
+   char *text;
+   uint32_t text_length;
+   uint32_t num_tokens;
+   uint32_t req_local_mem;
+   enum pipe_shader_type type;
+   struct pipe_stream_output_info so_info;
+
+   struct tgsi_token *tokens;
+   struct vrend_shader_analysis analysis;
+   bool separable_program;
+};
+
+/* Identifies a linked program independently of the context: the parsed TGSI
+ * and variant key of every stage determine the GLSL, and dual source blending
+ * the fragment output bindings. The TGSI entries are kept alive by the
+ * shaders of the programs that reference the binary. */
+struct vrend_program_binary_key {
+   const struct vrend_tgsi_cache_entry *tgsi[PIPE_SHADER_TYPES];
+   struct vrend_shader_key keys[PIPE_SHADER_TYPES];
+   struct vrend_shader_cfg cfg;
+   bool dual_src;
+};
+
+/* A program binary retrieved after a successful link. Every context still
+ * creates its own program object, so uniform values and bindings are not
+ * shared, but identical programs are only linked once and later loaded with
+ * glProgramBinary. Entries are dropped from vrend_state.program_binaries when
+ * the last program using them is destroyed. */
+struct vrend_program_binary {
+   struct pipe_reference reference;
+   uint64_t hash;
+   bool in_cache;
+   struct vrend_program_binary_key key;
+   GLenum format;
+   GLsizei size;
+   uint8_t data[];
+};
+
 struct vrend_shader_selector {
    struct pipe_reference reference;
 
@@ -508,6 +646,7 @@ struct vrend_shader_selector {
    struct vrend_shader_info sinfo;
 
    struct vrend_shader *current;
+   struct vrend_tgsi_cache_entry *tgsi;
    struct tgsi_token *tokens;
 
    uint32_t req_local_mem;
@@ -528,6 +667,9 @@ struct vrend_texture {
    GLint cur_swizzle[4];
    GLuint cur_srgb_decode;
    GLuint cur_base, cur_max;
+   /* the border color in the texture parameters is swizzled for a view
+    * with an emulated alpha format */
+   bool cur_alpha_border;
 };
 
 struct vrend_surface {
@@ -539,12 +681,41 @@ struct vrend_surface {
    GLuint last_layer;
    GLuint nr_samples;
    struct vrend_resource *texture;
+   struct vrend_sub_context *owning_sub;
+};
+
+/* GL parameters of a sampler object as translated from a guest sampler
+ * state. All fields are 32 bits wide, so the key hashes without padding. */
+struct vrend_sampler_key {
+   GLenum wrap_s, wrap_t, wrap_r;
+   GLenum min_filter, mag_filter;
+   GLenum compare_mode, compare_func;
+   GLenum srgb_decode;
+   GLint seamless_cube_map;
+   GLfloat min_lod, max_lod, lod_bias;
+   GLuint border_color[4];
+};
+
+/* A GL sampler object shared by every guest sampler state, in any context,
+ * that translates to the same parameters. Entries are dropped from
+ * vrend_state.sampler_cache when the last sampler state using them goes
+ * away. */
+struct vrend_sampler_object {
+   struct pipe_reference reference;
+   uint64_t hash;
+   bool in_cache;
+   struct vrend_sampler_key key;
+   GLuint id;
 };
 
 struct vrend_sampler_state {
    struct pipe_sampler_state base;
    struct vrend_sub_context *sub_ctx;
-   GLuint ids[2];
+   /* indexed by sRGB decode: skipped, enabled */
+   struct vrend_sampler_object *objects[2];
+   /* same with the border color swizzled for emulated alpha formats,
+    * created on first use */
+   struct vrend_sampler_object *alpha_objects[2];
 };
 
 struct vrend_depth_stencil_alpha_state {
@@ -634,12 +805,119 @@ struct vrend_vertex_element_array {
    struct vrend_sub_context *owning_sub;
 };
 
+#define VREND_VERTEX_ARRAY_CACHE_SIZE 64
+
+/* The complete vertex input state of a draw: the vertex elements, the
+ * attribute locations of the program on the legacy path, and the buffers,
+ * offsets and strides the attributes read from. */
+struct vrend_vertex_array_key {
+   const struct vrend_vertex_element_array *ve;
+   uint32_t num_attribs;
+   GLint locs[PIPE_MAX_ATTRIBS];
+   uint32_t num_vbos;
+   struct {
+      GLuint buffer;
+      uint32_t stride;
+      uint32_t offset;
+   } vbos[PIPE_MAX_ATTRIBS];
+};
+
+/* A VAO with the whole vertex input state of a key baked in, so switching
+ * between meshes only takes a glBindVertexArray. Entries hold references to
+ * their buffers, the GL names can't be reused while they are cached. */
+struct vrend_vertex_array {
+   struct list_head head;
+   uint64_t hash;
+   struct vrend_vertex_array_key key;
+   struct vrend_resource *buffers[PIPE_MAX_ATTRIBS];
+   GLuint id;
+   /* a buffer was detached from the context and its reference dropped, the
+    * VAO is deleted the next time the sub context looks one up */
+   bool stale;
+};
+
+#define VREND_FRAMEBUFFER_CACHE_SIZE 16
+
+/* The attachments of a framebuffer state. The surfaces carry the resource,
+ * level and layer range, so their pointers identify the attachment set. */
+struct vrend_framebuffer_key {
+   struct vrend_surface *surf[PIPE_MAX_COLOR_BUFS];
+   struct vrend_surface *zsurf;
+   uint32_t nr_cbufs;
+};
+
+/* A complete FBO for one attachment set, switching the framebuffer state
+ * to a recently used set only takes a glBindFramebuffer. Entries hold
+ * references to their surfaces, the pointers can't be reused while they
+ * are cached. */
+struct vrend_framebuffer {
+   struct list_head head;
+   struct vrend_framebuffer_key key;
+   GLuint id;
+   /* a surface was destroyed while this was bound, drop it once unbound */
+   bool stale;
+};
+
 struct vrend_constants {
    unsigned int *consts;
    uint32_t num_consts;
    uint32_t num_allocated_consts;
 };
 
+/* Legacy constants and the sysval block are streamed through a persistently
+ * mapped uniform buffer. The buffer is split in segments, a segment is fenced
+ * after the draw that last reads it and the fence is waited for before the
+ * segment is reused. */
+#define VREND_CONST_RING_SIZE (1024 * 1024)
+#define VREND_CONST_RING_SEGMENTS 4
+/* a segment still busy after this long is overwritten anyway, so that a lost
+ * fence can't block the context forever */
+#define VREND_CONST_RING_WAIT_NS 1000000000ull
+
+struct vrend_const_ring {
+   GLuint id;
+   uint8_t *map;
+   uint32_t offset;
+   uint32_t segment;
+   /* bumped whenever a segment is reused, data written before may be gone */
+   uint32_t serial;
+   GLsync fences[VREND_CONST_RING_SEGMENTS];
+   /* segments left by the writer that still need a fence after the draw */
+   uint32_t unfenced;
+   /* the buffer could not be mapped, map points to a staging copy that is
+    * uploaded with glBufferSubData */
+   bool staged;
+   /* not even the staging copy could be set up, don't retry on every draw */
+   bool failed;
+};
+
+/* Indirect draws with the draw count in a buffer are rewritten by a compute
+ * shader when ARB_indirect_parameters is missing. */
+#define VREND_INDIRECT_FIXUP_MAX_DRAWS (1 << 20)
+
+struct vrend_indirect_fixup {
+   GLuint program;
+   GLint src_offset_loc;
+   GLint src_stride_loc;
+   GLint count_offset_loc;
+   GLint max_draws_loc;
+   GLint cmd_size_loc;
+   GLuint buffer;
+   uint32_t buffer_size;
+   uint32_t ssbo_alignment;
+   bool failed;
+};
+
+/* Where the commands of an indirect draw are read from. */
+struct vrend_indirect_source {
+   GLuint buffer;
+   uint32_t offset;
+   uint32_t stride;
+   uint32_t draw_count;
+   GLuint count_buffer;
+   uint32_t count_offset;
+};
+
 struct vrend_shader_view {
    int num_views;
    struct vrend_sampler_view *views[PIPE_MAX_SHADER_SAMPLER_VIEWS];
@@ -647,6 +925,16 @@ struct vrend_shader_view {
    uint32_t old_ids[PIPE_MAX_SHADER_SAMPLER_VIEWS];
 };
 
+#define VREND_MAX_TEXTURE_UNITS (PIPE_SHADER_TYPES * PIPE_MAX_SAMPLERS)
+
+/* What the draw path last bound to a texture unit. The view and sampler
+ * object are referenced so their GL names can't be reused while they are
+ * recorded here. */
+struct vrend_texture_unit {
+   struct vrend_sampler_view *view;
+   struct vrend_sampler_object *sampler;
+};
+
 struct vrend_viewport {
    GLint cur_x, cur_y;
    GLsizei width, height;
@@ -686,6 +974,12 @@ struct vrend_sub_context {
    GLuint vaoid;
    uint32_t enabled_attribs_bitmask;
 
+   /* cached VAOs, most recently used first, and the one of the last draw */
+   struct list_head vertex_arrays;
+   uint32_t num_vertex_arrays;
+   struct vrend_vertex_array *vertex_array;
+   bool vertex_arrays_stale;
+
    /* Using an array of lists only adds VREND_PROGRAM_NQUEUES - 1 list_head
     * structures to the consumed memory, but looking up the program can
     * be spead up by the factor VREND_PROGRAM_NQUEUES which makes this
@@ -718,8 +1012,17 @@ struct vrend_sub_context {
 
    struct vrend_constants consts[PIPE_SHADER_TYPES];
    bool const_dirty[PIPE_SHADER_TYPES];
+   struct vrend_const_ring const_ring;
+   struct vrend_indirect_fixup indirect_fixup;
+   uint32_t const_ring_serial[PIPE_SHADER_TYPES];
    struct vrend_sampler_state *sampler_state[PIPE_SHADER_TYPES][PIPE_MAX_SAMPLERS];
 
+   struct vrend_query_pool query_pools[VREND_QUERY_POOL_TYPES];
+   struct list_head query_batches;
+   struct list_head free_query_batches;
+   /* stopped timers waiting for their results */
+   struct list_head gpu_timers;
+
    struct pipe_constant_buffer cbs[PIPE_SHADER_TYPES][PIPE_MAX_CONSTANT_BUFFERS];
    uint32_t const_bufs_used_mask[PIPE_SHADER_TYPES];
    uint32_t const_bufs_dirty[PIPE_SHADER_TYPES];
@@ -730,6 +1033,20 @@ struct vrend_sub_context {
    int32_t texture_levels[PIPE_SHADER_TYPES][PIPE_MAX_SAMPLERS];
    int32_t n_samplers[PIPE_SHADER_TYPES];
 
+   struct vrend_texture_unit texture_units[VREND_MAX_TEXTURE_UNITS];
+   /* the GL names of texture_units, laid out for glBindTextures/Samplers */
+   GLuint texture_unit_ids[VREND_MAX_TEXTURE_UNITS];
+   GLuint texture_unit_samplers[VREND_MAX_TEXTURE_UNITS];
+   /* the range of units waiting for glBindTextures/Samplers */
+   uint32_t texture_units_first_dirty;
+   uint32_t texture_units_end_dirty;
+   /* glActiveTexture, other code binds its textures on that unit */
+   uint32_t active_texture_unit;
+
+   struct list_head framebuffers;
+   uint32_t num_framebuffers;
+   struct vrend_framebuffer *framebuffer;
+   /* the GL name of the current framebuffer */
    uint32_t fb_id;
    int nr_cbufs;
    struct vrend_surface *zsurf;
@@ -774,6 +1091,8 @@ struct vrend_sub_context {
 
    struct pipe_rasterizer_state hw_rs_state;
    struct pipe_blend_state hw_blend_state;
+   /* GL_TEXTURE_CUBE_MAP_SEAMLESS, for drivers without sampler objects */
+   bool hw_seamless_cube_map;
 
    struct list_head streamout_list;
    struct vrend_streamout_object *current_so;
@@ -798,10 +1117,15 @@ struct vrend_sub_context {
    int fake_occlusion_query_samples_passed_multiplier;
 
    int prim_mode;
+   /* patch size of the last draw, used to predict the TCS variant when
+    * programs are precompiled on LINK_SHADER */
+   uint8_t last_vertices_per_patch;
    bool drawing;
    struct vrend_context *parent;
    struct sysval_uniform_block sysvalue_data;
    uint32_t sysvalue_data_cookie;
+   uint32_t sysval_ring_cookie;
+   uint32_t sysval_ring_serial;
    uint32_t current_program_id;
    uint32_t current_pipeline_id;
 };
@@ -856,9 +1180,23 @@ struct vrend_context {
    struct virgl_resource *untyped_resource_cache;
 
    struct vrend_shader_cfg shader_cfg;
+   struct virgl_renderer_shader_stats shader_stats;
+   struct virgl_renderer_copy_stats copy_stats;
+   /* lookups of vrend_state.sampler_cache */
+   uint64_t sampler_cache_hits;
+   uint64_t sampler_cache_misses;
+
+   /* VREND_GPU_TIME_*, the running batch and draw timers belong to sub */
+   uint32_t gpu_time_flags;
+   struct vrend_gpu_timer *gpu_timers[2];
+   struct vrend_gpu_time gpu_time;
 
    unsigned debug_flags;
 
+   /* held by the thread that has one of our GL contexts current */
+   mtx_t gl_mutex;
+   uint32_t query_check_pass;
+
    vrend_context_fence_retire fence_retire;
    void *fence_retire_data;
 
@@ -1311,6 +1649,72 @@ static void vrend_shader_destroy(struct vrend_shader *shader)
    free(shader);
 }
 
+static void vrend_tgsi_cache_entry_destroy(struct vrend_tgsi_cache_entry *entry)
+{
+   free(entry->tokens);
+   free(entry->text);
+   free(entry);
+}
+
+static inline void
+vrend_tgsi_cache_entry_reference(struct vrend_tgsi_cache_entry **ptr,
+                                 struct vrend_tgsi_cache_entry *entry)
+{
+   struct vrend_tgsi_cache_entry *old_entry = *ptr;
+   bool destroy;
+
+   /* the last reference and the removal from the cache must be atomic, or
+    * another context could pick up the dying entry */
+   mtx_lock(&vrend_state.cache_mutex);
+   destroy = pipe_reference((struct pipe_reference *)*ptr, (struct pipe_reference *)entry);
+   if (destroy && old_entry->in_cache && vrend_state.tgsi_cache)
+      _mesa_hash_table_u64_remove(vrend_state.tgsi_cache, old_entry->hash);
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   if (destroy)
+      vrend_tgsi_cache_entry_destroy(old_entry);
+   *ptr = entry;
+}
+
+static inline void
+vrend_program_binary_reference(struct vrend_program_binary **ptr,
+                               struct vrend_program_binary *binary)
+{
+   struct vrend_program_binary *old_binary = *ptr;
+   bool destroy;
+
+   mtx_lock(&vrend_state.cache_mutex);
+   destroy = pipe_reference((struct pipe_reference *)*ptr, (struct pipe_reference *)binary);
+   if (destroy && old_binary->in_cache && vrend_state.program_binaries)
+      _mesa_hash_table_u64_remove(vrend_state.program_binaries, old_binary->hash);
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   if (destroy)
+      free(old_binary);
+   *ptr = binary;
+}
+
+static inline void
+vrend_sampler_object_reference(struct vrend_sampler_object **ptr,
+                               struct vrend_sampler_object *obj)
+{
+   struct vrend_sampler_object *old_obj = *ptr;
+   bool destroy;
+
+   mtx_lock(&vrend_state.cache_mutex);
+   destroy = pipe_reference((struct pipe_reference *)*ptr, (struct pipe_reference *)obj);
+   if (destroy && old_obj->in_cache && vrend_state.sampler_cache)
+      _mesa_hash_table_u64_remove(vrend_state.sampler_cache, old_obj->hash);
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   /* the sampler objects live in the share group of all contexts */
+   if (destroy) {
+      glDeleteSamplers(1, &old_obj->id);
+      free(old_obj);
+   }
+   *ptr = obj;
+}
+
 static void vrend_destroy_shader_selector(struct vrend_shader_selector *sel)
 {
    struct vrend_shader *p = sel->current, *c;
@@ -1326,7 +1730,8 @@ static void vrend_destroy_shader_selector(struct vrend_shader_selector *sel)
    free(sel->sinfo.so_names);
    free(sel->sinfo.sampler_arrays);
    free(sel->sinfo.image_arrays);
-   free(sel->tokens);
+   if (sel->tgsi)
+      vrend_tgsi_cache_entry_reference(&sel->tgsi, NULL);
    free(sel);
 }
 
@@ -1361,11 +1766,21 @@ static inline int conv_shader_type(int type)
    };
 }
 
-static bool vrend_compile_shader(struct vrend_sub_context *sub_ctx,
-                                 struct vrend_shader *shader)
+/* Hand the GLSL to the driver without waiting for the result. With
+ * KHR_parallel_shader_compile the driver compiles on its own threads, and the
+ * status is only queried by vrend_compile_shader once the shader is used. */
+static void vrend_compile_shader_async(struct vrend_sub_context *sub_ctx,
+                                       struct vrend_shader *shader)
 {
-   GLint param;
+   struct virgl_renderer_shader_stats *stats = &sub_ctx->parent->shader_stats;
    const char *shader_parts[SHADER_MAX_STRINGS];
+   uint64_t start;
+
+   if (shader->id)
+      return;
+
+   TRACE_FUNC();
+   start = virgl_time_get_us();
 
    for (int i = 0; i < shader->glsl_strings.num_strings; i++)
       shader_parts[i] = shader->glsl_strings.strings[i].buf;
@@ -1373,7 +1788,23 @@ static bool vrend_compile_shader(struct vrend_sub_context *sub_ctx,
    shader->id = glCreateShader(conv_shader_type(shader->sel->type));
    glShaderSource(shader->id, shader->glsl_strings.num_strings, shader_parts, NULL);
    glCompileShader(shader->id);
+
+   stats->compiles++;
+   stats->compile_time_us += virgl_time_get_us() - start;
+}
+
+static bool vrend_compile_shader(struct vrend_sub_context *sub_ctx,
+                                 struct vrend_shader *shader)
+{
+   GLint param;
+   uint64_t start;
+
+   vrend_compile_shader_async(sub_ctx, shader);
+
+   TRACE_FUNC();
+   start = virgl_time_get_us();
    glGetShaderiv(shader->id, GL_COMPILE_STATUS, &param);
+   sub_ctx->parent->shader_stats.compile_time_us += virgl_time_get_us() - start;
    if (param == GL_FALSE) {
       char infolog[65536];
       int len;
@@ -1674,18 +2105,6 @@ static int bind_sampler_locs(struct vrend_linked_shader_program *sprog,
    return next_sampler_id;
 }
 
-static void bind_const_locs(struct vrend_linked_shader_program *sprog,
-                            enum pipe_shader_type shader_type)
-{
-  if (sprog->ss[shader_type]->sel->sinfo.num_consts) {
-     char name[32];
-     snprintf(name, 32, "%sconst0", pipe_shader_to_prefix(shader_type));
-     sprog->const_location[shader_type] = vrend_get_uniform_location(sprog, name,
-                                                                     shader_type);
-  } else
-     sprog->const_location[shader_type] = -1;
-}
-
 static inline GLuint
 vrend_get_uniform_block_index(struct vrend_linked_shader_program *sprog,
                               char *name, int shader_type)
@@ -1712,6 +2131,31 @@ vrend_uniform_block_binding(struct vrend_linked_shader_program *sprog,
     glUniformBlockBinding(id, loc, value);
 }
 
+static void bind_const_locs(struct vrend_linked_shader_program *sprog,
+                            enum pipe_shader_type shader_type)
+{
+  sprog->const_block_id[shader_type] = GL_INVALID_INDEX;
+  sprog->const_block_bind[shader_type] = -1;
+  sprog->const_location[shader_type] = -1;
+
+  if (sprog->ss[shader_type]->sel->sinfo.num_consts) {
+     char name[32];
+
+     /* the shader declares the constants as a block when they fit into one */
+     if (vrend_state.max_const_ubo_vec4) {
+        snprintf(name, 32, "%sconstblock", pipe_shader_to_prefix(shader_type));
+        sprog->const_block_id[shader_type] =
+           vrend_get_uniform_block_index(sprog, name, shader_type);
+        if (sprog->const_block_id[shader_type] != GL_INVALID_INDEX)
+           return;
+     }
+
+     snprintf(name, 32, "%sconst0", pipe_shader_to_prefix(shader_type));
+     sprog->const_location[shader_type] = vrend_get_uniform_location(sprog, name,
+                                                                     shader_type);
+  }
+}
+
 static int bind_ubo_locs(struct vrend_linked_shader_program *sprog,
                          enum pipe_shader_type shader_type, int next_ubo_id)
 {
@@ -1750,7 +2194,8 @@ static void bind_virgl_block_loc(struct vrend_linked_shader_program *sprog,
 
       if (sprog->virgl_block_bind == -1) {
          sprog->virgl_block_bind = virgl_block_ubo_id;
-         if (sprog->ubo_sysval_buffer_id == -1) {
+         /* with the constant ring the sysvals are streamed as well */
+         if (sprog->ubo_sysval_buffer_id == -1 && !vrend_state.max_const_ubo_vec4) {
              glGenBuffers(1, (GLuint *) &sprog->ubo_sysval_buffer_id);
              created_virgl_block_buffer = true;
          }
@@ -1776,6 +2221,22 @@ static void bind_virgl_block_loc(struct vrend_linked_shader_program *sprog,
    }
 }
 
+static int bind_const_block_loc(struct vrend_linked_shader_program *sprog,
+                                enum pipe_shader_type shader_type,
+                                int next_ubo_id)
+{
+   if (sprog->const_block_id[shader_type] == GL_INVALID_INDEX) {
+      sprog->const_block_bind[shader_type] = -1;
+      return next_ubo_id;
+   }
+
+   vrend_uniform_block_binding(sprog, shader_type,
+                               sprog->const_block_id[shader_type],
+                               next_ubo_id);
+   sprog->const_block_bind[shader_type] = next_ubo_id;
+   return next_ubo_id + 1;
+}
+
 static void rebind_ubo_and_sampler_locs(struct vrend_linked_shader_program *sprog,
                                         enum pipe_shader_type last_shader)
 {
@@ -1805,6 +2266,17 @@ static void rebind_ubo_and_sampler_locs(struct vrend_linked_shader_program *spro
 
       bind_virgl_block_loc(sprog, shader_type, next_ubo_id);
    }
+
+   /* The constant blocks follow the VirglBlock. */
+   int next_const_ubo_id = next_ubo_id + 1;
+   for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
+        shader_type <= last_shader;
+        shader_type++) {
+      if (!sprog->ss[shader_type])
+         continue;
+
+      next_const_ubo_id = bind_const_block_loc(sprog, shader_type, next_const_ubo_id);
+   }
 }
 
 static void bind_ssbo_locs(struct vrend_linked_shader_program *sprog,
@@ -1865,11 +2337,25 @@ static void bind_image_locs(struct vrend_linked_shader_program *sprog,
    sprog->images_used_mask[shader_type] = mask;
 }
 
-static bool vrend_link(GLuint id)
+static void vrend_link_async(struct vrend_context *ctx, GLuint id)
 {
-   GLint lret;
+   TRACE_FUNC();
+   uint64_t start = virgl_time_get_us();
+
    glLinkProgram(id);
+
+   ctx->shader_stats.links++;
+   ctx->shader_stats.link_time_us += virgl_time_get_us() - start;
+}
+
+static bool vrend_link_status(struct vrend_context *ctx, GLuint id)
+{
+   TRACE_FUNC();
+   uint64_t start = virgl_time_get_us();
+   GLint lret;
+
    glGetProgramiv(id, GL_LINK_STATUS, &lret);
+   ctx->shader_stats.link_time_us += virgl_time_get_us() - start;
    if (lret == GL_FALSE) {
       char infolog[65536];
       int len;
@@ -1880,6 +2366,134 @@ static bool vrend_link(GLuint id)
    return true;
 }
 
+static bool vrend_link(struct vrend_context *ctx, GLuint id)
+{
+   vrend_link_async(ctx, id);
+   return vrend_link_status(ctx, id);
+}
+
+/* Fill in the binary key of a program, returns false if one of the stages
+ * wasn't created from guest TGSI, like the passthrough TCS. */
+static bool vrend_program_binary_key_init(struct vrend_program_binary_key *key,
+                                          const struct vrend_context *ctx,
+                                          struct vrend_shader **stages,
+                                          bool dual_src)
+{
+   memset(key, 0, sizeof(*key));
+   for (int i = 0; i < PIPE_SHADER_TYPES; i++) {
+      if (!stages[i])
+         continue;
+      if (!stages[i]->sel->tgsi)
+         return false;
+      key->tgsi[i] = stages[i]->sel->tgsi;
+      memcpy(&key->keys[i], &stages[i]->key, sizeof(key->keys[i]));
+   }
+   memcpy(&key->cfg, &ctx->shader_cfg, sizeof(key->cfg));
+   key->dual_src = dual_src;
+   return true;
+}
+
+/* Load a binary that another program with the same key left behind, the
+ * program must not have been linked yet. */
+static bool vrend_program_binary_load(struct vrend_context *ctx,
+                                      struct vrend_linked_shader_program *sprog,
+                                      GLuint prog_id,
+                                      struct vrend_shader **stages)
+{
+   struct vrend_program_binary_key key;
+   struct vrend_program_binary *binary;
+   GLint lret;
+
+   if (!has_feature(feat_program_binary))
+      return false;
+
+   if (!vrend_program_binary_key_init(&key, ctx, stages, sprog->dual_src_linked))
+      return false;
+
+   mtx_lock(&vrend_state.cache_mutex);
+   binary = _mesa_hash_table_u64_search(vrend_state.program_binaries,
+                                        XXH64(&key, sizeof(key), 0));
+   if (binary && !memcmp(&binary->key, &key, sizeof(key)))
+      pipe_reference(NULL, &binary->reference);
+   else
+      binary = NULL;
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   if (!binary) {
+      glProgramParameteri(prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+      return false;
+   }
+
+   TRACE_FUNC();
+   glProgramBinary(prog_id, binary->format, binary->data, binary->size);
+   glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
+   if (lret == GL_FALSE) {
+      /* the driver may reject binaries, e.g. when its state changed, fall
+       * back to linking the program */
+      vrend_program_binary_reference(&binary, NULL);
+      glProgramParameteri(prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+      return false;
+   }
+
+   sprog->binary = binary;
+   ctx->shader_stats.program_cache_hits++;
+   return true;
+}
+
+/* Keep the binary of a freshly linked program so that other sub-contexts and
+ * contexts can skip linking the same program. */
+static void vrend_program_binary_store(struct vrend_context *ctx,
+                                       struct vrend_linked_shader_program *sprog)
+{
+   struct vrend_program_binary_key key;
+   struct vrend_program_binary *binary;
+   uint64_t hash;
+   GLint size = 0;
+
+   if (!has_feature(feat_program_binary) || sprog->is_pipeline || sprog->binary)
+      return;
+
+   if (!vrend_program_binary_key_init(&key, ctx, sprog->ss, sprog->dual_src_linked))
+      return;
+
+   /* an identical program was stored in the meantime or collides */
+   hash = XXH64(&key, sizeof(key), 0);
+   mtx_lock(&vrend_state.cache_mutex);
+   binary = _mesa_hash_table_u64_search(vrend_state.program_binaries, hash);
+   mtx_unlock(&vrend_state.cache_mutex);
+   if (binary)
+      return;
+
+   TRACE_FUNC();
+   glGetProgramiv(sprog->id.program, GL_PROGRAM_BINARY_LENGTH, &size);
+   if (size <= 0)
+      return;
+
+   binary = malloc(sizeof(*binary) + size);
+   if (!binary)
+      return;
+
+   glGetProgramBinary(sprog->id.program, size, &binary->size, &binary->format,
+                      binary->data);
+   if (binary->size <= 0) {
+      free(binary);
+      return;
+   }
+
+   pipe_reference_init(&binary->reference, 1);
+   binary->hash = hash;
+   binary->key = key;
+
+   /* another context may have stored it while we read the binary back */
+   mtx_lock(&vrend_state.cache_mutex);
+   binary->in_cache = !_mesa_hash_table_u64_search(vrend_state.program_binaries, hash);
+   if (binary->in_cache)
+      _mesa_hash_table_u64_insert(vrend_state.program_binaries, hash, binary);
+   mtx_unlock(&vrend_state.cache_mutex);
+   sprog->binary = binary;
+   ctx->shader_stats.program_binaries_stored++;
+}
+
 static bool vrend_link_separable_shader(struct vrend_sub_context *sub_ctx,
                                         struct vrend_shader *shader, int type)
 {
@@ -1929,7 +2543,7 @@ static bool vrend_link_separable_shader(struct vrend_sub_context *sub_ctx,
       }
    }
 
-   shader->is_linked = vrend_link(shader->program_id);
+   shader->is_linked = vrend_link(sub_ctx->parent, shader->program_id);
 
    if (!shader->is_linked) {
       /* dump shaders */
@@ -1940,65 +2554,154 @@ static bool vrend_link_separable_shader(struct vrend_sub_context *sub_ctx,
    return shader->is_linked;
 }
 
+static void vrend_destroy_program(struct vrend_linked_shader_program *ent);
+
+static bool finish_cs_shader_program(struct vrend_context *ctx,
+                                     struct vrend_linked_shader_program *sprog)
+{
+   if (sprog->link_pending) {
+      sprog->link_pending = false;
+      if (!vrend_link_status(ctx, sprog->id.program)) {
+         /* dump shaders */
+         vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
+         vrend_shader_dump(sprog->ss[PIPE_SHADER_COMPUTE]);
+         vrend_destroy_program(sprog);
+         return false;
+      }
+      vrend_program_binary_store(ctx, sprog);
+   }
+
+   vrend_use_program(ctx->sub, sprog);
+
+   bind_sampler_locs(sprog, PIPE_SHADER_COMPUTE, 0);
+   bind_ssbo_locs(sprog, PIPE_SHADER_COMPUTE);
+   bind_const_locs(sprog, PIPE_SHADER_COMPUTE);
+   bind_const_block_loc(sprog, PIPE_SHADER_COMPUTE,
+                        bind_ubo_locs(sprog, PIPE_SHADER_COMPUTE, 0));
+   bind_image_locs(sprog, PIPE_SHADER_COMPUTE);
+   return true;
+}
+
 static struct vrend_linked_shader_program *add_cs_shader_program(struct vrend_context *ctx,
-                                                                 struct vrend_shader *cs)
+                                                                 struct vrend_shader *cs,
+                                                                 bool defer_link)
 {
    struct vrend_linked_shader_program *sprog = CALLOC_STRUCT(vrend_linked_shader_program);
    GLuint prog_id;
+   if (!sprog)
+      return NULL;
+
+   sprog->ss[PIPE_SHADER_COMPUTE] = cs;
+
    prog_id = glCreateProgram();
    glAttachShader(prog_id, cs->id);
-
-   if (!vrend_link(prog_id)) {
-      /* dump shaders */
-      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
-      vrend_shader_dump(cs);
-      glDeleteProgram(prog_id);
-      free(sprog);
-      return NULL;
+   if (!vrend_program_binary_load(ctx, sprog, prog_id, sprog->ss)) {
+      vrend_link_async(ctx, prog_id);
+      sprog->link_pending = true;
    }
-   sprog->ss[PIPE_SHADER_COMPUTE] = cs;
 
    list_add(&sprog->sl[PIPE_SHADER_COMPUTE], &cs->programs);
    sprog->id.program = prog_id;
    list_addtail(&sprog->head, &ctx->sub->cs_programs);
 
-   vrend_use_program(ctx->sub, sprog);
-
-   bind_sampler_locs(sprog, PIPE_SHADER_COMPUTE, 0);
-   bind_ubo_locs(sprog, PIPE_SHADER_COMPUTE, 0);
-   bind_ssbo_locs(sprog, PIPE_SHADER_COMPUTE);
-   bind_const_locs(sprog, PIPE_SHADER_COMPUTE);
-   bind_image_locs(sprog, PIPE_SHADER_COMPUTE);
+   if (!defer_link && !finish_cs_shader_program(ctx, sprog))
+      return NULL;
    return sprog;
 }
 
 static inline bool
-vrend_link_stage(struct vrend_shader *stage) {
+vrend_link_stage(struct vrend_context *ctx, struct vrend_shader *stage) {
    if (!stage->is_linked)
-      stage->is_linked = vrend_link(stage->program_id);
+      stage->is_linked = vrend_link(ctx, stage->program_id);
    return stage->is_linked;
 }
 
-static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_context *sub_ctx,
-                                                              struct vrend_shader *vs,
-                                                              struct vrend_shader *fs,
-                                                              struct vrend_shader *gs,
-                                                              struct vrend_shader *tcs,
-                                                              struct vrend_shader *tes,
-                                                              bool separable)
+static bool finish_shader_program(struct vrend_sub_context *sub_ctx,
+                                  struct vrend_linked_shader_program *sprog)
 {
-   struct vrend_linked_shader_program *sprog = CALLOC_STRUCT(vrend_linked_shader_program);
+   struct vrend_shader *vs = sprog->ss[PIPE_SHADER_VERTEX];
+   enum pipe_shader_type last_shader;
+   GLuint vs_id;
    char name[64];
    int i;
-   GLuint prog_id = 0;
-   GLuint pipeline_id = 0;
-   GLuint vs_id, fs_id, gs_id, tes_id = 0;
-   enum pipe_shader_type last_shader;
-   if (!sprog)
-      return NULL;
 
-   if (separable) {
-       glGenProgramPipelines(1, &pipeline_id);
+   if (sprog->link_pending) {
+      sprog->link_pending = false;
+      if (!vrend_link_status(sub_ctx->parent, sprog->id.program)) {
+         /* dump shaders */
+         vrend_report_context_error(sub_ctx->parent, VIRGL_ERROR_CTX_ILLEGAL_SHADER, 0);
+         vrend_shader_dump(vs);
+         if (sprog->ss[PIPE_SHADER_TESS_CTRL])
+            vrend_shader_dump(sprog->ss[PIPE_SHADER_TESS_CTRL]);
+         if (sprog->ss[PIPE_SHADER_TESS_EVAL])
+            vrend_shader_dump(sprog->ss[PIPE_SHADER_TESS_EVAL]);
+         if (sprog->ss[PIPE_SHADER_GEOMETRY])
+            vrend_shader_dump(sprog->ss[PIPE_SHADER_GEOMETRY]);
+         vrend_shader_dump(sprog->ss[PIPE_SHADER_FRAGMENT]);
+         vrend_destroy_program(sprog);
+         return false;
+      }
+      vrend_program_binary_store(sub_ctx->parent, sprog);
+   }
+
+   vs_id = sprog->is_pipeline ? vs->program_id : sprog->id.program;
+   last_shader = sprog->ss[PIPE_SHADER_TESS_EVAL] ? PIPE_SHADER_TESS_EVAL :
+                 (sprog->ss[PIPE_SHADER_GEOMETRY] ? PIPE_SHADER_GEOMETRY : PIPE_SHADER_FRAGMENT);
+
+   vrend_use_program(sub_ctx, sprog);
+
+   for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
+        shader_type <= last_shader;
+        shader_type++) {
+      if (!sprog->ss[shader_type])
+         continue;
+
+      bind_const_locs(sprog, shader_type);
+      bind_image_locs(sprog, shader_type);
+      bind_ssbo_locs(sprog, shader_type);
+
+      if (sprog->ss[shader_type]->sel->sinfo.reads_drawid)
+         sprog->reads_drawid = true;
+   }
+   rebind_ubo_and_sampler_locs(sprog, last_shader);
+
+   if (!has_feature(feat_gles31_vertex_attrib_binding)) {
+      if (vs->sel->sinfo.num_inputs) {
+         sprog->attrib_locs = calloc(vs->sel->sinfo.num_inputs, sizeof(uint32_t));
+         if (sprog->attrib_locs) {
+            for (i = 0; i < vs->sel->sinfo.num_inputs; i++) {
+               snprintf(name, 32, "in_%d", i);
+               sprog->attrib_locs[i] = glGetAttribLocation(vs_id, name);
+            }
+         }
+      } else
+         sprog->attrib_locs = NULL;
+   }
+
+   return true;
+}
+
+static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_context *sub_ctx,
+                                                              struct vrend_shader *vs,
+                                                              struct vrend_shader *fs,
+                                                              struct vrend_shader *gs,
+                                                              struct vrend_shader *tcs,
+                                                              struct vrend_shader *tes,
+                                                              bool separable,
+                                                              bool defer_link)
+{
+   struct vrend_linked_shader_program *sprog = CALLOC_STRUCT(vrend_linked_shader_program);
+   char name[64];
+   int i;
+   GLuint prog_id = 0;
+   GLuint pipeline_id = 0;
+   GLuint vs_id, fs_id, gs_id, tes_id = 0;
+   bool binary_loaded = false;
+   if (!sprog)
+      return NULL;
+
+   if (separable) {
+       glGenProgramPipelines(1, &pipeline_id);
 
        vs_id = vs->program_id;
        fs_id = fs->program_id;
@@ -2073,13 +2776,25 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
 
    bool link_success;
    if (separable) { /* separable programs */
-      link_success = vrend_link_stage(vs);
-      link_success &= vrend_link_stage(fs);
-      if (gs) link_success &= vrend_link_stage(gs);
-      if (tcs) link_success &= vrend_link_stage(tcs);
-      if (tes) link_success &= vrend_link_stage(tes);
-   } else { /* non-separable programs */
-      link_success = vrend_link(prog_id);
+      link_success = vrend_link_stage(sub_ctx->parent, vs);
+      link_success &= vrend_link_stage(sub_ctx->parent, fs);
+      if (gs) link_success &= vrend_link_stage(sub_ctx->parent, gs);
+      if (tcs) link_success &= vrend_link_stage(sub_ctx->parent, tcs);
+      if (tes) link_success &= vrend_link_stage(sub_ctx->parent, tes);
+   } else { /* non-separable programs, the status is checked in finish_shader_program */
+      struct vrend_shader *stages[PIPE_SHADER_TYPES] = {
+         [PIPE_SHADER_VERTEX] = vs,
+         [PIPE_SHADER_FRAGMENT] = fs,
+         [PIPE_SHADER_GEOMETRY] = gs,
+         [PIPE_SHADER_TESS_CTRL] = tcs,
+         [PIPE_SHADER_TESS_EVAL] = tes,
+      };
+      if (vrend_program_binary_load(sub_ctx->parent, sprog, prog_id, stages)) {
+         binary_loaded = true;
+      } else {
+         vrend_link_async(sub_ctx->parent, prog_id);
+      }
+      link_success = true;
    }
 
    if (!link_success) {
@@ -2137,8 +2852,6 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
    if (tes)
       list_add(&sprog->sl[PIPE_SHADER_TESS_EVAL], &tes->programs);
 
-   last_shader = tes ? PIPE_SHADER_TESS_EVAL : (gs ? PIPE_SHADER_GEOMETRY : PIPE_SHADER_FRAGMENT);
-
    sprog->is_pipeline = separable;
    if (sprog->is_pipeline)
        sprog->id.pipeline = pipeline_id;
@@ -2150,37 +2863,10 @@ static struct vrend_linked_shader_program *add_shader_program(struct vrend_sub_c
    sprog->virgl_block_bind = -1;
    sprog->ubo_sysval_buffer_id = -1;
    sprog->sysvalue_data_cookie = UINT32_MAX;
+   sprog->link_pending = !separable && !binary_loaded;
 
-   vrend_use_program(sub_ctx, sprog);
-
-   for (enum pipe_shader_type shader_type = PIPE_SHADER_VERTEX;
-        shader_type <= last_shader;
-        shader_type++) {
-      if (!sprog->ss[shader_type])
-         continue;
-
-      bind_const_locs(sprog, shader_type);
-      bind_image_locs(sprog, shader_type);
-      bind_ssbo_locs(sprog, shader_type);
-
-      if (sprog->ss[shader_type]->sel->sinfo.reads_drawid)
-         sprog->reads_drawid = true;
-   }
-   rebind_ubo_and_sampler_locs(sprog, last_shader);
-
-   if (!has_feature(feat_gles31_vertex_attrib_binding)) {
-      if (vs->sel->sinfo.num_inputs) {
-         sprog->attrib_locs = calloc(vs->sel->sinfo.num_inputs, sizeof(uint32_t));
-         if (sprog->attrib_locs) {
-            for (i = 0; i < vs->sel->sinfo.num_inputs; i++) {
-               snprintf(name, 32, "in_%d", i);
-               sprog->attrib_locs[i] = glGetAttribLocation(vs_id, name);
-            }
-         }
-      } else
-         sprog->attrib_locs = NULL;
-   }
-
+   if (!defer_link && !finish_shader_program(sub_ctx, sprog))
+      return NULL;
    return sprog;
 }
 
@@ -2248,6 +2934,7 @@ static void vrend_destroy_program(struct vrend_linked_shader_program *ent)
        glDeleteProgram(ent->id.program);
 
    list_del(&ent->head);
+   vrend_program_binary_reference(&ent->binary, NULL);
 
    for (i = PIPE_SHADER_VERTEX; i <= PIPE_SHADER_COMPUTE; i++) {
       if (ent->ss[i])
@@ -2370,6 +3057,7 @@ int vrend_create_surface(struct vrend_context *ctx,
    pipe_reference_init(&surf->reference, 1);
 
    vrend_resource_reference(&surf->texture, res);
+   surf->owning_sub = ctx->sub;
 
    ret_handle = vrend_renderer_object_insert(ctx, surf, handle, VIRGL_OBJECT_SURFACE);
    if (ret_handle == 0) {
@@ -2402,9 +3090,55 @@ int vrend_create_dsa(struct vrend_context *ctx,
    return 0;
 }
 
+static void vrend_framebuffer_destroy(struct vrend_sub_context *sub,
+                                      struct vrend_framebuffer *fb)
+{
+   if (sub->framebuffer == fb) {
+      sub->framebuffer = NULL;
+      sub->fb_id = 0;
+   }
+
+   glDeleteFramebuffers(1, &fb->id);
+   for (int i = 0; i < PIPE_MAX_COLOR_BUFS; i++)
+      vrend_surface_reference(&fb->key.surf[i], NULL);
+   vrend_surface_reference(&fb->key.zsurf, NULL);
+
+   list_del(&fb->head);
+   sub->num_framebuffers--;
+   FREE(fb);
+}
+
+static void vrend_framebuffers_fini(struct vrend_sub_context *sub)
+{
+   list_for_each_entry_safe(struct vrend_framebuffer, fb, &sub->framebuffers, head)
+      vrend_framebuffer_destroy(sub, fb);
+}
+
+static bool vrend_framebuffer_uses_surface(const struct vrend_framebuffer *fb,
+                                           const struct vrend_surface *surf)
+{
+   if (fb->key.zsurf == surf)
+      return true;
+   for (uint32_t i = 0; i < fb->key.nr_cbufs; i++) {
+      if (fb->key.surf[i] == surf)
+         return true;
+   }
+   return false;
+}
+
 static void vrend_destroy_surface_object(void *obj_ptr)
 {
    struct vrend_surface *surface = obj_ptr;
+   struct vrend_sub_context *sub = surface->owning_sub;
+
+   list_for_each_entry_safe(struct vrend_framebuffer, fb, &sub->framebuffers, head) {
+      if (!vrend_framebuffer_uses_surface(fb, surface))
+         continue;
+      if (fb == sub->framebuffer)
+         fb->stale = true;
+      else
+         vrend_framebuffer_destroy(sub, fb);
+   }
 
    vrend_surface_reference(&surface, NULL);
 }
@@ -2443,6 +3177,50 @@ static void vrend_destroy_so_target_object(void *obj_ptr)
    vrend_so_target_reference(&target, NULL);
 }
 
+static void vrend_vertex_array_destroy(struct vrend_sub_context *sub,
+                                       struct vrend_vertex_array *va)
+{
+   if (sub->vertex_array == va)
+      sub->vertex_array = NULL;
+
+   glDeleteVertexArrays(1, &va->id);
+   for (int i = 0; i < PIPE_MAX_ATTRIBS; i++)
+      vrend_resource_reference(&va->buffers[i], NULL);
+
+   list_del(&va->head);
+   sub->num_vertex_arrays--;
+   FREE(va);
+}
+
+static void vrend_vertex_arrays_fini(struct vrend_sub_context *sub)
+{
+   list_for_each_entry_safe(struct vrend_vertex_array, va, &sub->vertex_arrays, head)
+      vrend_vertex_array_destroy(sub, va);
+}
+
+/* The GL context of the sub context may not be current when a resource is
+ * detached, so the VAOs that use it only let go of the buffer here and are
+ * deleted by the next lookup. */
+static void vrend_vertex_arrays_detach_resource(struct vrend_sub_context *sub,
+                                                struct vrend_resource *res)
+{
+   list_for_each_entry(struct vrend_vertex_array, va, &sub->vertex_arrays, head) {
+      bool uses_res = false;
+
+      for (int i = 0; i < PIPE_MAX_ATTRIBS; i++)
+         uses_res |= va->buffers[i] == res;
+      if (!uses_res)
+         continue;
+
+      for (int i = 0; i < PIPE_MAX_ATTRIBS; i++)
+         vrend_resource_reference(&va->buffers[i], NULL);
+      va->stale = true;
+      sub->vertex_arrays_stale = true;
+      if (sub->vertex_array == va)
+         sub->vertex_array = NULL;
+   }
+}
+
 static void vrend_destroy_vertex_elements_object(void *obj_ptr)
 {
    struct vrend_vertex_element_array *v = obj_ptr;
@@ -2450,6 +3228,12 @@ static void vrend_destroy_vertex_elements_object(void *obj_ptr)
    if (v == v->owning_sub->ve)
       v->owning_sub->ve = NULL;
 
+   list_for_each_entry_safe(struct vrend_vertex_array, va,
+                            &v->owning_sub->vertex_arrays, head) {
+      if (va->key.ve == v)
+         vrend_vertex_array_destroy(v->owning_sub, va);
+   }
+
    if (has_feature(feat_gles31_vertex_attrib_binding)) {
       glDeleteVertexArrays(1, &v->id);
    }
@@ -2460,8 +3244,10 @@ static void vrend_destroy_sampler_state_object(void *obj_ptr)
 {
    struct vrend_sampler_state *state = obj_ptr;
 
-   if (has_feature(feat_samplers))
-      glDeleteSamplers(2, state->ids);
+   for (int i = 0; i < 2; i++) {
+      vrend_sampler_object_reference(&state->objects[i], NULL);
+      vrend_sampler_object_reference(&state->alpha_objects[i], NULL);
+   }
 
    if (state->sub_ctx) {
       struct vrend_sub_context *sub_ctx = state->sub_ctx;
@@ -2570,6 +3356,78 @@ static void apply_sampler_border_color(GLuint sampler,
    }
 }
 
+static uint64_t vrend_sampler_key_hash(const struct vrend_sampler_key *key)
+{
+   return XXH64(key, sizeof(*key), 0);
+}
+
+static struct vrend_sampler_object *
+vrend_sampler_cache_get(struct vrend_context *ctx,
+                        const struct vrend_sampler_key *key)
+{
+   struct vrend_sampler_object *obj;
+   uint64_t hash = vrend_sampler_key_hash(key);
+   bool collision = false;
+
+   mtx_lock(&vrend_state.cache_mutex);
+   obj = _mesa_hash_table_u64_search(vrend_state.sampler_cache, hash);
+   if (obj) {
+      if (!memcmp(&obj->key, key, sizeof(*key))) {
+         pipe_reference(NULL, &obj->reference);
+         mtx_unlock(&vrend_state.cache_mutex);
+         ctx->sampler_cache_hits++;
+         return obj;
+      }
+      /* Keep the resident object, the new one just doesn't get shared */
+      collision = true;
+   }
+   mtx_unlock(&vrend_state.cache_mutex);
+   ctx->sampler_cache_misses++;
+
+   obj = CALLOC_STRUCT(vrend_sampler_object);
+   if (!obj)
+      return NULL;
+
+   pipe_reference_init(&obj->reference, 1);
+   obj->hash = hash;
+   obj->key = *key;
+
+   glGenSamplers(1, &obj->id);
+   glSamplerParameteri(obj->id, GL_TEXTURE_WRAP_S, key->wrap_s);
+   glSamplerParameteri(obj->id, GL_TEXTURE_WRAP_T, key->wrap_t);
+   glSamplerParameteri(obj->id, GL_TEXTURE_WRAP_R, key->wrap_r);
+   glSamplerParameterf(obj->id, GL_TEXTURE_MIN_FILTER, key->min_filter);
+   glSamplerParameterf(obj->id, GL_TEXTURE_MAG_FILTER, key->mag_filter);
+   glSamplerParameterf(obj->id, GL_TEXTURE_MIN_LOD, key->min_lod);
+   glSamplerParameterf(obj->id, GL_TEXTURE_MAX_LOD, key->max_lod);
+   glSamplerParameteri(obj->id, GL_TEXTURE_COMPARE_MODE, key->compare_mode);
+   glSamplerParameteri(obj->id, GL_TEXTURE_COMPARE_FUNC, key->compare_func);
+   if (!vrend_state.use_gles) {
+      glSamplerParameterf(obj->id, GL_TEXTURE_LOD_BIAS, key->lod_bias);
+      if (has_feature(feat_seamless_cubemap_per_texture))
+         glSamplerParameteri(obj->id, GL_TEXTURE_CUBE_MAP_SEAMLESS, key->seamless_cube_map);
+   }
+   apply_sampler_border_color(obj->id, key->border_color);
+   if (has_feature(feat_texture_srgb_decode))
+      glSamplerParameteri(obj->id, GL_TEXTURE_SRGB_DECODE_EXT, key->srgb_decode);
+
+   mtx_lock(&vrend_state.cache_mutex);
+   obj->in_cache = !collision &&
+                   !_mesa_hash_table_u64_search(vrend_state.sampler_cache, hash);
+   if (obj->in_cache)
+      _mesa_hash_table_u64_insert(vrend_state.sampler_cache, hash, obj);
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   return obj;
+}
+
+/* Swap the border color for views that sample an alpha format from red. */
+static void vrend_sampler_key_swizzle_alpha_border(struct vrend_sampler_key *key)
+{
+   key->border_color[0] = key->border_color[3];
+   key->border_color[3] = 0;
+}
+
 int vrend_create_sampler_state(struct vrend_context *ctx,
                                uint32_t handle,
                                struct pipe_sampler_state *templ)
@@ -2583,45 +3441,48 @@ int vrend_create_sampler_state(struct vrend_context *ctx,
    state->base = *templ;
 
    if (has_feature(feat_samplers)) {
-      glGenSamplers(2, state->ids);
+      struct vrend_sampler_key key;
+
+      memset(&key, 0, sizeof(key));
+      key.wrap_s = convert_wrap(ctx, templ->wrap_s);
+      key.wrap_t = convert_wrap(ctx, templ->wrap_t);
+      key.wrap_r = convert_wrap(ctx, templ->wrap_r);
+      key.min_filter = convert_min_filter(templ->min_img_filter, templ->min_mip_filter);
+      key.mag_filter = convert_mag_filter(templ->mag_img_filter);
+      key.min_lod = templ->min_lod;
+      key.max_lod = templ->max_lod;
+      key.compare_mode = templ->compare_mode ? GL_COMPARE_R_TO_TEXTURE : GL_NONE;
+      key.compare_func = GL_NEVER + templ->compare_func;
+      memcpy(key.border_color, templ->border_color.ui, sizeof(key.border_color));
+
+      if (vrend_state.use_gles) {
+         if (templ->lod_bias)
+            report_gles_warn(ctx, GLES_WARN_LOD_BIAS);
+         if (templ->seamless_cube_map != 0)
+            report_gles_warn(ctx, GLES_WARN_SEAMLESS_CUBE_MAP);
+      } else {
+         key.lod_bias = templ->lod_bias;
+         if (has_feature(feat_seamless_cubemap_per_texture))
+            key.seamless_cube_map = templ->seamless_cube_map;
+      }
 
       for (int i = 0; i < 2; ++i) {
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_S, convert_wrap(ctx, templ->wrap_s));
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_T, convert_wrap(ctx, templ->wrap_t));
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_R, convert_wrap(ctx, templ->wrap_r));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MIN_FILTER, convert_min_filter(templ->min_img_filter, templ->min_mip_filter));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MAG_FILTER, convert_mag_filter(templ->mag_img_filter));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MIN_LOD, templ->min_lod);
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MAX_LOD, templ->max_lod);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_COMPARE_MODE, templ->compare_mode ? GL_COMPARE_R_TO_TEXTURE : GL_NONE);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_COMPARE_FUNC, GL_NEVER + templ->compare_func);
-         if (vrend_state.use_gles) {
-            if (templ->lod_bias)
-               report_gles_warn(ctx, GLES_WARN_LOD_BIAS);
-         } else
-            glSamplerParameterf(state->ids[i], GL_TEXTURE_LOD_BIAS, templ->lod_bias);
+         if (has_feature(feat_texture_srgb_decode))
+            key.srgb_decode = i == 0 ? GL_SKIP_DECODE_EXT : GL_DECODE_EXT;
 
-         if (vrend_state.use_gles) {
-            if (templ->seamless_cube_map != 0) {
-               report_gles_warn(ctx, GLES_WARN_SEAMLESS_CUBE_MAP);
-            }
-         } else {
-            if (has_feature(feat_seamless_cubemap_per_texture)) {
-               glSamplerParameteri(state->ids[i], GL_TEXTURE_CUBE_MAP_SEAMLESS, templ->seamless_cube_map);
-            }
+         state->objects[i] = vrend_sampler_cache_get(ctx, &key);
+         if (!state->objects[i]) {
+            vrend_sampler_object_reference(&state->objects[0], NULL);
+            FREE(state);
+            return ENOMEM;
          }
-
-         apply_sampler_border_color(state->ids[i], templ->border_color.ui);
-         if (has_feature(feat_texture_srgb_decode))
-            glSamplerParameteri(state->ids[i], GL_TEXTURE_SRGB_DECODE_EXT,
-                                i == 0 ? GL_SKIP_DECODE_EXT : GL_DECODE_EXT);
       }
    }
    ret_handle = vrend_renderer_object_insert(ctx, state, handle,
                                              VIRGL_OBJECT_SAMPLER_STATE);
    if (!ret_handle) {
-      if (has_feature(feat_samplers))
-         glDeleteSamplers(2, state->ids);
+      for (int i = 0; i < 2; ++i)
+         vrend_sampler_object_reference(&state->objects[i], NULL);
       FREE(state);
       return ENOMEM;
    }
@@ -2874,7 +3735,7 @@ static void vrend_framebuffer_texture_2d(struct vrend_resource *res,
       glFramebufferTexture2D(target, attachment, textarget, texture, level);
    } else if (!has_feature(feat_implicit_msaa)) {
       /* fallback to non-msaa */
-      report_gles_warn(vrend_state.current_ctx, GLES_WARN_IMPLICIT_MSAA_SURFACE);
+      report_gles_warn(vrend_current_ctx, GLES_WARN_IMPLICIT_MSAA_SURFACE);
       glFramebufferTexture2D(target, attachment, textarget, texture, level);
    } else if (attachment == GL_COLOR_ATTACHMENT0){
       glFramebufferTexture2DMultisampleEXT(target, attachment, textarget,
@@ -2893,7 +3754,7 @@ static void vrend_framebuffer_texture_2d(struct vrend_resource *res,
       glBindRenderbuffer(GL_RENDERBUFFER, 0);
    } else {
       /* unsupported attachment for EXT_multisampled_render_to_texture, fallback to non-msaa */
-      report_gles_warn(vrend_state.current_ctx, GLES_WARN_IMPLICIT_MSAA_SURFACE);
+      report_gles_warn(vrend_current_ctx, GLES_WARN_IMPLICIT_MSAA_SURFACE);
       glFramebufferTexture2D(target, attachment, textarget, texture, level);
    }
 }
@@ -3009,43 +3870,26 @@ void vrend_fb_bind_texture(struct vrend_resource *res,
    vrend_fb_bind_texture_id(res, res->gl_id, idx, level, layer, 0);
 }
 
-static void vrend_hw_set_zsurf_texture(struct vrend_context *ctx)
+static void vrend_hw_set_zsurf_texture(struct vrend_surface *surf)
 {
-   struct vrend_surface *surf = ctx->sub->zsurf;
-
-   if (!surf) {
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-                             GL_TEXTURE_2D, 0, 0);
-   } else {
-      if (!surf->texture)
-         return;
+   if (!surf->texture)
+      return;
 
-      vrend_fb_bind_texture_id(surf->texture, surf->gl_id, 0, surf->level,
-                               surf->first_layer != surf->last_layer ? 0xffffffff :
-                               surf->first_layer, surf->nr_samples);
-   }
+   vrend_fb_bind_texture_id(surf->texture, surf->gl_id, 0, surf->level,
+                            surf->first_layer != surf->last_layer ? 0xffffffff :
+                            surf->first_layer, surf->nr_samples);
 }
 
-static void vrend_hw_set_color_surface(struct vrend_sub_context *sub_ctx, int index)
+static void vrend_hw_set_color_surface(struct vrend_surface *surf, int index)
 {
-   struct vrend_surface *surf = sub_ctx->surf[index];
-
-   if (!surf) {
-      GLenum attachment = GL_COLOR_ATTACHMENT0 + index;
-
-      glFramebufferTexture2D(GL_FRAMEBUFFER, attachment,
-                             GL_TEXTURE_2D, 0, 0);
-   } else {
-      uint32_t first_layer = sub_ctx->surf[index]->first_layer;
-      uint32_t last_layer = sub_ctx->surf[index]->last_layer;
-
-      vrend_fb_bind_texture_id(surf->texture, surf->gl_id, index, surf->level,
-                               first_layer != last_layer ? 0xffffffff : first_layer,
-                               surf->nr_samples);
-   }
+   vrend_fb_bind_texture_id(surf->texture, surf->gl_id, index, surf->level,
+                            surf->first_layer != surf->last_layer ? 0xffffffff :
+                            surf->first_layer, surf->nr_samples);
 }
 
-static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
+static struct vrend_framebuffer *
+vrend_framebuffer_create(struct vrend_sub_context *sub_ctx,
+                         const struct vrend_framebuffer_key *key)
 {
    static const GLenum buffers[8] = {
       GL_COLOR_ATTACHMENT0,
@@ -3057,9 +3901,85 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
       GL_COLOR_ATTACHMENT6,
       GL_COLOR_ATTACHMENT7,
    };
+   struct vrend_framebuffer *fb;
 
-   if (sub_ctx->nr_cbufs == 0) {
+   fb = CALLOC_STRUCT(vrend_framebuffer);
+   if (!fb)
+      return NULL;
+
+   fb->key.nr_cbufs = key->nr_cbufs;
+
+   glGenFramebuffers(1, &fb->id);
+   glBindFramebuffer(GL_FRAMEBUFFER, fb->id);
+
+   if (key->zsurf) {
+      vrend_surface_reference(&fb->key.zsurf, key->zsurf);
+      vrend_hw_set_zsurf_texture(key->zsurf);
+   }
+
+   for (uint32_t i = 0; i < key->nr_cbufs; i++) {
+      if (!key->surf[i])
+         continue;
+      vrend_surface_reference(&fb->key.surf[i], key->surf[i]);
+      vrend_hw_set_color_surface(key->surf[i], i);
+   }
+
+   if (key->nr_cbufs == 0)
       glReadBuffer(GL_NONE);
+   glDrawBuffers(key->nr_cbufs, buffers);
+
+   if (key->nr_cbufs > 0 || key->zsurf) {
+      GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      if (status != GL_FRAMEBUFFER_COMPLETE)
+         virgl_error("Failed to complete framebuffer 0x%x %s\n", status,
+                     sub_ctx->parent->debug_name);
+   }
+
+   if (sub_ctx->num_framebuffers >= VREND_FRAMEBUFFER_CACHE_SIZE) {
+      struct vrend_framebuffer *last =
+         list_last_entry(&sub_ctx->framebuffers, struct vrend_framebuffer, head);
+      if (last != sub_ctx->framebuffer)
+         vrend_framebuffer_destroy(sub_ctx, last);
+   }
+   list_add(&fb->head, &sub_ctx->framebuffers);
+   sub_ctx->num_framebuffers++;
+
+   return fb;
+}
+
+static struct vrend_framebuffer *
+vrend_framebuffer_lookup(struct vrend_sub_context *sub_ctx,
+                         const struct vrend_framebuffer_key *key)
+{
+   list_for_each_entry(struct vrend_framebuffer, fb, &sub_ctx->framebuffers, head) {
+      if (!fb->stale && !memcmp(&fb->key, key, sizeof(*key))) {
+         list_del(&fb->head);
+         list_add(&fb->head, &sub_ctx->framebuffers);
+         return fb;
+      }
+   }
+
+   return vrend_framebuffer_create(sub_ctx, key);
+}
+
+/* Make fb the current framebuffer, dropping the previous one if one of its
+ * surfaces was destroyed while it was bound. */
+static void vrend_framebuffer_bind(struct vrend_sub_context *sub_ctx,
+                                   struct vrend_framebuffer *fb)
+{
+   struct vrend_framebuffer *old = sub_ctx->framebuffer;
+
+   sub_ctx->framebuffer = fb;
+   sub_ctx->fb_id = fb->id;
+   glBindFramebuffer(GL_FRAMEBUFFER, fb->id);
+
+   if (old && old != fb && old->stale)
+      vrend_framebuffer_destroy(sub_ctx, old);
+}
+
+static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
+{
+   if (sub_ctx->nr_cbufs == 0) {
       if (has_feature(feat_srgb_write_control)) {
          glDisable(GL_FRAMEBUFFER_SRGB_EXT);
          sub_ctx->framebuffer_srgb_enabled = false;
@@ -3113,64 +4033,58 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_sub_context *sub_ctx)
          sub_ctx->needs_manual_srgb_encode_bitmask |= 1 << i;
       }
    }
-
-   glDrawBuffers(sub_ctx->nr_cbufs, buffers);
 }
 
 void vrend_set_framebuffer_state(struct vrend_context *ctx,
                                  uint32_t nr_cbufs, uint32_t surf_handle[PIPE_MAX_COLOR_BUFS],
                                  uint32_t zsurf_handle)
 {
-   struct vrend_surface *surf, *zsurf;
+   struct vrend_framebuffer_key key;
+   struct vrend_framebuffer *fb;
+   struct vrend_surface *surf;
    int i;
    int old_num;
-   GLenum status;
    GLint new_height = -1;
    bool new_fbo_origin_upper_left = false;
 
    struct vrend_sub_context *sub_ctx = ctx->sub;
 
-   glBindFramebuffer(GL_FRAMEBUFFER, sub_ctx->fb_id);
+   memset(&key, 0, sizeof(key));
 
    if (zsurf_handle) {
-      zsurf = vrend_object_lookup(sub_ctx->object_hash, zsurf_handle, VIRGL_OBJECT_SURFACE);
-      if (!zsurf) {
+      key.zsurf = vrend_object_lookup(sub_ctx->object_hash, zsurf_handle, VIRGL_OBJECT_SURFACE);
+      if (!key.zsurf) {
          vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, zsurf_handle);
          return;
       }
-   } else
-      zsurf = NULL;
-
-   if (sub_ctx->zsurf != zsurf) {
-      vrend_surface_reference(&sub_ctx->zsurf, zsurf);
-      vrend_hw_set_zsurf_texture(ctx);
    }
 
-   old_num = sub_ctx->nr_cbufs;
-   sub_ctx->nr_cbufs = nr_cbufs;
-
+   key.nr_cbufs = nr_cbufs;
    for (i = 0; i < (int)nr_cbufs; i++) {
-      if (surf_handle[i] != 0) {
-         surf = vrend_object_lookup(sub_ctx->object_hash, surf_handle[i], VIRGL_OBJECT_SURFACE);
-         if (!surf) {
-            vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, surf_handle[i]);
-            return;
-         }
-      } else
-         surf = NULL;
-
-      if (sub_ctx->surf[i] != surf) {
-         vrend_surface_reference(&sub_ctx->surf[i], surf);
-         vrend_hw_set_color_surface(sub_ctx, i);
+      if (surf_handle[i] == 0)
+         continue;
+      key.surf[i] = vrend_object_lookup(sub_ctx->object_hash, surf_handle[i], VIRGL_OBJECT_SURFACE);
+      if (!key.surf[i]) {
+         vrend_report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_SURFACE, surf_handle[i]);
+         return;
       }
    }
 
-   if (old_num > sub_ctx->nr_cbufs) {
-      for (i = sub_ctx->nr_cbufs; i < old_num; i++) {
-         vrend_surface_reference(&sub_ctx->surf[i], NULL);
-         vrend_hw_set_color_surface(sub_ctx, i);
-      }
+   fb = vrend_framebuffer_lookup(sub_ctx, &key);
+   if (!fb) {
+      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_UNKNOWN, 0);
+      return;
    }
+   vrend_framebuffer_bind(sub_ctx, fb);
+
+   vrend_surface_reference(&sub_ctx->zsurf, key.zsurf);
+
+   old_num = sub_ctx->nr_cbufs;
+   sub_ctx->nr_cbufs = nr_cbufs;
+   for (i = 0; i < (int)nr_cbufs; i++)
+      vrend_surface_reference(&sub_ctx->surf[i], key.surf[i]);
+   for (i = nr_cbufs; i < old_num; i++)
+      vrend_surface_reference(&sub_ctx->surf[i], NULL);
 
    /* find a buffer to set fb_height from */
    if (sub_ctx->nr_cbufs == 0 && !sub_ctx->zsurf) {
@@ -3207,12 +4121,6 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
 
    vrend_hw_emit_framebuffer_state(sub_ctx);
 
-   if (sub_ctx->nr_cbufs > 0 || sub_ctx->zsurf) {
-      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-      if (status != GL_FRAMEBUFFER_COMPLETE)
-         virgl_error("Failed to complete framebuffer 0x%x %s\n", status, ctx->debug_name);
-   }
-
    sub_ctx->shader_dirty = true;
    sub_ctx->blend_state_dirty = true;
 }
@@ -3305,6 +4213,27 @@ void vrend_set_viewport_states(struct vrend_context *ctx,
          signed_mask |= (1 << i); \
    }
 
+/* Specify the attribute formats of the elements in the bound VAO. */
+static void vrend_vertex_elements_set_formats(struct vrend_vertex_element_array *v)
+{
+   for (uint32_t i = 0; i < v->count; i++) {
+      struct vrend_vertex_element *ve = &v->elements[i];
+      GLint size = !vrend_state.use_gles && (v->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
+
+      if (util_format_is_pure_integer(ve->base.src_format)) {
+         UPDATE_INT_SIGN_MASK(ve->base.src_format, i,
+                              v->signed_int_bitmask,
+                              v->unsigned_int_bitmask);
+         glVertexAttribIFormat(i, size, ve->type, ve->base.src_offset);
+      }
+      else
+         glVertexAttribFormat(i, size, ve->type, ve->norm, ve->base.src_offset);
+      glVertexAttribBinding(i, ve->base.vertex_buffer_index);
+      glVertexBindingDivisor(i, ve->base.instance_divisor);
+      glEnableVertexAttribArray(i);
+   }
+}
+
 int vrend_create_vertex_elements_state(struct vrend_context *ctx,
                                        uint32_t handle,
                                        unsigned num_elements,
@@ -3426,22 +4355,7 @@ void vrend_bind_vertex_elements_state(struct vrend_context *ctx,
    if (has_feature(feat_gles31_vertex_attrib_binding) && v->id == 0) {
       glGenVertexArrays(1, &v->id);
       glBindVertexArray(v->id);
-      for (uint32_t i = 0; i < v->count; i++) {
-         struct vrend_vertex_element *ve = &v->elements[i];
-         GLint size = !vrend_state.use_gles && (v->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
-
-         if (util_format_is_pure_integer(ve->base.src_format)) {
-            UPDATE_INT_SIGN_MASK(ve->base.src_format, i,
-                                 v->signed_int_bitmask,
-                                 v->unsigned_int_bitmask);
-            glVertexAttribIFormat(i, size, ve->type, ve->base.src_offset);
-         }
-         else
-            glVertexAttribFormat(i, size, ve->type, ve->norm, ve->base.src_offset);
-         glVertexAttribBinding(i, ve->base.vertex_buffer_index);
-         glVertexBindingDivisor(i, ve->base.instance_divisor);
-         glEnableVertexAttribArray(i);
-      }
+      vrend_vertex_elements_set_formats(v);
    }
 }
 
@@ -4314,6 +5228,7 @@ static int vrend_shader_create(struct vrend_context *ctx,
 {
    static uint32_t uid;
 
+   TRACE_FUNC();
    shader->uid = ++uid;
 
    if (shader->sel->tokens) {
@@ -4322,7 +5237,9 @@ static int vrend_shader_create(struct vrend_context *ctx,
       VREND_DEBUG_EXT(dbg_shader_tgsi, ctx, vrend_dump_tgsi(shader->sel->tokens, 0));
       VREND_DEBUG(dbg_shader_tgsi, ctx, "\n");
 
-      bool ret = vrend_convert_shader(ctx, &ctx->shader_cfg, shader->sel->tokens,
+      const struct vrend_shader_analysis *analysis =
+            shader->sel->tgsi ? &shader->sel->tgsi->analysis : NULL;
+      bool ret = vrend_convert_shader(ctx, &ctx->shader_cfg, shader->sel->tokens, analysis,
                                       shader->sel->req_local_mem, key, &shader->sel->sinfo,
                                       &shader->var_sinfo, &shader->glsl_strings);
       if (!ret) {
@@ -4338,6 +5255,81 @@ static int vrend_shader_create(struct vrend_context *ctx,
    return 0;
 }
 
+/* Returns a mask of the virgl_renderer_shader_key_group values in which the
+ * two keys differ. */
+static uint32_t vrend_shader_key_diff(const struct vrend_shader_key *a,
+                                      const struct vrend_shader_key *b)
+{
+   uint32_t groups = 0;
+
+   if (a->out_generic_expected_mask != b->out_generic_expected_mask ||
+       a->out_texcoord_expected_mask != b->out_texcoord_expected_mask ||
+       a->in_generic_expected_mask != b->in_generic_expected_mask ||
+       a->in_texcoord_expected_mask != b->in_texcoord_expected_mask ||
+       a->in_patch_expected_mask != b->in_patch_expected_mask ||
+       memcmp(a->force_invariant_inputs, b->force_invariant_inputs,
+              sizeof(a->force_invariant_inputs)) ||
+       memcmp(&a->in_arrays, &b->in_arrays, sizeof(a->in_arrays)) ||
+       a->num_in_cull != b->num_in_cull || a->num_in_clip != b->num_in_clip ||
+       a->num_out_cull != b->num_out_cull || a->num_out_clip != b->num_out_clip ||
+       a->gs_present != b->gs_present || a->tcs_present != b->tcs_present ||
+       a->tes_present != b->tes_present ||
+       a->require_input_arrays != b->require_input_arrays ||
+       a->require_output_arrays != b->require_output_arrays ||
+       a->use_pervertex_in != b->use_pervertex_in)
+      groups |= 1 << VIRGL_RENDERER_SHADER_KEY_IO;
+
+   if (memcmp(&a->fs_info, &b->fs_info, sizeof(a->fs_info)))
+      groups |= 1 << VIRGL_RENDERER_SHADER_KEY_FS_INFO;
+
+   if (memcmp(&a->fs, &b->fs, sizeof(a->fs)) ||
+       memcmp(&a->vs, &b->vs, sizeof(a->vs)))
+      groups |= 1 << VIRGL_RENDERER_SHADER_KEY_STAGE;
+
+   if (memcmp(a->sampler_views_lower_swizzle_mask, b->sampler_views_lower_swizzle_mask,
+              sizeof(a->sampler_views_lower_swizzle_mask)) ||
+       memcmp(a->sampler_views_emulated_rect_mask, b->sampler_views_emulated_rect_mask,
+              sizeof(a->sampler_views_emulated_rect_mask)) ||
+       memcmp(a->tex_swizzle, b->tex_swizzle, sizeof(a->tex_swizzle)))
+      groups |= 1 << VIRGL_RENDERER_SHADER_KEY_SAMPLERS;
+
+   if (a->ssbo_binding_offset != b->ssbo_binding_offset ||
+       a->image_binding_offset != b->image_binding_offset)
+      groups |= 1 << VIRGL_RENDERER_SHADER_KEY_BINDINGS;
+
+   if (a->alpha_test != b->alpha_test ||
+       a->pstipple_enabled != b->pstipple_enabled ||
+       a->add_alpha_test != b->add_alpha_test ||
+       a->color_two_side != b->color_two_side ||
+       a->flatshade != b->flatshade)
+      groups |= 1 << VIRGL_RENDERER_SHADER_KEY_RASTER;
+
+   return groups;
+}
+
+static void vrend_shader_count_variant(struct vrend_context *ctx,
+                                       const struct vrend_shader_selector *sel,
+                                       const struct vrend_shader_key *key)
+{
+   struct virgl_renderer_shader_stats *stats = &ctx->shader_stats;
+   uint32_t num_variants = 1;
+   uint32_t groups;
+
+   for (const struct vrend_shader *v = sel->current; v; v = v->next_variant)
+      num_variants++;
+
+   stats->variants++;
+   stats->max_variants_per_shader = MAX2(stats->max_variants_per_shader, num_variants);
+   if (!sel->current)
+      return;
+
+   groups = vrend_shader_key_diff(&sel->current->key, key);
+   VREND_DEBUG(dbg_shader, ctx, "variant %u of shader type %d, key groups changed 0x%x\n",
+               num_variants, sel->type, groups);
+   while (groups)
+      stats->key_group_changes[u_bit_scan(&groups)]++;
+}
+
 static int vrend_shader_select(struct vrend_sub_context *sub_ctx,
                                struct vrend_shader_selector *sel,
                                bool *dirty)
@@ -4379,6 +5371,7 @@ static int vrend_shader_select(struct vrend_sub_context *sub_ctx,
          FREE(shader);
          return r;
       }
+      vrend_shader_count_variant(sub_ctx->parent, sel, &key);
    }
    if (dirty)
       *dirty = true;
@@ -4405,15 +5398,111 @@ static void *vrend_create_shader_state(const struct pipe_stream_output_info *so_
    return sel;
 }
 
-static int vrend_finish_shader(struct vrend_context *ctx,
-                               struct vrend_shader_selector *sel,
-                               const struct tgsi_token *tokens)
+static uint64_t vrend_tgsi_cache_hash(const struct vrend_shader_selector *sel,
+                                      const char *text, uint32_t text_length,
+                                      uint32_t num_tokens)
 {
-   sel->tokens = tgsi_dup_tokens(tokens);
-
-   if (!ctx->shader_cfg.use_gles && sel->type != PIPE_SHADER_COMPUTE)
-      sel->sinfo.separable_program =
-            vrend_shader_query_separable_program(sel->tokens, &ctx->shader_cfg);
+   uint64_t hash = XXH64(text, text_length, 0);
+   hash = XXH64(&sel->sinfo.so_info, sizeof(sel->sinfo.so_info), hash);
+   hash = XXH64(&sel->req_local_mem, sizeof(sel->req_local_mem), hash);
+   hash = XXH64(&sel->type, sizeof(sel->type), hash);
+   return XXH64(&num_tokens, sizeof(num_tokens), hash);
+}
+
+static bool vrend_tgsi_cache_entry_matches(const struct vrend_tgsi_cache_entry *entry,
+                                           const struct vrend_shader_selector *sel,
+                                           const char *text, uint32_t text_length,
+                                           uint32_t num_tokens)
+{
+   return entry->type == sel->type &&
+          entry->num_tokens == num_tokens &&
+          entry->req_local_mem == sel->req_local_mem &&
+          entry->text_length == text_length &&
+          !memcmp(&entry->so_info, &sel->sinfo.so_info, sizeof(entry->so_info)) &&
+          !memcmp(entry->text, text, text_length);
+}
+
+static struct vrend_tgsi_cache_entry *
+vrend_tgsi_cache_get(struct vrend_context *ctx,
+                     const struct vrend_shader_selector *sel,
+                     const char *text, uint32_t text_length,
+                     uint32_t num_tokens)
+{
+   struct vrend_tgsi_cache_entry *entry;
+   struct tgsi_token *tokens;
+   uint64_t hash = vrend_tgsi_cache_hash(sel, text, text_length, num_tokens);
+   bool collision = false;
+
+   mtx_lock(&vrend_state.cache_mutex);
+   entry = _mesa_hash_table_u64_search(vrend_state.tgsi_cache, hash);
+   if (entry) {
+      if (vrend_tgsi_cache_entry_matches(entry, sel, text, text_length, num_tokens)) {
+         pipe_reference(NULL, &entry->reference);
+         mtx_unlock(&vrend_state.cache_mutex);
+         return entry;
+      }
+      /* Keep the resident entry, the new one just doesn't get shared */
+      collision = true;
+   }
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   tokens = calloc(num_tokens + 10, sizeof(struct tgsi_token));
+   if (!tokens)
+      return NULL;
+
+   if (!tgsi_text_translate(text, tokens, num_tokens + 10)) {
+      free(tokens);
+      return NULL;
+   }
+
+   entry = CALLOC_STRUCT(vrend_tgsi_cache_entry);
+   if (!entry) {
+      free(tokens);
+      return NULL;
+   }
+
+   pipe_reference_init(&entry->reference, 1);
+   entry->hash = hash;
+   entry->text_length = text_length;
+   entry->num_tokens = num_tokens;
+   entry->req_local_mem = sel->req_local_mem;
+   entry->type = sel->type;
+   entry->so_info = sel->sinfo.so_info;
+   entry->tokens = tgsi_dup_tokens(tokens);
+   entry->text = malloc(text_length);
+   free(tokens);
+
+   if (!entry->tokens || !entry->text ||
+       !vrend_shader_analyze(entry->tokens, &entry->analysis)) {
+      vrend_tgsi_cache_entry_destroy(entry);
+      return NULL;
+   }
+   memcpy(entry->text, text, text_length);
+
+   if (!ctx->shader_cfg.use_gles && sel->type != PIPE_SHADER_COMPUTE)
+      entry->separable_program =
+            vrend_shader_query_separable_program(entry->tokens, &ctx->shader_cfg);
+
+   /* another context may have translated the same text in the meantime,
+    * that entry stays resident */
+   mtx_lock(&vrend_state.cache_mutex);
+   if (!collision && !_mesa_hash_table_u64_search(vrend_state.tgsi_cache, hash)) {
+      _mesa_hash_table_u64_insert(vrend_state.tgsi_cache, hash, entry);
+      entry->in_cache = true;
+   }
+   mtx_unlock(&vrend_state.cache_mutex);
+
+   return entry;
+}
+
+static int vrend_finish_shader(struct vrend_context *ctx,
+                               struct vrend_shader_selector *sel,
+                               struct vrend_tgsi_cache_entry *entry)
+{
+   /* the selector takes over the reference */
+   sel->tgsi = entry;
+   sel->tokens = entry->tokens;
+   sel->sinfo.separable_program = entry->separable_program;
 
    return vrend_shader_select(ctx->sub, sel, NULL) ? EINVAL : 0;
 }
@@ -4424,27 +5513,20 @@ static int vrend_shader_assign_tgsi(struct vrend_context *ctx,
                                     uint32_t current_length,
                                     uint32_t num_tokens)
 {
-   struct tgsi_token *tokens;
+   struct vrend_tgsi_cache_entry *entry;
 
    /* check for null termination */
    if (current_length < 4 || !memchr(shader_buf + current_length - 4, '\0', 4))
       return EINVAL;
 
-   tokens = calloc(num_tokens + 10, sizeof(struct tgsi_token));
-   if (!tokens)
-      return ENOMEM;
-
-   if (!tgsi_text_translate(shader_buf, tokens, num_tokens + 10)) {
-      free(tokens);
+   entry = vrend_tgsi_cache_get(ctx, sel, shader_buf,
+                                strnlen(shader_buf, current_length), num_tokens);
+   if (!entry)
       return EINVAL;
-   }
 
-   if (vrend_finish_shader(ctx, sel, tokens)) {
-      free(tokens);
+   if (vrend_finish_shader(ctx, sel, entry))
       return EINVAL;
-   }
 
-   free(tokens);
    return 0;
 }
 
@@ -4534,6 +5616,7 @@ int vrend_create_shader(struct vrend_context *ctx,
          vrend_destroy_shader_selector(sel);
          return ENOMEM;
       }
+      ctx->shader_stats.shaders++;
 
       if (expected_token_count > pkt_length) {
          /* We only got a partial shader, start a long shader transfer */
@@ -5031,6 +6114,23 @@ static GLenum get_xfb_mode(GLenum mode)
    }
 }
 
+/* Point attribute i of va at the buffer bound to GL_ARRAY_BUFFER. */
+static void vrend_vertex_attrib_pointer(const struct vrend_vertex_element_array *va,
+                                        int i, GLint loc, uint32_t stride,
+                                        uint32_t buffer_offset)
+{
+   const struct vrend_vertex_element *ve = &va->elements[i];
+   GLint size = !vrend_state.use_gles && (va->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
+   void *offset = (void *)(uintptr_t)(ve->base.src_offset + buffer_offset);
+
+   if (util_format_is_pure_integer(ve->base.src_format)) {
+      glVertexAttribIPointer(loc, size, ve->type, stride, offset);
+   } else {
+      glVertexAttribPointer(loc, size, ve->type, ve->norm, stride, offset);
+   }
+   glVertexAttribDivisorARB(loc, ve->base.instance_divisor);
+}
+
 static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
                                           struct vrend_vertex_element_array *va)
 {
@@ -5105,15 +6205,9 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
          glUnmapBuffer(GL_ARRAY_BUFFER);
          disable_bitmask |= (1 << loc);
       } else {
-         GLint size = !vrend_state.use_gles && (va->zyxw_bitmask & (1 << i)) ? GL_BGRA : ve->nr_chan;
-
          enable_bitmask |= (1 << loc);
-         if (util_format_is_pure_integer(ve->base.src_format)) {
-            glVertexAttribIPointer(loc, size, ve->type, vbo->base.stride, (void *)(uintptr_t)(ve->base.src_offset + vbo->base.buffer_offset));
-         } else {
-            glVertexAttribPointer(loc, size, ve->type, ve->norm, vbo->base.stride, (void *)(uintptr_t)(ve->base.src_offset + vbo->base.buffer_offset));
-         }
-         glVertexAttribDivisorARB(loc, ve->base.instance_divisor);
+         vrend_vertex_attrib_pointer(va, i, loc, vbo->base.stride,
+                                     vbo->base.buffer_offset);
       }
    }
    if (ctx->sub->enabled_attribs_bitmask != enable_bitmask) {
@@ -5188,86 +6282,394 @@ static void vrend_draw_bind_vertex_binding(struct vrend_context *ctx,
    }
 }
 
+/* Build the key of the current vertex input state. Returns false for state
+ * the legacy path has to emulate on every draw, like zero strides, or that
+ * it can't set up at all. */
+static bool vrend_vertex_array_key_init(struct vrend_sub_context *sub_ctx,
+                                        struct vrend_vertex_array_key *key)
+{
+   const struct vrend_vertex_element_array *ve = sub_ctx->ve;
+   bool binding = has_feature(feat_gles31_vertex_attrib_binding);
+
+   if (ve->count > vrend_state.max_vertex_attributes)
+      return false;
+
+   memset(key, 0, sizeof(*key));
+   key->ve = ve;
+   key->num_vbos = sub_ctx->num_vbos;
+
+   if (binding) {
+      key->num_attribs = ve->count;
+      for (int i = 0; i < sub_ctx->num_vbos; i++) {
+         struct vrend_resource *res = (struct vrend_resource *)sub_ctx->vbo[i].base.buffer;
+
+         key->vbos[i].buffer = res ? res->gl_id : 0;
+         if (res) {
+            key->vbos[i].stride = sub_ctx->vbo[i].base.stride;
+            key->vbos[i].offset = sub_ctx->vbo[i].base.buffer_offset;
+         }
+      }
+      return true;
+   }
+
+   key->num_attribs = MIN2(ve->count,
+                           sub_ctx->prog->ss[PIPE_SHADER_VERTEX]->sel->sinfo.num_inputs);
+   for (uint32_t i = 0; i < key->num_attribs; i++) {
+      const struct vrend_vertex_element *elem = &ve->elements[i];
+      int vbo_index = elem->base.vertex_buffer_index;
+      const struct vrend_vertex_buffer *vbo = &sub_ctx->vbo[vbo_index];
+      struct vrend_resource *res = (struct vrend_resource *)vbo->base.buffer;
+
+      if (!res || !vbo->base.stride || elem->type == GL_FALSE)
+         return false;
+
+      if (vrend_state.use_explicit_locations)
+         key->locs[i] = i;
+      else if (sub_ctx->prog->attrib_locs)
+         key->locs[i] = sub_ctx->prog->attrib_locs[i];
+      else
+         key->locs[i] = -1;
+      if (key->locs[i] == -1)
+         return false;
+
+      key->vbos[vbo_index].buffer = res->gl_id;
+      key->vbos[vbo_index].stride = vbo->base.stride;
+      key->vbos[vbo_index].offset = vbo->base.buffer_offset;
+   }
+   return true;
+}
+
+/* The attribute locations are the only part of the key that changes with
+ * the program instead of the vertex state. */
+static bool vrend_vertex_array_locs_match(const struct vrend_sub_context *sub_ctx,
+                                          const struct vrend_vertex_array *va)
+{
+   const struct vrend_linked_shader_program *prog = sub_ctx->prog;
+   uint32_t num_inputs = prog->ss[PIPE_SHADER_VERTEX]->sel->sinfo.num_inputs;
+
+   if (has_feature(feat_gles31_vertex_attrib_binding))
+      return true;
+
+   if (va->key.num_attribs != MIN2(va->key.ve->count, num_inputs))
+      return false;
+
+   if (vrend_state.use_explicit_locations)
+      return true;
+
+   return prog->attrib_locs &&
+          !memcmp(va->key.locs, prog->attrib_locs,
+                  va->key.num_attribs * sizeof(*va->key.locs));
+}
+
+static struct vrend_vertex_array *
+vrend_vertex_array_create(struct vrend_sub_context *sub_ctx,
+                          const struct vrend_vertex_array_key *key,
+                          uint64_t hash)
+{
+   struct vrend_vertex_array *va = CALLOC_STRUCT(vrend_vertex_array);
+   const struct vrend_vertex_element_array *ve = key->ve;
+
+   if (!va)
+      return NULL;
+
+   va->hash = hash;
+   va->key = *key;
+
+   glGenVertexArrays(1, &va->id);
+   glBindVertexArray(va->id);
+
+   if (has_feature(feat_gles31_vertex_attrib_binding)) {
+      vrend_vertex_elements_set_formats(sub_ctx->ve);
+      for (uint32_t i = 0; i < key->num_vbos; i++) {
+         vrend_resource_reference(&va->buffers[i],
+                                  (struct vrend_resource *)sub_ctx->vbo[i].base.buffer);
+         glBindVertexBuffer(i, key->vbos[i].buffer, key->vbos[i].offset,
+                            key->vbos[i].stride);
+      }
+   } else {
+      for (uint32_t i = 0; i < key->num_attribs; i++) {
+         int vbo_index = ve->elements[i].base.vertex_buffer_index;
+
+         vrend_resource_reference(&va->buffers[vbo_index],
+                                  (struct vrend_resource *)sub_ctx->vbo[vbo_index].base.buffer);
+         glBindBuffer(GL_ARRAY_BUFFER, key->vbos[vbo_index].buffer);
+         vrend_vertex_attrib_pointer(ve, i, key->locs[i],
+                                     key->vbos[vbo_index].stride,
+                                     key->vbos[vbo_index].offset);
+         glEnableVertexAttribArray(key->locs[i]);
+      }
+   }
+
+   if (sub_ctx->num_vertex_arrays >= VREND_VERTEX_ARRAY_CACHE_SIZE) {
+      vrend_vertex_array_destroy(sub_ctx,
+                                 list_last_entry(&sub_ctx->vertex_arrays,
+                                                 struct vrend_vertex_array, head));
+   }
+   list_add(&va->head, &sub_ctx->vertex_arrays);
+   sub_ctx->num_vertex_arrays++;
+
+   return va;
+}
+
+static struct vrend_vertex_array *
+vrend_vertex_array_lookup(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_vertex_array_key key;
+   uint64_t hash;
+
+   if (sub_ctx->vertex_arrays_stale) {
+      list_for_each_entry_safe(struct vrend_vertex_array, va, &sub_ctx->vertex_arrays, head) {
+         if (va->stale)
+            vrend_vertex_array_destroy(sub_ctx, va);
+      }
+      sub_ctx->vertex_arrays_stale = false;
+   }
+
+   if (!vrend_vertex_array_key_init(sub_ctx, &key))
+      return NULL;
+
+   hash = XXH64(&key, sizeof(key), 0);
+   list_for_each_entry(struct vrend_vertex_array, va, &sub_ctx->vertex_arrays, head) {
+      if (va->hash == hash && !memcmp(&va->key, &key, sizeof(key))) {
+         list_del(&va->head);
+         list_add(&va->head, &sub_ctx->vertex_arrays);
+         return va;
+      }
+   }
+
+   return vrend_vertex_array_create(sub_ctx, &key, hash);
+}
+
+/* Bind the VAO of the current vertex input state, setting up a new one only
+ * when the state was not seen recently. */
+static void vrend_draw_bind_vertex(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+
+   if (sub_ctx->ve) {
+      if (sub_ctx->vbo_dirty || !sub_ctx->vertex_array ||
+          !vrend_vertex_array_locs_match(sub_ctx, sub_ctx->vertex_array))
+         sub_ctx->vertex_array = vrend_vertex_array_lookup(sub_ctx);
+
+      if (sub_ctx->vertex_array) {
+         glBindVertexArray(sub_ctx->vertex_array->id);
+         sub_ctx->vbo_dirty = false;
+         return;
+      }
+   }
+
+   if (has_feature(feat_gles31_vertex_attrib_binding)) {
+      if (sub_ctx->ve) {
+         /* the VAO of the elements may hold the buffers of another draw */
+         sub_ctx->vbo_dirty = true;
+         vrend_draw_bind_vertex_binding(ctx, sub_ctx->ve);
+      } else {
+         glBindVertexArray(sub_ctx->vaoid);
+      }
+   } else {
+      glBindVertexArray(sub_ctx->vaoid);
+      if (sub_ctx->ve) {
+         vrend_draw_bind_vertex_legacy(ctx, sub_ctx->ve);
+      } else {
+         struct vrend_vertex_element_array va;
+         va.count = 0;
+         vrend_draw_bind_vertex_legacy(ctx, &va);
+      }
+   }
+}
+
+static void vrend_active_texture(struct vrend_sub_context *sub_ctx, uint32_t unit)
+{
+   if (sub_ctx->active_texture_unit != unit) {
+      glActiveTexture(GL_TEXTURE0 + unit);
+      sub_ctx->active_texture_unit = unit;
+   }
+}
+
+static void vrend_texture_units_mark_dirty(struct vrend_sub_context *sub_ctx, uint32_t unit)
+{
+   if (sub_ctx->texture_units_first_dirty >= sub_ctx->texture_units_end_dirty) {
+      sub_ctx->texture_units_first_dirty = unit;
+      sub_ctx->texture_units_end_dirty = unit + 1;
+   } else {
+      sub_ctx->texture_units_first_dirty = MIN2(sub_ctx->texture_units_first_dirty, unit);
+      sub_ctx->texture_units_end_dirty = MAX2(sub_ctx->texture_units_end_dirty, unit + 1);
+   }
+}
+
+/* Code outside of the draw path binds its textures on the active unit, so
+ * what was recorded for that unit can't be trusted at the next draw. */
+static void vrend_texture_units_invalidate_active(struct vrend_sub_context *sub_ctx)
+{
+   uint32_t unit = sub_ctx->active_texture_unit;
+
+   vrend_sampler_view_reference(&sub_ctx->texture_units[unit].view, NULL);
+   sub_ctx->texture_unit_ids[unit] = 0;
+}
+
+/* Bind a view to a texture unit unless the unit already holds it. With
+ * ARB_multi_bind the binding is only recorded, vrend_texture_units_flush
+ * then binds all changed units with one call. Returns whether the unit
+ * changed. */
+static bool vrend_texture_unit_bind(struct vrend_sub_context *sub_ctx, uint32_t unit,
+                                    struct vrend_sampler_view *view,
+                                    GLenum target, GLuint id)
+{
+   struct vrend_texture_unit *tu = &sub_ctx->texture_units[unit];
+
+   if (tu->view == view)
+      return false;
+
+   vrend_sampler_view_reference(&tu->view, view);
+   sub_ctx->texture_unit_ids[unit] = id;
+
+   if (has_feature(feat_multi_bind)) {
+      vrend_texture_units_mark_dirty(sub_ctx, unit);
+   } else {
+      vrend_active_texture(sub_ctx, unit);
+      glBindTexture(target, id);
+   }
+   return true;
+}
+
+static void vrend_texture_unit_bind_sampler(struct vrend_sub_context *sub_ctx, uint32_t unit,
+                                            struct vrend_sampler_object *obj)
+{
+   struct vrend_texture_unit *tu = &sub_ctx->texture_units[unit];
+
+   if (tu->sampler == obj)
+      return;
+
+   vrend_sampler_object_reference(&tu->sampler, obj);
+   sub_ctx->texture_unit_samplers[unit] = obj->id;
+
+   if (has_feature(feat_multi_bind))
+      vrend_texture_units_mark_dirty(sub_ctx, unit);
+   else
+      glBindSampler(unit, obj->id);
+}
+
+static void vrend_texture_units_flush(struct vrend_sub_context *sub_ctx)
+{
+   uint32_t first = sub_ctx->texture_units_first_dirty;
+   uint32_t end = sub_ctx->texture_units_end_dirty;
+
+   if (first >= end)
+      return;
+
+   glBindTextures(first, end - first, &sub_ctx->texture_unit_ids[first]);
+   if (has_feature(feat_samplers))
+      glBindSamplers(first, end - first, &sub_ctx->texture_unit_samplers[first]);
+
+   sub_ctx->texture_units_first_dirty = 0;
+   sub_ctx->texture_units_end_dirty = 0;
+}
+
+static void vrend_texture_units_fini(struct vrend_sub_context *sub)
+{
+   for (int i = 0; i < VREND_MAX_TEXTURE_UNITS; i++) {
+      struct vrend_texture_unit *tu = &sub->texture_units[i];
+
+      vrend_sampler_view_reference(&tu->view, NULL);
+      if (tu->sampler)
+         vrend_sampler_object_reference(&tu->sampler, NULL);
+   }
+}
+
+/* Compute and graphics share the texture units and a program switch can
+ * move a sampler to another unit, so every used sampler is bound and the
+ * unit shadow skips what is already in place. The dirty bits only decide
+ * whether the sampler state and the shadow sampler uniforms are applied
+ * again. */
 static int vrend_draw_bind_samplers_shader(struct vrend_sub_context *sub_ctx,
                                            int shader_type,
-                                           int next_sampler_id)
+                                           int next_sampler_id,
+                                           bool new_program)
 {
    int sampler_index = 0;
-   int n_samplers = 0;
    uint32_t dirty = sub_ctx->sampler_views_dirty[shader_type];
    uint32_t mask = sub_ctx->prog->samplers_used_mask[shader_type];
    struct vrend_shader_view *sviews = &sub_ctx->views[shader_type];
 
    while (mask) {
       int i = u_bit_scan(&mask);
+      int unit = next_sampler_id++;
+
+      sub_ctx->texture_levels[shader_type][sampler_index] = 0;
 
       struct vrend_sampler_view *tview = sviews->views[i];
-      if ((dirty & (1 << i)) && tview) {
-         if (sub_ctx->prog->shadow_samp_mask[shader_type] & (1 << i)) {
-            struct vrend_texture *tex = (struct vrend_texture *)tview->texture;
-
-            /* The modes LUMINANCE, INTENSITY, and ALPHA only apply when a depth texture
-             * is used by a sampler that returns an RGBA value, i.e. by sampler*D, if
-             * the texture is queries by using sampler*Shadow then these swizzles must
-             * not be applied, therefore, reset the swizzled to the default */
-            static const GLint swizzle[] = {GL_RED,GL_GREEN,GL_BLUE,GL_ALPHA};
-            if (memcmp(tex->cur_swizzle, swizzle, 4 * sizeof(GLint))) {
-               if (vrend_state.use_gles) {
-                  for (unsigned int i = 0; i < 4; ++i) {
-                     glTexParameteri(tview->texture->target, GL_TEXTURE_SWIZZLE_R + i, swizzle[i]);
-                  }
-               } else {
-                  glTexParameteriv(tview->texture->target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
-               }
-               memcpy(tex->cur_swizzle, swizzle, 4 * sizeof(GLint));
-            }
+      if (!tview || !tview->texture) {
+         sampler_index++;
+         continue;
+      }
 
-            glUniform4f(sub_ctx->prog->shadow_samp_mask_locs[shader_type][sampler_index],
-                        (tview->gl_swizzle[0] == GL_ZERO || tview->gl_swizzle[0] == GL_ONE) ? 0.0 : 1.0,
-                        (tview->gl_swizzle[1] == GL_ZERO || tview->gl_swizzle[1] == GL_ONE) ? 0.0 : 1.0,
-                        (tview->gl_swizzle[2] == GL_ZERO || tview->gl_swizzle[2] == GL_ONE) ? 0.0 : 1.0,
-                        (tview->gl_swizzle[3] == GL_ZERO || tview->gl_swizzle[3] == GL_ONE) ? 0.0 : 1.0);
-            glUniform4f(sub_ctx->prog->shadow_samp_add_locs[shader_type][sampler_index],
-                        tview->gl_swizzle[0] == GL_ONE ? 1.0 : 0.0,
-                        tview->gl_swizzle[1] == GL_ONE ? 1.0 : 0.0,
-                        tview->gl_swizzle[2] == GL_ONE ? 1.0 : 0.0,
-                        tview->gl_swizzle[3] == GL_ONE ? 1.0 : 0.0);
-         }
+      GLuint id = tview->gl_id;
+      struct vrend_resource *texture = tview->texture;
+      GLenum target = tview->target;
+      bool update;
 
-         if (tview->texture) {
-            GLuint id = tview->gl_id;
-            struct vrend_resource *texture = tview->texture;
-            GLenum target = tview->target;
+      debug_texture(__func__, tview->texture);
 
-            debug_texture(__func__, tview->texture);
+      if (has_bit(tview->texture->storage_bits, VREND_STORAGE_GL_BUFFER)) {
+         id = texture->tbo_tex_id;
+         target = GL_TEXTURE_BUFFER;
+      }
 
-            if (has_bit(tview->texture->storage_bits, VREND_STORAGE_GL_BUFFER)) {
-               id = texture->tbo_tex_id;
-               target = GL_TEXTURE_BUFFER;
-            }
+      update = (dirty & (1 << i)) || sviews->old_ids[i] != id;
+      if (vrend_texture_unit_bind(sub_ctx, unit, tview, target, id))
+         update = true;
 
-            glActiveTexture(GL_TEXTURE0 + next_sampler_id);
-            glBindTexture(target, id);
+      if ((update || new_program) &&
+          sub_ctx->prog->shadow_samp_mask[shader_type] & (1 << i)) {
+         struct vrend_texture *tex = (struct vrend_texture *)tview->texture;
 
+         /* The modes LUMINANCE, INTENSITY, and ALPHA only apply when a depth texture
+          * is used by a sampler that returns an RGBA value, i.e. by sampler*D, if
+          * the texture is queries by using sampler*Shadow then these swizzles must
+          * not be applied, therefore, reset the swizzled to the default */
+         static const GLint swizzle[] = {GL_RED,GL_GREEN,GL_BLUE,GL_ALPHA};
+         if (memcmp(tex->cur_swizzle, swizzle, 4 * sizeof(GLint))) {
+            /* the parameters go to the texture on the active unit */
+            vrend_active_texture(sub_ctx, unit);
+            glBindTexture(target, id);
             if (vrend_state.use_gles) {
-               const unsigned levels = tview->levels ? tview->levels : tview->texture->base.last_level + 1u;
-               sub_ctx->texture_levels[shader_type][n_samplers++] = levels;
-            }
-
-            if (sub_ctx->views[shader_type].old_ids[i] != id ||
-                sub_ctx->sampler_views_dirty[shader_type] & (1 << i)) {
-               vrend_apply_sampler_state(sub_ctx, texture, shader_type, i,
-                                         next_sampler_id, tview);
-               sviews->old_ids[i] = id;
+               for (unsigned int i = 0; i < 4; ++i) {
+                  glTexParameteri(tview->texture->target, GL_TEXTURE_SWIZZLE_R + i, swizzle[i]);
+               }
+            } else {
+               glTexParameteriv(tview->texture->target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
             }
-            dirty &= ~(1 << i);
+            memcpy(tex->cur_swizzle, swizzle, 4 * sizeof(GLint));
          }
+
+         glUniform4f(sub_ctx->prog->shadow_samp_mask_locs[shader_type][sampler_index],
+                     (tview->gl_swizzle[0] == GL_ZERO || tview->gl_swizzle[0] == GL_ONE) ? 0.0 : 1.0,
+                     (tview->gl_swizzle[1] == GL_ZERO || tview->gl_swizzle[1] == GL_ONE) ? 0.0 : 1.0,
+                     (tview->gl_swizzle[2] == GL_ZERO || tview->gl_swizzle[2] == GL_ONE) ? 0.0 : 1.0,
+                     (tview->gl_swizzle[3] == GL_ZERO || tview->gl_swizzle[3] == GL_ONE) ? 0.0 : 1.0);
+         glUniform4f(sub_ctx->prog->shadow_samp_add_locs[shader_type][sampler_index],
+                     tview->gl_swizzle[0] == GL_ONE ? 1.0 : 0.0,
+                     tview->gl_swizzle[1] == GL_ONE ? 1.0 : 0.0,
+                     tview->gl_swizzle[2] == GL_ONE ? 1.0 : 0.0,
+                     tview->gl_swizzle[3] == GL_ONE ? 1.0 : 0.0);
       }
+
+      /* the shader indexes the levels by the rank of the sampler */
+      if (vrend_state.use_gles) {
+         const unsigned levels = tview->levels ? tview->levels : tview->texture->base.last_level + 1u;
+         sub_ctx->texture_levels[shader_type][sampler_index] = levels;
+      }
+
+      /* sampler objects are shadowed per unit, another stage may have left
+       * a different one on this unit */
+      if (update || has_feature(feat_samplers))
+         vrend_apply_sampler_state(sub_ctx, texture, shader_type, i, unit, tview);
+      sviews->old_ids[i] = id;
+      dirty &= ~(1 << i);
       sampler_index++;
-      next_sampler_id++;
    }
 
-   sub_ctx->n_samplers[shader_type] = n_samplers;
+   sub_ctx->n_samplers[shader_type] = sampler_index;
    sub_ctx->sampler_views_dirty[shader_type] = dirty;
 
    return next_sampler_id;
@@ -5307,9 +6709,177 @@ static int vrend_draw_bind_ubo_shader(struct vrend_sub_context *sub_ctx,
    return next_ubo_id;
 }
 
+static bool vrend_const_ring_init(struct vrend_const_ring *ring)
+{
+   const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                            GL_MAP_COHERENT_BIT;
+
+   glGenBuffers(1, &ring->id);
+   glBindBuffer(GL_UNIFORM_BUFFER, ring->id);
+   glBufferStorage(GL_UNIFORM_BUFFER, VREND_CONST_RING_SIZE, NULL, flags);
+   ring->map = glMapBufferRange(GL_UNIFORM_BUFFER, 0, VREND_CONST_RING_SIZE, flags);
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+   if (!ring->map) {
+      virgl_warn("Failed to map the constant ring, staging the uploads\n");
+      glDeleteBuffers(1, &ring->id);
+
+      /* the shaders already read their constants from the ring, so keep a
+       * plain buffer around instead of trying again on every draw */
+      ring->map = malloc(VREND_CONST_RING_SIZE);
+      if (!ring->map) {
+         virgl_error("Failed to allocate the constant ring\n");
+         ring->id = 0;
+         ring->failed = true;
+         return false;
+      }
+      glGenBuffers(1, &ring->id);
+      glBindBuffer(GL_UNIFORM_BUFFER, ring->id);
+      glBufferData(GL_UNIFORM_BUFFER, VREND_CONST_RING_SIZE, NULL, GL_STREAM_DRAW);
+      glBindBuffer(GL_UNIFORM_BUFFER, 0);
+      ring->staged = true;
+   }
+
+   ring->offset = 0;
+   ring->segment = 0;
+   return true;
+}
+
+static void vrend_const_ring_fini(struct vrend_const_ring *ring)
+{
+   if (!ring->id)
+      return;
+
+   for (int i = 0; i < VREND_CONST_RING_SEGMENTS; i++) {
+      if (ring->fences[i])
+         glDeleteSync(ring->fences[i]);
+      ring->fences[i] = NULL;
+   }
+   ring->unfenced = 0;
+
+   /* deleting the buffer also drops the persistent mapping */
+   glDeleteBuffers(1, &ring->id);
+   if (ring->staged)
+      free(ring->map);
+   ring->id = 0;
+   ring->map = NULL;
+   ring->staged = false;
+}
+
+/* Fences the segments the writer left, called once the draws reading them
+ * have been issued. */
+static void vrend_const_ring_fence(struct vrend_const_ring *ring)
+{
+   while (ring->unfenced) {
+      int i = u_bit_scan(&ring->unfenced);
+
+      assert(!ring->fences[i]);
+      ring->fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   }
+}
+
+/* Returns a pointer to size bytes of the ring the GPU is done with, and
+ * their offset in the buffer. */
+static void *vrend_const_ring_alloc(struct vrend_const_ring *ring,
+                                    uint32_t size, uint32_t *offset)
+{
+   const uint32_t segment_size = VREND_CONST_RING_SIZE / VREND_CONST_RING_SEGMENTS;
+   uint32_t start, last_segment;
+
+   if (!size || size > segment_size)
+      return NULL;
+
+   if (!ring->id && (ring->failed || !vrend_const_ring_init(ring)))
+      return NULL;
+
+   start = align(ring->offset, vrend_state.const_ring_alignment);
+   if (start + size > VREND_CONST_RING_SIZE)
+      start = 0;
+   last_segment = (start + size - 1) / segment_size;
+
+   while (ring->segment != last_segment) {
+      GLsync fence;
+      GLenum status;
+
+      /* stages bound before this one may still read the segment in the
+       * draw that is being set up, it is fenced once the draw is issued */
+      ring->unfenced |= 1u << ring->segment;
+      ring->segment = (ring->segment + 1) % VREND_CONST_RING_SEGMENTS;
+      ring->serial++;
+
+      /* only a single command wrapping the whole ring, e.g. a loop of
+       * indirect draws, comes back before its draws are fenced; those are
+       * issued already */
+      if (ring->unfenced & (1u << ring->segment))
+         vrend_const_ring_fence(ring);
+
+      fence = ring->fences[ring->segment];
+      if (fence) {
+         status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                   VREND_CONST_RING_WAIT_NS);
+         if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+            virgl_error("Constant ring segment %u still in use, overwriting it\n",
+                        ring->segment);
+         glDeleteSync(fence);
+         ring->fences[ring->segment] = NULL;
+      }
+   }
+
+   ring->offset = start + size;
+   *offset = start;
+   return ring->map + start;
+}
+
+/* Makes size bytes written at offset visible to the GPU. */
+static void vrend_const_ring_upload(struct vrend_const_ring *ring,
+                                    uint32_t offset, uint32_t size)
+{
+   if (!ring->staged)
+      return;
+
+   glBindBuffer(GL_UNIFORM_BUFFER, ring->id);
+   glBufferSubData(GL_UNIFORM_BUFFER, offset, size, ring->map + offset);
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+static void vrend_draw_bind_const_ring(struct vrend_sub_context *sub_ctx,
+                                       int shader_type)
+{
+   const struct vrend_constants *consts = &sub_ctx->consts[shader_type];
+   uint32_t size = sub_ctx->shaders[shader_type]->sinfo.num_consts * 16;
+   uint32_t copy_size = MIN2(size, consts->num_consts * 4);
+   uint32_t offset;
+   uint8_t *ptr;
+
+   ptr = vrend_const_ring_alloc(&sub_ctx->const_ring, size, &offset);
+   if (!ptr)
+      return;
+
+   /* the bound range must cover the whole block */
+   if (consts->consts && copy_size)
+      memcpy(ptr, consts->consts, copy_size);
+   else
+      copy_size = 0;
+   memset(ptr + copy_size, 0, size - copy_size);
+   vrend_const_ring_upload(&sub_ctx->const_ring, offset, size);
+
+   glBindBufferRange(GL_UNIFORM_BUFFER, sub_ctx->prog->const_block_bind[shader_type],
+                     sub_ctx->const_ring.id, offset, size);
+   sub_ctx->const_ring_serial[shader_type] = sub_ctx->const_ring.serial;
+   sub_ctx->const_dirty[shader_type] = false;
+}
+
 static void vrend_draw_bind_const_shader(struct vrend_sub_context *sub_ctx,
                                          int shader_type, bool new_program)
 {
+   if (sub_ctx->prog->const_block_bind[shader_type] != -1) {
+      if (sub_ctx->shaders[shader_type] &&
+          (sub_ctx->const_dirty[shader_type] || new_program ||
+           sub_ctx->const_ring_serial[shader_type] != sub_ctx->const_ring.serial))
+         vrend_draw_bind_const_ring(sub_ctx, shader_type);
+      return;
+   }
+
    if (sub_ctx->consts[shader_type].consts &&
        sub_ctx->shaders[shader_type] &&
        (sub_ctx->prog->const_location[shader_type] != -1) &&
@@ -5505,10 +7075,36 @@ static void vrend_draw_bind_images_shader(struct vrend_sub_context *sub_ctx, int
    }
 }
 
+static void
+vrend_draw_bind_sysval_ring(struct vrend_sub_context *sub_ctx, bool new_program)
+{
+   uint32_t offset;
+   void *ptr;
+
+   if (!new_program &&
+       sub_ctx->sysval_ring_cookie == sub_ctx->sysvalue_data_cookie &&
+       sub_ctx->sysval_ring_serial == sub_ctx->const_ring.serial)
+      return;
+
+   ptr = vrend_const_ring_alloc(&sub_ctx->const_ring,
+                                sizeof(struct sysval_uniform_block), &offset);
+   if (!ptr)
+      return;
+
+   memcpy(ptr, &sub_ctx->sysvalue_data, sizeof(struct sysval_uniform_block));
+   vrend_const_ring_upload(&sub_ctx->const_ring, offset,
+                           sizeof(struct sysval_uniform_block));
+   glBindBufferRange(GL_UNIFORM_BUFFER, sub_ctx->prog->virgl_block_bind,
+                     sub_ctx->const_ring.id, offset,
+                     sizeof(struct sysval_uniform_block));
+   sub_ctx->sysval_ring_cookie = sub_ctx->sysvalue_data_cookie;
+   sub_ctx->sysval_ring_serial = sub_ctx->const_ring.serial;
+}
+
 static void
 vrend_fill_sysval_uniform_block (struct vrend_sub_context *sub_ctx)
 {
-   if (sub_ctx->prog->virgl_block_bind == -1)
+   if (sub_ctx->prog->virgl_block_bind == -1 || vrend_state.max_const_ubo_vec4)
       return;
 
    if (sub_ctx->sysvalue_data_cookie != sub_ctx->prog->sysvalue_data_cookie) {
@@ -5523,12 +7119,15 @@ vrend_fill_sysval_uniform_block (struct vrend_sub_context *sub_ctx)
 static void vrend_draw_bind_objects(struct vrend_sub_context *sub_ctx, bool new_program)
 {
    int next_ubo_id = 0, next_sampler_id = 0;
+
+   vrend_texture_units_invalidate_active(sub_ctx);
    for (int shader_type = PIPE_SHADER_VERTEX; shader_type <= sub_ctx->last_shader_idx; shader_type++) {
       vrend_set_active_pipeline_stage(sub_ctx->prog, shader_type);
 
       next_ubo_id = vrend_draw_bind_ubo_shader(sub_ctx, shader_type, next_ubo_id);
       vrend_draw_bind_const_shader(sub_ctx, shader_type, new_program);
-      next_sampler_id = vrend_draw_bind_samplers_shader(sub_ctx, shader_type, next_sampler_id);
+      next_sampler_id = vrend_draw_bind_samplers_shader(sub_ctx, shader_type, next_sampler_id,
+                                                         new_program);
 
       vrend_draw_bind_images_shader(sub_ctx, shader_type);
       vrend_draw_bind_ssbo_shader(sub_ctx, shader_type);
@@ -5542,11 +7141,16 @@ static void vrend_draw_bind_objects(struct vrend_sub_context *sub_ctx, bool new_
          }
       }
    }
+   vrend_texture_units_flush(sub_ctx);
 
-   if (sub_ctx->prog->virgl_block_bind != -1)
-      glBindBufferRange(GL_UNIFORM_BUFFER, sub_ctx->prog->virgl_block_bind,
-                        sub_ctx->prog->ubo_sysval_buffer_id,
-                        0, sizeof(struct sysval_uniform_block));
+   if (sub_ctx->prog->virgl_block_bind != -1) {
+      if (vrend_state.max_const_ubo_vec4)
+         vrend_draw_bind_sysval_ring(sub_ctx, new_program);
+      else
+         glBindBufferRange(GL_UNIFORM_BUFFER, sub_ctx->prog->virgl_block_bind,
+                           sub_ctx->prog->ubo_sysval_buffer_id,
+                           0, sizeof(struct sysval_uniform_block));
+   }
 
    vrend_draw_bind_abo_shader(sub_ctx);
 
@@ -5602,8 +7206,11 @@ enum select_program_result {
     PROGRAMM_NEW
 };
 
+/* With precompile set the shaders and the program are only submitted to the
+ * driver, checking the results is left to the first draw that uses them. */
 static enum select_program_result
-vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch)
+vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_patch,
+                     bool precompile)
 {
    struct vrend_linked_shader_program *prog;
    bool fs_dirty, vs_dirty, gs_dirty, tcs_dirty, tes_dirty;
@@ -5669,7 +7276,9 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
 
       struct vrend_shader *shader = sel->current;
       if (shader && !shader->is_compiled) {
-         if (!vrend_compile_shader(sub_ctx, shader))
+         if (precompile && !sel->sinfo.separable_program)
+            vrend_compile_shader_async(sub_ctx, shader);
+         else if (!vrend_compile_shader(sub_ctx, shader))
             return PROGRAMM_ERROR;
       }
       if (vrend_state.use_gles && sel->sinfo.gles_use_tex_query_level)
@@ -5721,10 +7330,13 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
                                    gs_id ? sub_ctx->shaders[PIPE_SHADER_GEOMETRY]->current : NULL,
                                    tcs_id ? sub_ctx->shaders[PIPE_SHADER_TESS_CTRL]->current : NULL,
                                    tes_id ? sub_ctx->shaders[PIPE_SHADER_TESS_EVAL]->current : NULL,
-                                   separable);
+                                   separable, precompile);
          if (!prog)
             return PROGRAMM_ERROR;
          prog->gles_use_query_texturelevel_mask = gles_emulate_query_texture_levels_mask;
+      } else if (prog->link_pending) {
+         if (!precompile && !finish_shader_program(sub_ctx, prog))
+            return PROGRAMM_ERROR;
       } else if (separable) {
           /* UBO block bindings are reset to zero if the programs are
            * re-linked.  With separable shaders, the program can be relinked
@@ -5771,23 +7383,59 @@ vrend_select_program(struct vrend_sub_context *sub_ctx, uint8_t vertices_per_pat
          sub_ctx->sampler_views_dirty[stage] = ~0;
       }
 
-      prog->ref_context = sub_ctx;
+      prog->ref_context = sub_ctx;
+   }
+   sub_ctx->cs_shader_dirty = true;
+   sub_ctx->shader_dirty = false;
+
+   return new_program;
+
+fail:
+   virgl_error("Failure to compile shader variants: %s\n", sub_ctx->parent->debug_name);
+   return PROGRAMM_ERROR;
+}
+
+static void vrend_link_compute_program_hook(struct vrend_context *ctx, uint32_t handle)
+{
+   struct vrend_sub_context *sub_ctx = ctx->sub;
+   struct vrend_shader_selector *sel;
+   struct vrend_shader *cs;
+   bool precompile = has_feature(feat_parallel_shader_compile);
+
+   if (!has_feature(feat_compute_shader))
+      return;
+
+   sel = vrend_object_lookup(sub_ctx->object_hash, handle, VIRGL_OBJECT_SHADER);
+   if (!sel || sel->type != PIPE_SHADER_COMPUTE)
+      return;
+
+   /* The compute key doesn't depend on the bound state, so the variant can be
+    * selected without binding the shader. */
+   if (vrend_shader_select(sub_ctx, sel, NULL) || !sel->current)
+      return;
+
+   cs = sel->current;
+   if (!cs->is_compiled) {
+      if (precompile)
+         vrend_compile_shader_async(sub_ctx, cs);
+      else if (!vrend_compile_shader(sub_ctx, cs))
+         return;
    }
-   sub_ctx->cs_shader_dirty = true;
-   sub_ctx->shader_dirty = false;
 
-   return new_program;
+   if (!lookup_cs_shader_program(ctx, cs->id))
+      add_cs_shader_program(ctx, cs, precompile);
 
-fail:
-   virgl_error("Failure to compile shader variants: %s\n", sub_ctx->parent->debug_name);
-   return PROGRAMM_ERROR;
+   /* add_cs_shader_program may have changed the bound program */
+   sub_ctx->cs_shader_dirty = true;
+   sub_ctx->shader_dirty = true;
 }
 
 void vrend_link_program_hook(struct vrend_context *ctx, uint32_t *handles)
 {
-   /* Pre-compiling compute shaders needs some additional work */
-   if (handles[PIPE_SHADER_COMPUTE])
+   if (handles[PIPE_SHADER_COMPUTE]) {
+      vrend_link_compute_program_hook(ctx, handles[PIPE_SHADER_COMPUTE]);
       return;
+   }
 
    struct vrend_shader_selector *vs = vrend_object_lookup(ctx->sub->object_hash,
                                                           handles[PIPE_SHADER_VERTEX],
@@ -5826,8 +7474,12 @@ void vrend_link_program_hook(struct vrend_context *ctx, uint32_t *handles)
        }
    }
 
-   /* Force early-link of the whole shader program. */
-   vrend_select_program(ctx->sub, 1);
+   /* Force early-link of the whole shader program. The variants are selected
+    * from the current state, which is what the next draw most likely uses, and
+    * the patch size is taken from the last draw. If the driver can compile in
+    * parallel only the compile and link are started here. */
+   vrend_select_program(ctx->sub, MAX2(ctx->sub->last_vertices_per_patch, 1),
+                        has_feature(feat_parallel_shader_compile));
 
    ctx->sub->shader_dirty = true;
    ctx->sub->cs_shader_dirty = true;
@@ -5841,6 +7493,228 @@ void vrend_link_program_hook(struct vrend_context *ctx, uint32_t *handles)
    ctx->sub->prog = prev_prog;
 }
 
+static const char *vrend_indirect_fixup_cs =
+   "layout(local_size_x = 64) in;\n"
+   "layout(std430, binding = 0) readonly buffer src_buf { uint src[]; };\n"
+   "layout(std430, binding = 1) readonly buffer count_buf { uint count[]; };\n"
+   "layout(std430, binding = 2) writeonly buffer dst_buf { uint dst[]; };\n"
+   "uniform uint src_offset;\n"
+   "uniform uint src_stride;\n"
+   "uniform uint count_offset;\n"
+   "uniform uint max_draws;\n"
+   "uniform uint cmd_size;\n"
+   "void main() {\n"
+   "   uint i = gl_GlobalInvocationID.x;\n"
+   "   if (i >= max_draws)\n"
+   "      return;\n"
+   "   uint n = min(count[count_offset], max_draws);\n"
+   "   for (uint j = 0u; j < cmd_size; j++)\n"
+   "      dst[i * cmd_size + j] = src[src_offset + i * src_stride + j];\n"
+   "   /* draws past the count get no instances */\n"
+   "   if (i >= n)\n"
+   "      dst[i * cmd_size + 1u] = 0u;\n"
+   "}\n";
+
+static bool vrend_indirect_fixup_supported(void)
+{
+   int gl_ver = vrend_state.gl_major_ver * 10 + vrend_state.gl_minor_ver;
+
+   if (!has_feature(feat_indirect_draw) || !has_feature(feat_compute_shader) ||
+       !has_feature(feat_ssbo))
+      return false;
+
+   /* the shader is written against the versions with compute in core */
+   return vrend_state.use_gles ? gl_ver >= 31 : gl_ver >= 43;
+}
+
+static bool vrend_indirect_fixup_init(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_indirect_fixup *fixup = &sub_ctx->indirect_fixup;
+   const char *sources[2];
+   GLuint shader;
+   GLint status;
+
+   if (fixup->program)
+      return true;
+   if (fixup->failed)
+      return false;
+
+   sources[0] = vrend_state.use_gles ? "#version 310 es\n" : "#version 430\n";
+   sources[1] = vrend_indirect_fixup_cs;
+
+   shader = glCreateShader(GL_COMPUTE_SHADER);
+   glShaderSource(shader, 2, sources, NULL);
+   glCompileShader(shader);
+   glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+   if (status == GL_TRUE) {
+      fixup->program = glCreateProgram();
+      glAttachShader(fixup->program, shader);
+      glLinkProgram(fixup->program);
+      glGetProgramiv(fixup->program, GL_LINK_STATUS, &status);
+   }
+   glDeleteShader(shader);
+
+   if (status != GL_TRUE) {
+      virgl_error("Failed to build the indirect draw fixup shader: %s\n",
+                  sub_ctx->parent->debug_name);
+      if (fixup->program)
+         glDeleteProgram(fixup->program);
+      fixup->program = 0;
+      fixup->failed = true;
+      return false;
+   }
+
+   fixup->src_offset_loc = glGetUniformLocation(fixup->program, "src_offset");
+   fixup->src_stride_loc = glGetUniformLocation(fixup->program, "src_stride");
+   fixup->count_offset_loc = glGetUniformLocation(fixup->program, "count_offset");
+   fixup->max_draws_loc = glGetUniformLocation(fixup->program, "max_draws");
+   fixup->cmd_size_loc = glGetUniformLocation(fixup->program, "cmd_size");
+   glGenBuffers(1, &fixup->buffer);
+
+   glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &status);
+   fixup->ssbo_alignment = MAX2(status, 4);
+   return true;
+}
+
+static void vrend_indirect_fixup_fini(struct vrend_sub_context *sub_ctx)
+{
+   struct vrend_indirect_fixup *fixup = &sub_ctx->indirect_fixup;
+
+   if (fixup->program)
+      glDeleteProgram(fixup->program);
+   if (fixup->buffer)
+      glDeleteBuffers(1, &fixup->buffer);
+}
+
+/* Without ARB_indirect_parameters the draw count can't be taken from a
+ * buffer. A compute shader copies the commands into a packed scratch buffer
+ * instead and empties the draws past the count, so they can be issued with
+ * the maximum draw count and the count never has to be read back. This
+ * binds the fixup program, so it must run before the draw state is bound.
+ * The caller has checked that the commands and the count fit the guest
+ * buffers, only those ranges are bound to the shader. */
+static bool vrend_indirect_fixup(struct vrend_sub_context *sub_ctx,
+                                 struct vrend_indirect_source *src,
+                                 uint32_t cmd_size)
+{
+   struct vrend_indirect_fixup *fixup = &sub_ctx->indirect_fixup;
+   uint32_t size = src->draw_count * cmd_size * 4;
+   uint32_t stride = src->stride ? src->stride : cmd_size * 4;
+   uint32_t src_start, src_size, count_start;
+
+   if (src->draw_count > VREND_INDIRECT_FIXUP_MAX_DRAWS ||
+       (src->offset | stride | src->count_offset) & 3)
+      return false;
+
+   /* programs can't be switched while transform feedback is running */
+   if (sub_ctx->current_so && sub_ctx->current_so->xfb_state == XFB_STATE_STARTED)
+      return false;
+
+   if (!vrend_indirect_fixup_init(sub_ctx))
+      return false;
+
+   if (!src->draw_count)
+      return true;
+
+   if (fixup->buffer_size < size) {
+      glBindBuffer(GL_SHADER_STORAGE_BUFFER, fixup->buffer);
+      glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STREAM_COPY);
+      fixup->buffer_size = size;
+   }
+
+   /* the bound ranges have to start at the SSBO offset alignment */
+   src_start = src->offset - src->offset % fixup->ssbo_alignment;
+   src_size = src->offset - src_start + (src->draw_count - 1) * stride + cmd_size * 4;
+   count_start = src->count_offset - src->count_offset % fixup->ssbo_alignment;
+
+   if (has_feature(feat_separate_shader_objects))
+      bind_pipeline(sub_ctx, 0);
+   use_program(sub_ctx, fixup->program);
+
+   glUniform1ui(fixup->src_offset_loc, (src->offset - src_start) / 4);
+   glUniform1ui(fixup->src_stride_loc, stride / 4);
+   glUniform1ui(fixup->count_offset_loc, (src->count_offset - count_start) / 4);
+   glUniform1ui(fixup->max_draws_loc, src->draw_count);
+   glUniform1ui(fixup->cmd_size_loc, cmd_size);
+
+   /* the draw rebinds the guest SSBOs */
+   glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, src->buffer, src_start, src_size);
+   glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, src->count_buffer, count_start,
+                     src->count_offset - count_start + 4);
+   glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, fixup->buffer, 0, size);
+   /* the commands or the count may have been written by the GPU */
+   glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+   glDispatchCompute(DIV_ROUND_UP(src->draw_count, 64), 1, 1);
+   glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+   src->buffer = fixup->buffer;
+   src->offset = 0;
+   src->stride = cmd_size * 4;
+   src->count_buffer = 0;
+   src->count_offset = 0;
+   return true;
+}
+
+static void vrend_draw_set_drawid(struct vrend_sub_context *sub_ctx, int drawid)
+{
+   if (!has_feature(feat_draw_parameters) || !sub_ctx->prog->reads_drawid ||
+       sub_ctx->sysvalue_data.drawid_base == drawid)
+      return;
+
+   sub_ctx->sysvalue_data.drawid_base = drawid;
+   sub_ctx->sysvalue_data_cookie++;
+
+   if (sub_ctx->prog->virgl_block_bind == -1)
+      return;
+   if (vrend_state.max_const_ubo_vec4)
+      vrend_draw_bind_sysval_ring(sub_ctx, false);
+   else
+      vrend_fill_sysval_uniform_block(sub_ctx);
+}
+
+/* Issue an indirect draw from the bound GL_DRAW_INDIRECT_BUFFER. Multi-draws
+ * without ARB_multi_draw_indirect become a loop of single indirect draws, the
+ * commands stay on the GPU either way. elsz is zero for non-indexed draws.
+ * The draw count has been checked against the size of the command buffer,
+ * which also bounds the number of GL calls in the loop. */
+static void vrend_draw_indirect(struct vrend_sub_context *sub_ctx,
+                                const struct pipe_draw_info *info,
+                                const struct vrend_indirect_source *src,
+                                GLenum mode, GLenum elsz)
+{
+   uint32_t cmd_size = elsz ? 20 : 16;
+   uint32_t stride = src->stride ? src->stride : cmd_size;
+
+   if (src->count_buffer) {
+      if (elsz)
+         glMultiDrawElementsIndirectCountARB(mode, elsz, (GLvoid const *)(uintptr_t)src->offset,
+                                             src->count_offset, src->draw_count, src->stride);
+      else
+         glMultiDrawArraysIndirectCountARB(mode, (GLvoid const *)(uintptr_t)src->offset,
+                                           src->count_offset, src->draw_count, src->stride);
+   } else if (src->draw_count > 1 && has_feature(feat_multi_draw_indirect)) {
+      if (elsz)
+         glMultiDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)src->offset,
+                                     src->draw_count, src->stride);
+      else
+         glMultiDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)src->offset,
+                                   src->draw_count, src->stride);
+   } else {
+      for (uint32_t i = 0; i < MAX2(src->draw_count, 1); i++) {
+         uintptr_t offset = src->offset + (uintptr_t)i * stride;
+
+         if (i)
+            vrend_draw_set_drawid(sub_ctx, info->drawid + i);
+         if (elsz)
+            glDrawElementsIndirect(mode, elsz, (GLvoid const *)offset);
+         else
+            glDrawArraysIndirect(mode, (GLvoid const *)offset);
+      }
+      if (src->draw_count > 1)
+         vrend_draw_set_drawid(sub_ctx, info->drawid);
+   }
+}
+
 int vrend_draw_vbo(struct vrend_context *ctx,
                    const struct pipe_draw_info *info,
                    uint32_t cso, uint32_t indirect_handle,
@@ -5849,6 +7723,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    enum select_program_result program_select_result = PROGRAMM_NO_CHANGE;
    struct vrend_resource *indirect_res = NULL;
    struct vrend_resource *indirect_params_res = NULL;
+   struct vrend_indirect_source indirect = { 0 };
    struct vrend_sub_context *sub_ctx = ctx->sub;
 
    if (ctx->in_error)
@@ -5860,9 +7735,6 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (info->start_instance && !has_feature(feat_base_instance))
       return EINVAL;
 
-   if (info->indirect.draw_count > 1 && !has_feature(feat_multi_draw_indirect))
-      return EINVAL;
-
    if (indirect_handle) {
       if (!has_feature(feat_indirect_draw))
          return EINVAL;
@@ -5873,9 +7745,9 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       }
    }
 
-   /* this must be zero until we support the feature */
    if (indirect_draw_count_handle) {
-      if (!has_feature(feat_indirect_params))
+      if (!indirect_res ||
+          (!has_feature(feat_indirect_params) && !vrend_indirect_fixup_supported()))
          return EINVAL;
 
       indirect_params_res = vrend_renderer_ctx_res_lookup(ctx, indirect_draw_count_handle);
@@ -5885,6 +7757,28 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       }
    }
 
+   /* The commands and the draw count are read from the guest buffers by GL
+    * or by the fixup shader, make sure they stay inside them. This also
+    * bounds the draw loop used without multi-draw indirect. */
+   if (indirect_res) {
+      uint32_t cmd_size = info->indexed ? 20 : 16;
+      uint32_t stride = info->indirect.stride ? info->indirect.stride : cmd_size;
+      uint32_t draws = MAX2(info->indirect.draw_count, 1);
+
+      if ((uint64_t)info->indirect.offset + (uint64_t)(draws - 1) * stride + cmd_size >
+          indirect_res->base.width0) {
+         vrend_report_context_error(ctx, VIRGL_ERROR_CTX_RESOURCE_OUT_OF_RANGE, indirect_handle);
+         return EINVAL;
+      }
+   }
+
+   if (indirect_params_res &&
+       (uint64_t)info->indirect.indirect_draw_count_offset + 4 > indirect_params_res->base.width0) {
+      vrend_report_context_error(ctx, VIRGL_ERROR_CTX_RESOURCE_OUT_OF_RANGE,
+                                 indirect_draw_count_handle);
+      return EINVAL;
+   }
+
    if (ctx->ctx_switch_pending)
       vrend_finish_context_switch(ctx);
 
@@ -5910,15 +7804,39 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       sub_ctx->prim_mode = (int)info->mode;
    }
 
+   if (info->vertices_per_patch)
+      sub_ctx->last_vertices_per_patch = info->vertices_per_patch;
+
    if (sub_ctx->shader_dirty || sub_ctx->swizzle_output_rgb_to_bgr ||
        sub_ctx->needs_manual_srgb_encode_bitmask || sub_ctx->vbo_dirty)
-      program_select_result = vrend_select_program(sub_ctx, info->vertices_per_patch);
+      program_select_result = vrend_select_program(sub_ctx, info->vertices_per_patch, false);
 
    if (!sub_ctx->prog || program_select_result == PROGRAMM_ERROR) {
       virgl_error("Dropping rendering due to missing shaders: %s\n", ctx->debug_name);
       return 0;
    }
 
+   if (indirect_res) {
+      indirect.buffer = indirect_res->gl_id;
+      indirect.offset = info->indirect.offset;
+      indirect.stride = info->indirect.stride;
+      indirect.draw_count = info->indirect.draw_count;
+      if (indirect_params_res) {
+         indirect.count_buffer = indirect_params_res->gl_id;
+         indirect.count_offset = info->indirect.indirect_draw_count_offset;
+      }
+
+      /* a draw count buffer only ever lowers the count */
+      if (indirect.count_buffer && !indirect.draw_count)
+         return 0;
+
+      if (indirect.count_buffer && !has_feature(feat_indirect_params) &&
+          !vrend_indirect_fixup(sub_ctx, &indirect, info->indexed ? 5 : 4)) {
+         virgl_error("Dropping indirect draw with a draw count buffer: %s\n", ctx->debug_name);
+         return 0;
+      }
+   }
+
    vrend_use_program(sub_ctx, sub_ctx->prog);
 
    if (has_feature(feat_draw_parameters) &&
@@ -5947,21 +7865,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    vrend_draw_bind_objects(sub_ctx, program_select_result == PROGRAMM_NEW);
    vrend_fill_sysval_uniform_block(sub_ctx);
 
-   if (has_feature(feat_gles31_vertex_attrib_binding)) {
-      if (sub_ctx->ve) {
-         vrend_draw_bind_vertex_binding(ctx, sub_ctx->ve);
-      } else {
-         glBindVertexArray(sub_ctx->vaoid);
-      }
-   } else {
-      if (sub_ctx->ve) {
-         vrend_draw_bind_vertex_legacy(ctx, sub_ctx->ve);
-      } else {
-         struct vrend_vertex_element_array va;
-         va.count = 0;
-         vrend_draw_bind_vertex_legacy(ctx, &va);
-      }
-   }
+   vrend_draw_bind_vertex(ctx);
 
    if (info->indexed) {
       struct vrend_resource *res = (struct vrend_resource *)sub_ctx->ib.buffer;
@@ -6012,14 +7916,14 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    }
 
    if (has_feature(feat_indirect_draw)) {
-      GLint buf = indirect_res ? indirect_res->gl_id : 0;
+      GLint buf = indirect.buffer;
       if (sub_ctx->draw_indirect_buffer != buf) {
          glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buf);
          sub_ctx->draw_indirect_buffer = buf;
       }
 
       if (has_feature(feat_indirect_params)) {
-         GLint buf = indirect_params_res ? indirect_params_res->gl_id : 0;
+         GLint buf = indirect.count_buffer;
          if (sub_ctx->draw_indirect_params_buffer != buf) {
             glBindBuffer(GL_PARAMETER_BUFFER_ARB, buf);
             sub_ctx->draw_indirect_params_buffer = buf;
@@ -6056,13 +7960,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       int start = cso ? 0 : info->start;
 
       if (indirect_handle) {
-         if (indirect_params_res)
-            glMultiDrawArraysIndirectCountARB(mode, (GLvoid const *)(uintptr_t)info->indirect.offset,
-                                              info->indirect.indirect_draw_count_offset, info->indirect.draw_count, info->indirect.stride);
-         else if (info->indirect.draw_count > 1)
-            glMultiDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset, info->indirect.draw_count, info->indirect.stride);
-         else
-            glDrawArraysIndirect(mode, (GLvoid const *)(uintptr_t)info->indirect.offset);
+         vrend_draw_indirect(sub_ctx, info, &indirect, mode, 0);
       } else if (info->instance_count > 0) {
          if (info->start_instance > 0)
             glDrawArraysInstancedBaseInstance(mode, start, count, info->instance_count, info->start_instance);
@@ -6087,13 +7985,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       }
 
       if (indirect_handle) {
-         if (indirect_params_res)
-            glMultiDrawElementsIndirectCountARB(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset,
-                                                info->indirect.indirect_draw_count_offset, info->indirect.draw_count, info->indirect.stride);
-         else if (info->indirect.draw_count > 1)
-            glMultiDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset, info->indirect.draw_count, info->indirect.stride);
-         else
-            glDrawElementsIndirect(mode, elsz, (GLvoid const *)(uintptr_t)info->indirect.offset);
+         vrend_draw_indirect(sub_ctx, info, &indirect, mode, elsz);
       } else if (info->index_bias) {
          if (info->instance_count > 0) {
             if (info->start_instance > 0)
@@ -6137,6 +8029,8 @@ int vrend_draw_vbo(struct vrend_context *ctx,
 
    if (use_advanced_blending)
       glDisable(GL_BLEND);
+
+   vrend_const_ring_fence(&sub_ctx->const_ring);
    return 0;
 }
 
@@ -6177,9 +8071,12 @@ void vrend_launch_grid(struct vrend_context *ctx,
       if (sub_ctx->shaders[PIPE_SHADER_COMPUTE]->current->id != (GLuint)sub_ctx->prog_ids[PIPE_SHADER_COMPUTE]) {
          prog = lookup_cs_shader_program(ctx, sub_ctx->shaders[PIPE_SHADER_COMPUTE]->current->id);
          if (!prog) {
-            prog = add_cs_shader_program(ctx, sub_ctx->shaders[PIPE_SHADER_COMPUTE]->current);
+            prog = add_cs_shader_program(ctx, sub_ctx->shaders[PIPE_SHADER_COMPUTE]->current, false);
             if (!prog)
                return;
+         } else if (prog->link_pending) {
+            if (!finish_cs_shader_program(ctx, prog))
+               return;
          }
       } else
          prog = sub_ctx->prog;
@@ -6206,7 +8103,9 @@ void vrend_launch_grid(struct vrend_context *ctx,
    vrend_set_active_pipeline_stage(sub_ctx->prog, PIPE_SHADER_COMPUTE);
    vrend_draw_bind_ubo_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
    vrend_draw_bind_const_shader(sub_ctx, PIPE_SHADER_COMPUTE, new_program);
-   vrend_draw_bind_samplers_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0);
+   vrend_texture_units_invalidate_active(sub_ctx);
+   vrend_draw_bind_samplers_shader(sub_ctx, PIPE_SHADER_COMPUTE, 0, new_program);
+   vrend_texture_units_flush(sub_ctx);
    vrend_draw_bind_images_shader(sub_ctx, PIPE_SHADER_COMPUTE);
    vrend_draw_bind_ssbo_shader(sub_ctx, PIPE_SHADER_COMPUTE);
    vrend_draw_bind_abo_shader(sub_ctx);
@@ -6229,6 +8128,8 @@ void vrend_launch_grid(struct vrend_context *ctx,
    } else {
       glDispatchCompute(grid[0], grid[1], grid[2]);
    }
+
+   vrend_const_ring_fence(&sub_ctx->const_ring);
 }
 
 static GLenum translate_blend_func(uint32_t pipe_blend)
@@ -7049,19 +8950,29 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
     */
    bool is_emulated_alpha = vrend_format_is_emulated_alpha(tview->format);
    if (has_feature(feat_samplers)) {
-      int sampler = vstate->ids[tview->srgb_decode == GL_SKIP_DECODE_EXT ? 0 : 1];
+      int i = tview->srgb_decode == GL_SKIP_DECODE_EXT ? 0 : 1;
+      struct vrend_sampler_object *obj = vstate->objects[i];
+
+      /* the swizzled variant is a sampler object of its own, the shared
+       * one must keep the guest border color */
       if (is_emulated_alpha) {
-         union pipe_color_union border_color;
-         border_color = state->border_color;
-         border_color.ui[0] = border_color.ui[3];
-         border_color.ui[3] = 0;
-         apply_sampler_border_color(sampler, border_color.ui);
+         if (!vstate->alpha_objects[i]) {
+            struct vrend_sampler_key key = obj->key;
+            vrend_sampler_key_swizzle_alpha_border(&key);
+            vstate->alpha_objects[i] = vrend_sampler_cache_get(sub_ctx->parent, &key);
+         }
+         if (vstate->alpha_objects[i])
+            obj = vstate->alpha_objects[i];
       }
 
-      glBindSampler(sampler_id, sampler);
+      vrend_texture_unit_bind_sampler(sub_ctx, sampler_id, obj);
       return;
    }
 
+   /* the parameters go to the texture on the active unit */
+   vrend_texture_units_flush(sub_ctx);
+   vrend_active_texture(sub_ctx, sampler_id);
+
    if (tex->state.max_lod == -1)
       set_all = true;
 
@@ -7104,7 +9015,9 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
     * way to toggle between the behaviour when running on GLES. And adding
     * warnings will spew the logs quite bad. Ignore and hope for the best.
     */
-   if (!vrend_state.use_gles) {
+   if (!vrend_state.use_gles &&
+       sub_ctx->hw_seamless_cube_map != !!state->seamless_cube_map) {
+      sub_ctx->hw_seamless_cube_map = state->seamless_cube_map;
       if (state->seamless_cube_map) {
          glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
       } else {
@@ -7113,7 +9026,7 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
    }
 
    if (memcmp(&tex->state.border_color, &state->border_color, 16) || set_all ||
-       is_emulated_alpha) {
+       tex->cur_alpha_border != is_emulated_alpha) {
       if (is_emulated_alpha) {
          union pipe_color_union border_color;
          border_color = state->border_color;
@@ -7123,7 +9036,7 @@ static void vrend_apply_sampler_state(struct vrend_sub_context *sub_ctx,
       } else {
          glTexParameterIuiv(target, GL_TEXTURE_BORDER_COLOR, state->border_color.ui);
       }
-
+      tex->cur_alpha_border = is_emulated_alpha;
    }
    tex->state = *state;
 }
@@ -7245,10 +9158,14 @@ static bool do_wait(struct vrend_fence *fence, bool can_block)
 }
 
 static void vrend_renderer_check_queries(void);
+static void vrend_queries_fini(struct vrend_sub_context *sub);
 
 void vrend_renderer_poll(void) {
    if (vrend_state.use_async_fence_cb) {
       flush_eventfd(vrend_state.eventfd);
+#ifdef ENABLE_VIDEO
+      vrend_video_poll();
+#endif
       mtx_lock(&vrend_state.poll_mutex);
 
       /* queries must be checked before fences are retired. */
@@ -7263,6 +9180,14 @@ void vrend_renderer_poll(void) {
    }
 }
 
+/* Make the poll fd readable for work that completes outside of the GL
+ * fences, the embedder then calls vrend_renderer_poll(). */
+void vrend_renderer_wake_poll(void)
+{
+   if (vrend_state.eventfd >= 0 && write_eventfd(vrend_state.eventfd, 1))
+      perror("failed to write to eventfd\n");
+}
+
 static void wait_sync(struct vrend_fence *fence)
 {
    struct vrend_context *ctx = fence->ctx;
@@ -7314,7 +9239,7 @@ static void wait_sync(struct vrend_fence *fence)
     * by setting fence->ctx to NULL
     */
    if (ctx) {
-      ctx->fence_retire(fence->fence_id, ctx->fence_retire_data);
+      ctx->fence_retire(0, fence->fence_id, ctx->fence_retire_data);
    }
 
    free_fence_locked(fence);
@@ -7502,6 +9427,74 @@ vrend_renderer_get_pipe_callbacks(void)
    return &callbacks;
 }
 
+/* Legacy constants are streamed through a uniform buffer ring when the host
+ * can map buffers persistently, VIRGL_DISABLE_CONST_UBO falls back to
+ * glUniform4uiv. */
+static void vrend_init_const_ring_limits(void)
+{
+   GLint max_size = 0, max_blocks = 0, max_bindings = 0, alignment = 0, value;
+   int num_stages = 2;
+   struct vrend_const_ring probe = { 0 };
+
+   vrend_state.max_const_ubo_vec4 = 0;
+
+   if (!has_feature(feat_ubo) || !has_feature(feat_arb_buffer_storage) ||
+       getenv("VIRGL_DISABLE_CONST_UBO"))
+      return;
+
+   glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_size);
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+   /* the shaders only know the smallest per-stage block limit */
+   glGetIntegerv(GL_MAX_VERTEX_UNIFORM_BLOCKS, &max_blocks);
+   glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_BLOCKS, &value);
+   max_blocks = MIN2(max_blocks, value);
+   if (has_feature(feat_geometry_shader)) {
+      glGetIntegerv(GL_MAX_GEOMETRY_UNIFORM_BLOCKS, &value);
+      max_blocks = MIN2(max_blocks, value);
+      num_stages++;
+   }
+   if (has_feature(feat_tessellation)) {
+      glGetIntegerv(GL_MAX_TESS_CONTROL_UNIFORM_BLOCKS, &value);
+      max_blocks = MIN2(max_blocks, value);
+      glGetIntegerv(GL_MAX_TESS_EVALUATION_UNIFORM_BLOCKS, &value);
+      max_blocks = MIN2(max_blocks, value);
+      num_stages += 2;
+   }
+   if (has_feature(feat_compute_shader)) {
+      glGetIntegerv(GL_MAX_COMPUTE_UNIFORM_BLOCKS, &value);
+      max_blocks = MIN2(max_blocks, value);
+   }
+
+   /* each stage binds its UBOs and its constant block after the ones of the
+    * stages before it, with the shared VirglBlock in between, so a program
+    * with every stage at the limit must still fit the binding points */
+   glGetIntegerv(GL_MAX_UNIFORM_BUFFER_BINDINGS, &max_bindings);
+   glGetIntegerv(GL_MAX_COMBINED_UNIFORM_BLOCKS, &value);
+   max_bindings = MIN2(max_bindings, value);
+   if (max_bindings > 0)
+      max_blocks = MIN2(max_blocks, (max_bindings - 1) / num_stages + 1);
+
+   if (max_size < 16 || max_blocks < 2 || alignment <= 0 ||
+       !util_is_power_of_two_nonzero(alignment))
+      return;
+
+   /* the rings are created per context later on, keep using glUniform4uiv
+    * if the host can't map one at all */
+   if (!vrend_const_ring_init(&probe))
+      return;
+   value = probe.staged;
+   vrend_const_ring_fini(&probe);
+   if (value) {
+      virgl_info("Constant ring can't be mapped, using uniforms\n");
+      return;
+   }
+
+   vrend_state.const_ring_alignment = alignment;
+   vrend_state.max_const_ubo_blocks = MIN2(max_blocks, 127);
+   vrend_state.max_const_ubo_vec4 = MIN2(max_size / 16, 4096);
+}
+
 static bool use_integer(void) {
    if (getenv("VIRGL_USE_INTEGER"))
       return true;
@@ -7520,8 +9513,10 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    int gl_ver;
    virgl_gl_context gl_context;
    struct virgl_gl_ctx_param ctx_params = {0};
+   struct virgl_init_phase phase;
 
    vrend_clicbs = cbs;
+   vrend_state.format_probes = 0;
 
    /* Give some defaults to be able to run the tests */
    vrend_state.max_texture_2d_size =
@@ -7532,6 +9527,8 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       vrend_init_debug_flags();
    }
 
+   virgl_init_phase_begin(&phase, "vrend-context");
+
    ctx_params.shared = false;
    if (flags & VREND_USE_COMPAT_CONTEXT) {
       ctx_params.compat_ctx = true;
@@ -7583,6 +9580,22 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    if (!vrend_winsys_has_gl_colorspace())
       clear_feature(feat_srgb_write_control) ;
 
+   if (has_feature(feat_program_binary)) {
+      GLint num_formats = 0;
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+      if (!num_formats)
+         clear_feature(feat_program_binary);
+   }
+
+   /* VIRGL_INDIRECT_FIXUP sends draw count buffers through the compute
+    * fixup even when the host could read them itself */
+   if (getenv("VIRGL_INDIRECT_FIXUP") && vrend_indirect_fixup_supported())
+      clear_feature(feat_indirect_params);
+
+   /* VIRGL_COPY_FALLBACK sends texture copies through the paths of formats
+    * that can't be rendered to even when the GPU could copy them directly */
+   vrend_state.use_copy_fallback = !!getenv("VIRGL_COPY_FALLBACK");
+
    glGetIntegerv(GL_MAX_DRAW_BUFFERS, (GLint *) &vrend_state.max_draw_buffers);
 
    /* For testing we need to know maximum */
@@ -7594,6 +9607,8 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    if (vrend_state.max_draw_buffers > 8)
       vrend_state.max_draw_buffers = 8;
 
+   vrend_init_const_ring_limits();
+
    if (!has_feature(feat_arb_robustness) &&
        !has_feature(feat_gles_khr_robustness)) {
       virgl_warn("Running without ARB/KHR robustness in place may crash\n");
@@ -7614,21 +9629,33 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
       glDisable(GL_DEBUG_OUTPUT);
    }
 
-   vrend_build_format_list_common();
+   virgl_init_phase_end(&phase);
+   virgl_init_phase_begin(&phase, "vrend-formats");
 
-   if (vrend_state.use_gles) {
-      vrend_build_format_list_gles();
-   } else {
-      vrend_build_format_list_gl();
-   }
+   /* probing the formats takes hundreds of GL calls, reuse the results of
+    * an earlier run on the same driver when there are some */
+   if (!vrend_format_cache_load(vrend_state.use_gles)) {
+      vrend_state.format_probes++;
+      vrend_build_format_list_common();
+
+      if (vrend_state.use_gles) {
+         vrend_build_format_list_gles();
+      } else {
+         vrend_build_format_list_gl();
+      }
 
-   vrend_check_texture_storage(tex_conv_table);
+      vrend_check_texture_storage(tex_conv_table);
 
-   if (has_feature(feat_multisample)) {
-      vrend_check_texture_multisample(tex_conv_table,
-                                      has_feature(feat_storage_multisample));
+      if (has_feature(feat_multisample)) {
+         vrend_check_texture_multisample(tex_conv_table,
+                                         has_feature(feat_storage_multisample));
+      }
+
+      vrend_format_cache_store();
    }
 
+   virgl_init_phase_end(&phase);
+
    /* disable for format testing */
    if (has_feature(feat_debug_cb)) {
       glEnable(GL_DEBUG_OUTPUT);
@@ -7640,14 +9667,37 @@ int vrend_renderer_init(const struct vrend_if_cbs *cbs, uint32_t flags)
    list_inithead(&vrend_state.waiting_query_list);
    atomic_store(&vrend_state.has_waiting_queries, false);
 
+   vrend_state.tgsi_cache = _mesa_hash_table_u64_create(NULL);
+   vrend_state.program_binaries = _mesa_hash_table_u64_create(NULL);
+   vrend_state.sampler_cache = _mesa_hash_table_u64_create(NULL);
+
+   vrend_state.renderer_thread = thrd_current();
+   mtx_init(&vrend_state.query_mutex, mtx_plain);
+   mtx_init(&vrend_state.cache_mutex, mtx_plain);
+   mtx_init(&vrend_state.blit_mutex, mtx_plain);
+
    /* create 0 context */
    vrend_state.ctx0 = vrend_create_context(0, strlen("HOST"), "HOST");
 
+   virgl_init_phase_begin(&phase, "vrend-blitter");
+   vrend_blitter_precompile(has_feature(feat_multisample));
+   vrend_sync_make_current(vrend_state.ctx0->sub->gl_context);
+   virgl_init_phase_end(&phase);
+
    vrend_state.eventfd = -1;
    if (flags & VREND_USE_THREAD_SYNC) {
       if (flags & VREND_USE_ASYNC_FENCE_CB)
          vrend_state.use_async_fence_cb = true;
+      virgl_init_phase_begin(&phase, "vrend-sync-thread");
       vrend_renderer_use_threaded_sync();
+      virgl_init_phase_end(&phase);
+   }
+   /* context workers hand their fences to the sync thread */
+   if (flags & VREND_USE_THREADED_CONTEXTS) {
+      if (vrend_state.sync_thread)
+         vrend_state.use_threaded_contexts = true;
+      else
+         virgl_warn("Threaded contexts need the sync thread, running single threaded\n");
    }
    if (flags & VREND_USE_EXTERNAL_BLOB)
       vrend_state.use_external_blob = true;
@@ -7694,8 +9744,20 @@ vrend_renderer_fini(void)
 
    vrend_destroy_context(vrend_state.ctx0);
 
-   vrend_state.current_ctx = NULL;
-   vrend_state.current_hw_ctx = NULL;
+   _mesa_hash_table_u64_destroy(vrend_state.tgsi_cache);
+   vrend_state.tgsi_cache = NULL;
+   _mesa_hash_table_u64_destroy(vrend_state.program_binaries);
+   vrend_state.program_binaries = NULL;
+   _mesa_hash_table_u64_destroy(vrend_state.sampler_cache);
+   vrend_state.sampler_cache = NULL;
+
+   mtx_destroy(&vrend_state.query_mutex);
+   mtx_destroy(&vrend_state.cache_mutex);
+   mtx_destroy(&vrend_state.blit_mutex);
+
+   vrend_current_ctx = NULL;
+   vrend_current_hw_ctx = NULL;
+   vrend_state.use_threaded_contexts = false;
 
    vrend_state.finishing = false;
 }
@@ -7743,8 +9805,8 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
       }
    }
 
-   if (sub->fb_id)
-      glDeleteFramebuffers(1, &sub->fb_id);
+   vrend_framebuffers_fini(sub);
+   vrend_texture_units_fini(sub);
 
    if (sub->blit_fb_ids[0])
       glDeleteFramebuffers(2, sub->blit_fb_ids);
@@ -7758,6 +9820,7 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
          glDisableVertexAttribArray(i);
       }
    }
+   vrend_vertex_arrays_fini(sub);
    glDeleteVertexArrays(1, &sub->vaoid);
    glBindVertexArray(0);
 
@@ -7778,6 +9841,8 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
       sub->prog->ref_context = NULL;
 
    vrend_free_programs(sub);
+   vrend_const_ring_fini(&sub->const_ring);
+   vrend_indirect_fixup_fini(sub);
    for (enum pipe_shader_type type = 0; type < PIPE_SHADER_TYPES; type++) {
       free(sub->consts[type].consts);
       sub->consts[type].consts = NULL;
@@ -7810,6 +9875,7 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
    vrend_resource_reference((struct vrend_resource **)&sub->ib.buffer, NULL);
 
    vrend_object_fini_ctx_table(sub->object_hash);
+   vrend_queries_fini(sub);
    vrend_clicbs->destroy_gl_context(sub->gl_context);
 
    list_del(&sub->head);
@@ -7826,11 +9892,11 @@ static void destroy_active_markers_entry(struct hash_entry *entry)
 
 void vrend_destroy_context(struct vrend_context *ctx)
 {
-   bool switch_0 = (ctx == vrend_state.current_ctx);
-   struct vrend_context *cur = vrend_state.current_ctx;
+   bool switch_0 = (ctx == vrend_current_ctx);
+   struct vrend_context *cur = vrend_current_ctx;
    if (switch_0) {
-      vrend_state.current_ctx = NULL;
-      vrend_state.current_hw_ctx = NULL;
+      vrend_current_ctx = NULL;
+      vrend_current_hw_ctx = NULL;
    }
 
    vrend_clicbs->make_current(ctx->sub->gl_context);
@@ -7872,6 +9938,7 @@ void vrend_destroy_context(struct vrend_context *ctx)
    _mesa_hash_table_destroy(ctx->active_markers, destroy_active_markers_entry);
 #endif
 
+   mtx_destroy(&ctx->gl_mutex);
    FREE(ctx);
 
    if (!switch_0 && cur)
@@ -7886,6 +9953,8 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    if (!grctx)
       return NULL;
 
+   mtx_init(&grctx->gl_mutex, mtx_plain);
+
    if (nlen && debug_name) {
       strncpy(grctx->debug_name, debug_name,
               nlen < sizeof(grctx->debug_name) - 1 ?
@@ -7924,6 +9993,8 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    grctx->shader_cfg.has_texture_shadow_lod = has_feature(feat_texture_shadow_lod);
    grctx->shader_cfg.has_vs_layer = has_feature(feat_vs_layer_viewport);
    grctx->shader_cfg.has_vs_viewport_index = has_feature(feat_vs_viewport_index);
+   grctx->shader_cfg.max_const_ubo_vec4 = vrend_state.max_const_ubo_vec4;
+   grctx->shader_cfg.max_const_ubo_blocks = vrend_state.max_const_ubo_blocks;
 
    vrend_renderer_create_sub_ctx(grctx, 0);
    vrend_renderer_set_sub_ctx(grctx, 0);
@@ -8785,6 +10856,65 @@ vrend_renderer_resource_create(const struct vrend_renderer_resource_create_args
    return &gr->base;
 }
 
+/* Replace the storage of a 2D texture with an EGL image so that the resource
+ * aliases the memory behind the image. Views and surfaces keep the GL name
+ * they were created with, so this is refused once the resource is referenced
+ * by anything but its owner. */
+int vrend_renderer_resource_alias_egl_image(struct vrend_resource *res, void *image)
+{
+   struct vrend_texture *gt = (struct vrend_texture *)res;
+   bool immutable = false;
+   GLuint id;
+
+   if (!image || res->target != GL_TEXTURE_2D || res->base.last_level ||
+       res->base.nr_samples > 1 || res->gbm_bo ||
+       !has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE) ||
+       has_bit(res->storage_bits, VREND_STORAGE_EGL_IMAGE) ||
+       p_atomic_read(&res->base.reference.count) > 1)
+      return EINVAL;
+
+   glGenTextures(1, &id);
+   glBindTexture(GL_TEXTURE_2D, id);
+
+   if (has_bit(res->storage_bits, VREND_STORAGE_GL_IMMUTABLE) &&
+       has_feature(feat_egl_image_storage)) {
+      glEGLImageTargetTexStorageEXT(GL_TEXTURE_2D, (GLeglImageOES) image, NULL);
+      immutable = true;
+   } else if (has_feature(feat_egl_image)) {
+      glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES) image);
+   } else {
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glDeleteTextures(1, &id);
+      return EINVAL;
+   }
+
+   if (glGetError() != GL_NO_ERROR) {
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glDeleteTextures(1, &id);
+      return EINVAL;
+   }
+
+   if (!immutable) {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+      res->storage_bits &= ~VREND_STORAGE_GL_IMMUTABLE;
+   }
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   glDeleteTextures(1, &res->gl_id);
+   res->gl_id = id;
+   res->storage_bits |= VREND_STORAGE_EGL_IMAGE;
+
+   memset(&gt->state, 0, sizeof(gt->state));
+   gt->state.max_lod = -1;
+   gt->cur_swizzle[0] = gt->cur_swizzle[1] = gt->cur_swizzle[2] = gt->cur_swizzle[3] = -1;
+   gt->cur_srgb_decode = 0;
+   gt->cur_base = -1;
+   gt->cur_max = 10000;
+   gt->cur_alpha_border = false;
+   return 0;
+}
+
 void vrend_renderer_resource_destroy(struct vrend_resource *res)
 {
    if (has_bit(res->storage_bits, VREND_STORAGE_GL_TEXTURE)) {
@@ -9175,6 +11305,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
           res->target == GL_TEXTURE_1D_ARRAY ||
           res->target == GL_TEXTURE_2D_ARRAY ||
           res->target == GL_TEXTURE_2D_MULTISAMPLE_ARRAY ||
+          res->target == GL_TEXTURE_CUBE_MAP ||
           res->target == GL_TEXTURE_CUBE_MAP_ARRAY)
           send_size *= info->box->depth;
       else if (need_temp && info->box->depth != 1)
@@ -9299,14 +11430,20 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
                vrend_scale_depth(data, send_size, depth_scale);
          }
          if (res->target == GL_TEXTURE_CUBE_MAP) {
-            GLenum ctarget = GL_TEXTURE_CUBE_MAP_POSITIVE_X + info->box->z;
-            if (compressed) {
-               glCompressedTexSubImage2D(ctarget, info->level, x, y,
-                                         info->box->width, info->box->height,
-                                         glformat, comp_size, data);
-            } else {
-               glTexSubImage2D(ctarget, info->level, x, y, info->box->width, info->box->height,
-                               glformat, gltype, data);
+            /* all faces of the box are uploaded in one transfer, the temp
+             * copy is packed, otherwise the guest layer stride applies */
+            uint32_t face_size = need_temp ? send_size / info->box->depth : layer_stride;
+            for (int i = 0; i < info->box->depth; i++) {
+               GLenum ctarget = GL_TEXTURE_CUBE_MAP_POSITIVE_X + info->box->z + i;
+               const char *face_data = (const char *)data + i * face_size;
+               if (compressed) {
+                  glCompressedTexSubImage2D(ctarget, info->level, x, y,
+                                            info->box->width, info->box->height,
+                                            glformat, comp_size, face_data);
+               } else {
+                  glTexSubImage2D(ctarget, info->level, x, y, info->box->width, info->box->height,
+                                  glformat, gltype, face_data);
+               }
             }
          } else if (res->target == GL_TEXTURE_3D || res->target == GL_TEXTURE_2D_ARRAY || res->target == GL_TEXTURE_CUBE_MAP_ARRAY) {
             if (compressed) {
@@ -9457,6 +11594,99 @@ static int vrend_transfer_send_getteximage(struct vrend_resource *res,
    return 0;
 }
 
+/* Read the whole box back with a single call, array layers and cube map
+ * faces are addressed like the slices of a 3D texture. */
+static int vrend_transfer_send_gettexsubimage(struct vrend_resource *res,
+                                              const struct iovec *iov, int num_iovs,
+                                              const struct vrend_transfer_info *info)
+{
+   GLenum format = tex_conv_table[res->base.format].glformat;
+   GLenum type = tex_conv_table[res->base.format].gltype;
+   int elsize = util_format_get_blocksize(res->base.format);
+   bool compressed = util_format_is_compressed(res->base.format);
+   uint32_t stride = info->stride;
+   uint32_t layer_stride = info->layer_stride;
+   GLint y = info->box->y, z = info->box->z;
+   GLsizei height = info->box->height, depth = info->box->depth;
+   uint64_t send_size;
+   bool need_temp = num_iovs > 1 || compressed;
+   char *data;
+
+   if (res->target == GL_TEXTURE_1D_ARRAY) {
+      y = info->box->z;
+      height = info->box->depth;
+      z = 0;
+      depth = 1;
+   }
+
+   if (format == 0) {
+      format = GL_BGRA;
+      type = GL_UNSIGNED_BYTE;
+   }
+
+   if (!stride)
+      stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, info->level)) * elsize;
+
+   if (!layer_stride)
+      layer_stride = util_format_get_2d_size(res->base.format, stride,
+                                             u_minify(res->base.height0, info->level));
+
+   if (need_temp) {
+      send_size = util_format_get_nblocks(res->base.format, info->box->width,
+                                          info->box->height);
+      send_size *= elsize * info->box->depth;
+
+      /* glGetTextureSubImage takes a GLsizei buffer size */
+      if (send_size > UINT_MAX)
+         return EINVAL;
+
+      data = malloc(send_size);
+      if (!data)
+         return ENOMEM;
+   } else {
+      if (info->offset > iov[0].iov_len)
+         return EINVAL;
+      send_size = MIN2(iov[0].iov_len - info->offset, UINT_MAX);
+      data = (char *)iov[0].iov_base + info->offset;
+      glPixelStorei(GL_PACK_ROW_LENGTH, stride / elsize);
+      glPixelStorei(GL_PACK_IMAGE_HEIGHT, layer_stride / stride);
+   }
+
+   /* rows are packed at the guest stride or tightly in the temp buffer,
+    * neither is padded to the texel size, e.g. for 3, 6 or 12 byte texels */
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+#if UTIL_ARCH_BIG_ENDIAN
+   glPixelStorei(GL_PACK_SWAP_BYTES, 1);
+#endif
+
+   if (compressed)
+      glGetCompressedTextureSubImage(res->gl_id, info->level, info->box->x, y, z,
+                                     info->box->width, height, depth,
+                                     send_size, data);
+   else
+      glGetTextureSubImage(res->gl_id, info->level, info->box->x, y, z,
+                           info->box->width, height, depth,
+                           format, type, send_size, data);
+
+   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+#if UTIL_ARCH_BIG_ENDIAN
+   glPixelStorei(GL_PACK_SWAP_BYTES, 0);
+#endif
+
+   if (need_temp) {
+      write_transfer_data(&res->base, iov, num_iovs, data,
+                          info->stride, info->box, info->level, info->offset,
+                          false);
+      free(data);
+   } else {
+      glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+      glPixelStorei(GL_PACK_IMAGE_HEIGHT, 0);
+   }
+   return 0;
+}
+
 static void do_readpixels(struct vrend_resource *res,
                           int idx, uint32_t level, uint32_t layer,
                           GLint x, GLint y,
@@ -9726,6 +11956,14 @@ static int vrend_renderer_transfer_send_iov(struct vrend_context *ctx,
 
       can_readpixels = vrend_format_can_render(res->base.format) || vrend_format_is_ds(res->base.format);
 
+      /* glReadPixels reads one layer, boxes that span several layers and
+       * formats that can't be rendered to are read in one call if possible */
+      if (has_feature(feat_get_texture_sub_image) && res->base.nr_samples <= 1 &&
+          (!can_readpixels ||
+           (info->box->depth > 1 && !res->y_0_top &&
+            res->base.format != VIRGL_FORMAT_Z24X8_UNORM)))
+         return vrend_transfer_send_gettexsubimage(res, iov, num_iovs, info);
+
       if (can_readpixels)
          ret = vrend_transfer_send_readpixels(ctx, res, iov, num_iovs, info);
 
@@ -10208,7 +12446,8 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
                                          uint32_t dstz, uint32_t src_level,
                                          const struct pipe_box *src_box)
 {
-   char *tptr;
+   char *tptr = NULL;
+   GLuint pbo = 0;
    uint32_t total_size, src_stride, dst_stride, src_layer_stride;
    GLenum glformat, gltype;
    int elsize = util_format_get_blocksize(dst_res->base.format);
@@ -10235,9 +12474,17 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
                 util_format_get_blocksize(src_res->base.format);
    total_size = slice_size * vrend_get_texture_depth(src_res, src_level);
 
-   tptr = malloc(total_size);
-   if (!tptr)
-      return;
+   /* On GL the texture is read into a pixel buffer that is then used as the
+    * source of the upload, so the data never leaves the GPU. */
+   if (vrend_state.use_gles) {
+      tptr = malloc(total_size);
+      if (!tptr)
+         return;
+   } else {
+      glGenBuffers(1, &pbo);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+      glBufferData(GL_PIXEL_PACK_BUFFER, total_size, NULL, GL_STREAM_COPY);
+   }
 
    glformat = tex_conv_table[src_res->base.format].glformat;
    gltype = tex_conv_table[src_res->base.format].gltype;
@@ -10309,19 +12556,22 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       for (i = 0; i < cube_slice; i++) {
          GLenum ctarget = src_res->target == GL_TEXTURE_CUBE_MAP ?
                             (GLenum)(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i) : src_res->target;
+         void *data = (void *)(uintptr_t)slice_offset;
          if (compressed) {
             if (has_feature(feat_arb_robustness))
-               glGetnCompressedTexImageARB(ctarget, src_level, read_chunk_size, tptr + slice_offset);
+               glGetnCompressedTexImageARB(ctarget, src_level, read_chunk_size, data);
             else
-               glGetCompressedTexImage(ctarget, src_level, tptr + slice_offset);
+               glGetCompressedTexImage(ctarget, src_level, data);
          } else {
             if (has_feature(feat_arb_robustness))
-               glGetnTexImageARB(ctarget, src_level, glformat, gltype, read_chunk_size, tptr + slice_offset);
+               glGetnTexImageARB(ctarget, src_level, glformat, gltype, read_chunk_size, data);
             else
-               glGetTexImage(ctarget, src_level, glformat, gltype, tptr + slice_offset);
+               glGetTexImage(ctarget, src_level, glformat, gltype, data);
          }
          slice_offset += slice_size;
       }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
    }
 
    glPixelStorei(GL_PACK_ALIGNMENT, 4);
@@ -10343,11 +12593,21 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       break;
    }
 
+   /* the pixel buffer holds the whole source level, pick the box out of it */
+   if (pbo && !compressed) {
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, u_minify(src_res->base.width0, src_level));
+      glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, u_minify(src_res->base.height0, src_level));
+      glPixelStorei(GL_UNPACK_SKIP_PIXELS, src_box->x);
+      glPixelStorei(GL_UNPACK_SKIP_ROWS, src_box->y);
+   }
+
    glBindTexture(dst_res->target, dst_res->gl_id);
    slice_offset = src_box->z * slice_size;
    cube_slice = (src_res->target == GL_TEXTURE_CUBE_MAP) ? src_box->z + src_box->depth : cube_slice;
    i = (src_res->target == GL_TEXTURE_CUBE_MAP) ? src_box->z : 0;
-   if (slice_offset + src_box->width * src_box->height + cube_slice * slice_size > total_size) {
+   /* cube faces are uploaded one at a time, other targets in one call, both
+    * read the slices z to z + depth */
+   if ((uint64_t)(src_box->z + src_box->depth) * slice_size > total_size) {
       virgl_error("Offset out of bound: %d\n", src_box->z);
       goto cleanup;
    }
@@ -10355,25 +12615,26 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
    for (; i < cube_slice; i++) {
       GLenum ctarget = dst_res->target == GL_TEXTURE_CUBE_MAP ?
                           (GLenum)(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i) : dst_res->target;
+      const void *data = pbo ? (const void *)(uintptr_t)slice_offset : tptr + slice_offset;
       if (compressed) {
          if (ctarget == GL_TEXTURE_1D) {
             glCompressedTexSubImage1D(ctarget, dst_level, dstx,
                                       src_box->width,
-                                      glformat, slice_size, tptr + slice_offset);
+                                      glformat, slice_size, data);
          } else {
             glCompressedTexSubImage2D(ctarget, dst_level, dstx, dsty,
                                       src_box->width, src_box->height,
-                                      glformat, slice_size, tptr + slice_offset);
+                                      glformat, slice_size, data);
          }
       } else {
          if (ctarget == GL_TEXTURE_1D) {
-            glTexSubImage1D(ctarget, dst_level, dstx, src_box->width, glformat, gltype, tptr + slice_offset);
+            glTexSubImage1D(ctarget, dst_level, dstx, src_box->width, glformat, gltype, data);
          } else if (ctarget == GL_TEXTURE_3D ||
                     ctarget == GL_TEXTURE_2D_ARRAY ||
                     ctarget == GL_TEXTURE_CUBE_MAP_ARRAY) {
-            glTexSubImage3D(ctarget, dst_level, dstx, dsty, dstz, src_box->width, src_box->height, src_box->depth, glformat, gltype, tptr + slice_offset);
+            glTexSubImage3D(ctarget, dst_level, dstx, dsty, dstz, src_box->width, src_box->height, src_box->depth, glformat, gltype, data);
          } else {
-            glTexSubImage2D(ctarget, dst_level, dstx, dsty, src_box->width, src_box->height, glformat, gltype, tptr + slice_offset);
+            glTexSubImage2D(ctarget, dst_level, dstx, dsty, src_box->width, src_box->height, glformat, gltype, data);
          }
       }
       slice_offset += slice_size;
@@ -10381,6 +12642,16 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
 
 cleanup:
    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   if (pbo) {
+      if (!compressed) {
+         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+         glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+         glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+         glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+      }
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      glDeleteBuffers(1, &pbo);
+   }
    free(tptr);
    glBindTexture(dst_res->target, 0);
 }
@@ -10450,6 +12721,23 @@ static bool resource_dest_contains_box(struct vrend_resource *src_res,
    return resource_contains_box(dst_res, &dst_box, dst_level);
 }
 
+static void vrend_copy_region_fallback(struct vrend_context *ctx,
+                                       struct vrend_resource *src_res,
+                                       struct vrend_resource *dst_res,
+                                       uint32_t dst_level,
+                                       uint32_t dstx, uint32_t dsty, uint32_t dstz,
+                                       uint32_t src_level,
+                                       const struct pipe_box *src_box)
+{
+   VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use resource_copy_fallback\n");
+   vrend_resource_copy_fallback(src_res, dst_res, dst_level, dstx,
+                                dsty, dstz, src_level, src_box);
+   if (vrend_state.use_gles)
+      ctx->copy_stats.cpu_fallbacks++;
+   else
+      ctx->copy_stats.gpu_fallbacks++;
+}
+
 void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
                                          uint32_t dst_handle, uint32_t dst_level,
                                          uint32_t dstx, uint32_t dsty, uint32_t dstz,
@@ -10460,6 +12748,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    GLbitfield glmask = 0;
    GLint sy1, sy2, dy1, dy2;
    unsigned int comp_flags;
+   bool can_blit;
 
    if (ctx->in_error)
       return;
@@ -10502,6 +12791,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
                   src_box->x, src_box->width);
       vrend_resource_buffer_copy(ctx, src_res, dst_res, dstx,
                                  src_box->x, src_box->width);
+      ctx->copy_stats.buffer_copies++;
       return;
    }
 
@@ -10511,38 +12801,59 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    if (dst_res->egl_image)
       comp_flags ^= VREND_COPY_COMPAT_FLAG_ONE_IS_EGL_IMAGE;
 
-   if (has_feature(feat_copy_image) &&
+   /* VIRGL_COPY_FALLBACK skips glCopyImageSubData and the blit, copies
+    * take the paths of formats that can't be rendered to */
+   if (vrend_state.use_copy_fallback &&
+       src_res->base.format == dst_res->base.format) {
+      vrend_copy_region_fallback(ctx, src_res, dst_res, dst_level,
+                                 dstx, dsty, dstz, src_level, src_box);
+      return;
+   }
+
+   if (!vrend_state.use_copy_fallback && has_feature(feat_copy_image) &&
        format_is_copy_compatible(src_res->base.format,dst_res->base.format, comp_flags) &&
        src_res->base.nr_samples == dst_res->base.nr_samples) {
       VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use glCopyImageSubData\n");
       vrend_copy_sub_image(src_res, dst_res, src_level, src_box,
                            dst_level, dstx, dsty, dstz);
+      ctx->copy_stats.copy_image++;
       return;
    }
 
-   if (!vrend_format_can_render(src_res->base.format) ||
-       !vrend_format_can_render(dst_res->base.format)) {
-      VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use resource_copy_fallback\n");
-      vrend_resource_copy_fallback(src_res, dst_res, dst_level, dstx,
-                                   dsty, dstz, src_level, src_box);
-      return;
-   }
+   can_blit = !vrend_state.use_copy_fallback &&
+              vrend_format_can_render(src_res->base.format) &&
+              vrend_format_can_render(dst_res->base.format);
 
-   glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
-   VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use glBlitFramebuffer\n");
+   /* The fallback reads the source back to the CPU and can't convert, copy
+    * on the GPU instead. Formats that copy bit by bit are copied raw, others
+    * are converted by the compute shader when the blit can't render them. */
+   if (has_feature(feat_compute_shader) && has_feature(feat_images) &&
+       (format_is_copy_compatible(src_res->base.format, dst_res->base.format, 0) ?
+        src_res->base.format != dst_res->base.format || !can_blit : !can_blit)) {
+      bool copied;
 
-   /* clean out fb ids */
-   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-                          GL_TEXTURE_2D, 0, 0);
-   vrend_fb_bind_texture(src_res, 0, src_level, src_box->z);
+      /* the copy may have switched to the blitter context even if it
+       * ended up unsupported */
+      mtx_lock(&vrend_state.blit_mutex);
+      copied = vrend_renderer_copy_compute(src_res, dst_res, src_level, src_box,
+                                           dst_level, dstx, dsty, dstz);
+      vrend_sync_make_current(ctx->sub->gl_context);
+      mtx_unlock(&vrend_state.blit_mutex);
 
-   glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
-   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-                          GL_TEXTURE_2D, 0, 0);
-   vrend_fb_bind_texture(dst_res, 0, dst_level, dstz);
-   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
+      if (copied) {
+         VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use compute copy\n");
+         ctx->copy_stats.compute++;
+         return;
+      }
+   }
 
-   glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+   if (!can_blit) {
+      vrend_copy_region_fallback(ctx, src_res, dst_res, dst_level,
+                                 dstx, dsty, dstz, src_level, src_box);
+      return;
+   }
+
+   VREND_DEBUG(dbg_copy_resource, ctx, "COPY_REGION: use glBlitFramebuffer\n");
 
    glmask = GL_COLOR_BUFFER_BIT;
    glDisable(GL_SCISSOR_TEST);
@@ -10563,13 +12874,33 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       dy2 = dst_res->base.height0 - dsty;
    }
 
-   glBlitFramebuffer(src_box->x, sy1,
-                     src_box->x + src_box->width,
-                     sy2,
-                     dstx, dy1,
-                     dstx + src_box->width,
-                     dy2,
-                     glmask, GL_NEAREST);
+   /* one blit per layer, array layers, cube faces and 3D slices are
+    * attached one at a time */
+   for (int i = 0; i < MAX2(src_box->depth, 1); i++) {
+      glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+
+      /* clean out fb ids */
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                             GL_TEXTURE_2D, 0, 0);
+      vrend_fb_bind_texture(src_res, 0, src_level, src_box->z + i);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                             GL_TEXTURE_2D, 0, 0);
+      vrend_fb_bind_texture(dst_res, 0, dst_level, dstz + i);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
+
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+
+      glBlitFramebuffer(src_box->x, sy1,
+                        src_box->x + src_box->width,
+                        sy2,
+                        dstx, dy1,
+                        dstx + src_box->width,
+                        dy2,
+                        glmask, GL_NEAREST);
+   }
+   ctx->copy_stats.blits++;
 
    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
@@ -10977,8 +13308,10 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       blit_info.has_texture_srgb_decode = has_feature(feat_srgb_write_control);
 
       VREND_DEBUG(dbg_blit, ctx, "BLIT_INT: use GL fallback\n");
+      mtx_lock(&vrend_state.blit_mutex);
       vrend_renderer_blit_gl(ctx, src_res, dst_res, &blit_info);
       vrend_sync_make_current(ctx->sub->gl_context);
+      mtx_unlock(&vrend_state.blit_mutex);
    }
 
    if (blit_info.src_view != src_res->gl_id)
@@ -11184,6 +13517,16 @@ int vrend_renderer_create_fence(struct vrend_context *ctx,
    return ENOMEM;
 }
 
+/* Retire a fence that is not backed by a GL sync object, like the fences of
+ * the video ring. */
+void vrend_renderer_retire_fence(struct vrend_context *ctx,
+                                 uint32_t ring_idx,
+                                 uint64_t fence_id)
+{
+   if (ctx->fence_retire)
+      ctx->fence_retire(ring_idx, fence_id, ctx->fence_retire_data);
+}
+
 static bool need_fence_retire_signal_locked(struct vrend_fence *fence,
                                             const struct list_head *signaled_list)
 {
@@ -11252,6 +13595,10 @@ void vrend_renderer_check_fences(void)
       }
    }
 
+#ifdef ENABLE_VIDEO
+   vrend_video_poll();
+#endif
+
    if (list_is_empty(&retired_fences))
       return;
 
@@ -11259,7 +13606,7 @@ void vrend_renderer_check_fences(void)
 
    list_for_each_entry_safe(struct vrend_fence, fence, &retired_fences, fences) {
       struct vrend_context *ctx = fence->ctx;
-      ctx->fence_retire(fence->fence_id, ctx->fence_retire_data);
+      ctx->fence_retire(0, fence->fence_id, ctx->fence_retire_data);
 
       free_fence_locked(fence);
    }
@@ -11299,16 +13646,12 @@ vrend_update_oq_samples_multiplier(struct vrend_context *ctx)
 }
 
 
-static bool vrend_check_query(struct vrend_query *query)
+static void vrend_write_query_result(struct vrend_query *query, uint64_t result)
 {
    struct virgl_host_query_state state;
-   bool ret;
 
    state.result_size = vrend_is_timer_query(query->gltype) ? 8 : 4;
-   ret = vrend_get_one_query_result(query->id, state.result_size == 8,
-         &state.result);
-   if (ret == false)
-      return false;
+   state.result = state.result_size == 8 ? result : (uint32_t)result;
 
    /* We got a boolean, but the client wanted the actual number of samples
     * blow the number up so that the client doesn't think it was just one pixel
@@ -11330,10 +13673,302 @@ static bool vrend_check_query(struct vrend_query *query)
       else
          virgl_error("Query state does not fit buffer size\n");
    }
+}
+
+static bool vrend_check_query(struct vrend_query *query)
+{
+   uint64_t result;
+
+   if (!vrend_get_one_query_result(query->id, vrend_is_timer_query(query->gltype),
+                                   &result))
+      return false;
+
+   vrend_write_query_result(query, result);
+   return true;
+}
+
+static GLuint vrend_query_pool_get(struct vrend_sub_context *sub, GLenum gltype)
+{
+   struct vrend_query_pool *fresh = &sub->query_pools[0];
+
+   for (int i = 1; i < VREND_QUERY_POOL_TYPES; i++) {
+      struct vrend_query_pool *pool = &sub->query_pools[i];
+      if (pool->gltype == gltype && pool->num_ids)
+         return pool->ids[--pool->num_ids];
+   }
+
+   if (!fresh->num_ids) {
+      glGenQueries(VREND_QUERY_POOL_SIZE, fresh->ids);
+      fresh->num_ids = VREND_QUERY_POOL_SIZE;
+   }
+   return fresh->ids[--fresh->num_ids];
+}
+
+static void vrend_query_pool_put(struct vrend_sub_context *sub, GLenum gltype, GLuint id)
+{
+   struct vrend_query_pool *empty = NULL;
+
+   for (int i = 1; i < VREND_QUERY_POOL_TYPES; i++) {
+      struct vrend_query_pool *pool = &sub->query_pools[i];
+
+      if (pool->gltype == gltype && pool->num_ids < VREND_QUERY_POOL_SIZE) {
+         pool->ids[pool->num_ids++] = id;
+         return;
+      }
+      if (!pool->num_ids && !empty)
+         empty = pool;
+   }
+
+   if (empty) {
+      empty->gltype = gltype;
+      empty->ids[empty->num_ids++] = id;
+   } else {
+      glDeleteQueries(1, &id);
+   }
+}
+
+static void vrend_gpu_timer_destroy(struct vrend_sub_context *sub,
+                                    struct vrend_gpu_timer *timer)
+{
+   list_del(&timer->head);
+   vrend_query_pool_put(sub, GL_TIMESTAMP, timer->queries[0]);
+   vrend_query_pool_put(sub, GL_TIMESTAMP, timer->queries[1]);
+   free(timer);
+}
+
+/* Add up the timers of sub whose results are in, in the order they ran. */
+static void vrend_gpu_time_collect(struct vrend_context *ctx,
+                                   struct vrend_sub_context *sub)
+{
+   GLint disjoint = 0;
+
+   if (list_is_empty(&sub->gpu_timers))
+      return;
+
+   /* on GLES a disjoint operation, e.g. a GPU clock change, makes the
+    * timestamps in flight meaningless */
+   if (vrend_state.use_gles)
+      glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+   list_for_each_entry_safe(struct vrend_gpu_timer, timer, &sub->gpu_timers, head) {
+      uint64_t begin, end;
+
+      if (!vrend_get_one_query_result(timer->queries[1], true, &end))
+         break;
+
+      if (!disjoint && vrend_get_one_query_result(timer->queries[0], true, &begin) &&
+          end >= begin) {
+         if (timer->draw) {
+            ctx->gpu_time.draws++;
+            ctx->gpu_time.draw_ns += end - begin;
+         } else {
+            ctx->gpu_time.batches++;
+            ctx->gpu_time.batch_ns += end - begin;
+            TRACE_GPU_TIME(ctx->debug_name, end - begin);
+         }
+      }
+
+      vrend_gpu_timer_destroy(sub, timer);
+   }
+}
+
+bool vrend_context_enable_gpu_time(struct vrend_context *ctx, uint32_t flags)
+{
+   if (!has_feature(feat_timer_query))
+      return false;
+
+   ctx->gpu_time_flags = flags;
+   return true;
+}
+
+void vrend_context_gpu_time_begin(struct vrend_context *ctx, uint32_t type)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   const bool draw = type == VREND_GPU_TIME_DRAWS;
+   struct vrend_gpu_timer *timer;
+
+   if (!(ctx->gpu_time_flags & type) || ctx->gpu_timers[draw])
+      return;
+
+   if (!draw)
+      vrend_gpu_time_collect(ctx, sub);
+
+   timer = malloc(sizeof(*timer));
+   if (!timer)
+      return;
+
+   list_inithead(&timer->head);
+   timer->draw = draw;
+   timer->queries[0] = vrend_query_pool_get(sub, GL_TIMESTAMP);
+   timer->queries[1] = vrend_query_pool_get(sub, GL_TIMESTAMP);
+   glQueryCounter(timer->queries[0], GL_TIMESTAMP);
+   ctx->gpu_timers[draw] = timer;
+}
+
+void vrend_context_gpu_time_end(struct vrend_context *ctx, uint32_t type)
+{
+   const bool draw = type == VREND_GPU_TIME_DRAWS;
+   struct vrend_gpu_timer *timer = ctx->gpu_timers[draw];
+
+   if (!timer)
+      return;
+
+   glQueryCounter(timer->queries[1], GL_TIMESTAMP);
+   list_addtail(&timer->head, &ctx->sub->gpu_timers);
+   ctx->gpu_timers[draw] = NULL;
+}
+
+void vrend_context_get_gpu_time(struct vrend_context *ctx,
+                                struct vrend_gpu_time *gpu_time)
+{
+   *gpu_time = ctx->gpu_time;
+}
+
+static void vrend_query_batch_remove(struct vrend_query *query)
+{
+   if (query->batch) {
+      query->batch->queries[query->batch_slot] = NULL;
+      query->batch = NULL;
+   }
+}
+
+static struct vrend_query_batch *vrend_query_batch_open(struct vrend_sub_context *sub)
+{
+   struct vrend_query_batch *batch;
+
+   if (!list_is_empty(&sub->query_batches)) {
+      batch = list_last_entry(&sub->query_batches, struct vrend_query_batch, head);
+      if (!batch->fence && batch->num_queries < VREND_QUERY_BATCH_SIZE)
+         return batch;
+   }
+
+   if (!list_is_empty(&sub->free_query_batches)) {
+      batch = list_first_entry(&sub->free_query_batches, struct vrend_query_batch, head);
+      list_del(&batch->head);
+   } else {
+      batch = CALLOC_STRUCT(vrend_query_batch);
+      if (!batch)
+         return NULL;
+      glGenBuffers(1, &batch->buffer);
+      glBindBuffer(GL_QUERY_BUFFER, batch->buffer);
+      glBufferData(GL_QUERY_BUFFER, VREND_QUERY_BATCH_SIZE * 2 * sizeof(uint64_t),
+                   NULL, GL_STREAM_READ);
+      glBindBuffer(GL_QUERY_BUFFER, 0);
+   }
+
+   list_addtail(&batch->head, &sub->query_batches);
+   return batch;
+}
+
+static void vrend_query_batch_close(struct vrend_query_batch *batch)
+{
+   /* the batch is polled without flushing, the fence has to reach the GPU
+    * even if the guest goes idle */
+   if (!batch->fence && batch->num_queries) {
+      batch->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      glFlush();
+   }
+}
 
+/* Queue the availability and result writes of a waiting query, the query
+ * objects are not polled on the CPU. */
+static bool vrend_query_batch_add(struct vrend_sub_context *sub, struct vrend_query *query)
+{
+   struct vrend_query_batch *batch = vrend_query_batch_open(sub);
+   uintptr_t offset;
+
+   if (!batch)
+      return false;
+
+   offset = batch->num_queries * 2 * sizeof(uint64_t);
+   glBindBuffer(GL_QUERY_BUFFER, batch->buffer);
+   glGetQueryObjectui64v(query->id, GL_QUERY_RESULT_AVAILABLE, (GLuint64 *)offset);
+   glGetQueryObjectui64v(query->id, GL_QUERY_RESULT_NO_WAIT,
+                         (GLuint64 *)(offset + sizeof(uint64_t)));
+   glBindBuffer(GL_QUERY_BUFFER, 0);
+
+   query->batch = batch;
+   query->batch_slot = batch->num_queries;
+   batch->queries[batch->num_queries++] = query;
+
+   if (batch->num_queries == VREND_QUERY_BATCH_SIZE)
+      vrend_query_batch_close(batch);
    return true;
 }
 
+static void vrend_query_batch_destroy(struct vrend_query_batch *batch)
+{
+   if (batch->fence)
+      glDeleteSync(batch->fence);
+   glDeleteBuffers(1, &batch->buffer);
+   list_del(&batch->head);
+   FREE(batch);
+}
+
+/* Read back the batches whose writes have landed, in submission order. The
+ * query list lock must be held. */
+static void vrend_query_batches_resolve(struct vrend_sub_context *sub)
+{
+   list_for_each_entry_safe(struct vrend_query_batch, batch, &sub->query_batches, head) {
+      const uint64_t *slots;
+      GLenum status;
+
+      if (!batch->fence)
+         break;
+
+      status = glClientWaitSync(batch->fence, 0, 0);
+      if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+         break;
+
+      glBindBuffer(GL_QUERY_BUFFER, batch->buffer);
+      slots = glMapBufferRange(GL_QUERY_BUFFER, 0,
+                               batch->num_queries * 2 * sizeof(uint64_t), GL_MAP_READ_BIT);
+
+      for (uint32_t i = 0; i < batch->num_queries; i++) {
+         struct vrend_query *query = batch->queries[i];
+
+         if (!query)
+            continue;
+
+         /* a query that wasn't done yet goes into the next batch */
+         query->batch = NULL;
+         if (slots && slots[2 * i]) {
+            vrend_write_query_result(query, slots[2 * i + 1]);
+            list_delinit(&query->waiting_queries);
+         }
+      }
+
+      if (slots)
+         glUnmapBuffer(GL_QUERY_BUFFER);
+      glBindBuffer(GL_QUERY_BUFFER, 0);
+
+      glDeleteSync(batch->fence);
+      batch->fence = NULL;
+      batch->num_queries = 0;
+      list_del(&batch->head);
+      list_add(&batch->head, &sub->free_query_batches);
+   }
+}
+
+static void vrend_queries_fini(struct vrend_sub_context *sub)
+{
+   list_for_each_entry_safe(struct vrend_gpu_timer, timer, &sub->gpu_timers, head)
+      vrend_gpu_timer_destroy(sub, timer);
+
+   list_for_each_entry_safe(struct vrend_query_batch, batch, &sub->query_batches, head)
+      vrend_query_batch_destroy(batch);
+   list_for_each_entry_safe(struct vrend_query_batch, batch, &sub->free_query_batches, head)
+      vrend_query_batch_destroy(batch);
+
+   for (int i = 0; i < VREND_QUERY_POOL_TYPES; i++) {
+      struct vrend_query_pool *pool = &sub->query_pools[i];
+
+      if (pool->num_ids)
+         glDeleteQueries(pool->num_ids, pool->ids);
+      pool->num_ids = 0;
+   }
+}
+
 static struct vrend_sub_context *vrend_renderer_find_sub_ctx(struct vrend_context *ctx,
                                                              int sub_ctx_id)
 {
@@ -11353,7 +13988,7 @@ static bool vrend_hw_switch_context_with_sub(struct vrend_context *ctx, int sub_
    if (!ctx)
       return false;
 
-   if (ctx == vrend_state.current_ctx && sub_ctx_id == ctx->sub->sub_ctx_id &&
+   if (ctx == vrend_current_ctx && sub_ctx_id == ctx->sub->sub_ctx_id &&
        ctx->ctx_switch_pending == false) {
       return true;
    }
@@ -11367,33 +14002,101 @@ static bool vrend_hw_switch_context_with_sub(struct vrend_context *ctx, int sub_
 
    /* force the gl context switch to occur */
    if (ctx->sub != sub) {
-      vrend_state.current_hw_ctx = NULL;
+      vrend_current_hw_ctx = NULL;
       ctx->sub = sub;
    }
 
    ctx->ctx_switch_pending = true;
    vrend_finish_context_switch(ctx);
 
-   vrend_state.current_ctx = ctx;
+   vrend_current_ctx = ctx;
    return true;
 }
 
-static void vrend_renderer_check_queries(void)
+/* The waiting queries of a context are checked one sub context at a time,
+ * so the GL context is only switched once per sub context. */
+static void vrend_renderer_check_context_queries(struct vrend_context *ctx)
 {
-   list_for_each_entry_safe(struct vrend_query, query, &vrend_state.waiting_query_list, waiting_queries) {
-      if (!vrend_hw_switch_context_with_sub(query->ctx, query->sub_ctx_id)) {
-         virgl_warn("Failed to switch to context (%d) with sub (%d) for query %u\n",
-                      query->ctx->ctx_id, query->sub_ctx_id, query->id);
+   if (vrend_state.use_threaded_contexts)
+      vrend_context_lock(ctx);
+
+   mtx_lock(&vrend_state.query_mutex);
+   list_for_each_entry(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
+      bool waiting = false;
+
+      list_for_each_entry(struct vrend_query, query, &vrend_state.waiting_query_list, waiting_queries) {
+         if (query->owning_sub == sub) {
+            waiting = true;
+            break;
+         }
       }
-      else if (!vrend_check_query(query)) {
+      if (!waiting)
+         continue;
+
+      if (!vrend_hw_switch_context_with_sub(ctx, sub->sub_ctx_id)) {
+         virgl_warn("Failed to switch to context (%d) with sub (%d) for queries\n",
+                    ctx->ctx_id, sub->sub_ctx_id);
+         list_for_each_entry_safe(struct vrend_query, query, &vrend_state.waiting_query_list, waiting_queries) {
+            if (query->owning_sub == sub)
+               list_delinit(&query->waiting_queries);
+         }
          continue;
       }
 
-      list_delinit(&query->waiting_queries);
+      if (has_feature(feat_qbo))
+         vrend_query_batches_resolve(sub);
+
+      list_for_each_entry_safe(struct vrend_query, query, &vrend_state.waiting_query_list, waiting_queries) {
+         if (query->owning_sub != sub)
+            continue;
+
+         if (has_feature(feat_qbo)) {
+            if (query->batch || vrend_query_batch_add(sub, query))
+               continue;
+         }
+
+         if (vrend_check_query(query))
+            list_delinit(&query->waiting_queries);
+      }
+
+      if (has_feature(feat_qbo) && !list_is_empty(&sub->query_batches))
+         vrend_query_batch_close(list_last_entry(&sub->query_batches,
+                                                 struct vrend_query_batch, head));
    }
+   mtx_unlock(&vrend_state.query_mutex);
+
+   if (vrend_state.use_threaded_contexts)
+      vrend_context_unlock(ctx);
+}
+
+/* Queries are checked one context at a time, with threaded contexts the
+ * context lock has to be taken before the list lock, like the workers do. */
+static void vrend_renderer_check_queries(void)
+{
+   uint32_t pass = ++vrend_state.query_check_pass;
+   struct vrend_context *ctx;
 
+   do {
+      ctx = NULL;
+      mtx_lock(&vrend_state.query_mutex);
+      list_for_each_entry(struct vrend_query, query, &vrend_state.waiting_query_list, waiting_queries) {
+         if (query->ctx->query_check_pass != pass) {
+            ctx = query->ctx;
+            break;
+         }
+      }
+      mtx_unlock(&vrend_state.query_mutex);
+
+      if (ctx) {
+         ctx->query_check_pass = pass;
+         vrend_renderer_check_context_queries(ctx);
+      }
+   } while (ctx);
+
+   mtx_lock(&vrend_state.query_mutex);
    atomic_store(&vrend_state.has_waiting_queries,
                 !list_is_empty(&vrend_state.waiting_query_list));
+   mtx_unlock(&vrend_state.query_mutex);
 }
 
 bool vrend_hw_switch_context(struct vrend_context *ctx, bool now)
@@ -11401,7 +14104,7 @@ bool vrend_hw_switch_context(struct vrend_context *ctx, bool now)
    if (!ctx)
       return false;
 
-   if (ctx == vrend_state.current_ctx && ctx->ctx_switch_pending == false)
+   if (ctx == vrend_current_ctx && ctx->ctx_switch_pending == false)
       return true;
 
    if (ctx->ctx_id != 0 && ctx->in_error) {
@@ -11412,24 +14115,73 @@ bool vrend_hw_switch_context(struct vrend_context *ctx, bool now)
    if (now == true) {
       vrend_finish_context_switch(ctx);
    }
-   vrend_state.current_ctx = ctx;
+   vrend_current_ctx = ctx;
    return true;
 }
 
+/* the context the calling thread last switched to */
+struct vrend_context *vrend_hw_current_context(void)
+{
+   return vrend_current_ctx;
+}
+
 static void vrend_finish_context_switch(struct vrend_context *ctx)
 {
    if (ctx->ctx_switch_pending == false)
       return;
    ctx->ctx_switch_pending = false;
 
-   if (vrend_state.current_hw_ctx == ctx)
+   if (vrend_current_hw_ctx == ctx)
       return;
 
-   vrend_state.current_hw_ctx = ctx;
+   vrend_current_hw_ctx = ctx;
 
    vrend_clicbs->make_current(ctx->sub->gl_context);
 }
 
+bool vrend_renderer_use_threaded_contexts(void)
+{
+   return vrend_state.use_threaded_contexts;
+}
+
+/* With threaded contexts the GL contexts of a vrend context are bound by its
+ * worker for command execution, and by the renderer thread for transfers,
+ * resource attachment and query checks. The lock hands them over. */
+void vrend_context_lock(struct vrend_context *ctx)
+{
+   mtx_lock(&ctx->gl_mutex);
+}
+
+void vrend_context_unlock(struct vrend_context *ctx)
+{
+   /* GL objects created or written here must be visible to the thread that
+    * takes the context next, nothing is bound if the switch failed */
+   if (vrend_current_hw_ctx)
+      glFlush();
+
+   /* a GL context can only be current in one thread, the renderer thread
+    * goes back to ctx0 and the workers release theirs */
+   if (thrd_equal(thrd_current(), vrend_state.renderer_thread)) {
+      vrend_renderer_force_ctx_0();
+   } else {
+      vrend_clicbs->make_current(NULL);
+      vrend_current_ctx = NULL;
+      vrend_current_hw_ctx = NULL;
+   }
+
+   mtx_unlock(&ctx->gl_mutex);
+}
+
+/* Flush what a worker executed for ctx so far. The context is bound even when
+ * it is in error, nothing of it is executed here. */
+void vrend_context_flush(struct vrend_context *ctx)
+{
+   ctx->ctx_switch_pending = true;
+   vrend_finish_context_switch(ctx);
+   vrend_current_ctx = ctx;
+   glFlush();
+}
+
 void
 vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle)
 {
@@ -11492,6 +14244,7 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
    q->index = query_index;
    q->ctx = ctx;
    q->sub_ctx_id = ctx->sub->sub_ctx_id;
+   q->owning_sub = ctx->sub;
    q->fake_samples_passed = fake_samples_passed;
 
    vrend_resource_reference(&q->res, res);
@@ -11559,9 +14312,9 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
    }
 
    if (!err) {
-      glGenQueries(1, &q->id);
+      q->id = vrend_query_pool_get(ctx->sub, q->gltype);
       if (!vrend_renderer_object_insert(ctx, q, handle, VIRGL_OBJECT_QUERY)) {
-         glDeleteQueries(1, &q->id);
+         vrend_query_pool_put(ctx->sub, q->gltype, q->id);
          err = ENOMEM;
       }
    }
@@ -11577,8 +14330,11 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
 static void vrend_destroy_query(struct vrend_query *query)
 {
    vrend_resource_reference(&query->res, NULL);
+   mtx_lock(&vrend_state.query_mutex);
    list_del(&query->waiting_queries);
-   glDeleteQueries(1, &query->id);
+   vrend_query_batch_remove(query);
+   mtx_unlock(&vrend_state.query_mutex);
+   vrend_query_pool_put(query->owning_sub, query->gltype, query->id);
    free(query);
 }
 
@@ -11599,7 +14355,10 @@ int vrend_begin_query(struct vrend_context *ctx, uint32_t handle)
    if (q->index > 0 && !has_feature(feat_transform_feedback3))
       return EINVAL;
 
+   mtx_lock(&vrend_state.query_mutex);
    list_delinit(&q->waiting_queries);
+   vrend_query_batch_remove(q);
+   mtx_unlock(&vrend_state.query_mutex);
 
    if (q->gltype == GL_TIMESTAMP)
       return 0;
@@ -11641,24 +14400,31 @@ int vrend_end_query(struct vrend_context *ctx, uint32_t handle)
 }
 
 void vrend_get_query_result(struct vrend_context *ctx, uint32_t handle,
-                            UNUSED uint32_t wait)
+                            uint32_t wait)
 {
    struct vrend_query *q;
-   bool ret;
+   bool ret = false;
 
    q = vrend_object_lookup(ctx->sub->object_hash, handle, VIRGL_OBJECT_QUERY);
    if (!q)
       return;
 
-   ret = vrend_check_query(q);
+   /* With query buffer objects the result is picked up by the next batch
+    * instead of polling the query here. */
+   if (wait || !has_feature(feat_qbo))
+      ret = vrend_check_query(q);
+
+   mtx_lock(&vrend_state.query_mutex);
    if (ret) {
       list_delinit(&q->waiting_queries);
+      vrend_query_batch_remove(q);
    } else if (list_is_empty(&q->waiting_queries)) {
       list_addtail(&q->waiting_queries, &vrend_state.waiting_query_list);
    }
 
    atomic_store(&vrend_state.has_waiting_queries,
                 !list_is_empty(&vrend_state.waiting_query_list));
+   mtx_unlock(&vrend_state.query_mutex);
 }
 
 #define COPY_QUERY_RESULT_TO_BUFFER(resid, offset, pvalue, size, multiplier) \
@@ -12434,10 +15200,11 @@ static void vrend_renderer_fill_caps_v2(int gl_ver, int gles_ver,  union virgl_c
    if (has_feature(feat_indirect_draw))
       caps->v2.capability_bits |= VIRGL_CAP_BIND_COMMAND_ARGS;
 
-   if (has_feature(feat_multi_draw_indirect))
+   /* multi-draws are looped over when the host can't do them */
+   if (has_feature(feat_indirect_draw))
       caps->v2.capability_bits |= VIRGL_CAP_MULTI_DRAW_INDIRECT;
 
-   if (has_feature(feat_indirect_params))
+   if (has_feature(feat_indirect_params) || vrend_indirect_fixup_supported())
       caps->v2.capability_bits |= VIRGL_CAP_INDIRECT_PARAMS;
 
    for (int i = 0; i < VIRGL_FORMAT_MAX; i++) {
@@ -12689,6 +15456,11 @@ GLint64 vrend_renderer_get_timestamp(void)
    return v;
 }
 
+uint32_t vrend_renderer_get_format_probes(void)
+{
+   return vrend_state.format_probes;
+}
+
 void *vrend_renderer_get_cursor_contents(struct pipe_resource *pres,
                                          uint32_t *width,
                                          uint32_t *height)
@@ -12750,8 +15522,8 @@ void *vrend_renderer_get_cursor_contents(struct pipe_resource *pres,
 void vrend_renderer_force_ctx_0(void)
 {
    TRACE_FUNC();
-   vrend_state.current_ctx = NULL;
-   vrend_state.current_hw_ctx = NULL;
+   vrend_current_ctx = NULL;
+   vrend_current_hw_ctx = NULL;
    vrend_hw_switch_context(vrend_state.ctx0, true);
 }
 
@@ -12844,6 +15616,9 @@ void vrend_renderer_detach_res_ctx(struct vrend_context *ctx,
       return;
    }
 
+   list_for_each_entry(struct vrend_sub_context, sub, &ctx->sub_ctxs, head)
+      vrend_vertex_arrays_detach_resource(sub, (struct vrend_resource *)res->pipe_resource);
+
    vrend_ctx_resource_remove(ctx->res_hash, res->res_id);
 }
 
@@ -12918,6 +15693,8 @@ void vrend_renderer_get_cap_set(uint32_t cap_set, uint32_t *max_ver,
 void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 {
    struct virgl_gl_ctx_param ctx_params;
+   struct vrend_framebuffer_key fb_key;
+   struct vrend_framebuffer *fb;
    GLuint i;
 
    list_for_each_entry(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
@@ -12930,6 +15707,10 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    if (!sub)
       return;
 
+   /* the batch timer can't follow into another GL context */
+   const bool timed = ctx->gpu_timers[0] != NULL;
+   vrend_context_gpu_time_end(ctx, VREND_GPU_TIME_BATCHES);
+
    ctx_params.shared = (ctx->ctx_id == 0 && sub_ctx_id == 0) ? false : true;
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
@@ -12945,6 +15726,11 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
       glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
    }
 
+   /* let the driver use as many compiler threads as it likes, shaders
+    * precompiled on LINK_SHADER are then built in the background */
+   if (has_feature(feat_parallel_shader_compile))
+      glMaxShaderCompilerThreadsKHR(0xffffffff);
+
    sub->sub_ctx_id = sub_ctx_id;
 
    /* initialize the depth far_val to 1 */
@@ -12962,14 +15748,23 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
       glBindVertexArray(sub->vaoid);
    }
 
-   glGenFramebuffers(1, &sub->fb_id);
-   glBindFramebuffer(GL_FRAMEBUFFER, sub->fb_id);
    glGenFramebuffers(2, sub->blit_fb_ids);
 
    for (int i = 0; i < VREND_PROGRAM_NQUEUES; ++i)
       list_inithead(&sub->gl_programs[i]);
    list_inithead(&sub->cs_programs);
+   list_inithead(&sub->vertex_arrays);
+   list_inithead(&sub->framebuffers);
    list_inithead(&sub->streamout_list);
+   list_inithead(&sub->query_batches);
+   list_inithead(&sub->free_query_batches);
+   list_inithead(&sub->gpu_timers);
+
+   /* no attachments until the guest sets a framebuffer state */
+   memset(&fb_key, 0, sizeof(fb_key));
+   fb = vrend_framebuffer_create(sub, &fb_key);
+   if (fb)
+      vrend_framebuffer_bind(sub, fb);
 
    sub->object_hash = vrend_object_init_ctx_table();
 
@@ -12981,6 +15776,42 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
       ctx->sub0 = sub;
 
    vrend_set_tweak_from_env(&ctx->sub->tweaks);
+
+   if (timed)
+      vrend_context_gpu_time_begin(ctx, VREND_GPU_TIME_BATCHES);
+}
+
+void vrend_context_get_shader_stats(struct vrend_context *ctx,
+                                    struct virgl_renderer_shader_stats *stats)
+{
+   *stats = ctx->shader_stats;
+   stats->programs = 0;
+   stats->max_programs_per_sub_ctx = 0;
+
+   list_for_each_entry(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
+      uint32_t num_programs = list_length(&sub->cs_programs);
+
+      for (unsigned i = 0; i < VREND_PROGRAM_NQUEUES; ++i)
+         num_programs += list_length(&sub->gl_programs[i]);
+
+      stats->programs += num_programs;
+      stats->max_programs_per_sub_ctx = MAX2(stats->max_programs_per_sub_ctx, num_programs);
+   }
+}
+
+/* Program binary cache hits and the links that could not use one, plus the
+ * lookups of the shared sampler objects. */
+void vrend_context_get_cache_stats(struct vrend_context *ctx,
+                                   uint64_t *hits, uint64_t *misses)
+{
+   *hits = ctx->shader_stats.program_cache_hits + ctx->sampler_cache_hits;
+   *misses = ctx->shader_stats.links + ctx->sampler_cache_misses;
+}
+
+void vrend_context_get_copy_stats(struct vrend_context *ctx,
+                                  struct virgl_renderer_copy_stats *stats)
+{
+   *stats = ctx->copy_stats;
 }
 
 unsigned vrend_context_has_debug_flag(const struct vrend_context *ctx, enum virgl_debug_flags flag)
@@ -13005,11 +15836,16 @@ void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 
    list_for_each_entry(struct vrend_sub_context, sub, &ctx->sub_ctxs, head) {
       if (sub->sub_ctx_id == sub_ctx_id) {
+         const bool timed = ctx->sub == sub && ctx->gpu_timers[0];
+
          if (ctx->sub == sub) {
+            vrend_context_gpu_time_end(ctx, VREND_GPU_TIME_BATCHES);
             ctx->sub = ctx->sub0;
          }
          vrend_destroy_sub_context(sub);
          vrend_clicbs->make_current(ctx->sub->gl_context);
+         if (timed)
+            vrend_context_gpu_time_begin(ctx, VREND_GPU_TIME_BATCHES);
          break;
       }
    }
@@ -13019,8 +15855,13 @@ void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 {
    struct vrend_sub_context *sub = vrend_renderer_find_sub_ctx(ctx, sub_ctx_id);
    if (sub && ctx->sub != sub) {
+      const bool timed = ctx->gpu_timers[0] != NULL;
+
+      vrend_context_gpu_time_end(ctx, VREND_GPU_TIME_BATCHES);
       ctx->sub = sub;
       vrend_clicbs->make_current(sub->gl_context);
+      if (timed)
+         vrend_context_gpu_time_begin(ctx, VREND_GPU_TIME_BATCHES);
    }
 }
 
@@ -13028,6 +15869,8 @@ void vrend_renderer_prepare_reset(void)
 {
    /* make sure user contexts are no longer accessed */
    vrend_free_sync_thread();
+   /* the sync thread isn't respawned, new contexts run single threaded */
+   vrend_state.use_threaded_contexts = false;
    vrend_hw_switch_context(vrend_state.ctx0, true);
 }
 
@@ -168,7 +168,8 @@ struct vrend_format_table {
    uint32_t flags;
 };
 
-typedef void (*vrend_context_fence_retire)(uint64_t fence_id,
+typedef void (*vrend_context_fence_retire)(uint32_t ring_idx,
+                                           uint64_t fence_id,
                                            void *retire_data);
 
 struct vrend_if_cbs {
@@ -189,6 +190,7 @@ struct vrend_if_cbs {
 #define VREND_USE_VIDEO          (1 << 3)
 #define VREND_D3D11_SHARE_TEXTURE (1 << 4)
 #define VREND_USE_COMPAT_CONTEXT (1 << 5)
+#define VREND_USE_THREADED_CONTEXTS (1 << 6)
 
 bool vrend_check_no_error(struct vrend_context *ctx);
 
@@ -250,6 +252,43 @@ void vrend_destroy_context(struct vrend_context *ctx);
 struct virgl_context *vrend_renderer_context_create(uint32_t handle,
                                                     uint32_t nlen,
                                                     const char *name);
+void vrend_renderer_context_wait_idle(struct virgl_context *ctx);
+
+struct vrend_ctx0_fence_wait;
+struct vrend_ctx0_fence_wait *vrend_ctx0_fence_wait_create(uint32_t fence_id);
+int vrend_ctx0_fence_wait_put(struct vrend_ctx0_fence_wait *wait);
+void vrend_renderer_context_queue_ctx0_fence(struct virgl_context *ctx,
+                                             struct vrend_ctx0_fence_wait *wait);
+void vrend_renderer_context_get_shader_stats(struct virgl_context *ctx,
+                                             struct virgl_renderer_shader_stats *stats);
+void vrend_context_get_shader_stats(struct vrend_context *ctx,
+                                    struct virgl_renderer_shader_stats *stats);
+void vrend_renderer_context_get_copy_stats(struct virgl_context *ctx,
+                                           struct virgl_renderer_copy_stats *stats);
+int vrend_renderer_context_get_decode_stats(struct virgl_context *ctx,
+                                            struct virgl_renderer_decode_stats *stats,
+                                            struct virgl_renderer_cmd_stats *cmds,
+                                            uint32_t *num_cmds);
+void vrend_context_get_cache_stats(struct vrend_context *ctx,
+                                   uint64_t *hits, uint64_t *misses);
+void vrend_context_get_copy_stats(struct vrend_context *ctx,
+                                  struct virgl_renderer_copy_stats *stats);
+
+#define VREND_GPU_TIME_BATCHES (1 << 0)
+#define VREND_GPU_TIME_DRAWS   (1 << 1)
+
+struct vrend_gpu_time {
+   uint64_t batches;
+   uint64_t batch_ns;
+   uint64_t draws;
+   uint64_t draw_ns;
+};
+
+bool vrend_context_enable_gpu_time(struct vrend_context *ctx, uint32_t flags);
+void vrend_context_gpu_time_begin(struct vrend_context *ctx, uint32_t type);
+void vrend_context_gpu_time_end(struct vrend_context *ctx, uint32_t type);
+void vrend_context_get_gpu_time(struct vrend_context *ctx,
+                                struct vrend_gpu_time *gpu_time);
 
 struct vrend_renderer_resource_create_args {
    enum pipe_texture_target target;
@@ -281,6 +320,8 @@ struct pipe_resource *
 vrend_renderer_resource_create(const struct vrend_renderer_resource_create_args *args,
                                void *image_eos);
 
+int vrend_renderer_resource_alias_egl_image(struct vrend_resource *res, void *image);
+
 int vrend_create_surface(struct vrend_context *ctx, uint32_t handle,
                          struct vrend_resource *res,
                          enum virgl_formats format, uint32_t level, uint32_t first_layer,
@@ -449,6 +490,9 @@ void vrend_renderer_set_fence_retire(struct vrend_context *ctx,
 int vrend_renderer_create_fence(struct vrend_context *ctx,
                                 uint32_t flags,
                                 uint64_t fence_id);
+void vrend_renderer_retire_fence(struct vrend_context *ctx,
+                                 uint32_t ring_idx,
+                                 uint64_t fence_id);
 
 void vrend_renderer_check_fences(void);
 
@@ -456,6 +500,11 @@ int vrend_renderer_create_ctx0_fence(uint32_t fence_id);
 int vrend_renderer_export_ctx0_fence(uint32_t fence_id, int* out_fd);
 
 bool vrend_hw_switch_context(struct vrend_context *ctx, bool now);
+struct vrend_context *vrend_hw_current_context(void);
+bool vrend_renderer_use_threaded_contexts(void);
+void vrend_context_lock(struct vrend_context *ctx);
+void vrend_context_unlock(struct vrend_context *ctx);
+void vrend_context_flush(struct vrend_context *ctx);
 uint32_t vrend_renderer_object_insert(struct vrend_context *ctx, void *data,
                                       uint32_t handle, enum virgl_object_type type);
 void vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle);
@@ -492,6 +541,9 @@ void vrend_build_emulated_format_list_gles(void);
 void vrend_check_texture_storage(struct vrend_format_table *table);
 void vrend_check_texture_multisample(struct vrend_format_table *table,
                                      bool enable_storage);
+bool vrend_format_cache_load(bool use_gles);
+void vrend_format_cache_store(void);
+uint32_t vrend_renderer_get_format_probes(void);
 
 struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx,
                                                      int res_handle);
@@ -585,6 +637,7 @@ bool format_is_copy_compatible(enum virgl_formats src, enum virgl_formats dst,
 void vrend_renderer_prepare_reset(void);
 void vrend_renderer_reset(void);
 void vrend_renderer_poll(void);
+void vrend_renderer_wake_poll(void);
 int vrend_renderer_get_poll_fd(void);
 
 unsigned vrend_context_has_debug_flag(const struct vrend_context *ctx,
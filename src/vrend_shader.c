@@ -2922,18 +2922,30 @@ get_temp(const struct dump_ctx *ctx,
          char buf[static 64], bool *require_dummy_value)
 {
    struct vrend_temp_range *range = find_temp_range(ctx, reg);
+   struct vrend_strbuf sb;
+
+   strbuf_alloc_fixed(&sb, buf, 64);
    if (range) {
+      strbuf_append(&sb, "temp");
       if (indirect_dim) {
-         snprintf(buf, 64, "temp%d[addr%d + %d]", range->first, dim, reg - range->first);
+         strbuf_append_int(&sb, range->first);
+         strbuf_append(&sb, "[addr");
+         strbuf_append_int(&sb, dim);
+         strbuf_append(&sb, " + ");
+         strbuf_append_int(&sb, reg - range->first);
+         strbuf_append_char(&sb, ']');
       } else {
          if (range->array_id > 0) {
-            snprintf(buf, 64, "temp%d[%d]", range->first, reg - range->first);
+            strbuf_append_int(&sb, range->first);
+            strbuf_append_char(&sb, '[');
+            strbuf_append_int(&sb, reg - range->first);
+            strbuf_append_char(&sb, ']');
          } else {
-            snprintf(buf, 64, "temp%d", reg);
+            strbuf_append_int(&sb, reg);
          }
       }
    } else {
-      snprintf(buf, 64, "dummy_value");
+      strbuf_append(&sb, "dummy_value");
       *require_dummy_value = true;
    }
 }
@@ -4465,7 +4477,9 @@ get_destination_info(struct dump_ctx *ctx,
          char temp_buf[64];
          get_temp(ctx, dst_reg->Register.Indirect, 0, dst_reg->Register.Index,
                   temp_buf, &ctx->require_dummy_value);
-         strbuf_fmt(&dst_bufs[i], "%s%s", temp_buf, writemask);
+         strbuf_reset(&dst_bufs[i]);
+         strbuf_append(&dst_bufs[i], temp_buf);
+         strbuf_append(&dst_bufs[i], writemask);
          if (inst->Instruction.Precise) {
             struct vrend_temp_range *range = find_temp_range(ctx, dst_reg->Register.Index);
             if (range && ctx->cfg->has_gpu_shader5) {
@@ -4852,7 +4866,15 @@ get_source_info(struct dump_ctx *ctx,
          char temp_buf[64];
          get_temp(ctx, src->Register.Indirect, src->Indirect.Index, src->Register.Index,
                   temp_buf, &ctx->require_dummy_value);
-         strbuf_fmt(src_buf, "%s%cvec4(%s%s)%s%c", get_string(stypeprefix), stprefix ? '(' : ' ', prefix, temp_buf, swizzle, stprefix ? ')' : ' ');
+         strbuf_reset(src_buf);
+         strbuf_append(src_buf, get_string(stypeprefix));
+         strbuf_append_char(src_buf, stprefix ? '(' : ' ');
+         strbuf_append(src_buf, "vec4(");
+         strbuf_append(src_buf, prefix);
+         strbuf_append(src_buf, temp_buf);
+         strbuf_append_char(src_buf, ')');
+         strbuf_append(src_buf, swizzle);
+         strbuf_append_char(src_buf, stprefix ? ')' : ' ');
          break;
       }
       case TGSI_FILE_CONSTANT: {
@@ -5020,31 +5042,31 @@ get_source_info(struct dump_ctx *ctx,
                case TGSI_IMM_FLOAT32:
                   if (isinf(imd->val[idx].f) || isnan(imd->val[idx].f)) {
                      ctx->shader_req_bits |= SHADER_REQ_INTS;
-                     snprintf(temp, 48, "uintBitsToFloat(%uU)", imd->val[idx].ui);
-                  } else
+                     strbuf_append(src_buf, "uintBitsToFloat(");
+                     strbuf_append_uint(src_buf, imd->val[idx].ui);
+                     strbuf_append(src_buf, "U)");
+                  } else {
                      snprintf(temp, 25, "%.8g", imd->val[idx].f);
+                     strbuf_append(src_buf, temp);
+                  }
                   break;
                case TGSI_IMM_UINT32:
-                  snprintf(temp, 25, "%uU", imd->val[idx].ui);
+               case TGSI_IMM_FLOAT64:
+                  strbuf_append_uint(src_buf, imd->val[idx].ui);
+                  strbuf_append_char(src_buf, 'U');
                   break;
                case TGSI_IMM_INT32:
-                  snprintf(temp, 25, "%d", imd->val[idx].i);
+                  strbuf_append_int(src_buf, imd->val[idx].i);
                   sinfo->imm_value = imd->val[idx].i;
                   break;
-               case TGSI_IMM_FLOAT64:
-                  snprintf(temp, 48, "%uU", imd->val[idx].ui);
-                  break;
                default:
                   virgl_error("Unhandled imm type: %x\n", imd->type);
                   return false;
                }
-               strbuf_append(src_buf, temp);
                if (j < 3)
-                  strbuf_append(src_buf, ",");
-               else {
-                  snprintf(temp, 4, "))%c", isfloatabsolute ? ')' : 0);
-                  strbuf_append(src_buf, temp);
-               }
+                  strbuf_append_char(src_buf, ',');
+               else
+                  strbuf_append(src_buf, isfloatabsolute ? ")))" : "))");
             }
       }  break;
       case  TGSI_FILE_SYSTEM_VALUE: {
@@ -6615,6 +6637,19 @@ static void emit_image_decl(const struct dump_ctx *ctx,
                access, volatile_str, coherent_str, precision, ptc, stc, sname, i);
 }
 
+/* The renderer streams the legacy constants through a uniform buffer when
+ * the block fits next to the guest UBOs and the VirglBlock. */
+static bool use_const_ubo(const struct dump_ctx *ctx)
+{
+   if (!ctx->cfg->max_const_ubo_vec4)
+      return false;
+   if (!ctx->cfg->use_gles && ctx->cfg->glsl_version < 140)
+      return false;
+   if (ctx->num_consts > ctx->cfg->max_const_ubo_vec4)
+      return false;
+   return util_bitcount(ctx->ubo_used_mask) + 2 <= ctx->cfg->max_const_ubo_blocks;
+}
+
 static int emit_ios_common(const struct dump_ctx *ctx,
                            struct vrend_glsl_strbufs *glsl_strbufs,
                            uint32_t *shadow_samp_mask)
@@ -6660,7 +6695,11 @@ static int emit_ios_common(const struct dump_ctx *ctx,
    }
    if (ctx->num_consts) {
       const char *cname = tgsi_proc_to_prefix(ctx->prog_type);
-      emit_hdrf(glsl_strbufs, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
+      if (use_const_ubo(ctx))
+         emit_hdrf(glsl_strbufs, "layout (std140) uniform %sconstblock { uvec4 %sconst0[%d]; };\n",
+                   cname, cname, ctx->num_consts);
+      else
+         emit_hdrf(glsl_strbufs, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
    }
 
    if (ctx->ubo_used_mask) {
@@ -7919,9 +7958,15 @@ static void fill_sinfo(const struct dump_ctx *ctx, struct vrend_shader_info *sin
    }
 }
 
-static bool allocate_strbuffers(struct vrend_glsl_strbufs* glsl_strbufs)
+/* Roughly what a TGSI token expands to in GLSL, used to size the main
+ * buffer up front so that long shaders don't have to grow it repeatedly. */
+#define GLSL_BYTES_PER_TGSI_TOKEN 16
+
+static bool allocate_strbuffers(struct vrend_glsl_strbufs* glsl_strbufs,
+                                unsigned num_tokens)
 {
-   if (!strbuf_alloc(&glsl_strbufs->glsl_main, 4096))
+   if (!strbuf_alloc(&glsl_strbufs->glsl_main,
+                     MAX2(4096, num_tokens * GLSL_BYTES_PER_TGSI_TOKEN)))
       return false;
 
    if (strbuf_get_error(&glsl_strbufs->glsl_main))
@@ -8067,33 +8112,67 @@ bool vrend_shader_query_separable_program(const struct tgsi_token *tokens,
    return ctx.separable_program && supports_separable;
 }
 
+bool vrend_shader_analyze(const struct tgsi_token *tokens,
+                          struct vrend_shader_analysis *analysis)
+{
+   struct dump_ctx ctx;
+
+   memset(&ctx, 0, sizeof(struct dump_ctx));
+
+   /* First pass to deal with edge cases. */
+   ctx.iter.iterate_declaration = iter_decls;
+   ctx.iter.iterate_instruction = analyze_instruction;
+   ctx.ssbo_first_binding = UINT32_MAX;
+   if (!tgsi_iterate_shader(tokens, &ctx.iter))
+      return false;
+
+   if (!tgsi_scan_shader(tokens, &analysis->info))
+      return false;
+
+   analysis->ssbo_first_binding = ctx.ssbo_first_binding;
+   analysis->ssbo_integer_mask = ctx.ssbo_integer_mask;
+   analysis->fog_input_mask = ctx.fog_input_mask;
+   analysis->fog_output_mask = ctx.fog_output_mask;
+   analysis->integer_memory = ctx.integer_memory;
+   analysis->fs_uses_clipdist_input = ctx.fs_uses_clipdist_input;
+   return true;
+}
+
 bool vrend_convert_shader(const struct vrend_context *rctx,
                           const struct vrend_shader_cfg *cfg,
                           const struct tgsi_token *tokens,
+                          const struct vrend_shader_analysis *analysis,
                           uint32_t req_local_mem,
                           const struct vrend_shader_key *key,
                           struct vrend_shader_info *sinfo,
                           struct vrend_variable_shader_info *var_sinfo,
                           struct vrend_strarray *shader)
 {
+   struct vrend_shader_analysis local_analysis;
    struct dump_ctx ctx;
    bool bret;
 
+   /* callers that translate more than one variant pass the analysis in */
+   if (!analysis) {
+      if (!vrend_shader_analyze(tokens, &local_analysis))
+         return false;
+      analysis = &local_analysis;
+   }
+
    memset(&ctx, 0, sizeof(struct dump_ctx));
    ctx.cfg = cfg;
-
-   /* First pass to deal with edge cases. */
-   ctx.iter.iterate_declaration = iter_decls;
-   ctx.iter.iterate_instruction = analyze_instruction;
-   ctx.ssbo_first_binding = UINT32_MAX;
-   bret = tgsi_iterate_shader(tokens, &ctx.iter);
-   if (bret == false)
-      return false;
+   ctx.info = analysis->info;
+   ctx.ssbo_first_binding = analysis->ssbo_first_binding;
+   ctx.ssbo_integer_mask = analysis->ssbo_integer_mask;
+   ctx.fog_input_mask = analysis->fog_input_mask;
+   ctx.fog_output_mask = analysis->fog_output_mask;
+   ctx.integer_memory = analysis->integer_memory;
+   ctx.fs_uses_clipdist_input = analysis->fs_uses_clipdist_input;
 
    ctx.is_last_vertex_stage =
-         (ctx.iter.processor.Processor == TGSI_PROCESSOR_GEOMETRY) ||
-         (ctx.iter.processor.Processor == TGSI_PROCESSOR_TESS_EVAL && !key->gs_present) ||
-         (ctx.iter.processor.Processor == TGSI_PROCESSOR_VERTEX &&  !key->gs_present && !key->tes_present);
+         (ctx.info.processor == TGSI_PROCESSOR_GEOMETRY) ||
+         (ctx.info.processor == TGSI_PROCESSOR_TESS_EVAL && !key->gs_present) ||
+         (ctx.info.processor == TGSI_PROCESSOR_VERTEX &&  !key->gs_present && !key->tes_present);
 
    ctx.num_inputs = 0;
    ctx.iter.prolog = prolog;
@@ -8124,19 +8203,16 @@ bool vrend_convert_shader(const struct vrend_context *rctx,
    ctx.generic_ios.match.outputs_expected_mask = key->out_generic_expected_mask;
    ctx.texcoord_ios.match.outputs_expected_mask = key->out_texcoord_expected_mask;
 
-   if (!tgsi_scan_shader(tokens, &ctx.info))
-      goto fail;
-
    /* if we are in core profile mode we should use GLSL 1.40 */
    if (cfg->glsl_version >= 140)
       ctx.glsl_ver_required = require_glsl_ver(&ctx, 140);
 
-   if (ctx.iter.processor.Processor == TGSI_PROCESSOR_GEOMETRY ||
+   if (ctx.info.processor == TGSI_PROCESSOR_GEOMETRY ||
        key->gs_present)
       ctx.glsl_ver_required = require_glsl_ver(&ctx, 140);
 
-   if (ctx.iter.processor.Processor == TGSI_PROCESSOR_TESS_EVAL ||
-       ctx.iter.processor.Processor == TGSI_PROCESSOR_TESS_CTRL ||
+   if (ctx.info.processor == TGSI_PROCESSOR_TESS_EVAL ||
+       ctx.info.processor == TGSI_PROCESSOR_TESS_CTRL ||
        key->tes_present || key->tcs_present)
          ctx.glsl_ver_required = require_glsl_ver(&ctx, 150);
 
@@ -8159,7 +8235,7 @@ bool vrend_convert_shader(const struct vrend_context *rctx,
    if (ctx.info.indirect_files & (1 << TGSI_FILE_SAMPLER))
       ctx.shader_req_bits |= SHADER_REQ_GPU_SHADER5;
 
-   if (!allocate_strbuffers(&ctx.glsl_strbufs))
+   if (!allocate_strbuffers(&ctx.glsl_strbufs, ctx.info.num_tokens))
       goto fail;
 
    bret = tgsi_iterate_shader(tokens, &ctx.iter);
@@ -8368,7 +8444,7 @@ bool vrend_shader_create_passthrough_tcs(const struct vrend_context *rctx,
    ctx.ssbo_atomic_array_base = 0xffffffff;
    ctx.has_sample_input = false;
 
-   if (!allocate_strbuffers(&ctx.glsl_strbufs))
+   if (!allocate_strbuffers(&ctx.glsl_strbufs, 0))
       goto fail;
 
    tgsi_iterate_shader(vs_tokens, &ctx.iter);
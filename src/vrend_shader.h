@@ -27,6 +27,7 @@
 
 #include "pipe/p_state.h"
 #include "pipe/p_shader_tokens.h"
+#include "tgsi/tgsi_scan.h"
 
 #include "vrend_strbuf.h"
 
@@ -176,6 +177,18 @@ struct vrend_variable_shader_info {
    int legacy_color_bits;
 };
 
+/* Results of the key independent scans of a TGSI shader, computed once per
+ * shader and reused when translating each of its variants. */
+struct vrend_shader_analysis {
+   struct tgsi_shader_info info;
+   uint32_t ssbo_first_binding;
+   uint32_t ssbo_integer_mask;
+   uint32_t fog_input_mask;
+   uint32_t fog_output_mask;
+   bool integer_memory;
+   bool fs_uses_clipdist_input;
+};
+
 struct vrend_shader_key {
    uint64_t out_generic_expected_mask;
    uint64_t out_texcoord_expected_mask;
@@ -259,6 +272,9 @@ struct vrend_shader_cfg {
    uint32_t has_texture_shadow_lod : 1;
    uint32_t has_vs_layer : 1;
    uint32_t has_vs_viewport_index : 1;
+   /* zero if the legacy constants are plain uniforms */
+   uint32_t max_const_ubo_vec4 : 13;
+   uint32_t max_const_ubo_blocks : 7;
 };
 
 struct vrend_context;
@@ -267,9 +283,13 @@ struct vrend_context;
 #define SHADER_STRING_VER_EXT 0
 #define SHADER_STRING_HDR 1
 
+bool vrend_shader_analyze(const struct tgsi_token *tokens,
+                          struct vrend_shader_analysis *analysis);
+
 bool vrend_convert_shader(const struct vrend_context *rctx,
                           const struct vrend_shader_cfg *cfg,
                           const struct tgsi_token *tokens,
+                          const struct vrend_shader_analysis *analysis,
                           uint32_t req_local_mem,
                           const struct vrend_shader_key *key,
                           struct vrend_shader_info *sinfo,
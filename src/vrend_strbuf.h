@@ -29,6 +29,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 #include "util/u_math.h"
 
 #include "vrend_debug.h"
@@ -111,9 +113,12 @@ static inline bool strbuf_grow(struct vrend_strbuf *sb, int len)
          return false;
       }
       /* Reallocate to the larger size of current alloc + min realloc,
-       * or the resulting string size if larger.
+       * twice the current alloc, or the resulting string size if larger.
+       * Growing geometrically keeps the number of reallocs for long
+       * shaders logarithmic in the size of the generated GLSL.
        */
-      size_t new_size = MAX2(sb->size + len + 1, sb->alloc_size + STRBUF_MIN_MALLOC);
+      size_t new_size = MAX3(sb->size + len + 1, sb->alloc_size + STRBUF_MIN_MALLOC,
+                             sb->alloc_size * 2);
       char *new = realloc(sb->buf, new_size);
       if (!new) {
          strbuf_set_error(sb);
@@ -141,6 +146,46 @@ static inline void strbuf_append(struct vrend_strbuf *sb, const char *addstr)
    strbuf_append_buffer(sb, addstr, strlen(addstr));
 }
 
+/* Specialised appenders for the pieces the shader translator emits most,
+ * these avoid going through vsnprintf for every register name. */
+static inline void strbuf_append_char(struct vrend_strbuf *sb, char c)
+{
+   assert(c != '\0');
+   if (strbuf_get_error(sb) ||
+       !strbuf_grow(sb, 1))
+      return;
+   sb->buf[sb->size++] = c;
+   sb->buf[sb->size] = '\0';
+}
+
+static inline void strbuf_append_uint(struct vrend_strbuf *sb, uint32_t value)
+{
+   char digits[10];
+   int len = 0;
+
+   do {
+      digits[len++] = '0' + value % 10;
+      value /= 10;
+   } while (value);
+
+   if (strbuf_get_error(sb) ||
+       !strbuf_grow(sb, len))
+      return;
+   while (len)
+      sb->buf[sb->size++] = digits[--len];
+   sb->buf[sb->size] = '\0';
+}
+
+static inline void strbuf_append_int(struct vrend_strbuf *sb, int32_t value)
+{
+   if (value < 0) {
+      strbuf_append_char(sb, '-');
+      strbuf_append_uint(sb, -(uint32_t)value);
+   } else {
+      strbuf_append_uint(sb, value);
+   }
+}
+
 static inline void strbuf_vappendf(struct vrend_strbuf *sb, const char *fmt, va_list ap)
 {
    va_list cp;
@@ -66,6 +66,10 @@
  */
 
 
+#include <drm_fourcc.h>
+
+#include "util/u_thread.h"
+#include "virglrenderer.h"
 #include "virgl_video.h"
 #include "virgl_video_hw.h"
 
@@ -80,11 +84,25 @@ struct vrend_video_context {
     struct vrend_context *ctx;
     struct list_head codecs;
     struct list_head buffers;
+
+    /* frames of asynchronous codecs in end_frame order, and the fences of
+     * the video ring in submission order */
+    struct list_head frames;
+    struct list_head fences;
+    uint64_t frame_seqno;       /* the last frame ended */
+    uint64_t completed_seqno;   /* the last frame completed */
+
+    /* in video_worker.busy while there are frames or fences */
+    struct list_head busy_head;
+    bool busy;
+    uint32_t poll_pass;
 };
 
 struct vrend_video_codec {
     struct virgl_video_codec *codec;
     uint32_t handle;
+    uint32_t entrypoint;
+    bool async;                         /* VIRGL_VIDEO_CODEC_FLAG_ASYNC */
     struct vrend_resource *feed_res;    /* encoding feedback */
     struct vrend_resource *dest_res;    /* encoding coded buffer */
     struct vrend_video_context *ctx;
@@ -95,7 +113,8 @@ struct vrend_video_plane {
     uint32_t res_handle;
     GLuint texture;         /* texture for temporary use */
     GLuint framebuffer;     /* framebuffer for temporary use */
-    EGLImageKHR egl_image;  /* egl image for temporary use */
+    EGLImageKHR egl_image;  /* egl image of the dmabuf plane */
+    bool aliased;           /* the resource shares the memory of the plane */
 };
 
 struct vrend_video_buffer {
@@ -107,8 +126,48 @@ struct vrend_video_buffer {
 
     uint32_t num_planes;
     struct vrend_video_plane planes[3];
+
+    /* all planes alias the surface, no copies are needed */
+    bool zero_copy;
+};
+
+/* a frame of an asynchronous codec, waiting for the video engine */
+struct vrend_video_frame {
+    struct list_head head;          /* in vrend_video_context.frames */
+    struct list_head queue_head;    /* in video_worker.queue until synced */
+    struct vrend_video_codec *cdc;
+    struct vrend_video_buffer *tgt;
+    uint64_t seqno;
+    bool synced;
+    int status;
+};
+
+/* a fence of the video ring */
+struct vrend_video_fence {
+    struct list_head head;
+    uint32_t flags;
+    uint64_t fence_id;
+    uint64_t seqno;                 /* the last frame ended before it */
 };
 
+/*
+ * The video worker waits for the video engine, so that end_frame of an
+ * asynchronous codec doesn't block the context. The completion callbacks
+ * use GL and run in the thread of the context, from vrend_video_poll() or
+ * when the guest uses the codec or the buffer of a frame again.
+ */
+static struct {
+    bool initialized;
+    bool running;
+    bool stop;
+    thrd_t thread;
+    mtx_t mutex;
+    cnd_t cond;                     /* a frame was queued or synced */
+    struct list_head queue;         /* frames to sync */
+    struct list_head busy;          /* contexts with frames or fences */
+    uint32_t poll_pass;
+} video_worker;
+
 static struct vrend_video_codec *vrend_video_codec(
         struct virgl_video_codec *codec)
 {
@@ -145,6 +204,78 @@ static struct vrend_video_buffer *get_video_buffer(
     return NULL;
 }
 
+static EGLImageKHR get_plane_egl_image(struct vrend_video_plane *plane,
+                                       const struct virgl_video_dma_buf *dmabuf,
+                                       unsigned index)
+{
+    if (EGL_NO_IMAGE_KHR == plane->egl_image) {
+        EGLint img_attrs[16] = {
+            EGL_LINUX_DRM_FOURCC_EXT,       dmabuf->planes[index].drm_format,
+            EGL_WIDTH,                      dmabuf->width / (index + 1),
+            EGL_HEIGHT,                     dmabuf->height / (index + 1),
+            EGL_DMA_BUF_PLANE0_FD_EXT,      dmabuf->planes[index].fd,
+            EGL_DMA_BUF_PLANE0_OFFSET_EXT,  dmabuf->planes[index].offset,
+            EGL_DMA_BUF_PLANE0_PITCH_EXT,   dmabuf->planes[index].pitch,
+            EGL_NONE
+        };
+
+        plane->egl_image = eglCreateImageKHR(eglGetCurrentDisplay(),
+                EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
+    }
+
+    return plane->egl_image;
+}
+
+static bool plane_format_matches(uint32_t drm_format, enum virgl_formats format)
+{
+    switch (drm_format) {
+    case DRM_FORMAT_R8:
+        return format == VIRGL_FORMAT_R8_UNORM;
+    case DRM_FORMAT_GR88:
+        return format == VIRGL_FORMAT_R8G8_UNORM;
+    case DRM_FORMAT_R16:
+        return format == VIRGL_FORMAT_R16_UNORM;
+    case DRM_FORMAT_GR1616:
+        return format == VIRGL_FORMAT_R16G16_UNORM;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Let the plane resources use the memory of the surface directly, so that
+ * decoded pictures are visible to the guest and pictures to encode are
+ * visible to VA-API without a copy. Planes that can't be aliased keep using
+ * the copies in sync_dmabuf_to_video_buffer and sync_video_buffer_to_dmabuf.
+ */
+static void alias_video_buffer(struct vrend_video_buffer *buf,
+                               const struct virgl_video_dma_buf *dmabuf)
+{
+    unsigned i, num_aliased = 0;
+
+    for (i = 0; i < dmabuf->num_planes && i < buf->num_planes; i++) {
+        struct vrend_video_plane *plane = &buf->planes[i];
+        struct vrend_resource *res;
+
+        res = vrend_renderer_ctx_res_lookup(buf->ctx->ctx, plane->res_handle);
+        if (!res || res->base.width0 != dmabuf->width / (i + 1) ||
+            res->base.height0 != dmabuf->height / (i + 1) ||
+            !plane_format_matches(dmabuf->planes[i].drm_format, res->base.format))
+            continue;
+
+        if (EGL_NO_IMAGE_KHR == get_plane_egl_image(plane, dmabuf, i))
+            continue;
+
+        plane->aliased = !vrend_renderer_resource_alias_egl_image(res,
+                                                            plane->egl_image);
+        if (plane->aliased)
+            num_aliased++;
+    }
+
+    buf->zero_copy = num_aliased && num_aliased == buf->num_planes;
+    virgl_debug("video buffer %u: %u of %u planes aliased\n",
+                buf->handle, num_aliased, buf->num_planes);
+}
 
 static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
                                        const struct virgl_video_dma_buf *dmabuf)
@@ -158,6 +289,9 @@ static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
         struct vrend_video_plane *plane = &buf->planes[i];
         struct vrend_resource *res;
 
+        if (plane->aliased)
+            continue;
+
         res = vrend_renderer_ctx_res_lookup(buf->ctx->ctx, plane->res_handle);
         if (!res) {
             virgl_error("%s: res %d not found\n", __func__, plane->res_handle);
@@ -165,22 +299,7 @@ static int sync_dmabuf_to_video_buffer(struct vrend_video_buffer *buf,
         }
 
         /* dmabuf -> eglimage */
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
-            EGLint img_attrs[16] = {
-                EGL_LINUX_DRM_FOURCC_EXT,       dmabuf->planes[i].drm_format,
-                EGL_WIDTH,                      dmabuf->width / (i + 1),
-                EGL_HEIGHT,                     dmabuf->height / (i + 1),
-                EGL_DMA_BUF_PLANE0_FD_EXT,      dmabuf->planes[i].fd,
-                EGL_DMA_BUF_PLANE0_OFFSET_EXT,  dmabuf->planes[i].offset,
-                EGL_DMA_BUF_PLANE0_PITCH_EXT,   dmabuf->planes[i].pitch,
-                EGL_NONE
-            };
-
-            plane->egl_image = eglCreateImageKHR(eglGetCurrentDisplay(),
-                    EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
-        }
-
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
+        if (EGL_NO_IMAGE_KHR == get_plane_egl_image(plane, dmabuf, i)) {
             virgl_error("%s: create egl image failed\n", __func__);
             continue;
         }
@@ -219,6 +338,9 @@ static int sync_video_buffer_to_dmabuf(struct vrend_video_buffer *buf,
         struct vrend_video_plane *plane = &buf->planes[i];
         struct vrend_resource *res;
 
+        if (plane->aliased)
+            continue;
+
         res = vrend_renderer_ctx_res_lookup(buf->ctx->ctx, plane->res_handle);
         if (!res) {
             virgl_error("%s: res %d not found\n", __func__, plane->res_handle);
@@ -226,22 +348,7 @@ static int sync_video_buffer_to_dmabuf(struct vrend_video_buffer *buf,
         }
 
         /* dmabuf -> eglimage */
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
-            EGLint img_attrs[16] = {
-                EGL_LINUX_DRM_FOURCC_EXT,       dmabuf->planes[i].drm_format,
-                EGL_WIDTH,                      dmabuf->width / (i + 1),
-                EGL_HEIGHT,                     dmabuf->height / (i + 1),
-                EGL_DMA_BUF_PLANE0_FD_EXT,      dmabuf->planes[i].fd,
-                EGL_DMA_BUF_PLANE0_OFFSET_EXT,  dmabuf->planes[i].offset,
-                EGL_DMA_BUF_PLANE0_PITCH_EXT,   dmabuf->planes[i].pitch,
-                EGL_NONE
-            };
-
-            plane->egl_image = eglCreateImageKHR(eglGetCurrentDisplay(),
-                    EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
-        }
-
-        if (EGL_NO_IMAGE_KHR == plane->egl_image) {
+        if (EGL_NO_IMAGE_KHR == get_plane_egl_image(plane, dmabuf, i)) {
             virgl_error("%s: create egl image failed\n", __func__);
             continue;
         }
@@ -278,6 +385,10 @@ static void vrend_video_decode_completed(
 
     (void)codec;
 
+    /* VA-API already waited for the decoder */
+    if (buf->zero_copy)
+        return;
+
     sync_dmabuf_to_video_buffer(buf, dmabuf);
 }
 
@@ -290,9 +401,24 @@ static void vrend_video_enocde_upload_picture(
 
     (void)codec;
 
+    /* the encoder reads the planes as soon as the picture begins */
+    if (buf->zero_copy) {
+        glFinish();
+        return;
+    }
+
     sync_video_buffer_to_dmabuf(buf, dmabuf);
 }
 
+static void vrend_video_buffer_created(struct virgl_video_buffer *buffer,
+                                       const struct virgl_video_dma_buf *dmabuf)
+{
+    struct vrend_video_buffer *buf = vrend_video_buffer(buffer);
+
+    if (buf)
+        alias_video_buffer(buf, dmabuf);
+}
+
 static void vrend_video_encode_completed(
                                 struct virgl_video_codec *codec,
                                 const struct virgl_video_dma_buf *src_buf,
@@ -347,27 +473,325 @@ static void vrend_video_encode_completed(
 }
 
 static struct virgl_video_callbacks video_callbacks = {
+    .buffer_created             = vrend_video_buffer_created,
     .decode_completed           = vrend_video_decode_completed,
     .encode_upload_picture      = vrend_video_enocde_upload_picture,
     .encode_completed           = vrend_video_encode_completed,
 };
 
+static int video_worker_thread(void *arg)
+{
+    (void)arg;
+
+    u_thread_setname("vrend-video");
+
+    mtx_lock(&video_worker.mutex);
+    while (true) {
+        struct vrend_video_frame *frame;
+        int status;
+
+        while (list_is_empty(&video_worker.queue) && !video_worker.stop)
+            cnd_wait(&video_worker.cond, &video_worker.mutex);
+        if (list_is_empty(&video_worker.queue))
+            break;
+
+        /* the frame is not freed before it is synced */
+        frame = list_first_entry(&video_worker.queue,
+                                 struct vrend_video_frame, queue_head);
+        mtx_unlock(&video_worker.mutex);
+
+        status = virgl_video_sync_buffer(frame->tgt->buffer);
+
+        mtx_lock(&video_worker.mutex);
+        list_delinit(&frame->queue_head);
+        frame->status = status;
+        frame->synced = true;
+        cnd_broadcast(&video_worker.cond);
+
+        /* the frame is completed and its fences retired in the next poll */
+        vrend_renderer_wake_poll();
+    }
+    mtx_unlock(&video_worker.mutex);
+
+    return 0;
+}
+
+static void update_busy(struct vrend_video_context *ctx)
+{
+    bool busy = !list_is_empty(&ctx->frames) || !list_is_empty(&ctx->fences);
+
+    if (busy == ctx->busy)
+        return;
+
+    mtx_lock(&video_worker.mutex);
+    if (busy)
+        list_addtail(&ctx->busy_head, &video_worker.busy);
+    else
+        list_del(&ctx->busy_head);
+    mtx_unlock(&video_worker.mutex);
+
+    ctx->busy = busy;
+}
+
+/* Hand an ended frame to the video worker, returns false if the frame has
+ * to be completed synchronously. */
+static bool queue_frame(struct vrend_video_codec *cdc,
+                        struct vrend_video_buffer *tgt)
+{
+    struct vrend_video_context *ctx = cdc->ctx;
+    struct vrend_video_frame *frame;
+
+    if (!video_worker.running)
+        return false;
+
+    frame = (struct vrend_video_frame *)calloc(1, sizeof(*frame));
+    if (!frame)
+        return false;
+
+    frame->cdc = cdc;
+    frame->tgt = tgt;
+    frame->seqno = ++ctx->frame_seqno;
+    list_addtail(&frame->head, &ctx->frames);
+
+    mtx_lock(&video_worker.mutex);
+    list_addtail(&frame->queue_head, &video_worker.queue);
+    cnd_broadcast(&video_worker.cond);
+    mtx_unlock(&video_worker.mutex);
+
+    update_busy(ctx);
+
+    return true;
+}
+
+static void retire_fences(struct vrend_video_context *ctx)
+{
+    list_for_each_entry_safe(struct vrend_video_fence, fence,
+                             &ctx->fences, head) {
+        struct vrend_video_fence *next;
+
+        if (fence->seqno > ctx->completed_seqno)
+            break;
+
+        list_del(&fence->head);
+
+        /* a mergeable fence is covered by the next one if that is retired */
+        next = list_is_empty(&ctx->fences) ? NULL :
+               list_first_entry(&ctx->fences, struct vrend_video_fence, head);
+        if (!(fence->flags & VIRGL_RENDERER_FENCE_FLAG_MERGEABLE) ||
+            !next || next->seqno > ctx->completed_seqno)
+            vrend_renderer_retire_fence(ctx->ctx, VIRGL_VIDEO_FENCE_RING_IDX,
+                                        fence->fence_id);
+        free(fence);
+    }
+}
+
+/*
+ * Run the completion callbacks of the frames of the context in order, up to
+ * and including last, waiting for the video worker as needed. Without last,
+ * only the frames the worker is done with are completed. Called with the GL
+ * context of ctx current.
+ */
+static void complete_frames(struct vrend_video_context *ctx,
+                            struct vrend_video_frame *last)
+{
+    list_for_each_entry_safe(struct vrend_video_frame, frame,
+                             &ctx->frames, head) {
+        bool synced, done = frame == last;
+
+        mtx_lock(&video_worker.mutex);
+        while (last && !frame->synced)
+            cnd_wait(&video_worker.cond, &video_worker.mutex);
+        synced = frame->synced;
+        mtx_unlock(&video_worker.mutex);
+
+        if (!synced)
+            break;
+
+        if (!frame->status)
+            virgl_video_complete_frame(frame->cdc->codec, frame->tgt->buffer);
+        ctx->completed_seqno = frame->seqno;
+
+        list_del(&frame->head);
+        free(frame);
+
+        if (done)
+            break;
+    }
+
+    update_busy(ctx);
+}
+
+/* Complete the frames up to the last one that uses the codec or the buffer,
+ * before the guest changes or destroys them. */
+static void complete_frames_using(struct vrend_video_context *ctx,
+                                  struct vrend_video_codec *cdc,
+                                  struct vrend_video_buffer *buf)
+{
+    struct vrend_video_frame *last = NULL;
+
+    list_for_each_entry(struct vrend_video_frame, frame, &ctx->frames, head) {
+        if ((cdc && frame->cdc == cdc) || (buf && frame->tgt == buf))
+            last = frame;
+    }
+
+    if (last)
+        complete_frames(ctx, last);
+}
+
+/* Wait for the frames without completing them, when the results can't be
+ * used anymore. */
+static void drop_frames(struct vrend_video_context *ctx)
+{
+    list_for_each_entry_safe(struct vrend_video_frame, frame,
+                             &ctx->frames, head) {
+        mtx_lock(&video_worker.mutex);
+        while (!frame->synced)
+            cnd_wait(&video_worker.cond, &video_worker.mutex);
+        mtx_unlock(&video_worker.mutex);
+
+        ctx->completed_seqno = frame->seqno;
+        list_del(&frame->head);
+        free(frame);
+    }
+}
+
+static void poll_context(struct vrend_video_context *ctx)
+{
+    bool threaded = vrend_renderer_use_threaded_contexts();
+    struct vrend_context *prev = vrend_hw_current_context();
+
+    if (threaded)
+        vrend_context_lock(ctx->ctx);
+
+    /* the completion callbacks use the GL objects of the context */
+    if (vrend_hw_switch_context(ctx->ctx, true)) {
+        complete_frames(ctx, NULL);
+    } else {
+        virgl_warn("failed to switch to context %p for video frames\n",
+                   (void *)ctx->ctx);
+        drop_frames(ctx);
+    }
+
+    retire_fences(ctx);
+    update_busy(ctx);
+
+    /* give the caller back the context it was using */
+    if (prev && prev != ctx->ctx && !vrend_hw_switch_context(prev, true))
+        vrend_renderer_force_ctx_0();
+
+    if (threaded)
+        vrend_context_unlock(ctx->ctx);
+}
+
+void vrend_video_poll(void)
+{
+    struct vrend_video_context *ctx;
+    uint32_t pass;
+
+    if (!video_worker.initialized)
+        return;
+
+    /* contexts are only destroyed by the thread that polls */
+    pass = ++video_worker.poll_pass;
+    do {
+        ctx = NULL;
+        mtx_lock(&video_worker.mutex);
+        list_for_each_entry(struct vrend_video_context, vctx,
+                            &video_worker.busy, busy_head) {
+            if (vctx->poll_pass != pass) {
+                vctx->poll_pass = pass;
+                ctx = vctx;
+                break;
+            }
+        }
+        mtx_unlock(&video_worker.mutex);
+
+        if (ctx)
+            poll_context(ctx);
+    } while (ctx);
+}
+
+int vrend_video_create_fence(struct vrend_video_context *ctx,
+                             uint32_t flags,
+                             uint64_t fence_id)
+{
+    struct vrend_video_fence *fence;
+
+    /* the video context of the vrend context failed to allocate */
+    if (!ctx || !video_worker.initialized)
+        return EINVAL;
+
+    fence = (struct vrend_video_fence *)calloc(1, sizeof(*fence));
+    if (!fence)
+        return ENOMEM;
+
+    fence->flags = flags;
+    fence->fence_id = fence_id;
+    fence->seqno = ctx->frame_seqno;
+    list_addtail(&fence->head, &ctx->fences);
+    update_busy(ctx);
+
+    /* nothing to wait for */
+    if (fence->seqno <= ctx->completed_seqno)
+        vrend_renderer_wake_poll();
+
+    return 0;
+}
+
 int vrend_video_init(int drm_fd)
 {
     if (drm_fd < 0)
         return -1;
 
-    return virgl_video_init(drm_fd, &video_callbacks, 0);
+    if (virgl_video_init(drm_fd, &video_callbacks, 0))
+        return -1;
+
+    mtx_init(&video_worker.mutex, mtx_plain);
+    cnd_init(&video_worker.cond);
+    list_inithead(&video_worker.queue);
+    list_inithead(&video_worker.busy);
+    video_worker.stop = false;
+
+    /* asynchronous codecs complete their frames in end_frame without it */
+    video_worker.running = thrd_create(&video_worker.thread,
+                                       video_worker_thread,
+                                       NULL) == thrd_success;
+    if (!video_worker.running)
+        virgl_warn("failed to start the video worker\n");
+
+    video_worker.initialized = true;
+
+    return 0;
 }
 
 void vrend_video_fini(void)
 {
+    if (video_worker.initialized) {
+        if (video_worker.running) {
+            mtx_lock(&video_worker.mutex);
+            video_worker.stop = true;
+            cnd_broadcast(&video_worker.cond);
+            mtx_unlock(&video_worker.mutex);
+
+            thrd_join(video_worker.thread, NULL);
+        }
+
+        cnd_destroy(&video_worker.cond);
+        mtx_destroy(&video_worker.mutex);
+        memset(&video_worker, 0, sizeof(video_worker));
+    }
+
     virgl_video_destroy();
 }
 
 int vrend_video_fill_caps(union virgl_caps *caps)
 {
-    return virgl_video_fill_caps(caps);
+    int ret = virgl_video_fill_caps(caps);
+
+    if (!ret && video_worker.initialized)
+        caps->v2.capability_bits_v2 |= VIRGL_CAP_V2_VIDEO_FENCE_RING;
+
+    return ret;
 }
 
 int vrend_video_create_codec(struct vrend_video_context *ctx,
@@ -421,6 +845,8 @@ int vrend_video_create_codec(struct vrend_video_context *ctx,
     }
 
     cdc->handle = handle;
+    cdc->entrypoint = entrypoint;
+    cdc->async = flags & VIRGL_VIDEO_CODEC_FLAG_ASYNC;
     cdc->ctx = ctx;
     list_add(&cdc->head, &ctx->codecs);
 
@@ -441,9 +867,27 @@ void vrend_video_destroy_codec(struct vrend_video_context *ctx,
 {
     struct vrend_video_codec *cdc = get_video_codec(ctx, handle);
 
+    if (cdc)
+        complete_frames_using(ctx, cdc, NULL);
+
     destroy_video_codec(cdc);
 }
 
+static void destroy_video_planes(struct vrend_video_buffer *buf)
+{
+    unsigned i;
+    struct vrend_video_plane *plane;
+
+    for (i = 0; i < buf->num_planes; i++) {
+        plane = &buf->planes[i];
+
+        glDeleteTextures(1, &plane->texture);
+        glDeleteFramebuffers(1, &plane->framebuffer);
+        if (plane->egl_image != EGL_NO_IMAGE_KHR)
+            eglDestroyImageKHR(eglGetCurrentDisplay(), plane->egl_image);
+    }
+}
+
 int vrend_video_create_buffer(struct vrend_video_context *ctx,
                               uint32_t handle,
                               uint32_t format,
@@ -472,17 +916,6 @@ int vrend_video_create_buffer(struct vrend_video_context *ctx,
     if (!buf)
         return -1;
 
-    args.format = format;
-    args.width = width;
-    args.height = height;
-    args.interlaced = 0;
-    args.opaque = buf;
-    buf->buffer = virgl_video_create_buffer(&args);
-    if (!buf->buffer) {
-        free(buf);
-        return -1;
-    }
-
     for (i = 0; i < ARRAY_SIZE(buf->planes); i++)
         buf->planes[i].egl_image = EGL_NO_IMAGE_KHR;
 
@@ -506,6 +939,20 @@ int vrend_video_create_buffer(struct vrend_video_context *ctx,
 
     buf->handle = handle;
     buf->ctx = ctx;
+
+    /* the planes are aliased to the surface while it is created */
+    args.format = format;
+    args.width = width;
+    args.height = height;
+    args.interlaced = 0;
+    args.opaque = buf;
+    buf->buffer = virgl_video_create_buffer(&args);
+    if (!buf->buffer) {
+        destroy_video_planes(buf);
+        free(buf);
+        return -1;
+    }
+
     list_add(&buf->head, &ctx->buffers);
 
     return 0;
@@ -513,23 +960,13 @@ int vrend_video_create_buffer(struct vrend_video_context *ctx,
 
 static void destroy_video_buffer(struct vrend_video_buffer *buf)
 {
-    unsigned i;
-    struct vrend_video_plane *plane;
-
     if (!buf)
         return;
 
     list_del(&buf->head);
 
-    for (i = 0; i < buf->num_planes; i++) {
-        plane = &buf->planes[i];
-
-        glDeleteTextures(1, &plane->texture);
-        glDeleteFramebuffers(1, &plane->framebuffer);
-        if (plane->egl_image == EGL_NO_IMAGE_KHR)
-            eglDestroyImageKHR(eglGetCurrentDisplay(), plane->egl_image);
-    }
-
+    /* aliased resources keep the memory of the surface alive */
+    destroy_video_planes(buf);
     virgl_video_destroy_buffer(buf->buffer);
 
     free(buf);
@@ -540,6 +977,9 @@ void vrend_video_destroy_buffer(struct vrend_video_context *ctx,
 {
     struct vrend_video_buffer *buf = get_video_buffer(ctx, handle);
 
+    if (buf)
+        complete_frames_using(ctx, NULL, buf);
+
     destroy_video_buffer(buf);
 }
 
@@ -552,6 +992,8 @@ struct vrend_video_context *vrend_video_create_context(struct vrend_context *ctx
         vctx->ctx = ctx;
         list_inithead(&vctx->codecs);
         list_inithead(&vctx->buffers);
+        list_inithead(&vctx->frames);
+        list_inithead(&vctx->fences);
     }
 
     return vctx;
@@ -559,6 +1001,13 @@ struct vrend_video_context *vrend_video_create_context(struct vrend_context *ctx
 
 void vrend_video_destroy_context(struct vrend_video_context *ctx)
 {
+   drop_frames(ctx);
+
+   list_for_each_entry_safe(struct vrend_video_fence, fence, &ctx->fences, head)
+      free(fence);
+   list_inithead(&ctx->fences);
+   update_busy(ctx);
+
    list_for_each_entry_safe(struct vrend_video_codec, vcdc, &ctx->codecs, head)
       destroy_video_codec(vcdc);
 
@@ -578,6 +1027,12 @@ int vrend_video_begin_frame(struct vrend_video_context *ctx,
     if (!cdc || !tgt)
         return -1;
 
+    /* the encoder reuses the coded buffer and the feedback resources */
+    if (cdc->entrypoint == PIPE_VIDEO_ENTRYPOINT_ENCODE)
+        complete_frames_using(ctx, cdc, tgt);
+    else
+        complete_frames_using(ctx, NULL, tgt);
+
     return virgl_video_begin_frame(cdc->codec, tgt->buffer);
 }
 
@@ -853,6 +1308,20 @@ int vrend_video_end_frame(struct vrend_video_context *ctx,
     if (!cdc || !tgt)
         return -1;
 
-    return virgl_video_end_frame(cdc->codec, tgt->buffer);
+    if (!cdc->async)
+        return virgl_video_end_frame(cdc->codec, tgt->buffer);
+
+    if (virgl_video_submit_frame(cdc->codec, tgt->buffer))
+        return -1;
+
+    if (queue_frame(cdc, tgt))
+        return 0;
+
+    if (virgl_video_sync_buffer(tgt->buffer))
+        return -1;
+
+    virgl_video_complete_frame(cdc->codec, tgt->buffer);
+
+    return 0;
 }
 
@@ -46,9 +46,17 @@ void vrend_video_fini(void);
 
 int vrend_video_fill_caps(union virgl_caps *caps);
 
+/* Complete the frames of asynchronous codecs the video engine is done with
+ * and retire the fences of the video ring. */
+void vrend_video_poll(void);
+
 struct vrend_video_context *vrend_video_create_context(struct vrend_context *ctx);
 void vrend_video_destroy_context(struct vrend_video_context *ctx);
 
+int vrend_video_create_fence(struct vrend_video_context *ctx,
+                             uint32_t flags,
+                             uint64_t fence_id);
+
 int vrend_video_create_codec(struct vrend_video_context *ctx,
                              uint32_t handle,
                              uint32_t profile,
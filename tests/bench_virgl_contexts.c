@@ -0,0 +1,206 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+/* multi-context throughput benchmark, run with "meson test --benchmark"
+ *
+ * Every context renders into its own target, the submissions are interleaved
+ * the way a VMM forwards them from several guest clients. The same stream is
+ * run single threaded and with VIRGL_RENDERER_THREADED_CONTEXTS. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <virglrenderer.h>
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "util/u_memory.h"
+#include "testvirgl_encode.h"
+
+#define BENCH_DEFAULT_CONTEXTS 4
+#define BENCH_TARGET_SIZE 256
+#define BENCH_SUBMITS_PER_CTX 500
+#define BENCH_CLEARS_PER_SUBMIT 32
+
+struct bench_ctx {
+   struct virgl_context base;
+   struct virgl_resource target;
+};
+
+static void bench_flush(struct virgl_context *ctx)
+{
+   virgl_renderer_submit_cmd(ctx->cbuf->buf, ctx->ctx_id, ctx->cbuf->cdw);
+   ctx->cbuf->cdw = 0;
+}
+
+static double bench_now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int bench_init_ctx(struct bench_ctx *bctx, int ctx_id)
+{
+   struct virgl_context *ctx = &bctx->base;
+   struct virgl_renderer_resource_create_args args;
+   struct virgl_surface surf;
+   struct pipe_framebuffer_state fb_state;
+   char name[32];
+   int ret;
+
+   /* context 1 is created by testvirgl_init_single_ctx */
+   if (ctx_id != 1) {
+      snprintf(name, sizeof(name), "bench%d", ctx_id);
+      ret = virgl_renderer_context_create(ctx_id, strlen(name), name);
+      if (ret)
+         return ret;
+   }
+
+   ctx->flush = bench_flush;
+   ctx->ctx_id = ctx_id;
+   ctx->cbuf = CALLOC_STRUCT(virgl_cmd_buf);
+   if (!ctx->cbuf)
+      return -1;
+   ctx->cbuf->buf = CALLOC(1, VIRGL_MAX_CMDBUF_DWORDS * 4);
+   if (!ctx->cbuf->buf) {
+      FREE(ctx->cbuf);
+      return -1;
+   }
+
+   testvirgl_init_simple_2d_resource(&args, ctx_id);
+   args.width = BENCH_TARGET_SIZE;
+   args.height = BENCH_TARGET_SIZE;
+   args.bind = PIPE_BIND_RENDER_TARGET;
+   ret = virgl_renderer_resource_create(&args, NULL, 0);
+   if (ret)
+      return ret;
+
+   memset(&bctx->target, 0, sizeof(bctx->target));
+   bctx->target.handle = args.handle;
+   bctx->target.base.target = args.target;
+   bctx->target.base.format = args.format;
+   bctx->target.base.width0 = args.width;
+   bctx->target.base.height0 = args.height;
+   virgl_renderer_ctx_attach_resource(ctx_id, args.handle);
+
+   memset(&surf, 0, sizeof(surf));
+   surf.base.format = args.format;
+   surf.handle = 1;
+   surf.base.texture = &bctx->target.base;
+   virgl_encoder_create_surface(ctx, surf.handle, &bctx->target, &surf.base);
+
+   memset(&fb_state, 0, sizeof(fb_state));
+   fb_state.nr_cbufs = 1;
+   fb_state.cbufs[0] = &surf.base;
+   virgl_encoder_set_framebuffer_state(ctx, &fb_state);
+   ctx->flush(ctx);
+   return 0;
+}
+
+static void bench_fini_ctx(struct bench_ctx *bctx)
+{
+   struct virgl_context *ctx = &bctx->base;
+
+   virgl_renderer_ctx_detach_resource(ctx->ctx_id, bctx->target.handle);
+   virgl_renderer_resource_unref(bctx->target.handle);
+   FREE(ctx->cbuf->buf);
+   FREE(ctx->cbuf);
+   if (ctx->ctx_id != 1)
+      virgl_renderer_context_destroy(ctx->ctx_id);
+}
+
+/* Read back one texel of the target, which waits for the context. */
+static void bench_sync(struct bench_ctx *bctx)
+{
+   uint32_t texel;
+   struct iovec iov = { &texel, sizeof(texel) };
+   struct virgl_box box = { 0, 0, 0, 1, 1, 1 };
+
+   virgl_renderer_transfer_read_iov(bctx->target.handle, bctx->base.ctx_id,
+                                    0, 0, 0, &box, 0, &iov, 1);
+}
+
+static int bench_contexts(int num_ctx, const char *mode)
+{
+   struct bench_ctx *ctxs;
+   union pipe_color_union color;
+   double start, total;
+   int i, ret = 0;
+
+   ret = testvirgl_init_single_ctx();
+   if (ret)
+      return ret;
+
+   ctxs = CALLOC(num_ctx, sizeof(*ctxs));
+   if (!ctxs) {
+      testvirgl_fini_single_ctx();
+      return -1;
+   }
+
+   for (i = 0; i < num_ctx && !ret; i++)
+      ret = bench_init_ctx(&ctxs[i], i + 1);
+   if (ret)
+      goto out;
+
+   for (i = 0; i < num_ctx; i++)
+      bench_sync(&ctxs[i]);
+
+   start = bench_now_ms();
+   for (int s = 0; s < BENCH_SUBMITS_PER_CTX; s++) {
+      for (i = 0; i < num_ctx; i++) {
+         struct virgl_context *ctx = &ctxs[i].base;
+
+         for (int c = 0; c < BENCH_CLEARS_PER_SUBMIT; c++) {
+            color.f[0] = (float)c / BENCH_CLEARS_PER_SUBMIT;
+            color.f[1] = (float)s / BENCH_SUBMITS_PER_CTX;
+            color.f[2] = (float)i / num_ctx;
+            color.f[3] = 1.0;
+            virgl_encode_clear(ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+         }
+         ctx->flush(ctx);
+      }
+   }
+   for (i = 0; i < num_ctx; i++)
+      bench_sync(&ctxs[i]);
+   total = bench_now_ms() - start;
+
+   printf("%s: %d contexts, %.3f ms, %.0f submits/s\n", mode, num_ctx, total,
+          num_ctx * BENCH_SUBMITS_PER_CTX / (total / 1000.0));
+
+out:
+   for (i = num_ctx - 1; i >= 0; i--) {
+      if (ctxs[i].base.cbuf)
+         bench_fini_ctx(&ctxs[i]);
+   }
+   FREE(ctxs);
+   testvirgl_fini_single_ctx();
+   return ret;
+}
+
+int main(int argc, char **argv)
+{
+   int num_ctx = BENCH_DEFAULT_CONTEXTS;
+   int base_flags;
+   int ret;
+
+   if (argc > 1)
+      num_ctx = MAX2(atoi(argv[1]), 1);
+
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+   context_flags |= VIRGL_RENDERER_THREAD_SYNC;
+   base_flags = context_flags;
+
+   ret = bench_contexts(num_ctx, "single threaded");
+   if (!ret) {
+      context_flags = base_flags | VIRGL_RENDERER_THREADED_CONTEXTS;
+      ret = bench_contexts(num_ctx, "threaded contexts");
+   }
+
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
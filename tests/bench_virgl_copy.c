@@ -0,0 +1,149 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+/* resource_copy_region benchmarks, run with "meson test --benchmark" */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <virglrenderer.h>
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "util/u_memory.h"
+#include "util/u_format.h"
+#include "testvirgl_encode.h"
+
+#define BENCH_COPY_SIZE 512
+#define BENCH_COPY_ITERATIONS 100
+
+static void bench_flush(struct virgl_context *ctx)
+{
+   virgl_renderer_submit_cmd(ctx->cbuf->buf, ctx->ctx_id, ctx->cbuf->cdw);
+   ctx->cbuf->cdw = 0;
+}
+
+static double bench_now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int bench_create_res(struct virgl_resource *res, int handle,
+                            enum pipe_format format)
+{
+   struct virgl_renderer_resource_create_args args;
+   int ret;
+
+   testvirgl_init_simple_2d_resource(&args, handle);
+   args.format = format;
+   args.width = BENCH_COPY_SIZE;
+   args.height = BENCH_COPY_SIZE;
+   ret = virgl_renderer_resource_create(&args, NULL, 0);
+   if (ret)
+      return ret;
+
+   memset(res, 0, sizeof(*res));
+   res->handle = handle;
+   res->base.target = args.target;
+   res->base.format = args.format;
+   res->base.width0 = args.width;
+   res->base.height0 = args.height;
+   return 0;
+}
+
+/* Read back one texel of the destination, which waits for the copies. */
+static void bench_sync(struct virgl_context *ctx, struct virgl_resource *res)
+{
+   uint8_t texel[16];
+   struct iovec iov = { texel, sizeof(texel) };
+   struct virgl_box box = { 0, 0, 0, 1, 1, 1 };
+
+   virgl_renderer_transfer_read_iov(res->handle, ctx->ctx_id, 0, 0, 0, &box,
+                                    0, &iov, 1);
+}
+
+/* Copy the same region over and over between two formats of equal texel
+ * size and report the throughput. Same format copies are served by
+ * glCopyImageSubData, the others take the compute or readback path. */
+static int bench_copy_region(struct virgl_context *ctx,
+                             enum pipe_format src_format,
+                             enum pipe_format dst_format)
+{
+   struct virgl_resource src, dst;
+   struct pipe_box box = { 0, 0, 0, BENCH_COPY_SIZE, BENCH_COPY_SIZE, 1 };
+   double bytes, start, total;
+   int ret;
+
+   ret = bench_create_res(&src, 1, src_format);
+   if (ret)
+      return ret;
+   ret = bench_create_res(&dst, 2, dst_format);
+   if (ret) {
+      virgl_renderer_resource_unref(src.handle);
+      return ret;
+   }
+
+   virgl_renderer_ctx_attach_resource(ctx->ctx_id, src.handle);
+   virgl_renderer_ctx_attach_resource(ctx->ctx_id, dst.handle);
+
+   /* warm up, this builds the copy program if one is needed */
+   virgl_encode_resource_copy_region(ctx, &dst, 0, 0, 0, 0, &src, 0, &box);
+   ctx->flush(ctx);
+   bench_sync(ctx, &dst);
+
+   start = bench_now_ms();
+   for (int i = 0; i < BENCH_COPY_ITERATIONS; i++) {
+      virgl_encode_resource_copy_region(ctx, &dst, 0, 0, 0, 0, &src, 0, &box);
+      ctx->flush(ctx);
+   }
+   bench_sync(ctx, &dst);
+   total = bench_now_ms() - start;
+
+   bytes = (double)BENCH_COPY_SIZE * BENCH_COPY_SIZE *
+           util_format_get_blocksize(src_format) * BENCH_COPY_ITERATIONS;
+   printf("copy_region %s -> %s: %.3f ms avg, %.1f MB/s\n",
+          util_format_name(src_format), util_format_name(dst_format),
+          total / BENCH_COPY_ITERATIONS, bytes / 1e3 / total);
+
+   virgl_renderer_ctx_detach_resource(ctx->ctx_id, src.handle);
+   virgl_renderer_ctx_detach_resource(ctx->ctx_id, dst.handle);
+   virgl_renderer_resource_unref(src.handle);
+   virgl_renderer_resource_unref(dst.handle);
+   return 0;
+}
+
+int main(void)
+{
+   static const struct {
+      enum pipe_format src, dst;
+   } pairs[] = {
+      { PIPE_FORMAT_R8G8B8A8_UNORM, PIPE_FORMAT_R8G8B8A8_UNORM },
+      { PIPE_FORMAT_R32_FLOAT, PIPE_FORMAT_R8G8B8A8_UNORM },
+      { PIPE_FORMAT_R8G8B8A8_UNORM, PIPE_FORMAT_R32_UINT },
+      { PIPE_FORMAT_R16_UNORM, PIPE_FORMAT_R8G8_UNORM },
+      { PIPE_FORMAT_R16G16B16A16_FLOAT, PIPE_FORMAT_R32G32_UINT },
+      { PIPE_FORMAT_R32G32B32A32_FLOAT, PIPE_FORMAT_R32G32B32A32_UINT },
+   };
+   struct virgl_context ctx;
+   int ret;
+
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   if (ret)
+      return EXIT_FAILURE;
+   ctx.flush = bench_flush;
+
+   for (unsigned i = 0; i < ARRAY_SIZE(pairs) && !ret; i++)
+      ret = bench_copy_region(&ctx, pairs[i].src, pairs[i].dst);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
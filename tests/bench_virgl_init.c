@@ -0,0 +1,121 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+/* renderer startup benchmark, run with "meson test --benchmark"
+ *
+ * Every iteration initializes the renderer and queries the caps in a fresh
+ * process, the way each VM or vtest client starts, once with the format
+ * cache disabled and once with a warm cache. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <virglrenderer.h>
+#include "virgl_hw.h"
+#include "testvirgl.h"
+
+#define BENCH_INIT_ITERATIONS 20
+
+static double bench_now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int bench_init_once(void)
+{
+   uint32_t max_ver, max_size;
+   void *caps;
+   int ret;
+
+   ret = testvirgl_init_single_ctx();
+   if (ret)
+      return ret;
+
+   virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+   caps = calloc(1, max_size);
+   if (caps)
+      virgl_renderer_fill_caps(2, max_ver, caps);
+   free(caps);
+
+   testvirgl_fini_single_ctx();
+   return caps ? 0 : -1;
+}
+
+static int bench_init_forked(double *ms)
+{
+   double start = bench_now_ms();
+   int status;
+   pid_t pid;
+
+   pid = fork();
+   if (pid < 0)
+      return -1;
+   if (!pid)
+      _exit(bench_init_once() ? EXIT_FAILURE : EXIT_SUCCESS);
+
+   if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+       WEXITSTATUS(status) != EXIT_SUCCESS)
+      return -1;
+
+   *ms = bench_now_ms() - start;
+   return 0;
+}
+
+static int bench_init(const char *mode)
+{
+   double total = 0, min = 0;
+
+   for (int i = 0; i < BENCH_INIT_ITERATIONS; i++) {
+      double ms;
+
+      if (bench_init_forked(&ms))
+         return -1;
+      total += ms;
+      if (!i || ms < min)
+         min = ms;
+   }
+
+   printf("init %s: %.3f ms avg, %.3f ms min\n", mode,
+          total / BENCH_INIT_ITERATIONS, min);
+   return 0;
+}
+
+int main(void)
+{
+   char path[] = "/tmp/virgl-format-cache-XXXXXX";
+   double cold;
+   int fd, ret;
+
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+
+   fd = mkstemp(path);
+   if (fd < 0)
+      return EXIT_FAILURE;
+   close(fd);
+   unlink(path);
+   setenv("VIRGL_FORMAT_CACHE", path, 1);
+
+   setenv("VIRGL_DISABLE_FORMAT_CACHE", "1", 1);
+   ret = bench_init("without format cache");
+   unsetenv("VIRGL_DISABLE_FORMAT_CACHE");
+
+   /* the first run probes and writes the cache */
+   if (!ret)
+      ret = bench_init_forked(&cold);
+   if (!ret) {
+      printf("init filling the format cache: %.3f ms\n", cold);
+      ret = bench_init("with format cache");
+   }
+
+   unlink(path);
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
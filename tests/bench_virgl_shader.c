@@ -0,0 +1,296 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+/* shader creation benchmarks, run with "meson test --benchmark" */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <virglrenderer.h>
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "util/u_memory.h"
+#include "tgsi/tgsi_text.h"
+#include "vrend_shader.h"
+#include "testvirgl_encode.h"
+
+#include "large_shader.h"
+
+#define BENCH_DEFAULT_CONTEXTS 16
+#define BENCH_TRANSLATE_ITERATIONS 200
+#define BENCH_MAX_TOKENS 16384
+
+static void bench_flush(struct virgl_context *ctx)
+{
+   virgl_renderer_submit_cmd(ctx->cbuf->buf, ctx->ctx_id, ctx->cbuf->cdw);
+   ctx->cbuf->cdw = 0;
+}
+
+static double bench_now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int bench_init_ctx(struct virgl_context *ctx, int ctx_id)
+{
+   char name[32];
+   int ret;
+
+   /* context 1 is created by testvirgl_init_single_ctx */
+   if (ctx_id != 1) {
+      snprintf(name, sizeof(name), "bench%d", ctx_id);
+      ret = virgl_renderer_context_create(ctx_id, strlen(name), name);
+      if (ret)
+         return ret;
+   }
+
+   ctx->flush = bench_flush;
+   ctx->ctx_id = ctx_id;
+   ctx->cbuf = CALLOC_STRUCT(virgl_cmd_buf);
+   if (!ctx->cbuf)
+      return -1;
+   ctx->cbuf->buf = CALLOC(1, VIRGL_MAX_CMDBUF_DWORDS * 4);
+   if (!ctx->cbuf->buf) {
+      FREE(ctx->cbuf);
+      return -1;
+   }
+   return 0;
+}
+
+static void bench_fini_ctx(struct virgl_context *ctx)
+{
+   FREE(ctx->cbuf->buf);
+   FREE(ctx->cbuf);
+   if (ctx->ctx_id != 1)
+      virgl_renderer_context_destroy(ctx->ctx_id);
+}
+
+/* Every context creates the same large fragment shader, the way every guest
+ * process sends the same shaders, so all but the first creation can be
+ * served from the renderer wide TGSI cache. */
+static int bench_large_shader_contexts(int num_ctx)
+{
+   struct virgl_context *ctxs = CALLOC(num_ctx, sizeof(*ctxs));
+   struct pipe_shader_state fs;
+   double start, first = 0, total;
+   int i, ret = 0;
+
+   if (!ctxs)
+      return -1;
+
+   for (i = 0; i < num_ctx; i++) {
+      ret = bench_init_ctx(&ctxs[i], i + 1);
+      if (ret)
+         goto out;
+   }
+
+   memset(&fs, 0, sizeof(fs));
+   start = bench_now_ms();
+   for (i = 0; i < num_ctx; i++) {
+      virgl_encode_shader_state(&ctxs[i], 1, PIPE_SHADER_FRAGMENT, &fs, large_frag);
+      virgl_encode_bind_shader(&ctxs[i], 1, PIPE_SHADER_FRAGMENT);
+      ctxs[i].flush(&ctxs[i]);
+      if (i == 0)
+         first = bench_now_ms() - start;
+   }
+   total = bench_now_ms() - start;
+
+   printf("large shader: %d contexts, first %.3f ms, others %.3f ms avg, total %.3f ms\n",
+          num_ctx, first, num_ctx > 1 ? (total - first) / (num_ctx - 1) : 0.0, total);
+
+out:
+   while (i-- > 0)
+      bench_fini_ctx(&ctxs[i]);
+   FREE(ctxs);
+   return ret;
+}
+
+/* Link the same VS/FS pair under rasterizer and alpha test states that all
+ * end up in the fragment shader key, so every link creates a new variant. */
+static int bench_shader_variants(void)
+{
+   struct virgl_context ctx;
+   struct pipe_shader_state vs, fs;
+   uint32_t handles[PIPE_SHADER_TYPES];
+   int vs_handle = 100, fs_handle = 101, obj_handle = 102;
+   int num_variants = 0;
+   double start, total;
+   int ret;
+
+   const char *vs_text =
+      "VERT\n"
+      "DCL IN[0]\n"
+      "DCL IN[1]\n"
+      "DCL OUT[0], POSITION\n"
+      "DCL OUT[1], COLOR\n"
+      "  0: MOV OUT[1], IN[1]\n"
+      "  1: MOV OUT[0], IN[0]\n"
+      "  2: END\n";
+
+   ret = bench_init_ctx(&ctx, 1);
+   if (ret)
+      return ret;
+
+   memset(&vs, 0, sizeof(vs));
+   memset(&fs, 0, sizeof(fs));
+   virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX, &vs, vs_text);
+   virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT, &fs, large_frag);
+   ctx.flush(&ctx);
+
+   memset(handles, 0, sizeof(handles));
+   handles[PIPE_SHADER_VERTEX] = vs_handle;
+   handles[PIPE_SHADER_FRAGMENT] = fs_handle;
+
+   start = bench_now_ms();
+   for (unsigned func = PIPE_FUNC_NEVER; func <= PIPE_FUNC_ALWAYS; func++) {
+      for (unsigned rs_bits = 0; rs_bits < 8; rs_bits++) {
+         struct pipe_rasterizer_state rasterizer;
+         struct pipe_depth_stencil_alpha_state dsa;
+
+         memset(&rasterizer, 0, sizeof(rasterizer));
+         rasterizer.half_pixel_center = 1;
+         rasterizer.depth_clip = 1;
+         rasterizer.flatshade = rs_bits & 1;
+         rasterizer.light_twoside = (rs_bits >> 1) & 1;
+         rasterizer.poly_stipple_enable = (rs_bits >> 2) & 1;
+         virgl_encode_rasterizer_state(&ctx, obj_handle, &rasterizer);
+         virgl_encode_bind_object(&ctx, obj_handle, VIRGL_OBJECT_RASTERIZER);
+         obj_handle++;
+
+         memset(&dsa, 0, sizeof(dsa));
+         dsa.alpha.enabled = 1;
+         dsa.alpha.func = func;
+         virgl_encode_dsa_state(&ctx, obj_handle, &dsa);
+         virgl_encode_bind_object(&ctx, obj_handle, VIRGL_OBJECT_DSA);
+         obj_handle++;
+
+         virgl_encode_link_shader(&ctx, handles);
+         ctx.flush(&ctx);
+         num_variants++;
+      }
+   }
+   total = bench_now_ms() - start;
+
+   printf("shader variants: %d links, %.3f ms avg, total %.3f ms\n",
+          num_variants, total / num_variants, total);
+
+   bench_fini_ctx(&ctx);
+   return 0;
+}
+
+/* Run the TGSI to GLSL translator directly on a small corpus, without a GL
+ * context, and report how many bytes of GLSL it produces per second. */
+static int bench_shader_translation(void)
+{
+   static struct tgsi_token tokens[BENCH_MAX_TOKENS];
+   struct vrend_shader_cfg cfg;
+   struct vrend_shader_key key;
+   size_t glsl_bytes = 0;
+   double start, total;
+
+   const char *corpus[] = {
+      "VERT\n"
+      "DCL IN[0]\n"
+      "DCL IN[1]\n"
+      "DCL OUT[0], POSITION\n"
+      "DCL OUT[1], GENERIC[0]\n"
+      "DCL CONST[0..3]\n"
+      "DCL TEMP[0]\n"
+      "  0: MUL TEMP[0], IN[0].xxxx, CONST[0]\n"
+      "  1: MAD TEMP[0], IN[0].yyyy, CONST[1], TEMP[0]\n"
+      "  2: MAD TEMP[0], IN[0].zzzz, CONST[2], TEMP[0]\n"
+      "  3: MAD OUT[0], IN[0].wwww, CONST[3], TEMP[0]\n"
+      "  4: MOV OUT[1], IN[1]\n"
+      "  5: END\n",
+      "FRAG\n"
+      "DCL IN[0], GENERIC[0], PERSPECTIVE\n"
+      "DCL OUT[0], COLOR\n"
+      "DCL SAMP[0]\n"
+      "DCL SVIEW[0], 2D, FLOAT\n"
+      "DCL TEMP[0]\n"
+      "IMM[0] FLT32 {0.5000, 1.0000, 0.0000, 0.0000}\n"
+      "  0: TEX TEMP[0], IN[0], SAMP[0], 2D\n"
+      "  1: MUL OUT[0], TEMP[0], IMM[0].xxxy\n"
+      "  2: END\n",
+      large_frag,
+   };
+
+   memset(&cfg, 0, sizeof(cfg));
+   cfg.glsl_version = 450;
+   cfg.max_draw_buffers = 8;
+   cfg.max_shader_patch_varyings = 30;
+   cfg.use_core_profile = 1;
+   cfg.use_explicit_locations = 1;
+   memset(&key, 0, sizeof(key));
+
+   start = bench_now_ms();
+   for (int iter = 0; iter < BENCH_TRANSLATE_ITERATIONS; iter++) {
+      for (unsigned i = 0; i < ARRAY_SIZE(corpus); i++) {
+         struct vrend_shader_info sinfo;
+         struct vrend_variable_shader_info var_sinfo;
+         struct vrend_strarray glsl_strings;
+         bool ret;
+
+         if (!tgsi_text_translate(corpus[i], tokens, BENCH_MAX_TOKENS))
+            return -1;
+
+         memset(&sinfo, 0, sizeof(sinfo));
+         memset(&var_sinfo, 0, sizeof(var_sinfo));
+         if (!strarray_alloc(&glsl_strings, SHADER_MAX_STRINGS))
+            return -1;
+
+         ret = vrend_convert_shader(NULL, &cfg, tokens, NULL, 0, &key,
+                                    &sinfo, &var_sinfo, &glsl_strings);
+         if (ret) {
+            for (int j = 0; j < glsl_strings.num_strings; j++)
+               glsl_bytes += glsl_strings.strings[j].size;
+         }
+
+         strarray_free(&glsl_strings, true);
+         free(sinfo.so_names);
+         free(sinfo.sampler_arrays);
+         free(sinfo.image_arrays);
+         if (!ret)
+            return -1;
+      }
+   }
+   total = bench_now_ms() - start;
+
+   printf("shader translation: %u shaders x %d, %.1f MB GLSL, %.2f MB/s\n",
+          (unsigned)ARRAY_SIZE(corpus), BENCH_TRANSLATE_ITERATIONS,
+          glsl_bytes / 1e6, glsl_bytes / 1e3 / total);
+   return 0;
+}
+
+int main(int argc, char **argv)
+{
+   int num_ctx = BENCH_DEFAULT_CONTEXTS;
+   int ret;
+
+   if (argc > 1)
+      num_ctx = MAX2(atoi(argv[1]), 1);
+
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+
+   ret = bench_shader_translation();
+   if (ret)
+      return EXIT_FAILURE;
+
+   ret = testvirgl_init_single_ctx();
+   if (ret)
+      return EXIT_FAILURE;
+
+   ret = bench_large_shader_contexts(num_ctx);
+   if (!ret)
+      ret = bench_shader_variants();
+
+   testvirgl_fini_single_ctx();
+   return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
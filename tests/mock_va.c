@@ -0,0 +1,531 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/udmabuf.h>
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+#include <drm_fourcc.h>
+
+#include "mock_va.h"
+
+#define MOCK_VA_MAX_SURFACES 64
+#define MOCK_VA_MAX_CONTEXTS 16
+#define MOCK_VA_MAX_BUFFERS  256
+#define MOCK_VA_PITCH_ALIGN  256
+#define MOCK_VA_PAGE_SIZE    4096
+
+struct mock_va_surface {
+   bool used;
+   unsigned width, height;
+   unsigned pitch, chroma_offset;
+   size_t size;
+   int dmabuf;
+   uint8_t *map;
+   bool decoding;
+};
+
+struct mock_va_context {
+   bool used;
+   VASurfaceID target;
+};
+
+struct mock_va_buffer {
+   bool used;
+   void *data;
+};
+
+static int mock_va_display;
+static struct mock_va_surface mock_surfaces[MOCK_VA_MAX_SURFACES];
+static struct mock_va_context mock_contexts[MOCK_VA_MAX_CONTEXTS];
+static struct mock_va_buffer mock_buffers[MOCK_VA_MAX_BUFFERS];
+
+/* the "decoder" finishes pictures in vaSyncSurface, while it is not held */
+static pthread_mutex_t mock_decoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mock_decoder_cond = PTHREAD_COND_INITIALIZER;
+static bool mock_decoder_held;
+
+static unsigned mock_align(unsigned value, unsigned alignment)
+{
+   return (value + alignment - 1) / alignment * alignment;
+}
+
+static int mock_va_alloc(size_t size, uint8_t **map)
+{
+   struct udmabuf_create create;
+   int devfd, memfd, dmabuf = -1;
+
+   devfd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+   if (devfd < 0)
+      return -1;
+
+   memfd = memfd_create("mock-va-surface", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+   if (memfd < 0)
+      goto out_dev;
+
+   if (ftruncate(memfd, size) ||
+       fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK))
+      goto out_mem;
+
+   memset(&create, 0, sizeof(create));
+   create.memfd = memfd;
+   create.flags = UDMABUF_FLAGS_CLOEXEC;
+   create.size = size;
+   dmabuf = ioctl(devfd, UDMABUF_CREATE, &create);
+   if (dmabuf < 0)
+      goto out_mem;
+
+   *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+   if (*map == MAP_FAILED) {
+      close(dmabuf);
+      dmabuf = -1;
+   }
+
+out_mem:
+   close(memfd);
+out_dev:
+   close(devfd);
+   return dmabuf;
+}
+
+bool mock_va_available(void)
+{
+   uint8_t *map;
+   int fd = mock_va_alloc(MOCK_VA_PAGE_SIZE, &map);
+
+   if (fd < 0)
+      return false;
+
+   munmap(map, MOCK_VA_PAGE_SIZE);
+   close(fd);
+   return true;
+}
+
+VADisplay vaGetDisplayDRM(int fd)
+{
+   (void)fd;
+   return &mock_va_display;
+}
+
+VAStatus vaInitialize(VADisplay dpy, int *major_version, int *minor_version)
+{
+   (void)dpy;
+   *major_version = VA_MAJOR_VERSION;
+   *minor_version = VA_MINOR_VERSION;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaTerminate(VADisplay dpy)
+{
+   (void)dpy;
+   return VA_STATUS_SUCCESS;
+}
+
+const char *vaQueryVendorString(VADisplay dpy)
+{
+   (void)dpy;
+   return "Mesa Gallium driver for the virglrenderer tests";
+}
+
+int vaMaxNumProfiles(VADisplay dpy)
+{
+   (void)dpy;
+   return 1;
+}
+
+int vaMaxNumEntrypoints(VADisplay dpy)
+{
+   (void)dpy;
+   return 1;
+}
+
+VAStatus vaQueryConfigProfiles(VADisplay dpy, VAProfile *profile_list,
+                               int *num_profiles)
+{
+   (void)dpy;
+   profile_list[0] = VAProfileMPEG2Main;
+   *num_profiles = 1;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaQueryConfigEntrypoints(VADisplay dpy, VAProfile profile,
+                                  VAEntrypoint *entrypoint_list,
+                                  int *num_entrypoints)
+{
+   (void)dpy;
+   *num_entrypoints = 0;
+   if (profile == VAProfileMPEG2Main)
+      entrypoint_list[(*num_entrypoints)++] = VAEntrypointVLD;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaGetConfigAttributes(VADisplay dpy, VAProfile profile,
+                               VAEntrypoint entrypoint,
+                               VAConfigAttrib *attrib_list, int num_attribs)
+{
+   (void)dpy;
+   (void)profile;
+   (void)entrypoint;
+
+   for (int i = 0; i < num_attribs; i++) {
+      if (attrib_list[i].type == VAConfigAttribRTFormat)
+         attrib_list[i].value = VA_RT_FORMAT_YUV420;
+      else
+         attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
+   }
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateConfig(VADisplay dpy, VAProfile profile,
+                        VAEntrypoint entrypoint, VAConfigAttrib *attrib_list,
+                        int num_attribs, VAConfigID *config_id)
+{
+   (void)dpy;
+   (void)attrib_list;
+   (void)num_attribs;
+
+   if (profile != VAProfileMPEG2Main || entrypoint != VAEntrypointVLD)
+      return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+
+   *config_id = 1;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaDestroyConfig(VADisplay dpy, VAConfigID config_id)
+{
+   (void)dpy;
+   (void)config_id;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaQuerySurfaceAttributes(VADisplay dpy, VAConfigID config,
+                                  VASurfaceAttrib *attrib_list,
+                                  unsigned int *num_attribs)
+{
+   (void)dpy;
+   (void)config;
+   (void)attrib_list;
+   *num_attribs = 0;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateSurfaces(VADisplay dpy, unsigned int format,
+                          unsigned int width, unsigned int height,
+                          VASurfaceID *surfaces, unsigned int num_surfaces,
+                          VASurfaceAttrib *attrib_list, unsigned int num_attribs)
+{
+   (void)dpy;
+   (void)attrib_list;
+   (void)num_attribs;
+
+   if (format != VA_RT_FORMAT_YUV420)
+      return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+
+   for (unsigned n = 0; n < num_surfaces; n++) {
+      struct mock_va_surface *sfc = NULL;
+      unsigned id;
+
+      for (id = 0; id < MOCK_VA_MAX_SURFACES; id++) {
+         if (!mock_surfaces[id].used) {
+            sfc = &mock_surfaces[id];
+            break;
+         }
+      }
+      if (!sfc)
+         return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+      sfc->width = width;
+      sfc->height = height;
+      sfc->pitch = mock_align(width, MOCK_VA_PITCH_ALIGN);
+      sfc->chroma_offset = mock_align(sfc->pitch * height, MOCK_VA_PAGE_SIZE);
+      sfc->size = mock_align(sfc->chroma_offset + sfc->pitch * height / 2,
+                             MOCK_VA_PAGE_SIZE);
+      sfc->dmabuf = mock_va_alloc(sfc->size, &sfc->map);
+      if (sfc->dmabuf < 0)
+         return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+      sfc->used = true;
+      /* surface 0 is VA_INVALID_SURFACE for some callers */
+      surfaces[n] = id + 1;
+   }
+
+   return VA_STATUS_SUCCESS;
+}
+
+static struct mock_va_surface *mock_va_surface(VASurfaceID id)
+{
+   if (id < 1 || id > MOCK_VA_MAX_SURFACES || !mock_surfaces[id - 1].used)
+      return NULL;
+   return &mock_surfaces[id - 1];
+}
+
+VAStatus vaDestroySurfaces(VADisplay dpy, VASurfaceID *surfaces, int num_surfaces)
+{
+   (void)dpy;
+
+   for (int n = 0; n < num_surfaces; n++) {
+      struct mock_va_surface *sfc = mock_va_surface(surfaces[n]);
+
+      if (!sfc)
+         continue;
+
+      munmap(sfc->map, sfc->size);
+      close(sfc->dmabuf);
+      memset(sfc, 0, sizeof(*sfc));
+   }
+
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaExportSurfaceHandle(VADisplay dpy, VASurfaceID surface_id,
+                               uint32_t mem_type, uint32_t flags,
+                               void *descriptor)
+{
+   struct mock_va_surface *sfc = mock_va_surface(surface_id);
+   VADRMPRIMESurfaceDescriptor *desc = descriptor;
+
+   (void)dpy;
+
+   if (!sfc)
+      return VA_STATUS_ERROR_INVALID_SURFACE;
+   if (mem_type != VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2 ||
+       !(flags & VA_EXPORT_SURFACE_SEPARATE_LAYERS))
+      return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+
+   memset(desc, 0, sizeof(*desc));
+   desc->fourcc = VA_FOURCC_NV12;
+   desc->width = sfc->width;
+   desc->height = sfc->height;
+
+   /* one object per layer, the caller closes the fd of every plane */
+   desc->num_objects = 2;
+   desc->num_layers = 2;
+   for (unsigned i = 0; i < 2; i++) {
+      desc->objects[i].fd = dup(sfc->dmabuf);
+      desc->objects[i].size = sfc->size;
+      desc->objects[i].drm_format_modifier = DRM_FORMAT_MOD_LINEAR;
+
+      desc->layers[i].drm_format = i ? DRM_FORMAT_GR88 : DRM_FORMAT_R8;
+      desc->layers[i].num_planes = 1;
+      desc->layers[i].object_index[0] = i;
+      desc->layers[i].offset[0] = i ? sfc->chroma_offset : 0;
+      desc->layers[i].pitch[0] = sfc->pitch;
+   }
+
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateContext(VADisplay dpy, VAConfigID config_id,
+                         int picture_width, int picture_height, int flag,
+                         VASurfaceID *render_targets, int num_render_targets,
+                         VAContextID *context)
+{
+   (void)dpy;
+   (void)config_id;
+   (void)picture_width;
+   (void)picture_height;
+   (void)flag;
+   (void)render_targets;
+   (void)num_render_targets;
+
+   for (unsigned id = 0; id < MOCK_VA_MAX_CONTEXTS; id++) {
+      if (!mock_contexts[id].used) {
+         mock_contexts[id].used = true;
+         mock_contexts[id].target = VA_INVALID_SURFACE;
+         *context = id + 1;
+         return VA_STATUS_SUCCESS;
+      }
+   }
+
+   return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+}
+
+static struct mock_va_context *mock_va_context(VAContextID id)
+{
+   if (id < 1 || id > MOCK_VA_MAX_CONTEXTS || !mock_contexts[id - 1].used)
+      return NULL;
+   return &mock_contexts[id - 1];
+}
+
+VAStatus vaDestroyContext(VADisplay dpy, VAContextID context)
+{
+   struct mock_va_context *ctx = mock_va_context(context);
+
+   (void)dpy;
+
+   if (!ctx)
+      return VA_STATUS_ERROR_INVALID_CONTEXT;
+
+   ctx->used = false;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateBuffer(VADisplay dpy, VAContextID context, VABufferType type,
+                        unsigned int size, unsigned int num_elements,
+                        void *data, VABufferID *buf_id)
+{
+   (void)dpy;
+   (void)context;
+   (void)type;
+
+   for (unsigned id = 0; id < MOCK_VA_MAX_BUFFERS; id++) {
+      struct mock_va_buffer *buf = &mock_buffers[id];
+
+      if (buf->used)
+         continue;
+
+      buf->data = calloc(num_elements, size);
+      if (!buf->data)
+         return VA_STATUS_ERROR_ALLOCATION_FAILED;
+      if (data)
+         memcpy(buf->data, data, (size_t)size * num_elements);
+
+      buf->used = true;
+      *buf_id = id + 1;
+      return VA_STATUS_SUCCESS;
+   }
+
+   return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+}
+
+static struct mock_va_buffer *mock_va_buffer(VABufferID id)
+{
+   if (id < 1 || id > MOCK_VA_MAX_BUFFERS || !mock_buffers[id - 1].used)
+      return NULL;
+   return &mock_buffers[id - 1];
+}
+
+VAStatus vaDestroyBuffer(VADisplay dpy, VABufferID buffer_id)
+{
+   struct mock_va_buffer *buf = mock_va_buffer(buffer_id);
+
+   (void)dpy;
+
+   if (!buf)
+      return VA_STATUS_ERROR_INVALID_BUFFER;
+
+   free(buf->data);
+   memset(buf, 0, sizeof(*buf));
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaMapBuffer(VADisplay dpy, VABufferID buf_id, void **pbuf)
+{
+   struct mock_va_buffer *buf = mock_va_buffer(buf_id);
+
+   (void)dpy;
+
+   if (!buf)
+      return VA_STATUS_ERROR_INVALID_BUFFER;
+
+   *pbuf = buf->data;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaUnmapBuffer(VADisplay dpy, VABufferID buf_id)
+{
+   (void)dpy;
+   return mock_va_buffer(buf_id) ? VA_STATUS_SUCCESS : VA_STATUS_ERROR_INVALID_BUFFER;
+}
+
+VAStatus vaBeginPicture(VADisplay dpy, VAContextID context,
+                        VASurfaceID render_target)
+{
+   struct mock_va_context *ctx = mock_va_context(context);
+
+   (void)dpy;
+
+   if (!ctx)
+      return VA_STATUS_ERROR_INVALID_CONTEXT;
+   if (!mock_va_surface(render_target))
+      return VA_STATUS_ERROR_INVALID_SURFACE;
+
+   ctx->target = render_target;
+   return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaRenderPicture(VADisplay dpy, VAContextID context,
+                         VABufferID *buffers, int num_buffers)
+{
+   (void)dpy;
+   (void)buffers;
+   (void)num_buffers;
+   return mock_va_context(context) ? VA_STATUS_SUCCESS : VA_STATUS_ERROR_INVALID_CONTEXT;
+}
+
+void mock_va_hold_decoder(bool hold)
+{
+   pthread_mutex_lock(&mock_decoder_mutex);
+   mock_decoder_held = hold;
+   pthread_cond_broadcast(&mock_decoder_cond);
+   pthread_mutex_unlock(&mock_decoder_mutex);
+}
+
+void mock_va_fill_surfaces(uint8_t luma, uint8_t chroma)
+{
+   pthread_mutex_lock(&mock_decoder_mutex);
+   for (unsigned id = 0; id < MOCK_VA_MAX_SURFACES; id++) {
+      struct mock_va_surface *sfc = &mock_surfaces[id];
+
+      if (!sfc->used)
+         continue;
+      memset(sfc->map, luma, sfc->pitch * sfc->height);
+      memset(sfc->map + sfc->chroma_offset, chroma, sfc->pitch * sfc->height / 2);
+   }
+   pthread_mutex_unlock(&mock_decoder_mutex);
+}
+
+VAStatus vaEndPicture(VADisplay dpy, VAContextID context)
+{
+   struct mock_va_context *ctx = mock_va_context(context);
+   struct mock_va_surface *sfc;
+
+   (void)dpy;
+
+   if (!ctx)
+      return VA_STATUS_ERROR_INVALID_CONTEXT;
+
+   sfc = mock_va_surface(ctx->target);
+   if (!sfc)
+      return VA_STATUS_ERROR_INVALID_SURFACE;
+
+   pthread_mutex_lock(&mock_decoder_mutex);
+   sfc->decoding = true;
+   pthread_mutex_unlock(&mock_decoder_mutex);
+   ctx->target = VA_INVALID_SURFACE;
+   return VA_STATUS_SUCCESS;
+}
+
+/* "Decode" the picture by filling the target with the test pattern. */
+VAStatus vaSyncSurface(VADisplay dpy, VASurfaceID render_target)
+{
+   struct mock_va_surface *sfc = mock_va_surface(render_target);
+
+   (void)dpy;
+
+   if (!sfc)
+      return VA_STATUS_ERROR_INVALID_SURFACE;
+
+   pthread_mutex_lock(&mock_decoder_mutex);
+   while (mock_decoder_held)
+      pthread_cond_wait(&mock_decoder_cond, &mock_decoder_mutex);
+   if (sfc->decoding) {
+      memset(sfc->map, MOCK_VA_LUMA, sfc->pitch * sfc->height);
+      memset(sfc->map + sfc->chroma_offset, MOCK_VA_CHROMA, sfc->pitch * sfc->height / 2);
+      sfc->decoding = false;
+   }
+   pthread_mutex_unlock(&mock_decoder_mutex);
+
+   return VA_STATUS_SUCCESS;
+}
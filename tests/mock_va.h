@@ -0,0 +1,30 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+/* A VA-API stand-in for the video tests.
+ *
+ * The VA entry points used by virgl_video.c are defined in mock_va.c and
+ * take precedence over libva. Surfaces are NV12 in udmabuf memory, and the
+ * mock "decoder" fills the target surface of a picture with a fixed pattern
+ * when the surface is synced after vaEndPicture. */
+#ifndef MOCK_VA_H
+#define MOCK_VA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MOCK_VA_LUMA   0x40
+#define MOCK_VA_CHROMA 0x80
+
+/* Whether surfaces can be allocated, i.e. /dev/udmabuf is usable. */
+bool mock_va_available(void);
+
+/* While the decoder is held, vaSyncSurface blocks and no picture completes. */
+void mock_va_hold_decoder(bool hold);
+
+/* Write to the memory of every surface directly, without decoding. */
+void mock_va_fill_surfaces(uint8_t luma, uint8_t chroma);
+
+#endif
@@ -22,11 +22,15 @@
  *
  **************************************************************************/
 #include <check.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <unistd.h>
 #include <virglrenderer.h>
 #include "virgl_hw.h"
+#include "virglrenderer_hw.h"
 #include "vrend_iov.h"
 #include "util/u_formats.h"
 #include "testvirgl_encode.h"
@@ -145,6 +149,156 @@ START_TEST(virgl_test_clear)
 }
 END_TEST
 
+/* the same clear with the commands executed on the context worker, the
+ * readback has to wait for them */
+START_TEST(virgl_test_threaded_clear)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res;
+    struct virgl_surface surf;
+    struct pipe_framebuffer_state fb_state;
+    union pipe_color_union color;
+    struct virgl_box box;
+    int saved_flags = context_flags;
+    int ret;
+    int i;
+
+    context_flags |= VIRGL_RENDERER_THREAD_SYNC | VIRGL_RENDERER_THREADED_CONTEXTS;
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    context_flags = saved_flags;
+    ck_assert_int_eq(ret, 0);
+
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, 50, 50);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+    memset(&surf, 0, sizeof(surf));
+    surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    surf.handle = 1;
+    surf.base.texture = &res.base;
+    virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf.base;
+    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+    color.f[0] = 0.0;
+    color.f[1] = 1.0;
+    color.f[2] = 0.0;
+    color.f[3] = 1.0;
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+    testvirgl_ctx_send_cmdbuf(&ctx);
+
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = 5;
+    box.h = 1;
+    box.d = 1;
+    ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 50, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    for (i = 0; i < 5; i++) {
+        uint32_t *ptr = res.iovs[0].iov_base;
+        ck_assert_int_eq(ptr[i], test_green);
+    }
+
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+    testvirgl_destroy_backed_res(&res);
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+static void set_color_framebuffer(struct virgl_context *ctx, struct virgl_surface *surf)
+{
+    struct pipe_framebuffer_state fb_state;
+
+    memset(&fb_state, 0, sizeof(fb_state));
+    if (surf) {
+        fb_state.nr_cbufs = 1;
+        fb_state.cbufs[0] = &surf->base;
+    }
+    virgl_encoder_set_framebuffer_state(ctx, &fb_state);
+}
+
+/* switch between two render targets, recreating one surface in between, the
+ * clears have to land in the target of the current framebuffer state */
+START_TEST(virgl_test_framebuffer_switch)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res[2];
+    struct virgl_surface surf[3];
+    union pipe_color_union black, green;
+    struct virgl_box box;
+    int ret;
+    int i, j;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    for (i = 0; i < 2; i++) {
+        ret = testvirgl_create_backed_simple_2d_res(&res[i], i + 1, 50, 50);
+        ck_assert_int_eq(ret, 0);
+        virgl_renderer_ctx_attach_resource(ctx.ctx_id, res[i].handle);
+    }
+
+    memset(surf, 0, sizeof(surf));
+    for (i = 0; i < 3; i++) {
+        surf[i].base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+        surf[i].handle = i + 1;
+        surf[i].base.texture = &res[i ? 1 : 0].base;
+    }
+    virgl_encoder_create_surface(&ctx, surf[0].handle, &res[0], &surf[0].base);
+    virgl_encoder_create_surface(&ctx, surf[1].handle, &res[1], &surf[1].base);
+
+    memset(&black, 0, sizeof(black));
+    black.f[3] = 1.0;
+    memset(&green, 0, sizeof(green));
+    green.f[1] = 1.0;
+    green.f[3] = 1.0;
+
+    set_color_framebuffer(&ctx, &surf[0]);
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &black, 0.0, 0);
+    set_color_framebuffer(&ctx, &surf[1]);
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &black, 0.0, 0);
+    set_color_framebuffer(&ctx, &surf[0]);
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &green, 0.0, 0);
+
+    /* a new surface for the second target */
+    virgl_encode_delete_object(&ctx, surf[1].handle, VIRGL_OBJECT_SURFACE);
+    virgl_encoder_create_surface(&ctx, surf[2].handle, &res[1], &surf[2].base);
+    set_color_framebuffer(&ctx, &surf[2]);
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &green, 0.0, 0);
+
+    /* destroy the bound surface before switching away from it */
+    virgl_encode_delete_object(&ctx, surf[2].handle, VIRGL_OBJECT_SURFACE);
+    set_color_framebuffer(&ctx, NULL);
+    testvirgl_ctx_send_cmdbuf(&ctx);
+
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = 5;
+    box.h = 1;
+    box.d = 1;
+    for (i = 0; i < 2; i++) {
+        uint32_t *ptr = res[i].iovs[0].iov_base;
+
+        ret = virgl_renderer_transfer_read_iov(res[i].handle, ctx.ctx_id, 0, 50, 0, &box, 0, NULL, 0);
+        ck_assert_int_eq(ret, 0);
+        for (j = 0; j < 5; j++)
+            ck_assert_int_eq(ptr[j], test_green);
+    }
+
+    for (i = 0; i < 2; i++) {
+        virgl_renderer_ctx_detach_resource(ctx.ctx_id, res[i].handle);
+        testvirgl_destroy_backed_res(&res[i]);
+    }
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 START_TEST(virgl_test_blit_simple)
 {
     struct virgl_context ctx;
@@ -492,62 +646,12 @@ START_TEST(virgl_test_render_simple)
 }
 END_TEST
 
-static void virgl_test_bind_images_shader(int first_layer, int last_layer, int expected_error)
-{
-    struct virgl_context ctx;
-    struct virgl_resource res;
-    struct virgl_surface surf;
-    struct pipe_framebuffer_state fb_state;
-    int ret;
-    int tw = 300, th = 300;
-
-    ret = testvirgl_init_ctx_cmdbuf(&ctx);
-    ck_assert_int_eq(ret, 0);
-
-    /* init and create simple 2D resource */
-    ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
-    ck_assert_int_eq(ret, 0);
-
-    /* attach resource to context */
-    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
-
-    /* set the framebuffer state */
-    fb_state.nr_cbufs = 1;
-    fb_state.zsbuf = NULL;
-    fb_state.cbufs[0] = &surf.base;
-    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
-
-    /* Create shader images */
-    struct vrend_image_view images[1] = {0};
-    images[0].u.tex.first_layer = first_layer;
-    images[0].u.tex.last_layer = last_layer;
-    virgl_encoder_set_shader_images(&ctx, PIPE_SHADER_FRAGMENT, 1, 1, images, res.handle);
-
-    ret = testvirgl_ctx_send_cmdbuf(&ctx);
-    ck_assert_int_eq(ret, expected_error);
-
-    /* cleanup */
-    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
-
-    testvirgl_destroy_backed_res(&res);
-
-    testvirgl_fini_ctx_cmdbuf(&ctx);
-}
-
-START_TEST(virgl_test_bind_images_shader_pass)
-{
-    virgl_test_bind_images_shader(0, 0, 0);
-}
-END_TEST
-
-START_TEST(virgl_test_bind_images_shader_fail_layers)
-{
-    virgl_test_bind_images_shader(1, 0, EINVAL);
-}
-END_TEST
+/* draw many times with changing legacy constants, enough to wrap the
+ * renderer's constant ring a few times, and check the last ones win */
+#define TEST_CONST_VEC4 256
+#define TEST_CONST_DRAWS 1024
 
-/* create a resource - clear it to a color, render something */
-START_TEST(virgl_test_render_geom_simple)
+START_TEST(virgl_test_render_constants)
 {
     struct virgl_context ctx;
     struct virgl_resource res;
@@ -556,9 +660,9 @@ START_TEST(virgl_test_render_geom_simple)
     struct pipe_framebuffer_state fb_state;
     struct pipe_vertex_element ve[2];
     struct pipe_vertex_buffer vbuf;
-    int ve_handle, vs_handle, fs_handle, gs_handle;
+    int ve_handle, vs_handle, fs_handle;
     int ctx_handle = 1;
-    union pipe_color_union color;
+    float consts[TEST_CONST_VEC4 * 4];
     struct virgl_box box;
     int ret;
     int tw = 300, th = 300;
@@ -566,43 +670,21 @@ START_TEST(virgl_test_render_geom_simple)
     ret = testvirgl_init_ctx_cmdbuf(&ctx);
     ck_assert_int_eq(ret, 0);
 
-    /* Geometry shader are only available since GLSL 150 */
-    uint32_t glsl_level = testvirgl_get_glsl_level_from_caps();
-    if (glsl_level < 150) {
-      testvirgl_fini_ctx_cmdbuf(&ctx);
-      return;
-    }
-
-    /* init and create simple 2D resource */
     ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
     ck_assert_int_eq(ret, 0);
-
-    /* attach resource to context */
     virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
 
-    /* create a surface for the resource */
     memset(&surf, 0, sizeof(surf));
     surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
     surf.handle = ctx_handle++;
     surf.base.texture = &res.base;
-
     virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
 
-    /* set the framebuffer state */
     fb_state.nr_cbufs = 1;
     fb_state.zsbuf = NULL;
     fb_state.cbufs[0] = &surf.base;
     virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
 
-    /* clear the resource */
-    /* clear buffer to green */
-    color.f[0] = 0.0;
-    color.f[1] = 1.0;
-    color.f[2] = 0.0;
-    color.f[3] = 1.0;
-    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
-
-    /* create vertex elements */
     ve_handle = ctx_handle++;
     memset(ve, 0, sizeof(ve));
     ve[0].src_offset = Offset(struct vertex, position);
@@ -610,15 +692,12 @@ START_TEST(virgl_test_render_geom_simple)
     ve[1].src_offset = Offset(struct vertex, color);
     ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
     virgl_encoder_create_vertex_elements(&ctx, ve_handle, 2, ve);
-
     virgl_encode_bind_object(&ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
 
-    /* create vbo */
     ret = testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(vertices), PIPE_BIND_VERTEX_BUFFER);
     ck_assert_int_eq(ret, 0);
     virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbo.handle);
 
-    /* inline write the data to it */
     box.x = 0;
     box.y = 0;
     box.z = 0;
@@ -632,74 +711,37 @@ START_TEST(virgl_test_render_geom_simple)
     vbuf.buffer = &vbo.base;
     virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
 
-    /* create vertex shader */
     {
         struct pipe_shader_state vs;
-         const char *text =
+        const char *text =
            "VERT\n"
            "DCL IN[0]\n"
-           "DCL IN[1]\n"
-           "DCL OUT[0], POSITION\n"
-           "DCL OUT[1], GENERIC[20]\n"
-           "  0: MOV OUT[1], IN[1]\n"
-           "  1: MOV OUT[0], IN[0]\n"
-           "  2: END\n";
-         memset(&vs, 0, sizeof(vs));
-         vs_handle = ctx_handle++;
-         virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
-                                   &vs, text);
-         virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
-    }
-
-    /* create geometry shader */
-    {
-        struct pipe_shader_state gs;
-         const char *text =
-           "GEOM\n"
-           "PROPERTY GS_INPUT_PRIMITIVE TRIANGLES\n"
-           "PROPERTY GS_OUTPUT_PRIMITIVE TRIANGLE_STRIP\n"
-           "PROPERTY GS_MAX_OUTPUT_VERTICES 3\n"
-           "PROPERTY GS_INVOCATIONS 1\n"
-           "DCL IN[][0], POSITION\n"
-           "DCL IN[][1], GENERIC[20]\n"
            "DCL OUT[0], POSITION\n"
-           "DCL OUT[1], GENERIC[20]\n"
-           "IMM[0] INT32 {0, 0, 0, 0}\n"
-           "0:MOV OUT[0], IN[0][0]\n"
-           "1:MOV OUT[1], IN[0][1]\n"
-           "2:EMIT IMM[0].xxxx\n"
-           "3:MOV OUT[0], IN[1][0]\n"
-           "4:MOV OUT[1], IN[0][1]\n" /* copy color from input vertex 0 */
-           "5:EMIT IMM[0].xxxx\n"
-           "6:MOV OUT[0], IN[2][0]\n"
-           "7:MOV OUT[1], IN[2][1]\n"
-           "8:EMIT IMM[0].xxxx\n"
-           "9:END\n";
-         memset(&gs, 0, sizeof(gs));
-         gs_handle = ctx_handle++;
-         virgl_encode_shader_state(&ctx, gs_handle, PIPE_SHADER_GEOMETRY,
-                                   &gs, text);
-         virgl_encode_bind_shader(&ctx, gs_handle, PIPE_SHADER_GEOMETRY);
+           "  0: MOV OUT[0], IN[0]\n"
+           "  1: END\n";
+        memset(&vs, 0, sizeof(vs));
+        vs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
+                                  &vs, text);
+        virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
     }
 
-    /* create fragment shader */
+    /* the color comes from the last constant */
     {
         struct pipe_shader_state fs;
         const char *text =
             "FRAG\n"
-            "DCL IN[0], GENERIC[20], LINEAR\n"
             "DCL OUT[0], COLOR\n"
-            "  0: MOV OUT[0], IN[0]\n"
+            "DCL CONST[0..255]\n"
+            "  0: MOV OUT[0], CONST[255]\n"
             "  1: END\n";
         memset(&fs, 0, sizeof(fs));
         fs_handle = ctx_handle++;
         virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
-                                   &fs, text);
-
+                                  &fs, text);
         virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
     }
 
-    /* set blend state */
     {
         struct pipe_blend_state blend;
         int blend_handle = ctx_handle++;
@@ -709,18 +751,6 @@ START_TEST(virgl_test_render_geom_simple)
         virgl_encode_bind_object(&ctx, blend_handle, VIRGL_OBJECT_BLEND);
     }
 
-    /* set depth stencil alpha state */
-    {
-        struct pipe_depth_stencil_alpha_state dsa;
-        int dsa_handle = ctx_handle++;
-        memset(&dsa, 0, sizeof(dsa));
-        dsa.depth.writemask = 1;
-        dsa.depth.func = PIPE_FUNC_LESS;
-        virgl_encode_dsa_state(&ctx, dsa_handle, &dsa);
-        virgl_encode_bind_object(&ctx, dsa_handle, VIRGL_OBJECT_DSA);
-    }
-
-    /* set rasterizer state */
     {
         struct pipe_rasterizer_state rasterizer;
         int rs_handle = ctx_handle++;
@@ -733,51 +763,44 @@ START_TEST(virgl_test_render_geom_simple)
         virgl_encode_bind_object(&ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
     }
 
-    /* set viewport state */
     {
         struct pipe_viewport_state vp;
-        float znear = 0, zfar = 1.0;
-        float half_w = tw / 2.0f;
-        float half_h = th / 2.0f;
-        float half_d = (zfar - znear) / 2.0f;
-
-        vp.scale[0] = half_w;
-        vp.scale[1] = half_h;
-        vp.scale[2] = half_d;
 
-        vp.translate[0] = half_w + 0;
-        vp.translate[1] = half_h + 0;
-        vp.translate[2] = half_d + znear;
+        vp.scale[0] = tw / 2.0f;
+        vp.scale[1] = th / 2.0f;
+        vp.scale[2] = 0.5f;
+        vp.translate[0] = tw / 2.0f;
+        vp.translate[1] = th / 2.0f;
+        vp.translate[2] = 0.5f;
         virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
     }
 
-    /* draw */
-    {
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    memset(consts, 0, sizeof(consts));
+    for (int i = 0; i < TEST_CONST_DRAWS; i++) {
         struct pipe_draw_info info;
+        float *color = &consts[(TEST_CONST_VEC4 - 1) * 4];
+        bool last = i == TEST_CONST_DRAWS - 1;
+
+        /* red for all but the last draw, which is blue */
+        color[0] = last ? 0.0f : 1.0f;
+        color[1] = 0.0f;
+        color[2] = last ? 1.0f : (float)i / TEST_CONST_DRAWS;
+        color[3] = 1.0f;
+        virgl_encoder_write_constant_buffer(&ctx, PIPE_SHADER_FRAGMENT, 0,
+                                            TEST_CONST_VEC4 * 4, consts);
+
         memset(&info, 0, sizeof(info));
         info.count = 3;
         info.mode = PIPE_PRIM_TRIANGLES;
         virgl_encoder_draw_vbo(&ctx, &info);
-    }
 
-    testvirgl_ctx_send_cmdbuf(&ctx);
+        ret = testvirgl_ctx_send_cmdbuf(&ctx);
+        ck_assert_int_eq(ret, 0);
+    }
 
-    /* create a fence */
-    testvirgl_reset_fence();
-    ret = virgl_renderer_create_fence(1, ctx.ctx_id);
-    ck_assert_int_eq(ret, 0);
-
-    do {
-        int fence;
-
-        virgl_renderer_poll();
-        fence = testvirgl_get_last_fence();
-        if (fence >= 1)
-            break;
-        nanosleep((struct timespec[]){{0, 50000}}, NULL);
-    } while(1);
-
-    /* read back the tri values in the resource */
     box.x = 0;
     box.y = 0;
     box.z = 0;
@@ -788,19 +811,10 @@ START_TEST(virgl_test_render_geom_simple)
     ck_assert_int_eq(ret, 0);
 
     {
-        int w, h;
-        bool all_cleared = true;
         uint32_t *ptr = res.iovs[0].iov_base;
-        for (h = 0; h < th; h++) {
-            for (w = 0; w < tw; w++) {
-                if (ptr[h * tw + w] != test_green)
-                    all_cleared = false;
-            }
-        }
-        ck_assert_int_eq(all_cleared, false);
+        ck_assert_int_eq(ptr[(th / 2) * tw + tw / 2], 0xff0000ff);
     }
 
-    /* cleanup */
     virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
 
     testvirgl_destroy_backed_res(&vbo);
@@ -810,24 +824,21 @@ START_TEST(virgl_test_render_geom_simple)
 }
 END_TEST
 
-/* create a resource - clear it to a color, render something
- * and test transform feedback
- */
-START_TEST(virgl_test_render_xfb)
+/* alternate between two meshes with the same vertex elements, every switch
+ * only swaps the vertex buffer and must pick up the right vertices */
+START_TEST(virgl_test_render_vertex_array_switch)
 {
     struct virgl_context ctx;
     struct virgl_resource res;
-    struct virgl_resource vbo;
-    struct virgl_resource xfb;
+    struct virgl_resource vbos[2];
     struct virgl_surface surf;
-    struct virgl_so_target so_target;
-    struct virgl_so_target *so_target_ptr;
     struct pipe_framebuffer_state fb_state;
     struct pipe_vertex_element ve[2];
     struct pipe_vertex_buffer vbuf;
-    int ve_handle, vs_handle, fs_handle, xfb_handle;
+    struct vertex meshes[2][3];
+    const uint32_t expected[2] = { 0xffff0000, 0xff0000ff };
+    int ve_handle, vs_handle, fs_handle;
     int ctx_handle = 1;
-    union pipe_color_union color;
     struct virgl_box box;
     int ret;
     int tw = 300, th = 300;
@@ -835,36 +846,21 @@ START_TEST(virgl_test_render_xfb)
     ret = testvirgl_init_ctx_cmdbuf(&ctx);
     ck_assert_int_eq(ret, 0);
 
-    /* init and create simple 2D resource */
     ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
     ck_assert_int_eq(ret, 0);
-
-    /* attach resource to context */
     virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
 
-    /* create a surface for the resource */
     memset(&surf, 0, sizeof(surf));
     surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
     surf.handle = ctx_handle++;
     surf.base.texture = &res.base;
-
     virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
 
-    /* set the framebuffer state */
     fb_state.nr_cbufs = 1;
     fb_state.zsbuf = NULL;
     fb_state.cbufs[0] = &surf.base;
     virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
 
-    /* clear the resource */
-    /* clear buffer to green */
-    color.f[0] = 0.0;
-    color.f[1] = 1.0;
-    color.f[2] = 0.0;
-    color.f[3] = 1.0;
-    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
-
-    /* create vertex elements */
     ve_handle = ctx_handle++;
     memset(ve, 0, sizeof(ve));
     ve[0].src_offset = Offset(struct vertex, position);
@@ -872,15 +868,299 @@ START_TEST(virgl_test_render_xfb)
     ve[1].src_offset = Offset(struct vertex, color);
     ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
     virgl_encoder_create_vertex_elements(&ctx, ve_handle, 2, ve);
-
     virgl_encode_bind_object(&ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
 
-    /* create vbo */
+    /* the same triangle, red in the first mesh and blue in the second */
+    for (int m = 0; m < 2; m++) {
+        for (int v = 0; v < 3; v++) {
+            memcpy(meshes[m][v].position, vertices[v].position,
+                   sizeof(meshes[m][v].position));
+            meshes[m][v].color[0] = m ? 0.0f : 1.0f;
+            meshes[m][v].color[1] = 0.0f;
+            meshes[m][v].color[2] = m ? 1.0f : 0.0f;
+            meshes[m][v].color[3] = 1.0f;
+        }
+
+        ret = testvirgl_create_backed_simple_buffer(&vbos[m], 2 + m, sizeof(meshes[m]),
+                                                    PIPE_BIND_VERTEX_BUFFER);
+        ck_assert_int_eq(ret, 0);
+        virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbos[m].handle);
+
+        box.x = 0;
+        box.y = 0;
+        box.z = 0;
+        box.w = sizeof(meshes[m]);
+        box.h = 1;
+        box.d = 1;
+        virgl_encoder_inline_write(&ctx, &vbos[m], 0, 0, (struct pipe_box *)&box,
+                                   meshes[m], box.w, 0);
+    }
+
+    {
+        struct pipe_shader_state vs;
+        const char *text =
+           "VERT\n"
+           "DCL IN[0]\n"
+           "DCL IN[1]\n"
+           "DCL OUT[0], POSITION\n"
+           "DCL OUT[1], COLOR\n"
+           "  0: MOV OUT[1], IN[1]\n"
+           "  1: MOV OUT[0], IN[0]\n"
+           "  2: END\n";
+        memset(&vs, 0, sizeof(vs));
+        vs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
+                                  &vs, text);
+        virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
+    }
+
+    {
+        struct pipe_shader_state fs;
+        const char *text =
+            "FRAG\n"
+            "DCL IN[0], COLOR, LINEAR\n"
+            "DCL OUT[0], COLOR\n"
+            "  0: MOV OUT[0], IN[0]\n"
+            "  1: END\n";
+        memset(&fs, 0, sizeof(fs));
+        fs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
+                                  &fs, text);
+        virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+    }
+
+    {
+        struct pipe_blend_state blend;
+        int blend_handle = ctx_handle++;
+        memset(&blend, 0, sizeof(blend));
+        blend.rt[0].colormask = PIPE_MASK_RGBA;
+        virgl_encode_blend_state(&ctx, blend_handle, &blend);
+        virgl_encode_bind_object(&ctx, blend_handle, VIRGL_OBJECT_BLEND);
+    }
+
+    {
+        struct pipe_rasterizer_state rasterizer;
+        int rs_handle = ctx_handle++;
+        memset(&rasterizer, 0, sizeof(rasterizer));
+        rasterizer.cull_face = PIPE_FACE_NONE;
+        rasterizer.half_pixel_center = 1;
+        rasterizer.bottom_edge_rule = 1;
+        rasterizer.depth_clip = 1;
+        virgl_encode_rasterizer_state(&ctx, rs_handle, &rasterizer);
+        virgl_encode_bind_object(&ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
+    }
+
+    {
+        struct pipe_viewport_state vp;
+
+        vp.scale[0] = tw / 2.0f;
+        vp.scale[1] = th / 2.0f;
+        vp.scale[2] = 0.5f;
+        vp.translate[0] = tw / 2.0f;
+        vp.translate[1] = th / 2.0f;
+        vp.translate[2] = 0.5f;
+        virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
+    }
+
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    for (int last = 0; last < 2; last++) {
+        /* end on the mesh under test */
+        for (int i = 0; i < 9; i++) {
+            struct pipe_draw_info info;
+            int m = (i + last) % 2;
+
+            vbuf.stride = sizeof(struct vertex);
+            vbuf.buffer_offset = 0;
+            vbuf.buffer = &vbos[m].base;
+            virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
+
+            memset(&info, 0, sizeof(info));
+            info.count = 3;
+            info.mode = PIPE_PRIM_TRIANGLES;
+            virgl_encoder_draw_vbo(&ctx, &info);
+
+            ret = testvirgl_ctx_send_cmdbuf(&ctx);
+            ck_assert_int_eq(ret, 0);
+        }
+
+        box.x = 0;
+        box.y = 0;
+        box.z = 0;
+        box.w = tw;
+        box.h = th;
+        box.d = 1;
+        ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 0, 0, &box, 0, NULL, 0);
+        ck_assert_int_eq(ret, 0);
+
+        {
+            uint32_t *ptr = res.iovs[0].iov_base;
+            ck_assert_int_eq(ptr[(th / 2) * tw + tw / 2], expected[last]);
+        }
+    }
+
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+    testvirgl_destroy_backed_res(&vbos[0]);
+    testvirgl_destroy_backed_res(&vbos[1]);
+    testvirgl_destroy_backed_res(&res);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+#define TEST_TEX_SIZE 4
+
+static void fill_texture(struct virgl_context *ctx, struct virgl_resource *tex,
+                         uint8_t b, uint8_t g, uint8_t r)
+{
+    uint8_t texels[TEST_TEX_SIZE * TEST_TEX_SIZE][4];
+    struct pipe_box box;
+
+    for (int i = 0; i < TEST_TEX_SIZE * TEST_TEX_SIZE; i++) {
+        texels[i][0] = b;
+        texels[i][1] = g;
+        texels[i][2] = r;
+        texels[i][3] = 0xff;
+    }
+
+    memset(&box, 0, sizeof(box));
+    box.width = TEST_TEX_SIZE;
+    box.height = TEST_TEX_SIZE;
+    box.depth = 1;
+    virgl_encoder_inline_write(ctx, tex, 0, 0, &box, texels,
+                               TEST_TEX_SIZE * 4, 0);
+}
+
+static void check_center(struct virgl_context *ctx,
+                         struct virgl_resource *res, int tw, int th,
+                         uint8_t b, uint8_t g, uint8_t r)
+{
+    struct virgl_box box;
+    uint8_t *pixel;
+    int ret;
+
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = tw;
+    box.h = th;
+    box.d = 1;
+    ret = virgl_renderer_transfer_read_iov(res->handle, ctx->ctx_id, 0, 0, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    pixel = (uint8_t *)res->iovs[0].iov_base + ((th / 2) * tw + tw / 2) * 4;
+    ck_assert_int_eq(pixel[0], b);
+    ck_assert_int_eq(pixel[1], g);
+    ck_assert_int_eq(pixel[2], r);
+}
+
+static void draw_and_check_center(struct virgl_context *ctx,
+                                  struct virgl_resource *res, int tw, int th,
+                                  uint8_t b, uint8_t g, uint8_t r)
+{
+    struct pipe_draw_info info;
+    int ret;
+
+    memset(&info, 0, sizeof(info));
+    info.count = 3;
+    info.mode = PIPE_PRIM_TRIANGLES;
+    virgl_encoder_draw_vbo(ctx, &info);
+    ret = testvirgl_ctx_send_cmdbuf(ctx);
+    ck_assert_int_eq(ret, 0);
+
+    check_center(ctx, res, tw, th, b, g, r);
+}
+
+/* sample two textures, switch to a program that puts the second sampler on
+ * the first texture unit, and switch back changing only the second view. The
+ * sampler that is not dirty has to be bound to its unit again. */
+START_TEST(virgl_test_render_samplers_partly_dirty)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res;
+    struct virgl_resource vbo;
+    struct virgl_resource tex[3];
+    struct virgl_surface surf;
+    struct pipe_framebuffer_state fb_state;
+    struct pipe_vertex_element ve;
+    struct pipe_vertex_buffer vbuf;
+    struct pipe_sampler_view view_state;
+    struct pipe_sampler_state sampler;
+    struct virgl_sampler_view views[3];
+    struct virgl_sampler_view *bound[2];
+    uint32_t samplers[2];
+    int vs_handle, fs_both_handle, fs_second_handle;
+    int ctx_handle = 1;
+    struct virgl_box box;
+    int ret;
+    int tw = 32, th = 32;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+    memset(&surf, 0, sizeof(surf));
+    surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    surf.handle = ctx_handle++;
+    surf.base.texture = &res.base;
+    virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf.base;
+    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+    /* red, black and blue textures */
+    memset(&view_state, 0, sizeof(view_state));
+    view_state.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    view_state.swizzle_r = PIPE_SWIZZLE_X;
+    view_state.swizzle_g = PIPE_SWIZZLE_Y;
+    view_state.swizzle_b = PIPE_SWIZZLE_Z;
+    view_state.swizzle_a = PIPE_SWIZZLE_W;
+    for (int i = 0; i < 3; i++) {
+        ret = testvirgl_create_backed_simple_2d_res(&tex[i], 3 + i,
+                                                    TEST_TEX_SIZE, TEST_TEX_SIZE);
+        ck_assert_int_eq(ret, 0);
+        virgl_renderer_ctx_attach_resource(ctx.ctx_id, tex[i].handle);
+
+        views[i].handle = ctx_handle++;
+        virgl_encode_sampler_view(&ctx, views[i].handle, &tex[i], &view_state);
+    }
+    fill_texture(&ctx, &tex[0], 0x00, 0x00, 0xff);
+    fill_texture(&ctx, &tex[1], 0x00, 0x00, 0x00);
+    fill_texture(&ctx, &tex[2], 0xff, 0x00, 0x00);
+
+    memset(&sampler, 0, sizeof(sampler));
+    sampler.wrap_s = PIPE_TEX_WRAP_CLAMP_TO_EDGE;
+    sampler.wrap_t = PIPE_TEX_WRAP_CLAMP_TO_EDGE;
+    sampler.wrap_r = PIPE_TEX_WRAP_CLAMP_TO_EDGE;
+    sampler.min_img_filter = PIPE_TEX_FILTER_NEAREST;
+    sampler.mag_img_filter = PIPE_TEX_FILTER_NEAREST;
+    sampler.min_mip_filter = PIPE_TEX_MIPFILTER_NONE;
+    for (int i = 0; i < 2; i++) {
+        samplers[i] = ctx_handle++;
+        virgl_encode_sampler_state(&ctx, samplers[i], &sampler);
+    }
+    virgl_encode_bind_sampler_states(&ctx, PIPE_SHADER_FRAGMENT, 0, 2, samplers);
+
+    memset(&ve, 0, sizeof(ve));
+    ve.src_offset = Offset(struct vertex, position);
+    ve.src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+    {
+        int ve_handle = ctx_handle++;
+        virgl_encoder_create_vertex_elements(&ctx, ve_handle, 1, &ve);
+        virgl_encode_bind_object(&ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+    }
+
     ret = testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(vertices), PIPE_BIND_VERTEX_BUFFER);
     ck_assert_int_eq(ret, 0);
     virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbo.handle);
 
-    /* inline write the data to it */
     box.x = 0;
     box.y = 0;
     box.z = 0;
@@ -894,57 +1174,53 @@ START_TEST(virgl_test_render_xfb)
     vbuf.buffer = &vbo.base;
     virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
 
-    /* create stream output buffer */
-    ret = testvirgl_create_backed_simple_buffer(&xfb, 3, 3*sizeof(vertices), PIPE_BIND_STREAM_OUTPUT);
-    ck_assert_int_eq(ret, 0);
-    virgl_renderer_ctx_attach_resource(ctx.ctx_id, xfb.handle);
-
-    /* set streamout target */
-    xfb_handle = ctx_handle++;
-    virgl_encoder_create_so_target(&ctx, xfb_handle, &xfb, 0, 3*sizeof(vertices));
-    so_target.handle = xfb_handle;
-    so_target_ptr = &so_target;
-    virgl_encoder_set_so_targets(&ctx, 1, (struct pipe_stream_output_target **)&so_target_ptr, 0);
-
-    /* create vertex shader */
     {
         struct pipe_shader_state vs;
-         const char *text =
+        const char *text =
            "VERT\n"
            "DCL IN[0]\n"
-           "DCL IN[1]\n"
            "DCL OUT[0], POSITION\n"
-           "DCL OUT[1], COLOR\n"
-           "  0: MOV OUT[1], IN[1]\n"
-           "  1: MOV OUT[0], IN[0]\n"
-           "  2: END\n";
-         memset(&vs, 0, sizeof(vs));
-         vs_handle = ctx_handle++;
-         vs.stream_output.num_outputs = 1;
-         vs.stream_output.stride[0] = 4;
-         vs.stream_output.output[0].num_components = 4;
-         virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
-                                   &vs, text);
-         virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
+           "  0: MOV OUT[0], IN[0]\n"
+           "  1: END\n";
+        memset(&vs, 0, sizeof(vs));
+        vs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
+                                  &vs, text);
+        virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
     }
 
-    /* create fragment shader */
     {
         struct pipe_shader_state fs;
-        const char *text =
+        const char *both =
             "FRAG\n"
-            "DCL IN[0], COLOR, LINEAR\n"
             "DCL OUT[0], COLOR\n"
-            "  0: MOV OUT[0], IN[0]\n"
+            "DCL SAMP[0]\n"
+            "DCL SAMP[1]\n"
+            "DCL SVIEW[0], 2D, FLOAT\n"
+            "DCL SVIEW[1], 2D, FLOAT\n"
+            "DCL TEMP[0..1]\n"
+            "IMM[0] FLT32 { 0.5, 0.5, 0.0, 0.0 }\n"
+            "  0: TEX TEMP[0], IMM[0], SAMP[0], 2D\n"
+            "  1: TEX TEMP[1], IMM[0], SAMP[1], 2D\n"
+            "  2: ADD OUT[0], TEMP[0], TEMP[1]\n"
+            "  3: END\n";
+        const char *second =
+            "FRAG\n"
+            "DCL OUT[0], COLOR\n"
+            "DCL SAMP[1]\n"
+            "DCL SVIEW[1], 2D, FLOAT\n"
+            "IMM[0] FLT32 { 0.5, 0.5, 0.0, 0.0 }\n"
+            "  0: TEX OUT[0], IMM[0], SAMP[1], 2D\n"
             "  1: END\n";
         memset(&fs, 0, sizeof(fs));
-        fs_handle = ctx_handle++;
-        virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
-                                   &fs, text);
-        virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+        fs_both_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, fs_both_handle, PIPE_SHADER_FRAGMENT,
+                                  &fs, both);
+        fs_second_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, fs_second_handle, PIPE_SHADER_FRAGMENT,
+                                  &fs, second);
     }
 
-    /* set blend state */
     {
         struct pipe_blend_state blend;
         int blend_handle = ctx_handle++;
@@ -954,18 +1230,6 @@ START_TEST(virgl_test_render_xfb)
         virgl_encode_bind_object(&ctx, blend_handle, VIRGL_OBJECT_BLEND);
     }
 
-    /* set depth stencil alpha state */
-    {
-        struct pipe_depth_stencil_alpha_state dsa;
-        int dsa_handle = ctx_handle++;
-        memset(&dsa, 0, sizeof(dsa));
-        dsa.depth.writemask = 1;
-        dsa.depth.func = PIPE_FUNC_LESS;
-        virgl_encode_dsa_state(&ctx, dsa_handle, &dsa);
-        virgl_encode_bind_object(&ctx, dsa_handle, VIRGL_OBJECT_DSA);
-    }
-
-    /* set rasterizer state */
     {
         struct pipe_rasterizer_state rasterizer;
         int rs_handle = ctx_handle++;
@@ -978,107 +1242,1257 @@ START_TEST(virgl_test_render_xfb)
         virgl_encode_bind_object(&ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
     }
 
-    /* set viewport state */
-    {
-        struct pipe_viewport_state vp;
-        float znear = 0, zfar = 1.0;
-        float half_w = tw / 2.0f;
-        float half_h = th / 2.0f;
-        float half_d = (zfar - znear) / 2.0f;
+    {
+        struct pipe_viewport_state vp;
+
+        vp.scale[0] = tw / 2.0f;
+        vp.scale[1] = th / 2.0f;
+        vp.scale[2] = 0.5f;
+        vp.translate[0] = tw / 2.0f;
+        vp.translate[1] = th / 2.0f;
+        vp.translate[2] = 0.5f;
+        virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
+    }
+
+    /* red + black */
+    bound[0] = &views[0];
+    bound[1] = &views[1];
+    virgl_encode_set_sampler_views(&ctx, PIPE_SHADER_FRAGMENT, 0, 2, bound);
+    virgl_encode_bind_shader(&ctx, fs_both_handle, PIPE_SHADER_FRAGMENT);
+    draw_and_check_center(&ctx, &res, tw, th, 0x00, 0x00, 0xff);
+
+    /* black, sampled through the first unit */
+    virgl_encode_bind_shader(&ctx, fs_second_handle, PIPE_SHADER_FRAGMENT);
+    draw_and_check_center(&ctx, &res, tw, th, 0x00, 0x00, 0x00);
+
+    /* red + blue, only the second view is dirty */
+    virgl_encode_bind_shader(&ctx, fs_both_handle, PIPE_SHADER_FRAGMENT);
+    bound[1] = &views[2];
+    virgl_encode_set_sampler_views(&ctx, PIPE_SHADER_FRAGMENT, 1, 1, &bound[1]);
+    draw_and_check_center(&ctx, &res, tw, th, 0xff, 0x00, 0xff);
+
+    /* once more without any dirty sampler */
+    draw_and_check_center(&ctx, &res, tw, th, 0xff, 0x00, 0xff);
+
+    for (int i = 0; i < 3; i++) {
+        virgl_renderer_ctx_detach_resource(ctx.ctx_id, tex[i].handle);
+        testvirgl_destroy_backed_res(&tex[i]);
+    }
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+    testvirgl_destroy_backed_res(&vbo);
+    testvirgl_destroy_backed_res(&res);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+static void virgl_test_bind_images_shader(int first_layer, int last_layer, int expected_error)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res;
+    struct virgl_surface surf;
+    struct pipe_framebuffer_state fb_state;
+    int ret;
+    int tw = 300, th = 300;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    /* init and create simple 2D resource */
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
+    ck_assert_int_eq(ret, 0);
+
+    /* attach resource to context */
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+    /* set the framebuffer state */
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf.base;
+    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+    /* Create shader images */
+    struct vrend_image_view images[1] = {0};
+    images[0].u.tex.first_layer = first_layer;
+    images[0].u.tex.last_layer = last_layer;
+    virgl_encoder_set_shader_images(&ctx, PIPE_SHADER_FRAGMENT, 1, 1, images, res.handle);
+
+    ret = testvirgl_ctx_send_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, expected_error);
+
+    /* cleanup */
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+    testvirgl_destroy_backed_res(&res);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+
+START_TEST(virgl_test_bind_images_shader_pass)
+{
+    virgl_test_bind_images_shader(0, 0, 0);
+}
+END_TEST
+
+START_TEST(virgl_test_bind_images_shader_fail_layers)
+{
+    virgl_test_bind_images_shader(1, 0, EINVAL);
+}
+END_TEST
+
+/* create a resource - clear it to a color, render something */
+START_TEST(virgl_test_render_geom_simple)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res;
+    struct virgl_resource vbo;
+    struct virgl_surface surf;
+    struct pipe_framebuffer_state fb_state;
+    struct pipe_vertex_element ve[2];
+    struct pipe_vertex_buffer vbuf;
+    int ve_handle, vs_handle, fs_handle, gs_handle;
+    int ctx_handle = 1;
+    union pipe_color_union color;
+    struct virgl_box box;
+    int ret;
+    int tw = 300, th = 300;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    /* Geometry shader are only available since GLSL 150 */
+    uint32_t glsl_level = testvirgl_get_glsl_level_from_caps();
+    if (glsl_level < 150) {
+      testvirgl_fini_ctx_cmdbuf(&ctx);
+      return;
+    }
+
+    /* init and create simple 2D resource */
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
+    ck_assert_int_eq(ret, 0);
+
+    /* attach resource to context */
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+    /* create a surface for the resource */
+    memset(&surf, 0, sizeof(surf));
+    surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    surf.handle = ctx_handle++;
+    surf.base.texture = &res.base;
+
+    virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+    /* set the framebuffer state */
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf.base;
+    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+    /* clear the resource */
+    /* clear buffer to green */
+    color.f[0] = 0.0;
+    color.f[1] = 1.0;
+    color.f[2] = 0.0;
+    color.f[3] = 1.0;
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+
+    /* create vertex elements */
+    ve_handle = ctx_handle++;
+    memset(ve, 0, sizeof(ve));
+    ve[0].src_offset = Offset(struct vertex, position);
+    ve[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+    ve[1].src_offset = Offset(struct vertex, color);
+    ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+    virgl_encoder_create_vertex_elements(&ctx, ve_handle, 2, ve);
+
+    virgl_encode_bind_object(&ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+
+    /* create vbo */
+    ret = testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(vertices), PIPE_BIND_VERTEX_BUFFER);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbo.handle);
+
+    /* inline write the data to it */
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = sizeof(vertices);
+    box.h = 1;
+    box.d = 1;
+    virgl_encoder_inline_write(&ctx, &vbo, 0, 0, (struct pipe_box *)&box, &vertices, box.w, 0);
+
+    vbuf.stride = sizeof(struct vertex);
+    vbuf.buffer_offset = 0;
+    vbuf.buffer = &vbo.base;
+    virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
+
+    /* create vertex shader */
+    {
+        struct pipe_shader_state vs;
+         const char *text =
+           "VERT\n"
+           "DCL IN[0]\n"
+           "DCL IN[1]\n"
+           "DCL OUT[0], POSITION\n"
+           "DCL OUT[1], GENERIC[20]\n"
+           "  0: MOV OUT[1], IN[1]\n"
+           "  1: MOV OUT[0], IN[0]\n"
+           "  2: END\n";
+         memset(&vs, 0, sizeof(vs));
+         vs_handle = ctx_handle++;
+         virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
+                                   &vs, text);
+         virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
+    }
+
+    /* create geometry shader */
+    {
+        struct pipe_shader_state gs;
+         const char *text =
+           "GEOM\n"
+           "PROPERTY GS_INPUT_PRIMITIVE TRIANGLES\n"
+           "PROPERTY GS_OUTPUT_PRIMITIVE TRIANGLE_STRIP\n"
+           "PROPERTY GS_MAX_OUTPUT_VERTICES 3\n"
+           "PROPERTY GS_INVOCATIONS 1\n"
+           "DCL IN[][0], POSITION\n"
+           "DCL IN[][1], GENERIC[20]\n"
+           "DCL OUT[0], POSITION\n"
+           "DCL OUT[1], GENERIC[20]\n"
+           "IMM[0] INT32 {0, 0, 0, 0}\n"
+           "0:MOV OUT[0], IN[0][0]\n"
+           "1:MOV OUT[1], IN[0][1]\n"
+           "2:EMIT IMM[0].xxxx\n"
+           "3:MOV OUT[0], IN[1][0]\n"
+           "4:MOV OUT[1], IN[0][1]\n" /* copy color from input vertex 0 */
+           "5:EMIT IMM[0].xxxx\n"
+           "6:MOV OUT[0], IN[2][0]\n"
+           "7:MOV OUT[1], IN[2][1]\n"
+           "8:EMIT IMM[0].xxxx\n"
+           "9:END\n";
+         memset(&gs, 0, sizeof(gs));
+         gs_handle = ctx_handle++;
+         virgl_encode_shader_state(&ctx, gs_handle, PIPE_SHADER_GEOMETRY,
+                                   &gs, text);
+         virgl_encode_bind_shader(&ctx, gs_handle, PIPE_SHADER_GEOMETRY);
+    }
+
+    /* create fragment shader */
+    {
+        struct pipe_shader_state fs;
+        const char *text =
+            "FRAG\n"
+            "DCL IN[0], GENERIC[20], LINEAR\n"
+            "DCL OUT[0], COLOR\n"
+            "  0: MOV OUT[0], IN[0]\n"
+            "  1: END\n";
+        memset(&fs, 0, sizeof(fs));
+        fs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
+                                   &fs, text);
+
+        virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+    }
+
+    /* set blend state */
+    {
+        struct pipe_blend_state blend;
+        int blend_handle = ctx_handle++;
+        memset(&blend, 0, sizeof(blend));
+        blend.rt[0].colormask = PIPE_MASK_RGBA;
+        virgl_encode_blend_state(&ctx, blend_handle, &blend);
+        virgl_encode_bind_object(&ctx, blend_handle, VIRGL_OBJECT_BLEND);
+    }
+
+    /* set depth stencil alpha state */
+    {
+        struct pipe_depth_stencil_alpha_state dsa;
+        int dsa_handle = ctx_handle++;
+        memset(&dsa, 0, sizeof(dsa));
+        dsa.depth.writemask = 1;
+        dsa.depth.func = PIPE_FUNC_LESS;
+        virgl_encode_dsa_state(&ctx, dsa_handle, &dsa);
+        virgl_encode_bind_object(&ctx, dsa_handle, VIRGL_OBJECT_DSA);
+    }
+
+    /* set rasterizer state */
+    {
+        struct pipe_rasterizer_state rasterizer;
+        int rs_handle = ctx_handle++;
+        memset(&rasterizer, 0, sizeof(rasterizer));
+        rasterizer.cull_face = PIPE_FACE_NONE;
+        rasterizer.half_pixel_center = 1;
+        rasterizer.bottom_edge_rule = 1;
+        rasterizer.depth_clip = 1;
+        virgl_encode_rasterizer_state(&ctx, rs_handle, &rasterizer);
+        virgl_encode_bind_object(&ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
+    }
+
+    /* set viewport state */
+    {
+        struct pipe_viewport_state vp;
+        float znear = 0, zfar = 1.0;
+        float half_w = tw / 2.0f;
+        float half_h = th / 2.0f;
+        float half_d = (zfar - znear) / 2.0f;
+
+        vp.scale[0] = half_w;
+        vp.scale[1] = half_h;
+        vp.scale[2] = half_d;
+
+        vp.translate[0] = half_w + 0;
+        vp.translate[1] = half_h + 0;
+        vp.translate[2] = half_d + znear;
+        virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
+    }
+
+    /* draw */
+    {
+        struct pipe_draw_info info;
+        memset(&info, 0, sizeof(info));
+        info.count = 3;
+        info.mode = PIPE_PRIM_TRIANGLES;
+        virgl_encoder_draw_vbo(&ctx, &info);
+    }
+
+    testvirgl_ctx_send_cmdbuf(&ctx);
+
+    /* create a fence */
+    testvirgl_reset_fence();
+    ret = virgl_renderer_create_fence(1, ctx.ctx_id);
+    ck_assert_int_eq(ret, 0);
+
+    do {
+        int fence;
+
+        virgl_renderer_poll();
+        fence = testvirgl_get_last_fence();
+        if (fence >= 1)
+            break;
+        nanosleep((struct timespec[]){{0, 50000}}, NULL);
+    } while(1);
+
+    /* read back the tri values in the resource */
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = tw;
+    box.h = th;
+    box.d = 1;
+    ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 0, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    {
+        int w, h;
+        bool all_cleared = true;
+        uint32_t *ptr = res.iovs[0].iov_base;
+        for (h = 0; h < th; h++) {
+            for (w = 0; w < tw; w++) {
+                if (ptr[h * tw + w] != test_green)
+                    all_cleared = false;
+            }
+        }
+        ck_assert_int_eq(all_cleared, false);
+    }
+
+    /* cleanup */
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+    testvirgl_destroy_backed_res(&vbo);
+    testvirgl_destroy_backed_res(&res);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* create a resource - clear it to a color, render something
+ * and test transform feedback
+ */
+START_TEST(virgl_test_render_xfb)
+{
+    struct virgl_context ctx;
+    struct virgl_resource res;
+    struct virgl_resource vbo;
+    struct virgl_resource xfb;
+    struct virgl_surface surf;
+    struct virgl_so_target so_target;
+    struct virgl_so_target *so_target_ptr;
+    struct pipe_framebuffer_state fb_state;
+    struct pipe_vertex_element ve[2];
+    struct pipe_vertex_buffer vbuf;
+    int ve_handle, vs_handle, fs_handle, xfb_handle;
+    int ctx_handle = 1;
+    union pipe_color_union color;
+    struct virgl_box box;
+    int ret;
+    int tw = 300, th = 300;
+
+    ret = testvirgl_init_ctx_cmdbuf(&ctx);
+    ck_assert_int_eq(ret, 0);
+
+    /* init and create simple 2D resource */
+    ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
+    ck_assert_int_eq(ret, 0);
+
+    /* attach resource to context */
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+    /* create a surface for the resource */
+    memset(&surf, 0, sizeof(surf));
+    surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+    surf.handle = ctx_handle++;
+    surf.base.texture = &res.base;
+
+    virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+    /* set the framebuffer state */
+    fb_state.nr_cbufs = 1;
+    fb_state.zsbuf = NULL;
+    fb_state.cbufs[0] = &surf.base;
+    virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+    /* clear the resource */
+    /* clear buffer to green */
+    color.f[0] = 0.0;
+    color.f[1] = 1.0;
+    color.f[2] = 0.0;
+    color.f[3] = 1.0;
+    virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+
+    /* create vertex elements */
+    ve_handle = ctx_handle++;
+    memset(ve, 0, sizeof(ve));
+    ve[0].src_offset = Offset(struct vertex, position);
+    ve[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+    ve[1].src_offset = Offset(struct vertex, color);
+    ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+    virgl_encoder_create_vertex_elements(&ctx, ve_handle, 2, ve);
+
+    virgl_encode_bind_object(&ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+
+    /* create vbo */
+    ret = testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(vertices), PIPE_BIND_VERTEX_BUFFER);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbo.handle);
+
+    /* inline write the data to it */
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = sizeof(vertices);
+    box.h = 1;
+    box.d = 1;
+    virgl_encoder_inline_write(&ctx, &vbo, 0, 0, (struct pipe_box *)&box, &vertices, box.w, 0);
+
+    vbuf.stride = sizeof(struct vertex);
+    vbuf.buffer_offset = 0;
+    vbuf.buffer = &vbo.base;
+    virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
+
+    /* create stream output buffer */
+    ret = testvirgl_create_backed_simple_buffer(&xfb, 3, 3*sizeof(vertices), PIPE_BIND_STREAM_OUTPUT);
+    ck_assert_int_eq(ret, 0);
+    virgl_renderer_ctx_attach_resource(ctx.ctx_id, xfb.handle);
+
+    /* set streamout target */
+    xfb_handle = ctx_handle++;
+    virgl_encoder_create_so_target(&ctx, xfb_handle, &xfb, 0, 3*sizeof(vertices));
+    so_target.handle = xfb_handle;
+    so_target_ptr = &so_target;
+    virgl_encoder_set_so_targets(&ctx, 1, (struct pipe_stream_output_target **)&so_target_ptr, 0);
+
+    /* create vertex shader */
+    {
+        struct pipe_shader_state vs;
+         const char *text =
+           "VERT\n"
+           "DCL IN[0]\n"
+           "DCL IN[1]\n"
+           "DCL OUT[0], POSITION\n"
+           "DCL OUT[1], COLOR\n"
+           "  0: MOV OUT[1], IN[1]\n"
+           "  1: MOV OUT[0], IN[0]\n"
+           "  2: END\n";
+         memset(&vs, 0, sizeof(vs));
+         vs_handle = ctx_handle++;
+         vs.stream_output.num_outputs = 1;
+         vs.stream_output.stride[0] = 4;
+         vs.stream_output.output[0].num_components = 4;
+         virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX,
+                                   &vs, text);
+         virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
+    }
+
+    /* create fragment shader */
+    {
+        struct pipe_shader_state fs;
+        const char *text =
+            "FRAG\n"
+            "DCL IN[0], COLOR, LINEAR\n"
+            "DCL OUT[0], COLOR\n"
+            "  0: MOV OUT[0], IN[0]\n"
+            "  1: END\n";
+        memset(&fs, 0, sizeof(fs));
+        fs_handle = ctx_handle++;
+        virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
+                                   &fs, text);
+        virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+    }
+
+    /* set blend state */
+    {
+        struct pipe_blend_state blend;
+        int blend_handle = ctx_handle++;
+        memset(&blend, 0, sizeof(blend));
+        blend.rt[0].colormask = PIPE_MASK_RGBA;
+        virgl_encode_blend_state(&ctx, blend_handle, &blend);
+        virgl_encode_bind_object(&ctx, blend_handle, VIRGL_OBJECT_BLEND);
+    }
+
+    /* set depth stencil alpha state */
+    {
+        struct pipe_depth_stencil_alpha_state dsa;
+        int dsa_handle = ctx_handle++;
+        memset(&dsa, 0, sizeof(dsa));
+        dsa.depth.writemask = 1;
+        dsa.depth.func = PIPE_FUNC_LESS;
+        virgl_encode_dsa_state(&ctx, dsa_handle, &dsa);
+        virgl_encode_bind_object(&ctx, dsa_handle, VIRGL_OBJECT_DSA);
+    }
+
+    /* set rasterizer state */
+    {
+        struct pipe_rasterizer_state rasterizer;
+        int rs_handle = ctx_handle++;
+        memset(&rasterizer, 0, sizeof(rasterizer));
+        rasterizer.cull_face = PIPE_FACE_NONE;
+        rasterizer.half_pixel_center = 1;
+        rasterizer.bottom_edge_rule = 1;
+        rasterizer.depth_clip = 1;
+        virgl_encode_rasterizer_state(&ctx, rs_handle, &rasterizer);
+        virgl_encode_bind_object(&ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
+    }
+
+    /* set viewport state */
+    {
+        struct pipe_viewport_state vp;
+        float znear = 0, zfar = 1.0;
+        float half_w = tw / 2.0f;
+        float half_h = th / 2.0f;
+        float half_d = (zfar - znear) / 2.0f;
+
+        vp.scale[0] = half_w;
+        vp.scale[1] = half_h;
+        vp.scale[2] = half_d;
+
+        vp.translate[0] = half_w + 0;
+        vp.translate[1] = half_h + 0;
+        vp.translate[2] = half_d + znear;
+        virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
+    }
+
+    /* draw */
+    {
+        struct pipe_draw_info info;
+        memset(&info, 0, sizeof(info));
+        info.count = 3;
+        info.mode = PIPE_PRIM_TRIANGLES;
+        virgl_encoder_draw_vbo(&ctx, &info);
+    }
+
+    testvirgl_ctx_send_cmdbuf(&ctx);
+
+    /* create a fence */
+    testvirgl_reset_fence();
+    ret = virgl_renderer_create_fence(1, ctx.ctx_id);
+    ck_assert_int_eq(ret, 0);
+
+    do {
+        int fence;
+
+        virgl_renderer_poll();
+        fence = testvirgl_get_last_fence();
+        if (fence >= 1)
+            break;
+        nanosleep((struct timespec[]){{0, 50000}}, NULL);
+    } while(1);
+
+    /* read back the tri values in the resource */
+    box.x = 0;
+    box.y = 0;
+    box.z = 0;
+    box.w = tw;
+    box.h = th;
+    box.d = 1;
+    ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 0, 0, &box, 0, NULL, 0);
+    ck_assert_int_eq(ret, 0);
+
+    {
+        int w, h;
+        bool all_cleared = true;
+        uint32_t *ptr = res.iovs[0].iov_base;
+        for (h = 0; h < th; h++) {
+            for (w = 0; w < tw; w++) {
+                if (ptr[h * tw + w] != test_green)
+                    all_cleared = false;
+            }
+        }
+        ck_assert_int_eq(all_cleared, false);
+    }
+
+    /* cleanup */
+    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+    testvirgl_destroy_backed_res(&xfb);
+    testvirgl_destroy_backed_res(&vbo);
+    testvirgl_destroy_backed_res(&res);
+
+    testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* send a large shader across */
+START_TEST(virgl_test_large_shader)
+{
+   int ret;
+   struct virgl_context ctx;
+   int ctx_handle = 1;
+   int fs_handle;
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   /* create large fragment shader */
+   {
+      struct pipe_shader_state fs;
+      const char *text = large_frag;
+
+      memset(&fs, 0, sizeof(fs));
+      fs_handle = ctx_handle++;
+      virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
+                                &fs, text);
+
+      virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+   }
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* precompile a compute program on LINK_SHADER and dispatch it */
+START_TEST(virgl_test_link_compute_shader)
+{
+   int ret;
+   struct virgl_context ctx;
+   int ctx_handle = 1;
+   int cs_handle;
+   uint32_t handles[PIPE_SHADER_TYPES];
+   uint32_t block[3] = {1, 1, 1};
+   uint32_t grid[3] = {1, 1, 1};
+   struct virgl_renderer_shader_stats stats;
+   union virgl_caps caps;
+   uint32_t max_ver, max_size;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+   virgl_renderer_fill_caps(2, max_ver, &caps);
+   if (!(caps.v2.capability_bits & VIRGL_CAP_COMPUTE_SHADER)) {
+      testvirgl_fini_ctx_cmdbuf(&ctx);
+      return;
+   }
+
+   {
+      struct pipe_shader_state cs;
+      const char *text =
+         "COMP\n"
+         "PROPERTY CS_FIXED_BLOCK_WIDTH 1\n"
+         "PROPERTY CS_FIXED_BLOCK_HEIGHT 1\n"
+         "PROPERTY CS_FIXED_BLOCK_DEPTH 1\n"
+         "DCL SV[0], BLOCK_ID\n"
+         "DCL TEMP[0]\n"
+         "  0: MOV TEMP[0].x, SV[0].xxxx\n"
+         "  1: END\n";
+
+      memset(&cs, 0, sizeof(cs));
+      cs_handle = ctx_handle++;
+      virgl_encode_shader_state(&ctx, cs_handle, PIPE_SHADER_COMPUTE,
+                                &cs, text);
+   }
+
+   memset(handles, 0, sizeof(handles));
+   handles[PIPE_SHADER_COMPUTE] = cs_handle;
+   virgl_encode_link_shader(&ctx, handles);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_shader_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(stats.compiles, 1);
+   ck_assert_int_eq(stats.links + stats.program_cache_hits, 1);
+   ck_assert_int_eq(stats.programs, 1);
+
+   /* the dispatch must use the precompiled program */
+   virgl_encode_bind_shader(&ctx, cs_handle, PIPE_SHADER_COMPUTE);
+   virgl_encode_launch_grid(&ctx, block, grid);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_shader_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(stats.compiles, 1);
+   ck_assert_int_eq(stats.links + stats.program_cache_hits, 1);
+   ck_assert_int_eq(stats.programs, 1);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* shader statistics count the shaders and programs of the context */
+START_TEST(virgl_test_shader_stats)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_renderer_shader_stats stats;
+   int ctx_handle = 1;
+   uint32_t handles[PIPE_SHADER_TYPES];
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   memset(handles, 0, sizeof(handles));
+   {
+      struct pipe_shader_state vs;
+      const char *text =
+         "VERT\n"
+         "DCL IN[0]\n"
+         "DCL OUT[0], POSITION\n"
+         "  0: MOV OUT[0], IN[0]\n"
+         "  1: END\n";
+      memset(&vs, 0, sizeof(vs));
+      handles[PIPE_SHADER_VERTEX] = ctx_handle++;
+      virgl_encode_shader_state(&ctx, handles[PIPE_SHADER_VERTEX],
+                                PIPE_SHADER_VERTEX, &vs, text);
+   }
+   {
+      struct pipe_shader_state fs;
+      const char *text =
+         "FRAG\n"
+         "DCL OUT[0], COLOR\n"
+         "IMM[0] FLT32 {0.0000, 1.0000, 0.0000, 1.0000}\n"
+         "  0: MOV OUT[0], IMM[0]\n"
+         "  1: END\n";
+      memset(&fs, 0, sizeof(fs));
+      handles[PIPE_SHADER_FRAGMENT] = ctx_handle++;
+      virgl_encode_shader_state(&ctx, handles[PIPE_SHADER_FRAGMENT],
+                                PIPE_SHADER_FRAGMENT, &fs, text);
+   }
+   virgl_encode_link_shader(&ctx, handles);
+
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_shader_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(stats.shaders, 2);
+   ck_assert_int_ge(stats.variants, 2);
+   /* each shader was only compiled for the key of the precompiled program */
+   ck_assert_int_eq(stats.max_variants_per_shader, 1);
+   ck_assert_int_ge(stats.compiles, 2);
+   ck_assert_int_ge(stats.links, 1);
+   ck_assert_int_eq(stats.programs, 1);
+   ck_assert_int_eq(stats.max_programs_per_sub_ctx, 1);
+
+   ret = virgl_renderer_context_get_shader_stats(ctx.ctx_id + 1, &stats);
+   ck_assert_int_eq(ret, EINVAL);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* copy a sub-box between two resources of the same format and compare the
+ * whole destination, with VIRGL_COPY_FALLBACK the copy goes through the
+ * read back fallback instead of a GPU copy */
+static void copy_region_and_check(bool fallback)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_resource res, res2;
+   struct virgl_renderer_copy_stats stats;
+   struct pipe_box box = { 5, 5, 0, 10, 10, 1 };
+   struct virgl_box full = { 0, 0, 0, 50, 50, 1 };
+   const uint32_t dstx = 20, dsty = 15;
+   uint32_t *src, *dst;
+
+   if (fallback)
+      setenv("VIRGL_COPY_FALLBACK", "1", 1);
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   unsetenv("VIRGL_COPY_FALLBACK");
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, 50, 50);
+   ck_assert_int_eq(ret, 0);
+   ret = testvirgl_create_backed_simple_2d_res(&res2, 2, 50, 50);
+   ck_assert_int_eq(ret, 0);
+
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res2.handle);
+
+   src = res.iovs[0].iov_base;
+   dst = res2.iovs[0].iov_base;
+   for (uint32_t i = 0; i < 50 * 50; i++)
+      src[i] = 0xff000000 | ((i / 50) << 8) | (i % 50);
+   memset(dst, 0, res2.iovs[0].iov_len);
+
+   ret = virgl_renderer_transfer_write_iov(res.handle, ctx.ctx_id, 0, 0, 0, &full, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   ret = virgl_renderer_transfer_write_iov(res2.handle, ctx.ctx_id, 0, 0, 0, &full, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   virgl_encode_resource_copy_region(&ctx, &res2, 0, dstx, dsty, 0, &res, 0, &box);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_copy_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   if (fallback) {
+      ck_assert_int_eq(stats.gpu_fallbacks + stats.cpu_fallbacks, 1);
+      ck_assert_int_eq(stats.copy_image + stats.compute + stats.blits, 0);
+   } else {
+      /* a renderable format never needs a fallback */
+      ck_assert_int_eq(stats.copy_image + stats.compute + stats.blits, 1);
+      ck_assert_int_eq(stats.gpu_fallbacks, 0);
+      ck_assert_int_eq(stats.cpu_fallbacks, 0);
+   }
+
+   memset(dst, 0xaa, res2.iovs[0].iov_len);
+   ret = virgl_renderer_transfer_read_iov(res2.handle, ctx.ctx_id, 0, 0, 0, &full, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   /* the X channel of B8G8R8X8 is undefined on readback */
+   for (uint32_t y = 0; y < 50; y++) {
+      for (uint32_t x = 0; x < 50; x++) {
+         uint32_t expected = 0;
+
+         if (x >= dstx && x < dstx + box.width && y >= dsty && y < dsty + box.height)
+            expected = src[(y - dsty + box.y) * 50 + x - dstx + box.x];
+         ck_assert_int_eq(dst[y * 50 + x] & 0x00ffffff, expected & 0x00ffffff);
+      }
+   }
+
+   ret = virgl_renderer_context_get_copy_stats(ctx.ctx_id + 1, &stats);
+   ck_assert_int_eq(ret, EINVAL);
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res2.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_destroy_backed_res(&res2);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+
+START_TEST(virgl_test_copy_stats)
+{
+   copy_region_and_check(false);
+}
+END_TEST
+
+START_TEST(virgl_test_copy_stats_fallback)
+{
+   copy_region_and_check(true);
+}
+END_TEST
+
+/* copy between two formats that can't be copied bit by bit, with
+ * VIRGL_COPY_FALLBACK the blit is skipped, so the copy has to be converted
+ * by the compute shader */
+START_TEST(virgl_test_copy_stats_convert)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_resource res, res2;
+   struct virgl_renderer_resource_create_args args;
+   struct virgl_renderer_copy_stats stats;
+   union virgl_caps caps;
+   uint32_t max_ver, max_size;
+   struct pipe_box box = { 5, 5, 0, 10, 10, 1 };
+   struct virgl_box full = { 0, 0, 0, 50, 50, 1 };
+   const uint32_t dstx = 20, dsty = 15;
+   uint8_t *src;
+   float *dst;
+
+   setenv("VIRGL_COPY_FALLBACK", "1", 1);
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   unsetenv("VIRGL_COPY_FALLBACK");
+   ck_assert_int_eq(ret, 0);
+
+   virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+   virgl_renderer_fill_caps(2, max_ver, &caps);
+   if (!(caps.v2.capability_bits & VIRGL_CAP_COMPUTE_SHADER) ||
+       !caps.v2.max_shader_image_frag_compute) {
+      testvirgl_fini_ctx_cmdbuf(&ctx);
+      return;
+   }
+
+   testvirgl_init_simple_2d_resource(&args, 1);
+   args.format = PIPE_FORMAT_R8G8B8A8_UNORM;
+   ret = virgl_renderer_resource_create(&args, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   res.handle = args.handle;
+   res.iovs = malloc(sizeof(struct iovec));
+   res.iovs[0].iov_len = 50 * 50 * 4;
+   res.iovs[0].iov_base = malloc(res.iovs[0].iov_len);
+   res.niovs = 1;
+   virgl_renderer_resource_attach_iov(res.handle, res.iovs, res.niovs);
+
+   testvirgl_init_simple_2d_resource(&args, 2);
+   args.format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   ret = virgl_renderer_resource_create(&args, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   res2.handle = args.handle;
+   res2.iovs = malloc(sizeof(struct iovec));
+   res2.iovs[0].iov_len = 50 * 50 * 16;
+   res2.iovs[0].iov_base = malloc(res2.iovs[0].iov_len);
+   res2.niovs = 1;
+   virgl_renderer_resource_attach_iov(res2.handle, res2.iovs, res2.niovs);
+
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res2.handle);
+
+   src = res.iovs[0].iov_base;
+   dst = res2.iovs[0].iov_base;
+   for (uint32_t i = 0; i < 50 * 50 * 4; i++)
+      src[i] = i * 7;
+   memset(dst, 0, res2.iovs[0].iov_len);
+
+   ret = virgl_renderer_transfer_write_iov(res.handle, ctx.ctx_id, 0, 0, 0, &full, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   ret = virgl_renderer_transfer_write_iov(res2.handle, ctx.ctx_id, 0, 0, 0, &full, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   virgl_encode_resource_copy_region(&ctx, &res2, 0, dstx, dsty, 0, &res, 0, &box);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_copy_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(stats.compute, 1);
+   ck_assert_int_eq(stats.copy_image + stats.blits, 0);
+   ck_assert_int_eq(stats.gpu_fallbacks + stats.cpu_fallbacks, 0);
+
+   memset(dst, 0xaa, res2.iovs[0].iov_len);
+   ret = virgl_renderer_transfer_read_iov(res2.handle, ctx.ctx_id, 0, 0, 0, &full, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   /* unorm bytes are stored as floats in [0, 1] */
+   for (uint32_t y = 0; y < 50; y++) {
+      for (uint32_t x = 0; x < 50; x++) {
+         for (uint32_t c = 0; c < 4; c++) {
+            uint32_t expected = 0;
+            float value = dst[(y * 50 + x) * 4 + c];
+
+            if (x >= dstx && x < dstx + box.width && y >= dsty && y < dsty + box.height)
+               expected = src[((y - dsty + box.y) * 50 + x - dstx + box.x) * 4 + c];
+            ck_assert(value >= 0.0f && value <= 1.0f);
+            ck_assert_int_eq((uint32_t)(value * 255.0f + 0.5f), expected);
+         }
+      }
+   }
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res2.handle);
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_destroy_backed_res(&res2);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+static void encode_simple_program(struct virgl_context *ctx, int vs_handle, int fs_handle)
+{
+   struct pipe_shader_state vs, fs;
+   uint32_t handles[PIPE_SHADER_TYPES];
+   const char *vs_text =
+      "VERT\n"
+      "DCL IN[0]\n"
+      "DCL OUT[0], POSITION\n"
+      "  0: MOV OUT[0], IN[0]\n"
+      "  1: END\n";
+   const char *fs_text =
+      "FRAG\n"
+      "DCL OUT[0], COLOR\n"
+      "IMM[0] FLT32 {0.0000, 1.0000, 0.0000, 1.0000}\n"
+      "  0: MOV OUT[0], IMM[0]\n"
+      "  1: END\n";
+
+   memset(&vs, 0, sizeof(vs));
+   memset(&fs, 0, sizeof(fs));
+   virgl_encode_shader_state(ctx, vs_handle, PIPE_SHADER_VERTEX, &vs, vs_text);
+   virgl_encode_shader_state(ctx, fs_handle, PIPE_SHADER_FRAGMENT, &fs, fs_text);
+
+   memset(handles, 0, sizeof(handles));
+   handles[PIPE_SHADER_VERTEX] = vs_handle;
+   handles[PIPE_SHADER_FRAGMENT] = fs_handle;
+   virgl_encode_link_shader(ctx, handles);
+}
+
+/* with VIRGL_CMD_STATS set each command of the context is timed */
+START_TEST(virgl_test_decode_stats)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_renderer_decode_stats stats;
+   struct virgl_renderer_cmd_stats cmds[VIRGL_MAX_COMMANDS];
+   uint32_t num_cmds = VIRGL_MAX_COMMANDS;
+   uint32_t bytes;
+
+   setenv("VIRGL_CMD_STATS", "1", 1);
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   unsetenv("VIRGL_CMD_STATS");
+   ck_assert_int_eq(ret, 0);
+
+   encode_simple_program(&ctx, 1, 2);
+   bytes = ctx.cbuf->cdw * 4;
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_decode_stats(ctx.ctx_id, &stats, cmds, &num_cmds);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(num_cmds, VIRGL_MAX_COMMANDS);
+   ck_assert_int_eq(stats.submits, 1);
+   ck_assert_int_eq(stats.bytes, bytes);
+   ck_assert_int_eq(stats.commands, 3);
+   ck_assert_int_eq(cmds[VIRGL_CCMD_CREATE_OBJECT].count, 2);
+   ck_assert_int_eq(cmds[VIRGL_CCMD_LINK_SHADER].count, 1);
+   ck_assert_int_gt(cmds[VIRGL_CCMD_LINK_SHADER].total_ns, 0);
+   ck_assert_int_le(cmds[VIRGL_CCMD_CREATE_OBJECT].p50_ns,
+                    cmds[VIRGL_CCMD_CREATE_OBJECT].p99_ns);
+   ck_assert_int_eq(cmds[VIRGL_CCMD_NOP].count, 0);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+
+   /* contexts created without the variable don't collect statistics */
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+   ret = virgl_renderer_context_get_decode_stats(ctx.ctx_id, &stats, NULL, NULL);
+   ck_assert_int_eq(ret, EINVAL);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+START_TEST(virgl_test_renderer_stats)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct virgl_renderer_stats stats;
+   struct virgl_renderer_context_stats ctx_stats[2];
+   uint32_t num_ctxs = ARRAY_SIZE(ctx_stats);
+   uint32_t bytes;
+   char path[] = "/tmp/virgl-stats-XXXXXX";
+   char text[16384], line[128];
+   ssize_t len;
+   int fd;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, 50, 50);
+   ck_assert_int_eq(ret, 0);
+
+   encode_simple_program(&ctx, 1, 2);
+   bytes = ctx.cbuf->cdw * 4;
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_get_stats(&stats, ctx_stats, &num_ctxs);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(num_ctxs, 1);
+   ck_assert_int_eq(stats.contexts, 1);
+   ck_assert_int_eq(stats.resources[VIRGL_RENDERER_STORAGE_HOST].count, 1);
+   ck_assert_int_eq(stats.resources[VIRGL_RENDERER_STORAGE_HOST].bytes, 50 * 50 * 4);
+   ck_assert_int_eq(stats.resources[VIRGL_RENDERER_STORAGE_DMABUF].count, 0);
+
+   ck_assert_int_eq(ctx_stats[0].ctx_id, ctx.ctx_id);
+   ck_assert_int_eq(ctx_stats[0].capset_id, VIRGL_RENDERER_CAPSET_VIRGL2);
+   ck_assert_int_eq(ctx_stats[0].submits, 1);
+   ck_assert_int_eq(ctx_stats[0].submit_bytes, bytes);
+   ck_assert_int_eq(ctx_stats[0].cache_hits + ctx_stats[0].cache_misses, 1);
+   ck_assert_int_eq(ctx_stats[0].fences_submitted, 0);
+
+   fd = mkstemp(path);
+   ck_assert_int_ge(fd, 0);
+   unlink(path);
+   ret = virgl_renderer_write_stats(fd);
+   ck_assert_int_eq(ret, 0);
+   len = pread(fd, text, sizeof(text) - 1, 0);
+   close(fd);
+   ck_assert_int_gt(len, 0);
+   text[len] = '\0';
+
+   ck_assert_ptr_nonnull(strstr(text, "# TYPE virgl_context_submits_total counter\n"));
+   snprintf(line, sizeof(line), "\nvirgl_context_submits_total{ctx=\"%d\",capset=\"virgl2\"} 1\n",
+            ctx.ctx_id);
+   ck_assert_ptr_nonnull(strstr(text, line));
+   ck_assert_ptr_nonnull(strstr(text, "\nvirgl_resources{storage=\"host\"} 1\n"));
+
+   testvirgl_destroy_backed_res(&res);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
+/* the GPU time of a command buffer is read back when the next one starts */
+START_TEST(virgl_test_gpu_time)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_renderer_context_stats ctx_stats;
+   uint32_t num_ctxs = 1;
+   union virgl_caps caps;
+   uint32_t max_ver, max_size;
+
+   setenv("VIRGL_GPU_TIME", "1", 1);
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   unsetenv("VIRGL_GPU_TIME");
+   ck_assert_int_eq(ret, 0);
 
-        vp.scale[0] = half_w;
-        vp.scale[1] = half_h;
-        vp.scale[2] = half_d;
+   virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+   virgl_renderer_fill_caps(2, max_ver, &caps);
+   if (!caps.v1.bset.timer_query) {
+      testvirgl_fini_ctx_cmdbuf(&ctx);
+      return;
+   }
 
-        vp.translate[0] = half_w + 0;
-        vp.translate[1] = half_h + 0;
-        vp.translate[2] = half_d + znear;
-        virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
-    }
+   encode_simple_program(&ctx, 1, 2);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
 
-    /* draw */
-    {
-        struct pipe_draw_info info;
-        memset(&info, 0, sizeof(info));
-        info.count = 3;
-        info.mode = PIPE_PRIM_TRIANGLES;
-        virgl_encoder_draw_vbo(&ctx, &info);
-    }
+   testvirgl_reset_fence();
+   ret = virgl_renderer_create_fence(1, ctx.ctx_id);
+   ck_assert_int_eq(ret, 0);
+   while (testvirgl_get_last_fence() < 1) {
+      virgl_renderer_poll();
+      nanosleep((struct timespec[]){{0, 50000}}, NULL);
+   }
 
-    testvirgl_ctx_send_cmdbuf(&ctx);
+   ret = virgl_renderer_get_stats(NULL, &ctx_stats, &num_ctxs);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(ctx_stats.gpu_timed_submits, 0);
+   ck_assert_int_eq(ctx_stats.gpu_time_ns, 0);
 
-    /* create a fence */
-    testvirgl_reset_fence();
-    ret = virgl_renderer_create_fence(1, ctx.ctx_id);
-    ck_assert_int_eq(ret, 0);
+   /* the fence passed, so the timestamps of the first command buffer are
+    * available; a short one may still take 0ns */
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
 
-    do {
-        int fence;
+   ret = virgl_renderer_get_stats(NULL, &ctx_stats, &num_ctxs);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_ge(ctx_stats.gpu_timed_submits, 1);
+   ck_assert_int_eq(ctx_stats.draw_gpu_time_ns, 0);
 
-        virgl_renderer_poll();
-        fence = testvirgl_get_last_fence();
-        if (fence >= 1)
-            break;
-        nanosleep((struct timespec[]){{0, 50000}}, NULL);
-    } while(1);
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
 
-    /* read back the tri values in the resource */
-    box.x = 0;
-    box.y = 0;
-    box.z = 0;
-    box.w = tw;
-    box.h = th;
-    box.d = 1;
-    ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 0, 0, &box, 0, NULL, 0);
-    ck_assert_int_eq(ret, 0);
+/* link the same program in two contexts, the second one must use the
+ * binary of the first one instead of linking when the driver supports
+ * program binaries */
+START_TEST(virgl_test_shared_program_binary)
+{
+   int ret;
+   struct virgl_context ctx;
+   struct virgl_renderer_shader_stats stats;
 
-    {
-        int w, h;
-        bool all_cleared = true;
-        uint32_t *ptr = res.iovs[0].iov_base;
-        for (h = 0; h < th; h++) {
-            for (w = 0; w < tw; w++) {
-                if (ptr[h * tw + w] != test_green)
-                    all_cleared = false;
-            }
-        }
-        ck_assert_int_eq(all_cleared, false);
-    }
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
 
-    /* cleanup */
-    virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+   encode_simple_program(&ctx, 1, 2);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
 
-    testvirgl_destroy_backed_res(&xfb);
-    testvirgl_destroy_backed_res(&vbo);
-    testvirgl_destroy_backed_res(&res);
+   ret = virgl_renderer_context_get_shader_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(stats.links, 1);
+   ck_assert_int_eq(stats.program_cache_hits, 0);
+   if (!stats.program_binaries_stored) {
+      testvirgl_fini_ctx_cmdbuf(&ctx);
+      return;
+   }
 
-    testvirgl_fini_ctx_cmdbuf(&ctx);
+   ret = virgl_renderer_context_create(2, strlen("test2"), "test2");
+   ck_assert_int_eq(ret, 0);
+   ctx.ctx_id = 2;
+
+   /* different handles, same shaders */
+   encode_simple_program(&ctx, 10, 11);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_get_shader_stats(ctx.ctx_id, &stats);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(stats.programs, 1);
+   ck_assert_int_ge(stats.program_cache_hits, 1);
+   ck_assert_int_eq(stats.links, 0);
+
+   virgl_renderer_context_destroy(2);
+   ctx.ctx_id = 1;
+   testvirgl_fini_ctx_cmdbuf(&ctx);
 }
 END_TEST
 
-/* send a large shader across */
-START_TEST(virgl_test_large_shader)
+/* identical sampler states in two contexts share one GL sampler object,
+ * deleting one of them must leave the others usable */
+START_TEST(virgl_test_shared_sampler_state)
 {
    int ret;
    struct virgl_context ctx;
-   int ctx_handle = 1;
-   int fs_handle;
+   struct pipe_sampler_state state;
+   struct virgl_renderer_context_stats ctx_stats[2];
+   uint32_t num_ctxs = 2;
+   uint32_t handles[1];
+
    ret = testvirgl_init_ctx_cmdbuf(&ctx);
    ck_assert_int_eq(ret, 0);
 
-   /* create large fragment shader */
-   {
-      struct pipe_shader_state fs;
-      const char *text = large_frag;
+   memset(&state, 0, sizeof(state));
+   state.wrap_s = PIPE_TEX_WRAP_CLAMP_TO_EDGE;
+   state.wrap_t = PIPE_TEX_WRAP_CLAMP_TO_EDGE;
+   state.min_img_filter = PIPE_TEX_FILTER_LINEAR;
+   state.mag_img_filter = PIPE_TEX_FILTER_LINEAR;
+   state.max_lod = 1000.0f;
 
-      memset(&fs, 0, sizeof(fs));
-      fs_handle = ctx_handle++;
-      virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT,
-                                &fs, text);
+   virgl_encode_sampler_state(&ctx, 1, &state);
+   virgl_encode_sampler_state(&ctx, 2, &state);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
 
-      virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+   ret = virgl_renderer_context_create(2, strlen("test2"), "test2");
+   ck_assert_int_eq(ret, 0);
+   ctx.ctx_id = 2;
+
+   virgl_encode_sampler_state(&ctx, 1, &state);
+   handles[0] = 1;
+   virgl_encode_bind_sampler_states(&ctx, PIPE_SHADER_FRAGMENT, 0, 1, handles);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   /* every sampler object of the new state was already created by ctx 1 */
+   ret = virgl_renderer_get_stats(NULL, ctx_stats, &num_ctxs);
+   ck_assert_int_eq(ret, 0);
+   ck_assert_int_eq(num_ctxs, 2);
+   for (uint32_t i = 0; i < num_ctxs; i++) {
+      if (ctx_stats[i].ctx_id != 2)
+         continue;
+      ck_assert_int_gt(ctx_stats[i].cache_hits, 0);
+      ck_assert_int_eq(ctx_stats[i].cache_misses, 0);
    }
 
+   virgl_renderer_context_destroy(2);
+   ctx.ctx_id = 1;
+
+   virgl_encode_delete_object(&ctx, 1, VIRGL_OBJECT_SAMPLER_STATE);
+   handles[0] = 2;
+   virgl_encode_bind_sampler_states(&ctx, PIPE_SHADER_FRAGMENT, 0, 1, handles);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
    testvirgl_fini_ctx_cmdbuf(&ctx);
 }
 END_TEST
@@ -1636,6 +3050,71 @@ START_TEST(virgl_test_clear_texture)
 }
 END_TEST
 
+/* more queries than fit in one block of pooled names, created twice so the
+ * second round runs on recycled names */
+#define TEST_NUM_QUERIES 40
+
+START_TEST(virgl_test_query_reuse)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res[TEST_NUM_QUERIES];
+   struct virgl_host_query_state *state;
+   int ret;
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   for (int i = 0; i < TEST_NUM_QUERIES; i++) {
+      ret = testvirgl_create_backed_simple_buffer(&res[i], 100 + i, sizeof(*state),
+                                                  VIRGL_BIND_CUSTOM);
+      ck_assert_int_eq(ret, 0);
+      virgl_renderer_ctx_attach_resource(ctx.ctx_id, res[i].handle);
+   }
+
+   for (int round = 0; round < 2; round++) {
+      int done;
+
+      for (int i = 0; i < TEST_NUM_QUERIES; i++) {
+         memset(res[i].iovs[0].iov_base, 0, sizeof(*state));
+         virgl_encoder_create_query(&ctx, i + 1, PIPE_QUERY_OCCLUSION_COUNTER, &res[i], 0);
+         virgl_encoder_begin_query(&ctx, i + 1);
+         virgl_encoder_end_query(&ctx, i + 1);
+         virgl_encoder_get_query_result(&ctx, i + 1, false);
+      }
+      ret = testvirgl_ctx_send_cmdbuf(&ctx);
+      ck_assert_int_eq(ret, 0);
+
+      do {
+         virgl_renderer_poll();
+         done = 0;
+         for (int i = 0; i < TEST_NUM_QUERIES; i++) {
+            state = res[i].iovs[0].iov_base;
+            if (state->query_state == VIRGL_QUERY_STATE_DONE)
+               done++;
+         }
+         if (done == TEST_NUM_QUERIES)
+            break;
+         nanosleep((struct timespec[]){{0, 50000}}, NULL);
+      } while (1);
+
+      for (int i = 0; i < TEST_NUM_QUERIES; i++) {
+         state = res[i].iovs[0].iov_base;
+         ck_assert_int_eq(state->result, 0);
+         virgl_encode_delete_object(&ctx, i + 1, VIRGL_OBJECT_QUERY);
+      }
+      ret = testvirgl_ctx_send_cmdbuf(&ctx);
+      ck_assert_int_eq(ret, 0);
+   }
+
+   for (int i = 0; i < TEST_NUM_QUERIES; i++) {
+      virgl_renderer_ctx_detach_resource(ctx.ctx_id, res[i].handle);
+      testvirgl_destroy_backed_res(&res[i]);
+   }
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 static void test_draw_vbo_unified(uint32_t indirect_handle, uint32_t indirect_draw_count_handle, int expected_error)
 {
    struct virgl_context ctx;
@@ -1889,6 +3368,245 @@ START_TEST(virgl_test_draw_vbo_fail_not_recoverable)
 }
 END_TEST
 
+/* clear to green, then draw over the center with two indirect commands of
+ * which the count buffer enables the first count, the first command draws a
+ * red triangle and the second a blue one on top of it */
+static void draw_indirect_count_and_check(struct virgl_context *ctx,
+                                          struct virgl_resource *res,
+                                          struct virgl_resource *cmds,
+                                          struct virgl_resource *count_buf,
+                                          int tw, int th, uint32_t count)
+{
+   struct pipe_draw_info info;
+   union pipe_color_union green;
+   struct virgl_box box;
+   int ret;
+
+   green.f[0] = 0.0;
+   green.f[1] = 1.0;
+   green.f[2] = 0.0;
+   green.f[3] = 1.0;
+   virgl_encode_clear(ctx, PIPE_CLEAR_COLOR0, &green, 0.0, 0);
+
+   box.x = 0;
+   box.y = 0;
+   box.z = 0;
+   box.w = sizeof(count);
+   box.h = 1;
+   box.d = 1;
+   virgl_encoder_inline_write(ctx, count_buf, 0, 0, (struct pipe_box *)&box,
+                              &count, box.w, 0);
+
+   memset(&info, 0, sizeof(info));
+   info.mode = PIPE_PRIM_TRIANGLES;
+   info.indirect.offset = 0;
+   info.indirect.stride = 4 * sizeof(uint32_t);
+   info.indirect.draw_count = 2;
+   info.indirect.indirect_draw_count_offset = 0;
+   virgl_encoder_draw_vbo_indirect(ctx, &info, cmds->handle, count_buf->handle);
+   ret = testvirgl_ctx_send_cmdbuf(ctx);
+   ck_assert_int_eq(ret, 0);
+
+   if (count >= 2)
+      check_center(ctx, res, tw, th, 0xff, 0x00, 0x00);
+   else if (count)
+      check_center(ctx, res, tw, th, 0x00, 0x00, 0xff);
+   else
+      check_center(ctx, res, tw, th, 0x00, 0xff, 0x00);
+}
+
+/* with VIRGL_INDIRECT_FIXUP the draw count buffer goes through the compute
+ * shader that zeroes the instance count of the commands past the count */
+START_TEST(virgl_test_draw_vbo_indirect_count_fixup)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res, vbo, cmds, count_buf;
+   struct virgl_surface surf;
+   struct pipe_framebuffer_state fb_state;
+   struct pipe_vertex_element ve[2];
+   struct pipe_vertex_buffer vbuf;
+   struct vertex mesh[6];
+   union virgl_caps caps;
+   uint32_t max_ver, max_size;
+   /* count, instance count, first, base instance */
+   uint32_t commands[2][4] = { { 3, 1, 0, 0 }, { 3, 1, 3, 0 } };
+   int ctx_handle = 1;
+   struct virgl_box box;
+   int ret;
+   int tw = 32, th = 32;
+
+   setenv("VIRGL_INDIRECT_FIXUP", "1", 1);
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   unsetenv("VIRGL_INDIRECT_FIXUP");
+   ck_assert_int_eq(ret, 0);
+
+   virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+   virgl_renderer_fill_caps(2, max_ver, &caps);
+   if (!(caps.v2.capability_bits & VIRGL_CAP_INDIRECT_PARAMS)) {
+      testvirgl_fini_ctx_cmdbuf(&ctx);
+      return;
+   }
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+   memset(&surf, 0, sizeof(surf));
+   surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+   surf.handle = ctx_handle++;
+   surf.base.texture = &res.base;
+   virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+   memset(&fb_state, 0, sizeof(fb_state));
+   fb_state.nr_cbufs = 1;
+   fb_state.cbufs[0] = &surf.base;
+   virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+   memset(ve, 0, sizeof(ve));
+   ve[0].src_offset = Offset(struct vertex, position);
+   ve[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   ve[1].src_offset = Offset(struct vertex, color);
+   ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   {
+      int ve_handle = ctx_handle++;
+      virgl_encoder_create_vertex_elements(&ctx, ve_handle, 2, ve);
+      virgl_encode_bind_object(&ctx, ve_handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+   }
+
+   /* the same triangle twice, red for the first command and blue for the second */
+   for (int v = 0; v < 6; v++) {
+      memcpy(mesh[v].position, vertices[v % 3].position, sizeof(mesh[v].position));
+      mesh[v].color[0] = v < 3 ? 1.0f : 0.0f;
+      mesh[v].color[1] = 0.0f;
+      mesh[v].color[2] = v < 3 ? 0.0f : 1.0f;
+      mesh[v].color[3] = 1.0f;
+   }
+
+   ret = testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(mesh), PIPE_BIND_VERTEX_BUFFER);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbo.handle);
+
+   box.x = 0;
+   box.y = 0;
+   box.z = 0;
+   box.w = sizeof(mesh);
+   box.h = 1;
+   box.d = 1;
+   virgl_encoder_inline_write(&ctx, &vbo, 0, 0, (struct pipe_box *)&box, mesh, box.w, 0);
+
+   vbuf.stride = sizeof(struct vertex);
+   vbuf.buffer_offset = 0;
+   vbuf.buffer = &vbo.base;
+   virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
+
+   ret = testvirgl_create_backed_simple_buffer(&cmds, 3, sizeof(commands), VIRGL_BIND_COMMAND_ARGS);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, cmds.handle);
+   box.w = sizeof(commands);
+   virgl_encoder_inline_write(&ctx, &cmds, 0, 0, (struct pipe_box *)&box, commands, box.w, 0);
+
+   ret = testvirgl_create_backed_simple_buffer(&count_buf, 4, sizeof(uint32_t), VIRGL_BIND_COMMAND_ARGS);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, count_buf.handle);
+
+   {
+      struct pipe_shader_state vs;
+      const char *text =
+         "VERT\n"
+         "DCL IN[0]\n"
+         "DCL IN[1]\n"
+         "DCL OUT[0], POSITION\n"
+         "DCL OUT[1], COLOR\n"
+         "  0: MOV OUT[1], IN[1]\n"
+         "  1: MOV OUT[0], IN[0]\n"
+         "  2: END\n";
+      int vs_handle = ctx_handle++;
+      memset(&vs, 0, sizeof(vs));
+      virgl_encode_shader_state(&ctx, vs_handle, PIPE_SHADER_VERTEX, &vs, text);
+      virgl_encode_bind_shader(&ctx, vs_handle, PIPE_SHADER_VERTEX);
+   }
+
+   {
+      struct pipe_shader_state fs;
+      const char *text =
+         "FRAG\n"
+         "DCL IN[0], COLOR, LINEAR\n"
+         "DCL OUT[0], COLOR\n"
+         "  0: MOV OUT[0], IN[0]\n"
+         "  1: END\n";
+      int fs_handle = ctx_handle++;
+      memset(&fs, 0, sizeof(fs));
+      virgl_encode_shader_state(&ctx, fs_handle, PIPE_SHADER_FRAGMENT, &fs, text);
+      virgl_encode_bind_shader(&ctx, fs_handle, PIPE_SHADER_FRAGMENT);
+   }
+
+   {
+      struct pipe_blend_state blend;
+      int blend_handle = ctx_handle++;
+      memset(&blend, 0, sizeof(blend));
+      blend.rt[0].colormask = PIPE_MASK_RGBA;
+      virgl_encode_blend_state(&ctx, blend_handle, &blend);
+      virgl_encode_bind_object(&ctx, blend_handle, VIRGL_OBJECT_BLEND);
+   }
+
+   {
+      struct pipe_rasterizer_state rasterizer;
+      int rs_handle = ctx_handle++;
+      memset(&rasterizer, 0, sizeof(rasterizer));
+      rasterizer.cull_face = PIPE_FACE_NONE;
+      rasterizer.half_pixel_center = 1;
+      rasterizer.bottom_edge_rule = 1;
+      rasterizer.depth_clip = 1;
+      virgl_encode_rasterizer_state(&ctx, rs_handle, &rasterizer);
+      virgl_encode_bind_object(&ctx, rs_handle, VIRGL_OBJECT_RASTERIZER);
+   }
+
+   {
+      struct pipe_viewport_state vp;
+
+      vp.scale[0] = tw / 2.0f;
+      vp.scale[1] = th / 2.0f;
+      vp.scale[2] = 0.5f;
+      vp.translate[0] = tw / 2.0f;
+      vp.translate[1] = th / 2.0f;
+      vp.translate[2] = 0.5f;
+      virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
+   }
+
+   /* no command enabled, then the first one, then both, then a count past
+    * the end that is clamped to both */
+   draw_indirect_count_and_check(&ctx, &res, &cmds, &count_buf, tw, th, 0);
+   draw_indirect_count_and_check(&ctx, &res, &cmds, &count_buf, tw, th, 1);
+   draw_indirect_count_and_check(&ctx, &res, &cmds, &count_buf, tw, th, 2);
+   draw_indirect_count_and_check(&ctx, &res, &cmds, &count_buf, tw, th, 5);
+
+   /* a third command would be read past the end of the command buffer */
+   {
+      struct pipe_draw_info info;
+
+      memset(&info, 0, sizeof(info));
+      info.mode = PIPE_PRIM_TRIANGLES;
+      info.indirect.stride = 4 * sizeof(uint32_t);
+      info.indirect.draw_count = 3;
+      virgl_encoder_draw_vbo_indirect(&ctx, &info, cmds.handle, count_buf.handle);
+      ret = testvirgl_ctx_send_cmdbuf(&ctx);
+      ck_assert_int_eq(ret, EINVAL);
+   }
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, count_buf.handle);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, cmds.handle);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, vbo.handle);
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+   testvirgl_destroy_backed_res(&count_buf);
+   testvirgl_destroy_backed_res(&cmds);
+   testvirgl_destroy_backed_res(&vbo);
+   testvirgl_destroy_backed_res(&res);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 static Suite *virgl_init_suite(void)
 {
   Suite *s;
@@ -1897,10 +3615,25 @@ static Suite *virgl_init_suite(void)
   s = suite_create("virgl_clear");
   tc_core = tcase_create("clear");
   tcase_add_test(tc_core, virgl_test_clear);
+  tcase_add_test(tc_core, virgl_test_threaded_clear);
+  tcase_add_test(tc_core, virgl_test_framebuffer_switch);
   tcase_add_test(tc_core, virgl_test_blit_simple);
   tcase_add_test(tc_core, virgl_test_overlap_obj_id);
   tcase_add_test(tc_core, virgl_test_large_shader);
+  tcase_add_test(tc_core, virgl_test_link_compute_shader);
+  tcase_add_test(tc_core, virgl_test_shader_stats);
+  tcase_add_test(tc_core, virgl_test_shared_program_binary);
+  tcase_add_test(tc_core, virgl_test_shared_sampler_state);
+  tcase_add_test(tc_core, virgl_test_copy_stats);
+  tcase_add_test(tc_core, virgl_test_copy_stats_fallback);
+  tcase_add_test(tc_core, virgl_test_copy_stats_convert);
+  tcase_add_test(tc_core, virgl_test_decode_stats);
+  tcase_add_test(tc_core, virgl_test_renderer_stats);
+  tcase_add_test(tc_core, virgl_test_gpu_time);
   tcase_add_test(tc_core, virgl_test_render_simple);
+  tcase_add_test(tc_core, virgl_test_render_constants);
+  tcase_add_test(tc_core, virgl_test_render_vertex_array_switch);
+  tcase_add_test(tc_core, virgl_test_render_samplers_partly_dirty);
   tcase_add_test(tc_core, virgl_test_render_geom_simple);
   tcase_add_test(tc_core, virgl_test_render_xfb);
   tcase_add_test(tc_core, virgl_test_set_viewport_state);
@@ -1918,9 +3651,11 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_test_create_shader_pass);
   tcase_add_test(tc_core, virgl_test_create_shader_fail);
   tcase_add_test(tc_core, virgl_test_clear_texture);
+  tcase_add_test(tc_core, virgl_test_query_reuse);
   tcase_add_test(tc_core, virgl_test_draw_vbo_pass);
   tcase_add_test(tc_core, virgl_test_draw_vbo_fail_indirect_missing_handle);
   tcase_add_test(tc_core, virgl_test_draw_vbo_fail_not_recoverable);
+  tcase_add_test(tc_core, virgl_test_draw_vbo_indirect_count_fixup);
   tcase_add_test(tc_core, virgl_test_bind_images_shader_pass);
   tcase_add_test(tc_core, virgl_test_bind_images_shader_fail_layers);
 
@@ -31,7 +31,10 @@
 
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <virglrenderer.h>
 #ifdef ENABLE_GBM
 #include <gbm.h>
@@ -564,6 +567,152 @@ START_TEST(virgl_init_egl_create_ctx_create_attach_res_illegal_res)
 }
 END_TEST
 
+/* a second init on the same driver takes the probed formats and caps from
+ * the cache file without probing and has to report the same caps as the
+ * first one */
+START_TEST(virgl_init_format_cache)
+{
+  int ret, fd;
+  uint32_t max_ver, max_size;
+  void *caps[2];
+  char path[] = "/tmp/virgl-format-cache-XXXXXX";
+  struct virgl_renderer_stats stats;
+  struct stat st;
+
+  fd = mkstemp(path);
+  ck_assert_int_ge(fd, 0);
+  close(fd);
+  unlink(path);
+  setenv("VIRGL_FORMAT_CACHE", path, 1);
+
+  test_cbs.version = 1;
+  for (int i = 0; i < 2; i++) {
+    ret = virgl_renderer_init(&mystruct, context_flags, &test_cbs);
+    ck_assert_int_eq(ret, 0);
+
+    virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+    ck_assert_int_ne(max_size, 0);
+    caps[i] = calloc(1, max_size);
+    virgl_renderer_fill_caps(2, max_ver, caps[i]);
+
+    ret = virgl_renderer_get_stats(&stats, NULL, NULL);
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(stats.format_probes, i ? 0 : 1);
+
+    virgl_renderer_cleanup(&mystruct);
+    ck_assert_int_eq(stat(path, &st), 0);
+  }
+
+  ck_assert_int_eq(memcmp(caps[0], caps[1], max_size), 0);
+
+  free(caps[0]);
+  free(caps[1]);
+  unlink(path);
+  unsetenv("VIRGL_FORMAT_CACHE");
+}
+END_TEST
+
+/* the startup profile lists the phases of init, and the first caps query
+ * only */
+START_TEST(virgl_init_phases)
+{
+  int ret;
+  uint32_t max_ver, max_size, num_phases, num_init_phases;
+  struct virgl_renderer_init_phase phases[16];
+  bool found_vrend = false;
+  void *caps;
+
+  test_cbs.version = 1;
+  ret = virgl_renderer_init(&mystruct, context_flags, &test_cbs);
+  ck_assert_int_eq(ret, 0);
+
+  ret = virgl_renderer_get_init_phases(NULL, NULL);
+  ck_assert_int_eq(ret, EINVAL);
+
+  num_init_phases = 0;
+  ret = virgl_renderer_get_init_phases(NULL, &num_init_phases);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_int_ge(num_init_phases, 1);
+  ck_assert_int_lt(num_init_phases, 16);
+
+  num_phases = 16;
+  ret = virgl_renderer_get_init_phases(phases, &num_phases);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_int_eq(num_phases, num_init_phases);
+  for (uint32_t i = 0; i < num_phases; i++) {
+    ck_assert_ptr_nonnull(phases[i].name);
+    if (!strcmp(phases[i].name, "vrend"))
+      found_vrend = true;
+  }
+  ck_assert(found_vrend);
+
+  virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+  caps = calloc(1, max_size);
+  for (int i = 0; i < 2; i++) {
+    virgl_renderer_fill_caps(2, max_ver, caps);
+
+    num_phases = 16;
+    ret = virgl_renderer_get_init_phases(phases, &num_phases);
+    ck_assert_int_eq(ret, 0);
+    ck_assert_int_eq(num_phases, num_init_phases + 1);
+    ck_assert_str_eq(phases[num_init_phases].name, "caps");
+  }
+  free(caps);
+
+  virgl_renderer_cleanup(&mystruct);
+
+  ret = virgl_renderer_get_init_phases(NULL, &num_phases);
+  ck_assert_int_eq(ret, 0);
+  ck_assert_int_eq(num_phases, 0);
+}
+END_TEST
+
+static uint32_t lazy_last_fence;
+
+static void lazy_write_fence(UNUSED void *cookie, uint32_t fence)
+{
+  lazy_last_fence = fence;
+}
+
+/* with a deferred virgl init, ctx0 fences retire without a GL context and
+ * the first virgl context brings the renderer up */
+START_TEST(virgl_init_lazy)
+{
+  int ret;
+  uint32_t max_ver, max_size;
+  void *caps;
+
+  test_cbs.version = 1;
+  test_cbs.write_fence = lazy_write_fence;
+  ret = virgl_renderer_init(&mystruct,
+                            (context_flags & ~VIRGL_RENDERER_THREAD_SYNC) |
+                            VIRGL_RENDERER_LAZY_VIRGL_INIT, &test_cbs);
+  ck_assert_int_eq(ret, 0);
+
+  lazy_last_fence = 0;
+  ret = virgl_renderer_create_fence(5, 0);
+  ck_assert_int_eq(ret, 0);
+  virgl_renderer_poll();
+  ck_assert_int_eq(lazy_last_fence, 5);
+
+  ret = virgl_renderer_context_create(1, strlen("test1"), "test1");
+  ck_assert_int_eq(ret, 0);
+
+  virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+  caps = calloc(1, max_size);
+  virgl_renderer_fill_caps(2, max_ver, caps);
+  ck_assert_int_ne(((union virgl_caps *)caps)->max_version, 0);
+  free(caps);
+
+  ret = virgl_renderer_create_fence(6, 0);
+  ck_assert_int_eq(ret, 0);
+
+  virgl_renderer_context_destroy(1);
+  virgl_renderer_cleanup(&mystruct);
+  test_cbs.write_fence = NULL;
+}
+END_TEST
+
 static Suite *virgl_init_suite(void)
 {
   Suite *s;
@@ -588,6 +737,9 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_init_get_caps_set0);
   tcase_add_test(tc_core, virgl_init_get_caps_set1);
   tcase_add_test(tc_core, virgl_init_get_caps_null);
+  tcase_add_test(tc_core, virgl_init_format_cache);
+  tcase_add_test(tc_core, virgl_init_phases);
+  tcase_add_test(tc_core, virgl_init_lazy);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_attach_res_illegal_res);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_bind_res_leak);
 
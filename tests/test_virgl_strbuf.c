@@ -199,6 +199,61 @@ START_TEST(strbuf_test_fixed_string)
 }
 END_TEST
 
+START_TEST(strbuf_test_append_int)
+{
+   struct vrend_strbuf sb;
+   bool ret;
+   ret = strbuf_alloc(&sb, 4);
+   ck_assert_int_eq(ret, true);
+   strbuf_append_uint(&sb, 0);
+   strbuf_append_char(&sb, ',');
+   strbuf_append_uint(&sb, UINT32_MAX);
+   strbuf_append_char(&sb, ',');
+   strbuf_append_int(&sb, -42);
+   strbuf_append_char(&sb, ',');
+   strbuf_append_int(&sb, INT32_MIN);
+   ck_assert_int_eq(strbuf_get_error(&sb), false);
+   ck_assert_str_eq(sb.buf, "0,4294967295,-42,-2147483648");
+   ck_assert_int_eq(strbuf_get_len(&sb), strlen(sb.buf));
+   strbuf_free(&sb);
+}
+END_TEST
+
+START_TEST(strbuf_test_geometric_growth)
+{
+   struct vrend_strbuf sb;
+   bool ret;
+   char str[1025];
+   ret = strbuf_alloc(&sb, 1024);
+   ck_assert_int_eq(ret, true);
+
+   for (int i = 0; i < 1024; i++)
+      str[i] = 'a' + (i % 26);
+   str[1024] = 0;
+   for (int i = 0; i < 4; i++)
+      strbuf_append(&sb, str);
+   ck_assert_int_eq(strbuf_get_error(&sb), false);
+   ck_assert_int_eq(strbuf_get_len(&sb), 4096);
+   /* 1024 -> 2048 -> 4096 -> 8192 */
+   ck_assert_int_eq(sb.alloc_size, 8192);
+   strbuf_free(&sb);
+}
+END_TEST
+
+START_TEST(strbuf_test_fixed_overflow)
+{
+   struct vrend_strbuf sb;
+   bool ret;
+   char buf[4];
+   ret = strbuf_alloc_fixed(&sb, buf, sizeof(buf));
+   ck_assert_int_eq(ret, true);
+   strbuf_append_uint(&sb, 123);
+   ck_assert_int_eq(strbuf_get_error(&sb), false);
+   strbuf_append_char(&sb, 'U');
+   ck_assert_int_eq(strbuf_get_error(&sb), true);
+   ck_assert_str_eq(sb.buf, "123");
+}
+END_TEST
 
 static Suite *init_suite(void)
 {
@@ -220,6 +275,9 @@ static Suite *init_suite(void)
   tcase_add_test(tc_core, strbuf_test_appendf);
   tcase_add_test(tc_core, strbuf_test_appendf_str);
   tcase_add_test(tc_core, strbuf_test_fixed_string);
+  tcase_add_test(tc_core, strbuf_test_append_int);
+  tcase_add_test(tc_core, strbuf_test_geometric_growth);
+  tcase_add_test(tc_core, strbuf_test_fixed_overflow);
   return s;
 }
 
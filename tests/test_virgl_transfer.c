@@ -677,6 +677,294 @@ START_TEST(virgl_test_transfer_res_write_invalid)
 }
 END_TEST
 
+/* write all six faces of a cube map with one transfer and read them back
+ * one face at a time */
+START_TEST(virgl_test_transfer_cube_all_faces)
+{
+  struct virgl_renderer_resource_create_args res;
+  struct pipe_box box;
+  uint32_t *data, *face;
+  struct iovec iov;
+  unsigned face_texels;
+  int ret;
+
+  get_resource_args(PIPE_TEXTURE_CUBE, false, &res, &box, 0, 0);
+  box.depth = 6;
+  face_texels = box.width * box.height;
+
+  data = calloc(6, face_texels * 4);
+  face = calloc(1, face_texels * 4);
+  for (unsigned i = 0; i < 6 * face_texels; i++)
+    data[i] = (i / face_texels + 1) * 0x01010101;
+
+  ret = virgl_renderer_resource_create(&res, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+  virgl_renderer_ctx_attach_resource(1, res.handle);
+
+  iov.iov_base = data;
+  iov.iov_len = 6 * face_texels * 4;
+  ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0,
+                                          (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  box.depth = 1;
+  iov.iov_base = face;
+  iov.iov_len = face_texels * 4;
+  for (unsigned f = 0; f < 6; f++) {
+    box.z = f;
+    memset(face, 0, face_texels * 4);
+    ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0,
+                                           (struct virgl_box *)&box, 0, &iov, 1);
+    ck_assert_int_eq(ret, 0);
+    /* the X channel of B8G8R8X8 is undefined on readback */
+    ck_assert_int_eq(face[0] & 0x00ffffff, data[f * face_texels] & 0x00ffffff);
+    ck_assert_int_eq(face[face_texels - 1] & 0x00ffffff,
+                     data[f * face_texels] & 0x00ffffff);
+  }
+
+  virgl_renderer_ctx_detach_resource(1, res.handle);
+  virgl_renderer_resource_unref(res.handle);
+  free(face);
+  free(data);
+}
+END_TEST
+
+/* write distinct texels to every layer or slice, then read a box spanning
+ * several of them back in one transfer */
+static void virgl_test_transfer_read_layers(enum pipe_texture_target target)
+{
+  struct virgl_renderer_resource_create_args res;
+  struct pipe_box box;
+  uint32_t *data, *readback;
+  struct iovec iov;
+  unsigned texels, layer_texels;
+  int ret;
+
+  get_resource_args(target, false, &res, &box, 0, 0);
+  ck_assert_int_gt(box.depth, 1);
+  layer_texels = box.width * box.height;
+  texels = layer_texels * box.depth;
+
+  data = calloc(texels, 4);
+  readback = calloc(texels, 4);
+  for (unsigned i = 0; i < texels; i++)
+    data[i] = ((i / layer_texels + 1) << 16) | (i % layer_texels);
+
+  ret = virgl_renderer_resource_create(&res, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+  virgl_renderer_ctx_attach_resource(1, res.handle);
+
+  iov.iov_base = data;
+  iov.iov_len = texels * 4;
+  ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0,
+                                          (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  /* skip the first layer so that the offset in z is honoured too */
+  box.z = 1;
+  box.depth -= 1;
+  iov.iov_base = readback;
+  iov.iov_len = layer_texels * box.depth * 4;
+  ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0,
+                                         (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  /* the X channel of B8G8R8X8 is undefined on readback */
+  for (unsigned i = 0; i < layer_texels * box.depth; i++)
+    ck_assert_int_eq(readback[i] & 0x00ffffff,
+                     data[layer_texels + i] & 0x00ffffff);
+
+  virgl_renderer_ctx_detach_resource(1, res.handle);
+  virgl_renderer_resource_unref(res.handle);
+  free(readback);
+  free(data);
+}
+
+START_TEST(virgl_test_transfer_3d_read_slices)
+{
+  virgl_test_transfer_read_layers(PIPE_TEXTURE_3D);
+}
+END_TEST
+
+START_TEST(virgl_test_transfer_2d_array_read_layers)
+{
+  virgl_test_transfer_read_layers(PIPE_TEXTURE_2D_ARRAY);
+}
+END_TEST
+
+/* fill every layer of a resource with distinct texels, copy a sub-box that
+ * spans several layers into an empty resource of a bit compatible format
+ * and read the whole destination back */
+static void virgl_test_copy_region_layers(enum pipe_texture_target target)
+{
+  struct virgl_renderer_resource_create_args src_args, dst_args;
+  struct virgl_context ctx;
+  struct virgl_resource src, dst;
+  struct pipe_box box, copy_box;
+  uint32_t *data, *readback;
+  struct iovec iov;
+  unsigned texels, layer_texels, layers;
+  unsigned dstx = 20, dsty = 15, dstz = 0;
+  int ret;
+
+  ret = testvirgl_init_ctx_cmdbuf(&ctx);
+  ck_assert_int_eq(ret, 0);
+
+  get_resource_args(target, false, &src_args, &box, 0, 0);
+  if (target == PIPE_TEXTURE_CUBE)
+    box.depth = 6;
+  layers = box.depth;
+  layer_texels = box.width * box.height;
+  texels = layer_texels * layers;
+
+  /* the X channel of the destination ignores the alpha of the source */
+  src_args.format = PIPE_FORMAT_B8G8R8A8_UNORM;
+  dst_args = src_args;
+  dst_args.handle = 2;
+  dst_args.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+
+  data = calloc(texels, 4);
+  readback = calloc(texels, 4);
+  for (unsigned i = 0; i < texels; i++)
+    data[i] = 0xff000000 | ((i / layer_texels + 1) << 16) | (i % layer_texels);
+
+  ret = virgl_renderer_resource_create(&src_args, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_resource_create(&dst_args, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+  virgl_renderer_ctx_attach_resource(ctx.ctx_id, src_args.handle);
+  virgl_renderer_ctx_attach_resource(ctx.ctx_id, dst_args.handle);
+
+  iov.iov_base = data;
+  iov.iov_len = texels * 4;
+  ret = virgl_renderer_transfer_write_iov(src_args.handle, ctx.ctx_id, 0, 0, 0,
+                                          (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  iov.iov_base = readback;
+  ret = virgl_renderer_transfer_write_iov(dst_args.handle, ctx.ctx_id, 0, 0, 0,
+                                          (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  src.handle = src_args.handle;
+  src.base.target = src_args.target;
+  src.base.format = src_args.format;
+  dst.handle = dst_args.handle;
+  dst.base.target = dst_args.target;
+  dst.base.format = dst_args.format;
+
+  /* skip the first source layer so that the offsets in z are honoured */
+  copy_box.x = 5;
+  copy_box.y = 5;
+  copy_box.z = layers > 1 ? 1 : 0;
+  copy_box.width = 10;
+  copy_box.height = 10;
+  copy_box.depth = layers > 1 ? layers - 1 : 1;
+  virgl_encode_resource_copy_region(&ctx, &dst, 0, dstx, dsty, dstz, &src, 0, &copy_box);
+  ret = testvirgl_ctx_send_cmdbuf(&ctx);
+  ck_assert_int_eq(ret, 0);
+
+  ret = virgl_renderer_transfer_read_iov(dst_args.handle, ctx.ctx_id, 0, 0, 0,
+                                         (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  /* the X channel of B8G8R8X8 is undefined on readback */
+  for (unsigned z = 0; z < layers; z++) {
+    for (unsigned y = 0; y < (unsigned)box.height; y++) {
+      for (unsigned x = 0; x < (unsigned)box.width; x++) {
+        bool inside = z >= dstz && z < dstz + copy_box.depth &&
+                      y >= dsty && y < dsty + copy_box.height &&
+                      x >= dstx && x < dstx + copy_box.width;
+        uint32_t expected = 0;
+
+        if (inside)
+          expected = data[(z - dstz + copy_box.z) * layer_texels +
+                          (y - dsty + copy_box.y) * box.width +
+                          x - dstx + copy_box.x];
+        ck_assert_int_eq(readback[z * layer_texels + y * box.width + x] & 0x00ffffff,
+                         expected & 0x00ffffff);
+      }
+    }
+  }
+
+  virgl_renderer_ctx_detach_resource(ctx.ctx_id, src_args.handle);
+  virgl_renderer_ctx_detach_resource(ctx.ctx_id, dst_args.handle);
+  virgl_renderer_resource_unref(src_args.handle);
+  virgl_renderer_resource_unref(dst_args.handle);
+  testvirgl_fini_ctx_cmdbuf(&ctx);
+  free(readback);
+  free(data);
+}
+
+START_TEST(virgl_test_copy_region_2d)
+{
+  virgl_test_copy_region_layers(PIPE_TEXTURE_2D);
+}
+END_TEST
+
+START_TEST(virgl_test_copy_region_2d_array_layers)
+{
+  virgl_test_copy_region_layers(PIPE_TEXTURE_2D_ARRAY);
+}
+END_TEST
+
+START_TEST(virgl_test_copy_region_3d_slices)
+{
+  virgl_test_copy_region_layers(PIPE_TEXTURE_3D);
+}
+END_TEST
+
+START_TEST(virgl_test_copy_region_cube_faces)
+{
+  virgl_test_copy_region_layers(PIPE_TEXTURE_CUBE);
+}
+END_TEST
+
+/* read back a format with 3 byte texels, the rows of the 50 texel wide
+ * resource aren't a multiple of 4 bytes and must not be padded */
+START_TEST(virgl_test_transfer_read_rgb8)
+{
+  struct virgl_renderer_resource_create_args res;
+  struct pipe_box box;
+  uint8_t *data, *readback;
+  struct iovec iov;
+  unsigned size;
+  int ret;
+
+  get_resource_args(PIPE_TEXTURE_2D, false, &res, &box, 0, 0);
+  res.format = PIPE_FORMAT_R8G8B8_UNORM;
+  size = box.width * box.height * 3;
+
+  data = calloc(size, 1);
+  readback = calloc(size, 1);
+  for (unsigned i = 0; i < size; i++)
+    data[i] = i * 7;
+
+  ret = virgl_renderer_resource_create(&res, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+  virgl_renderer_ctx_attach_resource(1, res.handle);
+
+  iov.iov_base = data;
+  iov.iov_len = size;
+  ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0,
+                                          (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  iov.iov_base = readback;
+  ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0,
+                                         (struct virgl_box *)&box, 0, &iov, 1);
+  ck_assert_int_eq(ret, 0);
+
+  for (unsigned i = 0; i < size; i++)
+    ck_assert_int_eq(readback[i], data[i]);
+
+  virgl_renderer_ctx_detach_resource(1, res.handle);
+  virgl_renderer_resource_unref(res.handle);
+  free(readback);
+  free(data);
+}
+END_TEST
+
 static void virgl_test_transfer_inline(enum pipe_texture_target target,
                                        bool invalid, int large_flags)
 {
@@ -1036,6 +1324,10 @@ static Suite *virgl_init_suite(void)
   tcase_add_loop_test(tc_core, virgl_test_transfer_res_write_valid, 0, PIPE_MAX_TEXTURE_TYPES);
   tcase_add_loop_test(tc_core, virgl_test_transfer_res_read_invalid, 0, PIPE_MAX_TEXTURE_TYPES);
   tcase_add_loop_test(tc_core, virgl_test_transfer_res_write_invalid, 0, PIPE_MAX_TEXTURE_TYPES);
+  tcase_add_test(tc_core, virgl_test_transfer_cube_all_faces);
+  tcase_add_test(tc_core, virgl_test_transfer_3d_read_slices);
+  tcase_add_test(tc_core, virgl_test_transfer_2d_array_read_layers);
+  tcase_add_test(tc_core, virgl_test_transfer_read_rgb8);
   suite_add_tcase(s, tc_core);
 
   tc_core = tcase_create("leak");
@@ -1059,6 +1351,14 @@ static Suite *virgl_init_suite(void)
 
   suite_add_tcase(s, tc_core);
 
+  tc_core = tcase_create("copy_region");
+  tcase_add_test(tc_core, virgl_test_copy_region_2d);
+  tcase_add_test(tc_core, virgl_test_copy_region_2d_array_layers);
+  tcase_add_test(tc_core, virgl_test_copy_region_3d_slices);
+  tcase_add_test(tc_core, virgl_test_copy_region_cube_faces);
+
+  suite_add_tcase(s, tc_core);
+
   tc_core = tcase_create("transfer_command_bounds");
   tcase_add_test(tc_core, virgl_test_transfer_near_res_bounds_with_stride_succeeds);
 
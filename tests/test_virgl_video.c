@@ -0,0 +1,297 @@
+/*
+ * Copyright 2026 virglrenderer contributors
+ * SPDX-License-Identifier: MIT
+ */
+
+/* video buffer tests, VA-API is replaced by the mock in mock_va.c */
+#include <check.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <virglrenderer.h>
+#include "virgl_hw.h"
+#include "virgl_protocol.h"
+#include "pipe/p_video_enums.h"
+#include "util/u_memory.h"
+#include "testvirgl_encode.h"
+#include "mock_va.h"
+
+#define TEST_VIDEO_SIZE 64
+
+static int test_cookie;
+static uint64_t test_video_fence_id;
+
+static int test_get_drm_fd(UNUSED void *cookie)
+{
+   return open("/dev/dri/renderD128", O_RDWR | O_CLOEXEC);
+}
+
+static void test_write_context_fence(UNUSED void *cookie, UNUSED uint32_t ctx_id,
+                                     uint32_t ring_idx, uint64_t fence_id)
+{
+   if (ring_idx == VIRGL_VIDEO_FENCE_RING_IDX)
+      test_video_fence_id = fence_id;
+}
+
+static struct virgl_renderer_callbacks test_video_cbs = {
+   .version = 3,
+   .get_drm_fd = test_get_drm_fd,
+   .write_context_fence = test_write_context_fence,
+};
+
+static void test_video_flush(struct virgl_context *ctx)
+{
+   virgl_renderer_submit_cmd(ctx->cbuf->buf, ctx->ctx_id, ctx->cbuf->cdw);
+   ctx->cbuf->cdw = 0;
+}
+
+static void test_video_init(struct virgl_context *ctx)
+{
+   int ret;
+
+   ret = virgl_renderer_init(&test_cookie, context_flags | VIRGL_RENDERER_USE_VIDEO,
+                             &test_video_cbs);
+   ck_assert_int_eq(ret, 0);
+   ret = virgl_renderer_context_create(1, strlen("video"), "video");
+   ck_assert_int_eq(ret, 0);
+
+   ctx->flush = test_video_flush;
+   ctx->ctx_id = 1;
+   ctx->cbuf = CALLOC_STRUCT(virgl_cmd_buf);
+   ck_assert_ptr_nonnull(ctx->cbuf);
+   ctx->cbuf->buf = CALLOC(1, VIRGL_MAX_CMDBUF_DWORDS * 4);
+   ck_assert_ptr_nonnull(ctx->cbuf->buf);
+}
+
+static void test_video_fini(struct virgl_context *ctx)
+{
+   FREE(ctx->cbuf->buf);
+   FREE(ctx->cbuf);
+   virgl_renderer_context_destroy(1);
+   virgl_renderer_cleanup(&test_cookie);
+}
+
+static void test_create_plane(uint32_t handle, enum virgl_formats format,
+                              uint32_t width, uint32_t height)
+{
+   struct virgl_renderer_resource_create_args args;
+   int ret;
+
+   testvirgl_init_simple_2d_resource(&args, handle);
+   args.format = format;
+   args.width = width;
+   args.height = height;
+   args.bind = VIRGL_BIND_SAMPLER_VIEW;
+   ret = virgl_renderer_resource_create(&args, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(1, handle);
+}
+
+static void test_check_plane(uint32_t handle, uint32_t width, uint32_t height,
+                             uint32_t cpp, uint8_t value)
+{
+   uint32_t size = width * height * cpp;
+   uint8_t *data = calloc(1, size);
+   struct iovec iov = { data, size };
+   struct virgl_box box = { 0, 0, 0, width, height, 1 };
+   int ret;
+
+   ck_assert_ptr_nonnull(data);
+   ret = virgl_renderer_transfer_read_iov(handle, 1, 0, 0, 0, &box, 0, &iov, 1);
+   ck_assert_int_eq(ret, 0);
+
+   for (uint32_t i = 0; i < size; i++)
+      ck_assert_int_eq(data[i], value);
+   free(data);
+}
+
+static uint32_t test_plane_tex_id(uint32_t handle)
+{
+   struct virgl_renderer_resource_info info;
+   int ret;
+
+   ret = virgl_renderer_resource_get_info(handle, &info);
+   ck_assert_int_eq(ret, 0);
+   return info.tex_id;
+}
+
+/* a decoded picture has to show up in the plane resources of the buffer */
+START_TEST(virgl_video_decode_to_planes)
+{
+   struct virgl_context ctx;
+   uint32_t planes[2] = { 10, 11 };
+   uint32_t tex_ids[2];
+   int ret;
+
+   test_video_init(&ctx);
+
+   test_create_plane(planes[0], VIRGL_FORMAT_R8_UNORM,
+                     TEST_VIDEO_SIZE, TEST_VIDEO_SIZE);
+   test_create_plane(planes[1], VIRGL_FORMAT_R8G8_UNORM,
+                     TEST_VIDEO_SIZE / 2, TEST_VIDEO_SIZE / 2);
+   for (unsigned i = 0; i < ARRAY_SIZE(planes); i++)
+      tex_ids[i] = test_plane_tex_id(planes[i]);
+
+   virgl_encode_create_video_codec(&ctx, 1, PIPE_VIDEO_PROFILE_MPEG2_MAIN,
+                                   PIPE_VIDEO_ENTRYPOINT_BITSTREAM,
+                                   PIPE_VIDEO_CHROMA_FORMAT_420, 0,
+                                   TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, 2, 0);
+   virgl_encode_create_video_buffer(&ctx, 2, PIPE_FORMAT_NV12,
+                                    TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, planes, 2);
+   virgl_encode_begin_frame(&ctx, 1, 2);
+   virgl_encode_end_frame(&ctx, 1, 2);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   test_check_plane(planes[0], TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, 1, MOCK_VA_LUMA);
+   test_check_plane(planes[1], TEST_VIDEO_SIZE / 2, TEST_VIDEO_SIZE / 2, 2,
+                    MOCK_VA_CHROMA);
+
+   /* the planes alias the surface: their storage was replaced by an EGL
+    * image of it, and writes to the surface show up without a decode */
+   for (unsigned i = 0; i < ARRAY_SIZE(planes); i++)
+      ck_assert_int_ne(test_plane_tex_id(planes[i]), tex_ids[i]);
+   mock_va_fill_surfaces(MOCK_VA_LUMA + 1, MOCK_VA_CHROMA + 1);
+   test_check_plane(planes[0], TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, 1, MOCK_VA_LUMA + 1);
+   test_check_plane(planes[1], TEST_VIDEO_SIZE / 2, TEST_VIDEO_SIZE / 2, 2,
+                    MOCK_VA_CHROMA + 1);
+
+   virgl_encode_destroy_video_buffer(&ctx, 2);
+   virgl_encode_destroy_video_codec(&ctx, 1);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   /* the resources stay valid after the surface is gone */
+   test_check_plane(planes[0], TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, 1, MOCK_VA_LUMA + 1);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(planes); i++) {
+      virgl_renderer_ctx_detach_resource(1, planes[i]);
+      virgl_renderer_resource_unref(planes[i]);
+   }
+   test_video_fini(&ctx);
+}
+END_TEST
+
+static bool test_wait_video_fence(uint64_t fence_id)
+{
+   struct timespec ts = { 0, 1000000 };
+
+   for (int i = 0; i < 5000; i++) {
+      virgl_renderer_poll();
+      if (test_video_fence_id == fence_id)
+         return true;
+      nanosleep(&ts, NULL);
+   }
+   return false;
+}
+
+/* end_frame of an asynchronous codec doesn't wait for the decoder, the
+ * fence on the video ring signals when the picture is in the planes */
+START_TEST(virgl_video_decode_async)
+{
+   struct virgl_context ctx;
+   uint32_t planes[2] = { 10, 11 };
+   union virgl_caps caps;
+   uint32_t max_ver, max_size;
+   int ret;
+
+   test_video_init(&ctx);
+   test_video_fence_id = 0;
+
+   virgl_renderer_get_cap_set(2, &max_ver, &max_size);
+   ck_assert_int_le(max_size, sizeof(caps));
+   virgl_renderer_fill_caps(2, max_ver, &caps);
+   ck_assert(caps.v2.capability_bits_v2 & VIRGL_CAP_V2_VIDEO_FENCE_RING);
+
+   test_create_plane(planes[0], VIRGL_FORMAT_R8_UNORM,
+                     TEST_VIDEO_SIZE, TEST_VIDEO_SIZE);
+   test_create_plane(planes[1], VIRGL_FORMAT_R8G8_UNORM,
+                     TEST_VIDEO_SIZE / 2, TEST_VIDEO_SIZE / 2);
+
+   virgl_encode_create_video_codec(&ctx, 1, PIPE_VIDEO_PROFILE_MPEG2_MAIN,
+                                   PIPE_VIDEO_ENTRYPOINT_BITSTREAM,
+                                   PIPE_VIDEO_CHROMA_FORMAT_420, 0,
+                                   TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, 2,
+                                   VIRGL_VIDEO_CODEC_FLAG_ASYNC);
+   virgl_encode_create_video_buffer(&ctx, 2, PIPE_FORMAT_NV12,
+                                    TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, planes, 2);
+
+   /* a held decoder would block a synchronous end_frame forever */
+   mock_va_hold_decoder(true);
+   virgl_encode_begin_frame(&ctx, 1, 2);
+   virgl_encode_end_frame(&ctx, 1, 2);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = virgl_renderer_context_create_fence(1, 0, VIRGL_VIDEO_FENCE_RING_IDX, 1);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_poll();
+   ck_assert_int_eq(test_video_fence_id, 0);
+
+   mock_va_hold_decoder(false);
+   ck_assert(test_wait_video_fence(1));
+
+   test_check_plane(planes[0], TEST_VIDEO_SIZE, TEST_VIDEO_SIZE, 1, MOCK_VA_LUMA);
+   test_check_plane(planes[1], TEST_VIDEO_SIZE / 2, TEST_VIDEO_SIZE / 2, 2,
+                    MOCK_VA_CHROMA);
+
+   /* without frames in flight the fence signals right away */
+   ret = virgl_renderer_context_create_fence(1, 0, VIRGL_VIDEO_FENCE_RING_IDX, 2);
+   ck_assert_int_eq(ret, 0);
+   ck_assert(test_wait_video_fence(2));
+
+   virgl_encode_destroy_video_buffer(&ctx, 2);
+   virgl_encode_destroy_video_codec(&ctx, 1);
+   ret = testvirgl_ctx_send_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   for (unsigned i = 0; i < ARRAY_SIZE(planes); i++) {
+      virgl_renderer_ctx_detach_resource(1, planes[i]);
+      virgl_renderer_resource_unref(planes[i]);
+   }
+   test_video_fini(&ctx);
+}
+END_TEST
+
+static Suite *virgl_video_suite(void)
+{
+   Suite *s;
+   TCase *tc_core;
+
+   s = suite_create("virgl_video");
+   tc_core = tcase_create("video");
+
+   if (mock_va_available() && !access("/dev/dri/renderD128", R_OK | W_OK)) {
+      tcase_add_test(tc_core, virgl_video_decode_to_planes);
+      tcase_add_test(tc_core, virgl_video_decode_async);
+   } else
+      fprintf(stderr, "no udmabuf or render node, skipping the video tests\n");
+
+   suite_add_tcase(s, tc_core);
+   return s;
+}
+
+int main(void)
+{
+   Suite *s;
+   SRunner *sr;
+   int number_failed;
+
+   if (getenv("VRENDTEST_USE_EGL_SURFACELESS"))
+      context_flags |= VIRGL_RENDERER_USE_SURFACELESS;
+   if (getenv("VRENDTEST_USE_EGL_GLES"))
+      context_flags |= VIRGL_RENDERER_USE_GLES;
+
+   s = virgl_video_suite();
+   sr = srunner_create(s);
+
+   srunner_run_all(sr, CK_NORMAL);
+   number_failed = srunner_ntests_failed(sr);
+   srunner_free(sr);
+
+   return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
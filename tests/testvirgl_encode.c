@@ -1027,3 +1027,83 @@ int virgl_encode_bind_shader(struct virgl_context *ctx,
    virgl_encoder_write_dword(ctx->cbuf, type);
    return 0;
 }
+
+int virgl_encode_launch_grid(struct virgl_context *ctx,
+                             const uint32_t *block, const uint32_t *grid)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_LAUNCH_GRID, 0, VIRGL_LAUNCH_GRID_SIZE));
+   virgl_encoder_write_dword(ctx->cbuf, block[0]);
+   virgl_encoder_write_dword(ctx->cbuf, block[1]);
+   virgl_encoder_write_dword(ctx->cbuf, block[2]);
+   virgl_encoder_write_dword(ctx->cbuf, grid[0]);
+   virgl_encoder_write_dword(ctx->cbuf, grid[1]);
+   virgl_encoder_write_dword(ctx->cbuf, grid[2]);
+   virgl_encoder_write_dword(ctx->cbuf, 0);
+   virgl_encoder_write_dword(ctx->cbuf, 0);
+   return 0;
+}
+
+int virgl_encode_create_video_codec(struct virgl_context *ctx, uint32_t handle,
+                                    uint32_t profile, uint32_t entrypoint,
+                                    uint32_t chroma_format, uint32_t level,
+                                    uint32_t width, uint32_t height,
+                                    uint32_t max_ref, uint32_t flags)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_CREATE_VIDEO_CODEC, 0, VIRGL_CREATE_VIDEO_CODEC_FLAGS));
+   virgl_encoder_write_dword(ctx->cbuf, handle);
+   virgl_encoder_write_dword(ctx->cbuf, profile);
+   virgl_encoder_write_dword(ctx->cbuf, entrypoint);
+   virgl_encoder_write_dword(ctx->cbuf, chroma_format);
+   virgl_encoder_write_dword(ctx->cbuf, level);
+   virgl_encoder_write_dword(ctx->cbuf, width);
+   virgl_encoder_write_dword(ctx->cbuf, height);
+   virgl_encoder_write_dword(ctx->cbuf, max_ref);
+   virgl_encoder_write_dword(ctx->cbuf, flags);
+   return 0;
+}
+
+int virgl_encode_destroy_video_codec(struct virgl_context *ctx, uint32_t handle)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_DESTROY_VIDEO_CODEC, 0, VIRGL_DESTROY_VIDEO_CODEC_MIN_SIZE));
+   virgl_encoder_write_dword(ctx->cbuf, handle);
+   return 0;
+}
+
+int virgl_encode_create_video_buffer(struct virgl_context *ctx, uint32_t handle,
+                                     uint32_t format, uint32_t width, uint32_t height,
+                                     const uint32_t *res_handles, unsigned num_res)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_CREATE_VIDEO_BUFFER, 0, 4 + num_res));
+   virgl_encoder_write_dword(ctx->cbuf, handle);
+   virgl_encoder_write_dword(ctx->cbuf, format);
+   virgl_encoder_write_dword(ctx->cbuf, width);
+   virgl_encoder_write_dword(ctx->cbuf, height);
+   for (unsigned i = 0; i < num_res; i++)
+      virgl_encoder_write_dword(ctx->cbuf, res_handles[i]);
+   return 0;
+}
+
+int virgl_encode_destroy_video_buffer(struct virgl_context *ctx, uint32_t handle)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_DESTROY_VIDEO_BUFFER, 0, VIRGL_DESTROY_VIDEO_BUFFER_MIN_SIZE));
+   virgl_encoder_write_dword(ctx->cbuf, handle);
+   return 0;
+}
+
+int virgl_encode_begin_frame(struct virgl_context *ctx,
+                             uint32_t cdc_handle, uint32_t tgt_handle)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_BEGIN_FRAME, 0, VIRGL_BEGIN_FRAME_MIN_SIZE));
+   virgl_encoder_write_dword(ctx->cbuf, cdc_handle);
+   virgl_encoder_write_dword(ctx->cbuf, tgt_handle);
+   return 0;
+}
+
+int virgl_encode_end_frame(struct virgl_context *ctx,
+                           uint32_t cdc_handle, uint32_t tgt_handle)
+{
+   virgl_encoder_write_cmd_dword(ctx, VIRGL_CMD0(VIRGL_CCMD_END_FRAME, 0, VIRGL_END_FRAME_MIN_SIZE));
+   virgl_encoder_write_dword(ctx->cbuf, cdc_handle);
+   virgl_encoder_write_dword(ctx->cbuf, tgt_handle);
+   return 0;
+}
@@ -299,4 +299,21 @@ int virgl_encoder_destroy_sub_ctx(struct virgl_context *ctx, uint32_t sub_ctx_id
 int virgl_encode_link_shader(struct virgl_context *ctx, uint32_t *handles);
 int virgl_encode_bind_shader(struct virgl_context *ctx,
                              uint32_t handle, uint32_t type);
+int virgl_encode_launch_grid(struct virgl_context *ctx,
+                             const uint32_t *block, const uint32_t *grid);
+
+int virgl_encode_create_video_codec(struct virgl_context *ctx, uint32_t handle,
+                                    uint32_t profile, uint32_t entrypoint,
+                                    uint32_t chroma_format, uint32_t level,
+                                    uint32_t width, uint32_t height,
+                                    uint32_t max_ref, uint32_t flags);
+int virgl_encode_destroy_video_codec(struct virgl_context *ctx, uint32_t handle);
+int virgl_encode_create_video_buffer(struct virgl_context *ctx, uint32_t handle,
+                                     uint32_t format, uint32_t width, uint32_t height,
+                                     const uint32_t *res_handles, unsigned num_res);
+int virgl_encode_destroy_video_buffer(struct virgl_context *ctx, uint32_t handle);
+int virgl_encode_begin_frame(struct virgl_context *ctx,
+                             uint32_t cdc_handle, uint32_t tgt_handle);
+int virgl_encode_end_frame(struct virgl_context *ctx,
+                           uint32_t cdc_handle, uint32_t tgt_handle);
 #endif